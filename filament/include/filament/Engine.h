@@ -21,6 +21,7 @@
 #include <filament/Fence.h>
 #include <filament/SwapChain.h>
 
+#include <filament/driver/BlobCache.h>
 #include <filament/driver/ExternalContext.h>
 
 #include <utils/compiler.h>
@@ -143,6 +144,7 @@ class TransformManager;
 class UTILS_PUBLIC Engine {
 public:
     using ExternalContext = driver::ExternalContext;
+    using BlobCache = driver::BlobCache;
     using Backend = driver::Backend;
 
     /**
@@ -166,6 +168,15 @@ public:
      *                          Setting this parameter will force filament to use the OpenGL
      *                          implementation (instead of Vulkaan for instance).
      *
+     *  @param blobCache        A pointer to an object that implements BlobCache, used to keep
+     *                          the compiled programs (OpenGL) or the pipeline cache (Vulkan)
+     *                          from one run to the next, which shortens the startup and the
+     *                          first use of each material variant. Can be nullptr.
+     *
+     *                          All methods of this interface are called from filament's
+     *                          render thread. The lifetime of \p blobCache must exceed the life
+     *                          time of the Engine object.
+     *
      *
      * @return A pointer to the newly created Engine, or nullptr if the Engine couldn't be created.
      *
@@ -180,7 +191,8 @@ public:
      * This method is thread-safe.
      */
     static Engine* create(Backend backend = Backend::DEFAULT,
-            ExternalContext* externalContext = nullptr, void* sharedGLContext = nullptr);
+            ExternalContext* externalContext = nullptr, void* sharedGLContext = nullptr,
+            BlobCache* blobCache = nullptr);
 
     /**
      * Destroy the Engine instance and all associated resources.
@@ -316,6 +328,63 @@ public:
      */
     void* streamAlloc(size_t size, size_t alignment = alignof(double)) noexcept;
 
+    /**
+     * Statistics about the command buffer, which holds the commands not yet executed by the
+     * rendering thread.
+     */
+    struct CommandBufferStats {
+        size_t size;            //!< current size of the command buffer in bytes
+        size_t requiredSize;    //!< space in bytes guaranteed available to the commands of a frame
+        size_t highWatermark;   //!< maximum space in bytes used by the commands not yet executed
+        uint32_t growCount;     //!< number of times the command buffer had to grow
+    };
+
+    /**
+     * Returns the statistics of the command buffer.
+     *
+     * The command buffer grows when the commands of a frame use more than requiredSize, up to a
+     * fixed limit. Past that, rendering blocks until the rendering thread catches up.
+     *
+     * @return The command buffer statistics.
+     */
+    CommandBufferStats getCommandBufferStats() const noexcept;
+
+    /**
+     * Number of objects of a type allocated by the backend.
+     */
+    struct DriverObjectCount {
+        uint32_t live;          //!< number of objects currently alive
+        uint32_t highWatermark; //!< maximum number of objects alive at once
+    };
+
+    /**
+     * Statistics about the objects allocated by the backend on behalf of the engine.
+     */
+    struct DriverObjectStats {
+        DriverObjectCount vertexBuffers;
+        DriverObjectCount indexBuffers;
+        DriverObjectCount renderPrimitives;
+        DriverObjectCount programs;
+        DriverObjectCount samplerBuffers;
+        DriverObjectCount uniformBuffers;
+        DriverObjectCount textures;
+        DriverObjectCount renderTargets;
+        DriverObjectCount fences;
+        DriverObjectCount swapChains;
+        DriverObjectCount streams;
+    };
+
+    /**
+     * Returns the number of objects of each type allocated by the backend.
+     *
+     * The counts are updated when the rendering thread creates and destroys the objects, so they
+     * lag behind the calls made on the Engine. A live count that keeps growing over many frames
+     * is the sign of a leak.
+     *
+     * @return The backend object statistics.
+     */
+    DriverObjectStats getDriverObjectStats() const noexcept;
+
 
     /**
      * helper for creating an Entity and Camera component in one call
@@ -212,6 +212,13 @@ public:
          * use the camera far distance.
          */
         float shadowFarHint = 100.0f;
+
+        /** Number of shadow cascades of a directional light, between 1 and
+         * CONFIG_MAX_SHADOW_CASCADES (4). The view frustum, up to shadowFar, is split in this
+         * many slices, each rendered in its own shadow map of mapSize texels. All the
+         * cascades are packed in a single texture. Ignored for other types of lights.
+         */
+        uint8_t shadowCascades = 1;
     };
 
     //! Use Builder to construct a Light object instance
@@ -46,6 +46,7 @@ struct ShaderGenerator;
 } // namespace details
 
 class Engine;
+class VertexBuffer;
 
 class UTILS_PUBLIC Material : public FilamentAPI {
     struct BuilderDetails;
@@ -63,6 +64,7 @@ public:
     using SamplerType = filament::driver::SamplerType;
     using SamplerFormat = filament::driver::SamplerFormat;
     using CullingMode = filament::driver::CullingMode;
+    using PrimitiveType = filament::driver::PrimitiveType;
 
     using ShaderModel = filament::driver::ShaderModel;
 
@@ -108,6 +110,60 @@ public:
         friend class details::FMaterial;
     };
 
+    /**
+     * Bits of the variant mask given to compile(). A material has a version of its shaders,
+     * called a variant, for each combination of these features.
+     */
+    struct Variants {
+        static constexpr uint8_t DIRECTIONAL_LIGHTING = 0x01;   //!< a directional light is present
+        static constexpr uint8_t DYNAMIC_LIGHTING     = 0x02;   //!< point or spot lights are present
+        static constexpr uint8_t SHADOW_RECEIVER      = 0x04;   //!< the renderable receives shadows
+        static constexpr uint8_t SKINNING             = 0x08;   //!< the renderable is skinned
+        static constexpr uint8_t INSTANCING           = 0x10;   //!< the renderable is instanced
+        static constexpr uint8_t SHADOW_CASCADES      = 0x20;   //!< the directional shadows use several cascades
+        static constexpr uint8_t ALL                  = 0x3F;
+    };
+
+    /**
+     * Called on the thread that calls Renderer::beginFrame() once all the variants requested
+     * with compile() have been handed to the backend.
+     */
+    using CompilationCallback = void(*)(Material* material, void* user);
+
+    /**
+     * Prepares, in the background, the variants of this material that only use the features of
+     * variantMask, so that their first use doesn't cause a hitch.
+     *
+     * Until a variant is ready, renderables needing it are drawn with the closest ready variant
+     * that has the same vertex inputs (e.g. without shadows), if any.
+     *
+     * @param variantMask   a combination of Variants bits
+     * @param callback      called once the variants are ready, can be nullptr
+     * @param user          passed to the callback
+     */
+    void compile(uint8_t variantMask,
+            CompilationCallback callback = nullptr, void* user = nullptr) noexcept;
+
+    /**
+     * Asks the backend to create ahead of time the state it needs to draw primitives of the given
+     * vertex buffer with the variants of this material that only use the features of
+     * variantMask, with the raster states this material is drawn with. This is meant for
+     * loading screens, so that the first frame showing the material doesn't stall.
+     *
+     * Only the backends that compile the shaders with the rest of the pipeline state (Vulkan)
+     * do work here, and the result is shared by all the vertex buffers with the same layout.
+     * Vulkan needs the format of the swap chain, so this does nothing until a frame has been
+     * started with a SwapChain (see Renderer::beginFrame()).
+     * Variants still being prepared by compile() are skipped, the others are compiled now if
+     * needed, so this is best called from compile()'s callback.
+     *
+     * @param variantMask   a combination of Variants bits
+     * @param vertexBuffer  a vertex buffer with the layout of the renderables using this material
+     * @param type          the type of the primitives
+     */
+    void precompile(uint8_t variantMask, VertexBuffer const* vertexBuffer,
+            PrimitiveType type = PrimitiveType::TRIANGLES) const noexcept;
+
     MaterialInstance* createInstance() const noexcept;
 
     const char* getName() const noexcept;
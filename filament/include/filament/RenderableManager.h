@@ -82,10 +82,36 @@ public:
         Builder& culling(bool enable) noexcept; // true by default
         Builder& castShadows(bool enable) noexcept; // false by default
         Builder& receiveShadows(bool enable) noexcept; // true by default
+
+        /**
+         * Marks a shadow caster that doesn't move nor deform (false by default). The depth of
+         * the static shadow casters is cached and only rendered again when the light's
+         * frustum changes or when the set of static casters visible from the light changes
+         * (including when one of them moves), the other shadow casters are drawn on top of it
+         * every frame. A static caster must call setStaticShadowCaster(false) before its
+         * geometry is deformed (e.g. morphing or skinning).
+         */
+        Builder& staticShadowCaster(bool enable) noexcept;
+
         Builder& skinning(size_t boneCount) noexcept; // 0 by default, 255 max
         Builder& skinning(size_t boneCount, Bone const* transforms) noexcept;
         Builder& skinning(size_t boneCount, math::mat4f const* transforms) noexcept;
 
+        /**
+         * Draws the Renderable's primitives instanceCount times with a single draw call each
+         * (1 by default, 256 max). Each instance is transformed by its own transform, expressed
+         * in the Renderable's model space and applied before the Renderable's world transform.
+         * Instance transforms are expected to be rigid or uniformly scaled.
+         *
+         * The bounding box set with boundingBox() must encompass all the instances since
+         * culling is performed on the Renderable as a whole.
+         *
+         * @param instanceCount number of instances to draw.
+         * @param transforms    optional array of instanceCount transforms, identity by default.
+         */
+        Builder& instances(size_t instanceCount) noexcept;
+        Builder& instances(size_t instanceCount, math::mat4f const* transforms) noexcept;
+
         // Sets an ordering index for blended primitives that all live at the same Z value.
         Builder& blendOrder(size_t index, uint16_t order) noexcept; // 0 by default
 
@@ -134,12 +160,20 @@ public:
     void setPriority(Instance instance, uint8_t priority) noexcept;
     void setCastShadows(Instance instance, bool enable) noexcept;
     void setReceiveShadows(Instance instance, bool enable) noexcept;
+    // see Builder::staticShadowCaster()
+    void setStaticShadowCaster(Instance instance, bool enable) noexcept;
     bool isShadowCaster(Instance instance) const noexcept;
     bool isShadowReceiver(Instance instance) const noexcept;
+    bool isStaticShadowCaster(Instance instance) const noexcept;
 
     void setBones(Instance instance, Bone const* transforms, size_t boneCount = 1, size_t offset = 0) noexcept;
     void setBones(Instance instance, math::mat4f const* transforms, size_t boneCount = 1, size_t offset = 0) noexcept;
 
+    // updates the transforms of the instances [offset, offset + count) of an instanced Renderable
+    void setInstanceTransforms(Instance instance, math::mat4f const* transforms, size_t count = 1, size_t offset = 0) noexcept;
+    // number of instances drawn for this Renderable, 1 unless instances() was used
+    size_t getInstanceCount(Instance instance) const noexcept;
+
 
     // getters...
     const Box& getAxisAlignedBoundingBox(Instance instance) const noexcept;
@@ -25,6 +25,8 @@
 
 #include <math/mat4.h>
 
+#include <stddef.h>
+
 namespace filament {
 
 /**
@@ -124,6 +126,25 @@ public:
      */
     void setTransform(Instance ci, const math::mat4f& localTransform) noexcept;
 
+    /**
+     * Sets the local transforms of several transform components at once.
+     *
+     * This is equivalent to calling setTransform() for each component, but the world transforms
+     * are updated in a single pass once all the local transforms are set, instead of once per
+     * component (and once per ancestor set in the same batch). This is the preferred way to
+     * update many transforms, e.g. when driving an animation.
+     *
+     * @param instances         Array of \p count instances of transform components.
+     * @param localTransforms   Array of \p count local transforms, localTransforms[i] is the
+     *                          new local transform of instances[i].
+     * @param count             Number of transforms to set.
+     * @note Inside a local transform transaction, the world transforms are updated by
+     *       commitLocalTransformTransaction() as usual.
+     * @see setTransform()
+     */
+    void setTransforms(Instance const* instances, const math::mat4f* localTransforms,
+            size_t count) noexcept;
+
     /**
      * Returns the local transform of a transform component.
      * @param ci The instance of the transform component to query the local transform from.
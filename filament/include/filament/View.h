@@ -116,6 +116,34 @@ public:
         bool homogeneousScaling = false;                //!< set to true to force homogeneous scaling
     };
 
+    /**
+     * Budget of the resources used for dynamic lighting (point and spot lights). These
+     * resources are allocated per View.
+     *
+     * The lights are assigned to "froxels", a grid of cells in view-space aligned with the
+     * screen and sliced exponentially in depth, and the list of lights for each froxel is
+     * stored in a "record" buffer shared by all froxels.
+     *
+     * maxLightCount:    maximum number of point and spot lights rendered. When more lights
+     *                   are visible, the farthest from the camera are dropped.
+     *                   Must be at most 256. 0 selects the maximum allowed by froxelCount.
+     * froxelCount:      maximum number of froxels, the actual number depends on the
+     *                   viewport's aspect ratio. Must be between 1024 and 16384.
+     *                   0 selects the default of 8192. Fewer lights can be used with more
+     *                   froxels, with 16384 froxels, at most 128 lights are rendered.
+     * froxelSliceCount: number of depth slices of the froxel grid, between 4 and 64.
+     *                   0 selects a number of slices suitable for froxelCount (16 by default).
+     * recordCount:      size of the record buffer, between 4096 and 65536.
+     *                   0 selects the default of 65536. When the record buffer overflows,
+     *                   no lights are assigned to the froxels farthest from the camera.
+     */
+    struct DynamicLightingBudget {
+        uint16_t maxLightCount = 0;     //!< maximum number of lights, 0 for the default
+        uint16_t froxelSliceCount = 0;  //!< number of depth slices, 0 for the default
+        uint32_t froxelCount = 0;       //!< maximum number of froxels, 0 for the default
+        uint32_t recordCount = 0;       //!< size of the record buffer, 0 for the default
+    };
+
     enum class DepthPrepass : int8_t {
         DEFAULT = -1,
         DISABLED,
@@ -379,6 +407,20 @@ public:
      */
     void setDynamicLightingOptions(float zLightNear, float zLightFar) noexcept;
 
+    /**
+     * Sets the budget of the resources used for dynamic lighting, see DynamicLightingBudget.
+     * Values out of range are clamped.
+     *
+     * @param budget The dynamic lighting budget to use on this view
+     */
+    void setDynamicLightingBudget(DynamicLightingBudget const& budget) noexcept;
+
+    /**
+     * Returns the dynamic lighting budget associated with this view.
+     * @return value set by setDynamicLightingBudget().
+     */
+    DynamicLightingBudget getDynamicLightingBudget() const noexcept;
+
     /**
      * Enable or disable post processing. Enabled by default.
      *
@@ -395,6 +437,26 @@ public:
      */
     void setPostProcessingEnabled(bool enabled) noexcept;
 
+    /**
+     * Enables or disables automatic instancing. Disabled by default.
+     *
+     * When enabled, consecutive draw calls of the same primitive with the same material
+     * instance are merged into a single instanced draw call, after the commands are sorted.
+     * This reduces the CPU cost of scenes with many copies of the same object.
+     *
+     * Only renderables that are not skinned, not already instanced and whose world transform
+     * is rigid or uniformly scaled can be merged. The materials used by these renderables
+     * must not filter out the `instancing` variant.
+     *
+     * @param enabled true enables automatic instancing, false disables it.
+     */
+    void setAutomaticInstancingEnabled(bool enabled) noexcept;
+
+    /**
+     * Returns whether automatic instancing is enabled.
+     */
+    bool isAutomaticInstancingEnabled() const noexcept;
+
 
     // for debugging...
 
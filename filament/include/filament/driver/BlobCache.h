@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef TNT_FILAMENT_DRIVER_BLOBCACHE_H
+#define TNT_FILAMENT_DRIVER_BLOBCACHE_H
+
+#include <utils/compiler.h>
+
+#include <stddef.h>
+
+namespace filament {
+namespace driver {
+
+/**
+ * Storage for opaque binary blobs, provided by the application to keep the results of expensive
+ * backend operations, such as compiling programs, from one run to the next.
+ *
+ * Where and how long the blobs are kept is up to the application. Keys and blobs are arbitrary
+ * bytes, two different keys never refer to the same blob.
+ *
+ * All methods are called from filament's rendering thread.
+ */
+class UTILS_PUBLIC BlobCache {
+public:
+    virtual ~BlobCache() noexcept;
+
+    /**
+     * Stores a blob, replacing the blob previously stored with the same key, if any.
+     * The key and blob are only valid during the call.
+     */
+    virtual void insert(const void* key, size_t keySize,
+            const void* blob, size_t blobSize) noexcept = 0;
+
+    /**
+     * Retrieves the blob stored with a key.
+     *
+     * @param key       the key of the blob
+     * @param keySize   the size of the key in bytes
+     * @param blob      where to copy the blob, if it fits in blobSize. Can be nullptr.
+     * @param blobSize  the size of the \p blob buffer in bytes
+     *
+     * @return the size of the blob in bytes, or 0 if there is no blob for this key. The blob is
+     *         only copied if this is less or equal to \p blobSize.
+     */
+    virtual size_t retrieve(const void* key, size_t keySize,
+            void* blob, size_t blobSize) noexcept = 0;
+};
+
+} // namespace driver
+} // namespace filament
+
+#endif // TNT_FILAMENT_DRIVER_BLOBCACHE_H
@@ -0,0 +1,265 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "details/Bvh.h"
+
+#include <utils/JobSystem.h>
+
+#include <math/fast.h>
+#include <math/vec4.h>
+
+#include <algorithm>
+#include <limits>
+#include <numeric>
+
+#include <assert.h>
+
+using namespace math;
+using namespace utils;
+
+namespace filament {
+namespace details {
+
+static_assert(Bvh::LEAF_SIZE % Culler::MODULO == 0,
+        "LEAF_SIZE must be a multiple of Culler::MODULO");
+
+Bvh::Bvh() noexcept = default;
+
+Bvh::~Bvh() noexcept = default;
+
+void Bvh::clear() noexcept {
+    mNodes.clear();
+    mItems.clear();
+    mIndices.clear();
+    mLeaves.clear();
+    mDirty.reset();
+    mLeafCount = 0;
+    mRefitLeafCount = 0;
+}
+
+void Bvh::build(Instance const* instances,
+        float3 const* centers, float3 const* extents, size_t count) {
+    clear();
+    if (!count) {
+        return;
+    }
+
+    // compute the topology of the tree, this sorts the AABBs by leaves
+    std::vector<uint32_t> order(count);
+    std::iota(order.begin(), order.end(), 0);
+    mNodes.reserve(2 * ((count + LEAF_SIZE - 1) / LEAF_SIZE));
+    buildNode(order.data(), centers, extents, 0, uint32_t(count));
+
+    Instance maxInstance = 0;
+    for (size_t i = 0; i < count; i++) {
+        maxInstance = std::max(maxInstance, instances[i]);
+    }
+    mItems.resize(count);
+    mIndices.resize(maxInstance + 1);
+    mLeaves.resize(maxInstance + 1);
+    for (size_t i = 0; i < count; i++) {
+        Instance instance = instances[order[i]];
+        mItems[i] = instance;
+        mIndices[instance] = order[i];
+    }
+
+    mDirty.reset(new std::atomic<bool>[mNodes.size()]);
+    for (size_t n = 0, c = mNodes.size(); n < c; n++) {
+        Node const& node = mNodes[n];
+        if (!node.right) {
+            for (uint32_t i = node.first, e = node.first + node.count; i < e; i++) {
+                mLeaves[mItems[i]] = uint32_t(n);
+            }
+        }
+        mDirty[n].store(!node.right, std::memory_order_relaxed);
+    }
+
+    refit(centers, extents);
+    mRefitLeafCount = 0;
+}
+
+uint32_t Bvh::buildNode(uint32_t* order, float3 const* centers, float3 const* extents,
+        uint32_t first, uint32_t count) {
+    const uint32_t index = uint32_t(mNodes.size());
+    mNodes.push_back({ {}, first, {}, count, 0 });
+    if (count <= LEAF_SIZE) {
+        mLeafCount++;
+        return index;
+    }
+
+    // split along the longest axis of the centers' bounds
+    float3 cmin = std::numeric_limits<float>::max();
+    float3 cmax = std::numeric_limits<float>::lowest();
+    for (uint32_t i = first, e = first + count; i < e; i++) {
+        cmin = min(cmin, centers[order[i]]);
+        cmax = max(cmax, centers[order[i]]);
+    }
+    const float3 size = cmax - cmin;
+    const size_t axis = size.x > size.y ? (size.x > size.z ? 0 : 2) : (size.y > size.z ? 1 : 2);
+
+    // split at the median, rounded so the left leaves are full
+    const uint32_t half = std::max(uint32_t(LEAF_SIZE), (count / 2) & ~uint32_t(LEAF_SIZE - 1));
+    std::nth_element(order + first, order + first + half, order + first + count,
+            [centers, axis](uint32_t lhs, uint32_t rhs) {
+                return centers[lhs][axis] < centers[rhs][axis];
+            });
+
+    buildNode(order, centers, extents, first, half);
+    const uint32_t right = buildNode(order, centers, extents, first + half, count - half);
+    mNodes[index].right = right;
+    return index;
+}
+
+void Bvh::computeLeafBounds(Node& node,
+        float3 const* centers, float3 const* extents) const noexcept {
+    float3 bmin = std::numeric_limits<float>::max();
+    float3 bmax = std::numeric_limits<float>::lowest();
+    for (uint32_t i = node.first, e = node.first + node.count; i < e; i++) {
+        const uint32_t index = mIndices[mItems[i]];
+        bmin = min(bmin, centers[index] - extents[index]);
+        bmax = max(bmax, centers[index] + extents[index]);
+    }
+    node.min = bmin;
+    node.max = bmax;
+}
+
+void Bvh::refit(float3 const* centers, float3 const* extents) noexcept {
+    size_t refitCount = 0;
+    for (size_t n = 0, c = mNodes.size(); n < c; n++) {
+        if (mDirty[n].load(std::memory_order_relaxed)) {
+            mDirty[n].store(false, std::memory_order_relaxed);
+            computeLeafBounds(mNodes[n], centers, extents);
+            refitCount++;
+        }
+    }
+    if (refitCount) {
+        mRefitLeafCount += refitCount;
+        // children are always after their parent, so this visits them first
+        for (size_t n = mNodes.size(); n-- > 0;) {
+            Node& node = mNodes[n];
+            if (node.right) {
+                Node const& left = mNodes[n + 1];
+                Node const& right = mNodes[node.right];
+                node.min = min(left.min, right.min);
+                node.max = max(left.max, right.max);
+            }
+        }
+    }
+}
+
+Bvh::Classification Bvh::classify(Node const& node, float4 const* planes) noexcept {
+    // same test as Culler::intersects(), but we also check if the box is entirely inside
+    const float3 center = (node.max + node.min) * 0.5f;
+    const float3 extent = (node.max - node.min) * 0.5f;
+    int inside = 1;
+    for (size_t j = 0; j < 6; j++) {
+        const float d = dot(planes[j].xyz, center) + planes[j].w;
+        const float r = dot(abs(planes[j].xyz), extent);
+        if (!fast::signbit(d - r)) {
+            return Classification::OUTSIDE;
+        }
+        inside &= fast::signbit(d + r) ? 1 : 0;
+    }
+    return inside ? Classification::INSIDE : Classification::INTERSECTS;
+}
+
+void Bvh::accept(Node const& node, Culler::result_type* results, size_t bit) const noexcept {
+    for (uint32_t i = node.first, e = node.first + node.count; i < e; i++) {
+        results[mIndices[mItems[i]]] |= Culler::result_type(1u << bit);
+    }
+}
+
+void Bvh::cullLeaf(uint32_t n, Culler::result_type* results, Frustum const& frustum,
+        float3 const* centers, float3 const* extents, size_t bit) const noexcept {
+    // gather the leaf's AABBs so we can use the SIMD culling code
+    Node const& node = mNodes[n];
+    float3 c[LEAF_SIZE];
+    float3 e[LEAF_SIZE];
+    Culler::result_type r[LEAF_SIZE] = {};
+    uint32_t indices[LEAF_SIZE];
+    for (uint32_t i = 0; i < node.count; i++) {
+        const uint32_t index = mIndices[mItems[node.first + i]];
+        indices[i] = index;
+        c[i] = centers[index];
+        e[i] = extents[index];
+    }
+    for (size_t i = node.count, count = Culler::round(node.count); i < count; i++) {
+        c[i] = 0;
+        e[i] = 0;
+    }
+    Culler::intersects(r, frustum, c, e, node.count, bit);
+    for (uint32_t i = 0; i < node.count; i++) {
+        results[indices[i]] |= r[i];
+    }
+}
+
+void Bvh::cull(JobSystem& js, Culler::result_type* results, Frustum const& frustum,
+        float3 const* centers, float3 const* extents, size_t bit) const noexcept {
+    if (mNodes.empty()) {
+        return;
+    }
+
+    /*
+     * The hierarchy is traversed serially to find the subtrees entirely inside the frustum
+     * and the leaves intersecting it, those are then processed in parallel.
+     */
+
+    constexpr uint32_t ACCEPT = 0x80000000u;
+    float4 const* const planes = frustum.getNormalizedPlanes();
+    std::vector<uint32_t> work;
+    uint32_t stack[64];
+    size_t sp = 0;
+    stack[sp++] = 0;
+    while (sp) {
+        const uint32_t n = stack[--sp];
+        Node const& node = mNodes[n];
+        switch (classify(node, planes)) {
+            case Classification::OUTSIDE:
+                break;
+            case Classification::INSIDE:
+                work.push_back(n | ACCEPT);
+                break;
+            case Classification::INTERSECTS:
+                if (node.right) {
+                    assert(sp + 2 <= sizeof(stack) / sizeof(stack[0]));
+                    stack[sp++] = node.right;
+                    stack[sp++] = n + 1;
+                } else {
+                    work.push_back(n);
+                }
+                break;
+        }
+    }
+
+    auto functor = [this, &work, results, &frustum, centers, extents, bit]
+            (uint32_t first, uint32_t count) {
+        for (uint32_t i = first, e = first + count; i < e; i++) {
+            const uint32_t n = work[i];
+            if (n & ACCEPT) {
+                accept(mNodes[n & ~ACCEPT], results, bit);
+            } else {
+                cullLeaf(n, results, frustum, centers, extents, bit);
+            }
+        }
+    };
+
+    auto job = jobs::parallel_for(js, nullptr, 0, uint32_t(work.size()),
+            std::cref(functor), jobs::CountSplitter<4, 8>());
+    js.runAndWait(job);
+}
+
+} // namespace details
+} // namespace filament
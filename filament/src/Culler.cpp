@@ -18,27 +18,51 @@
 
 #include <math/fast.h>
 
+#if defined(__ARM_NEON) && defined(__aarch64__)
+#   include <arm_neon.h>
+#   define FILAMENT_CULLER_USE_NEON 1
+#elif (defined(__x86_64__) || defined(__i386__)) && !defined(_MSC_VER)
+#   include <immintrin.h>
+#   define FILAMENT_CULLER_USE_X86 1
+#endif
+
 using namespace math;
 
 namespace filament {
 namespace details {
 
-void Culler::intersects(
-        result_type* UTILS_RESTRICT results,
-        Frustum const& UTILS_RESTRICT frustum,
-        math::float4 const* UTILS_RESTRICT b,
-        size_t count) noexcept {
+/*
+ * The culling loops come in several implementations. The generic one relies on the
+ * compiler's auto-vectorization, which doesn't always happen, and the others are written
+ * explicitly for a given instruction set. The best one available is selected at runtime.
+ *
+ * All implementations must produce the same results, they perform the same operations in
+ * the same order. The arrays are guaranteed to have a size multiple of Culler::MODULO.
+ */
 
-    math::float4 const * const UTILS_RESTRICT planes = frustum.mPlanes;
+using BoxKernel = void(*)(Culler::result_type* results, float4 const* planes,
+        float3 const* center, float3 const* extent, size_t count, size_t bit);
 
+using SphereKernel = void(*)(Culler::result_type* results, float4 const* planes,
+        float4 const* b, size_t count);
+
+struct Kernels {
+    BoxKernel boxes;
+    SphereKernel spheres;
+};
+
+static void intersectsGeneric(
+        Culler::result_type* UTILS_RESTRICT results,
+        float4 const* UTILS_RESTRICT planes,
+        float4 const* UTILS_RESTRICT b,
+        size_t count) noexcept {
     // we use a vectorize width of 8 because, on ARMv8 it allow the compiler to write 8
     // 8-bits results in one go. Without this it has to do 4 separate byte writes, which
     // ends-up being slower.
-    count = round(count); // capacity guaranteed to be multiple of 8
     #pragma clang loop vectorize_width(8)
     for (size_t i = 0; i < count; i++) {
         int visible = ~0;
-        math::float4 const sphere(b[i]);
+        float4 const sphere(b[i]);
 
         #pragma clang loop unroll(full)
         for (size_t j = 0; j < 6; j++) {
@@ -50,23 +74,19 @@ void Culler::intersects(
                               planes[j].w - sphere.w;
             visible &= fast::signbit(dot);
         }
-        results[i] = result_type(visible);
+        results[i] = Culler::result_type(visible);
     }
 }
 
-void Culler::intersects(
-        result_type* UTILS_RESTRICT results,
-        Frustum const& UTILS_RESTRICT frustum,
-        math::float3 const* UTILS_RESTRICT center,
-        math::float3 const* UTILS_RESTRICT extent,
+static void intersectsGeneric(
+        Culler::result_type* UTILS_RESTRICT results,
+        float4 const* UTILS_RESTRICT planes,
+        float3 const* UTILS_RESTRICT center,
+        float3 const* UTILS_RESTRICT extent,
         size_t count, size_t bit) noexcept {
-
-    math::float4 const * UTILS_RESTRICT const planes = frustum.mPlanes;
-
     // we use a vectorize width of 8 because, on ARMv8 it allows the compiler to write eight
     // 8-bits results in one go. Without this it has to do 4 separate byte writes, which
     // ends-up being slower.
-    count = round(count); // capacity guaranteed to be multiple of 8
     #pragma clang loop vectorize_width(8)
     for (size_t i = 0; i < count; i++) {
         int visible = ~0;
@@ -84,10 +104,291 @@ void Culler::intersects(
             visible &= fast::signbit(dot) << bit;
         }
 
-        results[i] |= result_type(visible);
+        results[i] |= Culler::result_type(visible);
+    }
+}
+
+#if defined(FILAMENT_CULLER_USE_X86)
+
+// loads 4 float3 and transposes them into 3 vectors of x, y and z
+__attribute__((target("sse4.1")))
+static inline void load4x3(float3 const* p, __m128& x, __m128& y, __m128& z) noexcept {
+    float const* f = &p->x;
+    const __m128 a = _mm_loadu_ps(f);       // x0 y0 z0 x1
+    const __m128 b = _mm_loadu_ps(f + 4);   // y1 z1 x2 y2
+    const __m128 c = _mm_loadu_ps(f + 8);   // z2 x3 y3 z3
+    const __m128 xa = _mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 0, 3, 0));   // x0 x1 ...
+    const __m128 xb = _mm_shuffle_ps(b, c, _MM_SHUFFLE(1, 1, 2, 2));   // x2 .. x3 ..
+    const __m128 ya = _mm_shuffle_ps(a, b, _MM_SHUFFLE(0, 0, 1, 1));   // y0 .. y1 ..
+    const __m128 yb = _mm_shuffle_ps(b, c, _MM_SHUFFLE(2, 2, 3, 3));   // y2 .. y3 ..
+    const __m128 za = _mm_shuffle_ps(a, b, _MM_SHUFFLE(1, 1, 2, 2));   // z0 .. z1 ..
+    const __m128 zb = _mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 3, 0, 0));   // z2 .. z3 ..
+    x = _mm_shuffle_ps(xa, xb, _MM_SHUFFLE(2, 0, 1, 0));
+    y = _mm_shuffle_ps(ya, yb, _MM_SHUFFLE(2, 0, 2, 0));
+    z = _mm_shuffle_ps(za, zb, _MM_SHUFFLE(2, 0, 2, 0));
+}
+
+// loads 4 float4 and transposes them into 4 vectors of x, y, z and w
+__attribute__((target("sse4.1")))
+static inline void load4x4(float4 const* p,
+        __m128& x, __m128& y, __m128& z, __m128& w) noexcept {
+    x = _mm_loadu_ps(&p[0].x);
+    y = _mm_loadu_ps(&p[1].x);
+    z = _mm_loadu_ps(&p[2].x);
+    w = _mm_loadu_ps(&p[3].x);
+    _MM_TRANSPOSE4_PS(x, y, z, w);
+}
+
+__attribute__((target("sse4.1")))
+static void intersectsSSE41(
+        Culler::result_type* UTILS_RESTRICT results,
+        float4 const* UTILS_RESTRICT planes,
+        float4 const* UTILS_RESTRICT b,
+        size_t count) noexcept {
+    for (size_t i = 0; i < count; i += 4) {
+        __m128 x, y, z, r;
+        load4x4(b + i, x, y, z, r);
+        __m128 visible = _mm_castsi128_ps(_mm_set1_epi32(-1));
+        for (size_t j = 0; j < 6; j++) {
+            __m128 dot = _mm_mul_ps(_mm_set1_ps(planes[j].x), x);
+            dot = _mm_add_ps(dot, _mm_mul_ps(_mm_set1_ps(planes[j].y), y));
+            dot = _mm_add_ps(dot, _mm_mul_ps(_mm_set1_ps(planes[j].z), z));
+            dot = _mm_sub_ps(_mm_add_ps(dot, _mm_set1_ps(planes[j].w)), r);
+            visible = _mm_and_ps(visible, dot);
+        }
+        const int mask = _mm_movemask_ps(visible);
+        for (size_t k = 0; k < 4; k++) {
+            results[i + k] = Culler::result_type((mask >> k) & 1);
+        }
+    }
+}
+
+__attribute__((target("sse4.1")))
+static void intersectsSSE41(
+        Culler::result_type* UTILS_RESTRICT results,
+        float4 const* UTILS_RESTRICT planes,
+        float3 const* UTILS_RESTRICT center,
+        float3 const* UTILS_RESTRICT extent,
+        size_t count, size_t bit) noexcept {
+    for (size_t i = 0; i < count; i += 4) {
+        __m128 cx, cy, cz, ex, ey, ez;
+        load4x3(center + i, cx, cy, cz);
+        load4x3(extent + i, ex, ey, ez);
+        __m128 visible = _mm_castsi128_ps(_mm_set1_epi32(-1));
+        for (size_t j = 0; j < 6; j++) {
+            const float4 p = planes[j];
+            __m128 dot = _mm_mul_ps(_mm_set1_ps(p.x), cx);
+            dot = _mm_sub_ps(dot, _mm_mul_ps(_mm_set1_ps(std::abs(p.x)), ex));
+            dot = _mm_add_ps(dot, _mm_mul_ps(_mm_set1_ps(p.y), cy));
+            dot = _mm_sub_ps(dot, _mm_mul_ps(_mm_set1_ps(std::abs(p.y)), ey));
+            dot = _mm_add_ps(dot, _mm_mul_ps(_mm_set1_ps(p.z), cz));
+            dot = _mm_sub_ps(dot, _mm_mul_ps(_mm_set1_ps(std::abs(p.z)), ez));
+            dot = _mm_add_ps(dot, _mm_set1_ps(p.w));
+            visible = _mm_and_ps(visible, dot);
+        }
+        const int mask = _mm_movemask_ps(visible);
+        for (size_t k = 0; k < 4; k++) {
+            results[i + k] |= Culler::result_type(((mask >> k) & 1) << bit);
+        }
+    }
+}
+
+__attribute__((target("avx2")))
+static void intersectsAVX2(
+        Culler::result_type* UTILS_RESTRICT results,
+        float4 const* UTILS_RESTRICT planes,
+        float4 const* UTILS_RESTRICT b,
+        size_t count) noexcept {
+    for (size_t i = 0; i < count; i += 8) {
+        __m128 x0, y0, z0, r0, x1, y1, z1, r1;
+        load4x4(b + i, x0, y0, z0, r0);
+        load4x4(b + i + 4, x1, y1, z1, r1);
+        const __m256 x = _mm256_insertf128_ps(_mm256_castps128_ps256(x0), x1, 1);
+        const __m256 y = _mm256_insertf128_ps(_mm256_castps128_ps256(y0), y1, 1);
+        const __m256 z = _mm256_insertf128_ps(_mm256_castps128_ps256(z0), z1, 1);
+        const __m256 r = _mm256_insertf128_ps(_mm256_castps128_ps256(r0), r1, 1);
+        __m256 visible = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+        for (size_t j = 0; j < 6; j++) {
+            __m256 dot = _mm256_mul_ps(_mm256_set1_ps(planes[j].x), x);
+            dot = _mm256_add_ps(dot, _mm256_mul_ps(_mm256_set1_ps(planes[j].y), y));
+            dot = _mm256_add_ps(dot, _mm256_mul_ps(_mm256_set1_ps(planes[j].z), z));
+            dot = _mm256_sub_ps(_mm256_add_ps(dot, _mm256_set1_ps(planes[j].w)), r);
+            visible = _mm256_and_ps(visible, dot);
+        }
+        const int mask = _mm256_movemask_ps(visible);
+        for (size_t k = 0; k < 8; k++) {
+            results[i + k] = Culler::result_type((mask >> k) & 1);
+        }
+    }
+}
+
+__attribute__((target("avx2")))
+static void intersectsAVX2(
+        Culler::result_type* UTILS_RESTRICT results,
+        float4 const* UTILS_RESTRICT planes,
+        float3 const* UTILS_RESTRICT center,
+        float3 const* UTILS_RESTRICT extent,
+        size_t count, size_t bit) noexcept {
+    for (size_t i = 0; i < count; i += 8) {
+        __m128 cx0, cy0, cz0, ex0, ey0, ez0, cx1, cy1, cz1, ex1, ey1, ez1;
+        load4x3(center + i, cx0, cy0, cz0);
+        load4x3(center + i + 4, cx1, cy1, cz1);
+        load4x3(extent + i, ex0, ey0, ez0);
+        load4x3(extent + i + 4, ex1, ey1, ez1);
+        const __m256 cx = _mm256_insertf128_ps(_mm256_castps128_ps256(cx0), cx1, 1);
+        const __m256 cy = _mm256_insertf128_ps(_mm256_castps128_ps256(cy0), cy1, 1);
+        const __m256 cz = _mm256_insertf128_ps(_mm256_castps128_ps256(cz0), cz1, 1);
+        const __m256 ex = _mm256_insertf128_ps(_mm256_castps128_ps256(ex0), ex1, 1);
+        const __m256 ey = _mm256_insertf128_ps(_mm256_castps128_ps256(ey0), ey1, 1);
+        const __m256 ez = _mm256_insertf128_ps(_mm256_castps128_ps256(ez0), ez1, 1);
+        __m256 visible = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+        for (size_t j = 0; j < 6; j++) {
+            const float4 p = planes[j];
+            __m256 dot = _mm256_mul_ps(_mm256_set1_ps(p.x), cx);
+            dot = _mm256_sub_ps(dot, _mm256_mul_ps(_mm256_set1_ps(std::abs(p.x)), ex));
+            dot = _mm256_add_ps(dot, _mm256_mul_ps(_mm256_set1_ps(p.y), cy));
+            dot = _mm256_sub_ps(dot, _mm256_mul_ps(_mm256_set1_ps(std::abs(p.y)), ey));
+            dot = _mm256_add_ps(dot, _mm256_mul_ps(_mm256_set1_ps(p.z), cz));
+            dot = _mm256_sub_ps(dot, _mm256_mul_ps(_mm256_set1_ps(std::abs(p.z)), ez));
+            dot = _mm256_add_ps(dot, _mm256_set1_ps(p.w));
+            visible = _mm256_and_ps(visible, dot);
+        }
+        const int mask = _mm256_movemask_ps(visible);
+        for (size_t k = 0; k < 8; k++) {
+            results[i + k] |= Culler::result_type(((mask >> k) & 1) << bit);
+        }
+    }
+}
+
+#endif // FILAMENT_CULLER_USE_X86
+
+#if defined(FILAMENT_CULLER_USE_NEON)
+
+static void intersectsNEON(
+        Culler::result_type* UTILS_RESTRICT results,
+        float4 const* UTILS_RESTRICT planes,
+        float4 const* UTILS_RESTRICT b,
+        size_t count) noexcept {
+    for (size_t i = 0; i < count; i += 4) {
+        // this loads 4 float4 and transposes them into x, y, z and w
+        const float32x4x4_t s = vld4q_f32(&b[i].x);
+        uint32x4_t visible = vdupq_n_u32(~0u);
+        for (size_t j = 0; j < 6; j++) {
+            float32x4_t dot = vmulq_n_f32(s.val[0], planes[j].x);
+            dot = vaddq_f32(dot, vmulq_n_f32(s.val[1], planes[j].y));
+            dot = vaddq_f32(dot, vmulq_n_f32(s.val[2], planes[j].z));
+            dot = vsubq_f32(vaddq_f32(dot, vdupq_n_f32(planes[j].w)), s.val[3]);
+            visible = vandq_u32(visible, vreinterpretq_u32_f32(dot));
+        }
+        visible = vshrq_n_u32(visible, 31);
+        results[i + 0] = Culler::result_type(vgetq_lane_u32(visible, 0));
+        results[i + 1] = Culler::result_type(vgetq_lane_u32(visible, 1));
+        results[i + 2] = Culler::result_type(vgetq_lane_u32(visible, 2));
+        results[i + 3] = Culler::result_type(vgetq_lane_u32(visible, 3));
+    }
+}
+
+static void intersectsNEON(
+        Culler::result_type* UTILS_RESTRICT results,
+        float4 const* UTILS_RESTRICT planes,
+        float3 const* UTILS_RESTRICT center,
+        float3 const* UTILS_RESTRICT extent,
+        size_t count, size_t bit) noexcept {
+    const int32x4_t shift = vdupq_n_s32(int32_t(bit));
+    for (size_t i = 0; i < count; i += 4) {
+        // this loads 4 float3 and transposes them into x, y and z
+        const float32x4x3_t c = vld3q_f32(&center[i].x);
+        const float32x4x3_t e = vld3q_f32(&extent[i].x);
+        uint32x4_t visible = vdupq_n_u32(~0u);
+        for (size_t j = 0; j < 6; j++) {
+            const float4 p = planes[j];
+            float32x4_t dot = vmulq_n_f32(c.val[0], p.x);
+            dot = vsubq_f32(dot, vmulq_n_f32(e.val[0], std::abs(p.x)));
+            dot = vaddq_f32(dot, vmulq_n_f32(c.val[1], p.y));
+            dot = vsubq_f32(dot, vmulq_n_f32(e.val[1], std::abs(p.y)));
+            dot = vaddq_f32(dot, vmulq_n_f32(c.val[2], p.z));
+            dot = vsubq_f32(dot, vmulq_n_f32(e.val[2], std::abs(p.z)));
+            dot = vaddq_f32(dot, vdupq_n_f32(p.w));
+            visible = vandq_u32(visible, vreinterpretq_u32_f32(dot));
+        }
+        visible = vshlq_u32(vshrq_n_u32(visible, 31), shift);
+        results[i + 0] |= Culler::result_type(vgetq_lane_u32(visible, 0));
+        results[i + 1] |= Culler::result_type(vgetq_lane_u32(visible, 1));
+        results[i + 2] |= Culler::result_type(vgetq_lane_u32(visible, 2));
+        results[i + 3] |= Culler::result_type(vgetq_lane_u32(visible, 3));
+    }
+}
+
+#endif // FILAMENT_CULLER_USE_NEON
+
+static bool isSupported(Culler::Test::Kernel kernel) noexcept {
+    switch (kernel) {
+        case Culler::Test::Kernel::DEFAULT:
+        case Culler::Test::Kernel::GENERIC:
+            return true;
+#if defined(FILAMENT_CULLER_USE_X86)
+        case Culler::Test::Kernel::SSE41:
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("sse4.1");
+        case Culler::Test::Kernel::AVX2:
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("avx2");
+#endif
+#if defined(FILAMENT_CULLER_USE_NEON)
+        case Culler::Test::Kernel::NEON:
+            return true;
+#endif
+        default:
+            return false;
+    }
+}
+
+static Kernels getKernels(Culler::Test::Kernel kernel) noexcept {
+    switch (kernel) {
+#if defined(FILAMENT_CULLER_USE_X86)
+        case Culler::Test::Kernel::SSE41:
+            return { &intersectsSSE41, &intersectsSSE41 };
+        case Culler::Test::Kernel::AVX2:
+            return { &intersectsAVX2, &intersectsAVX2 };
+#endif
+#if defined(FILAMENT_CULLER_USE_NEON)
+        case Culler::Test::Kernel::NEON:
+            return { &intersectsNEON, &intersectsNEON };
+#endif
+        case Culler::Test::Kernel::DEFAULT: {
+            // this is initialized only once, the first time we get here
+            static const Kernels best = getKernels(
+                    isSupported(Culler::Test::Kernel::NEON)  ? Culler::Test::Kernel::NEON  :
+                    isSupported(Culler::Test::Kernel::AVX2)  ? Culler::Test::Kernel::AVX2  :
+                    isSupported(Culler::Test::Kernel::SSE41) ? Culler::Test::Kernel::SSE41 :
+                                                               Culler::Test::Kernel::GENERIC);
+            return best;
+        }
+        default:
+            return { &intersectsGeneric, &intersectsGeneric };
     }
 }
 
+void Culler::intersects(
+        result_type* UTILS_RESTRICT results,
+        Frustum const& UTILS_RESTRICT frustum,
+        math::float4 const* UTILS_RESTRICT b,
+        size_t count) noexcept {
+    // capacity guaranteed to be multiple of 8
+    getKernels(Test::Kernel::DEFAULT).spheres(results, frustum.mPlanes, b, round(count));
+}
+
+void Culler::intersects(
+        result_type* UTILS_RESTRICT results,
+        Frustum const& UTILS_RESTRICT frustum,
+        math::float3 const* UTILS_RESTRICT center,
+        math::float3 const* UTILS_RESTRICT extent,
+        size_t count, size_t bit) noexcept {
+    // capacity guaranteed to be multiple of 8
+    getKernels(Test::Kernel::DEFAULT).boxes(results, frustum.mPlanes,
+            center, extent, round(count), bit);
+}
+
 /*
  * returns whether a box intersects with the frustum
  */
@@ -119,20 +420,26 @@ bool Culler::intersects(Frustum const& frustum, math::float4 const& sphere) noex
 
 // For testing...
 
+bool Culler::Test::isSupported(Kernel kernel) noexcept {
+    return details::isSupported(kernel);
+}
+
 void Culler::Test::intersects(
         result_type* UTILS_RESTRICT results,
         Frustum const& UTILS_RESTRICT frustum,
         math::float3 const* UTILS_RESTRICT c,
         math::float3 const* UTILS_RESTRICT e,
-        size_t count) noexcept {
-    Culler::intersects(results, frustum, c, e, count, 0);
+        size_t count, Kernel kernel) noexcept {
+    assert(isSupported(kernel));
+    getKernels(kernel).boxes(results, frustum.mPlanes, c, e, round(count), 0);
 }
 
 void Culler::Test::intersects(
         result_type* UTILS_RESTRICT results,
         Frustum const& UTILS_RESTRICT frustum,
-        math::float4 const* UTILS_RESTRICT b, size_t count) noexcept {
-    Culler::intersects(results, frustum, b, count);
+        math::float4 const* UTILS_RESTRICT b, size_t count, Kernel kernel) noexcept {
+    assert(isSupported(kernel));
+    getKernels(kernel).spheres(results, frustum.mPlanes, b, round(count));
 }
 
 } // namespace details
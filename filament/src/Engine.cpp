@@ -32,6 +32,9 @@
 #include "details/Texture.h"
 #include "details/View.h"
 #include "driver/Program.h"
+#if defined(FILAMENT_DRIVER_SUPPORTS_RECORDING)
+#include "driver/record/RecordingDriver.h"
+#endif
 
 #include "PrecompiledMaterials.h"
 
@@ -55,6 +58,7 @@
 #include <functional>
 
 #include <stdio.h>
+#include <stdlib.h>
 
 
 using namespace math;
@@ -71,8 +75,9 @@ namespace details {
 static std::unordered_map<Engine const*, std::unique_ptr<FEngine>> sEngines;
 static std::mutex sEnginesLock;
 
-FEngine* FEngine::create(Backend backend, ExternalContext* externalContext, void* sharedGLContext) {
-    FEngine* instance = new FEngine(backend, externalContext, sharedGLContext);
+FEngine* FEngine::create(Backend backend, ExternalContext* externalContext, void* sharedGLContext,
+        BlobCache* blobCache) {
+    FEngine* instance = new FEngine(backend, externalContext, sharedGLContext, blobCache);
 
     slog.i << "FEngine (" << sizeof(void*) * 8 << " bits) created at " << instance << io::endl;
 
@@ -127,13 +132,15 @@ static const half4 sFullScreenTriangleVertices[3] = {
 // these must be static because only a pointer is copied to the render stream
 static const uint16_t sFullScreenTriangleIndices[3] = { 0, 1, 2 };
 
-FEngine::FEngine(Backend backend, ExternalContext* externalContext, void* sharedGLContext) :
+FEngine::FEngine(Backend backend, ExternalContext* externalContext, void* sharedGLContext,
+        BlobCache* blobCache) :
         mBackend(backend),
         mExternalContext(externalContext),
         mSharedGLContext(sharedGLContext),
+        mBlobCache(blobCache),
         mEntityManager(EntityManager::get()),
         mRenderableManager(*this),
-        mTransformManager(),
+        mTransformManager(&mJobSystem),
         mLightManager(*this),
         mCameraManager(*this),
         mPerViewUib(PerViewUib::getUib()),
@@ -141,7 +148,8 @@ FEngine::FEngine(Backend backend, ExternalContext* externalContext, void* shared
         mPerViewSib(PerViewSib::getSib()),
         mPostProcessUib(PostProcessingUib::getUib()),
         mPostProcessSib(PostProcessSib::getSib()),
-        mCommandBufferQueue(CONFIG_MIN_COMMAND_BUFFERS_SIZE, CONFIG_COMMAND_BUFFERS_SIZE),
+        mCommandBufferQueue(CONFIG_MIN_COMMAND_BUFFERS_SIZE, CONFIG_COMMAND_BUFFERS_SIZE,
+                CONFIG_MAX_COMMAND_BUFFERS_SIZE),
         mPerRenderPassAllocator("per-renderpass allocator", CONFIG_PER_RENDER_PASS_ARENA_SIZE),
         mEpoch(std::chrono::steady_clock::now()),
         mDriverBarrier(1)
@@ -234,10 +242,12 @@ FEngine::~FEngine() noexcept {
 void FEngine::shutdown() {
 #ifndef NDEBUG
     // print out some statistics about this run
-    size_t wm = mCommandBufferQueue.getHigWatermark();
-    size_t wmpct = wm / (CONFIG_COMMAND_BUFFERS_SIZE / 100);
+    CommandBufferQueue::Stats stats = mCommandBufferQueue.getStats();
+    size_t wm = stats.highWatermark;
+    size_t wmpct = wm / (stats.bufferSize / 100);
     slog.d << "CircularBuffer: High watermark "
-            << wm / 1024 << " KiB (" << wmpct << "%)" << io::endl;
+            << wm / 1024 << " KiB (" << wmpct << "%), grew "
+            << stats.growCount << " times" << io::endl;
 #endif
 
     DriverApi& driver = getDriverApi();
@@ -284,6 +294,8 @@ void FEngine::shutdown() {
     for (auto& item : mMaterialInstances) {
         cleanupResourceList(item.second);
     }
+    // the materials have waited for their compilations, no job is left
+    mMaterialCompiler.requestExitAndWait();
     cleanupResourceList(mFences);
 
     for (size_t i = 0; i < POST_PROCESS_STAGES_COUNT; i++) {
@@ -307,14 +319,22 @@ void FEngine::shutdown() {
 
 void FEngine::prepare() {
     SYSTRACE_CALL();
-    // prepare() is called once per Renderer frame. Ideally we would upload the content of
-    // UBOs that are visible only. It's not such a big issue because the actual upload() is
-    // skipped is the UBO hasn't changed. Still we could have a lot of these.
+    // prepare() is called once per Renderer frame.
+    mFrameId++;
+
+    // Ideally we would upload the content of UBOs that are visible only. It's not such a big
+    // issue because the actual upload() is skipped is the UBO hasn't changed. Still we could
+    // have a lot of these.
     for (auto& materialInstanceList : mMaterialInstances) {
         for (auto& item : materialInstanceList.second) {
             item->commit(*this);
         }
     }
+
+    // create the programs of the material variants prepared in the background
+    for (auto& material : mMaterials) {
+        material->commitCompilations();
+    }
 }
 
 void FEngine::gc() {
@@ -352,6 +372,15 @@ int FEngine::loop() {
 #endif
     }
     mDriver = mExternalContext->createDriver(mSharedGLContext);
+    if (mDriver) {
+#if defined(FILAMENT_DRIVER_SUPPORTS_RECORDING)
+        // the driver commands can be recorded for replaying them offline (see tools/filament_replay)
+        if (const char* path = getenv("FILAMENT_DRIVER_RECORDING")) {
+            mDriver = RecordingDriver::create(std::move(mDriver), path);
+        }
+#endif
+        mDriver->setBlobCache(mBlobCache);
+    }
     mDriverBarrier.latch();
     if (UTILS_UNLIKELY(!mDriver)) {
         // if we get here, it's because the driver couldn't be initialized and the problem has
@@ -366,24 +395,18 @@ int FEngine::loop() {
     uint32_t affinityMask = (std::thread::hardware_concurrency() >= 6) ? 0xF0 : 0;
 
     auto& commandBufferQueue = mCommandBufferQueue;
-    while (true) {
-        // wait until we get command buffers to be executed (or thread exit requested)
-        auto buffers = commandBufferQueue.waitForCommands();
-        if (UTILS_UNLIKELY(!buffers.size())) {
-            break;
-        }
-
+    CommandBufferQueue::Slice buffer;
+    // wait until we get command buffers to be executed (or thread exit requested)
+    while (commandBufferQueue.waitForCommands(buffer)) {
         if (affinityMask) {
             // looks like thread affinity needs to be reset regularly (on Android)
             JobSystem::setThreadAffinity(affinityMask);
         }
 
-        // execute all command buffers
-        for (auto& item : buffers) {
-            if (UTILS_LIKELY(item.begin)) {
-                mCommandStream.execute(item.begin);
-                mCommandBufferQueue.releaseBuffer(item);
-            }
+        // execute the command buffer
+        if (UTILS_LIKELY(buffer.begin)) {
+            mCommandStream.execute(buffer.begin);
+            commandBufferQueue.releaseBuffer(buffer);
         }
     }
 
@@ -395,6 +418,8 @@ int FEngine::loop() {
 void FEngine::flushCommandBuffer(CommandBufferQueue& commandQueue) {
     getDriver().purge();
     commandQueue.flush();
+    // the queue may have switched to a larger buffer
+    mCommandStream.setCircularBuffer(commandQueue.getCircularBuffer());
 }
 
 const FMaterial* FEngine::getSkyboxMaterial(driver::TextureFormat format) const noexcept {
@@ -699,6 +724,33 @@ void* FEngine::streamAlloc(size_t size, size_t alignment) noexcept {
     return getDriverApi().allocate(size, alignment);
 }
 
+Engine::CommandBufferStats FEngine::getCommandBufferStats() const noexcept {
+    CommandBufferQueue::Stats stats = mCommandBufferQueue.getStats();
+    return { stats.bufferSize, stats.requiredSize, stats.highWatermark, stats.growCount };
+}
+
+Engine::DriverObjectStats FEngine::getDriverObjectStats() const noexcept {
+    Driver const& driver = getDriver();
+    auto count = [&driver](Driver::HandleType type) -> DriverObjectCount {
+        Driver::HandleCount c = driver.getHandleCount(type);
+        return { c.live, c.highWatermark };
+    };
+    using Type = Driver::HandleType;
+    return {
+            count(Type::VERTEX_BUFFER),
+            count(Type::INDEX_BUFFER),
+            count(Type::RENDER_PRIMITIVE),
+            count(Type::PROGRAM),
+            count(Type::SAMPLER_BUFFER),
+            count(Type::UNIFORM_BUFFER),
+            count(Type::TEXTURE),
+            count(Type::RENDER_TARGET),
+            count(Type::FENCE),
+            count(Type::SWAP_CHAIN),
+            count(Type::STREAM),
+    };
+}
+
 // ---------------------------------------------------------------------------------------------
 
 EnginePerformanceTest::~EnginePerformanceTest() noexcept = default;
@@ -733,8 +785,10 @@ EnginePerformanceTest::PFN EnginePerformanceTest::getDestroyUniverseApi() {
 
 using namespace details;
 
-Engine* Engine::create(Backend backend, ExternalContext* externalContext, void* sharedGLContext) {
-    std::unique_ptr<FEngine> engine(FEngine::create(backend, externalContext, sharedGLContext));
+Engine* Engine::create(Backend backend, ExternalContext* externalContext, void* sharedGLContext,
+        BlobCache* blobCache) {
+    std::unique_ptr<FEngine> engine(
+            FEngine::create(backend, externalContext, sharedGLContext, blobCache));
     if (UTILS_UNLIKELY(!engine)) {
         // something went wrong during the driver or engine initialization
         return nullptr;
@@ -871,6 +925,14 @@ void* Engine::streamAlloc(size_t size, size_t alignment) noexcept {
     return upcast(this)->streamAlloc(size, alignment);
 }
 
+Engine::CommandBufferStats Engine::getCommandBufferStats() const noexcept {
+    return upcast(this)->getCommandBufferStats();
+}
+
+Engine::DriverObjectStats Engine::getDriverObjectStats() const noexcept {
+    return upcast(this)->getDriverObjectStats();
+}
+
 DebugRegistry& Engine::getDebugRegistry() noexcept {
     return upcast(this)->getDebugRegistry();
 }
@@ -53,48 +53,77 @@ static constexpr bool SUPPORTS_NON_SQUARE_FROXELS = false;
 // - max texture size [min 2048]
 // - chosen texture width [64]
 // - size of CPU-side indices [16 bits]
+// - size of the per-froxel data allocated from our arena
 // Also, increasing the number of froxels adds more pressure on the "record buffer" which stores
 // the light indices per froxel. The record buffer is limited to 65536 entries, so with
 // 8192 froxels, we can store 8 lights per froxels assuming they're all used. In practice, some
 // froxels are not used, so we can store more.
-constexpr size_t FROXEL_BUFFER_ENTRY_COUNT_MAX  = 8192;
+constexpr size_t FROXEL_BUFFER_ENTRY_COUNT_MIN      = 1024;
+constexpr size_t FROXEL_BUFFER_ENTRY_COUNT_DEFAULT  = 8192;
+constexpr size_t FROXEL_BUFFER_ENTRY_COUNT_MAX      = 16384;
 
 // Make sure this matches the same constants in shading_lit.fs
 constexpr size_t FROXEL_BUFFER_WIDTH_SHIFT  = 6u;
 constexpr size_t FROXEL_BUFFER_WIDTH        = 1u << FROXEL_BUFFER_WIDTH_SHIFT;
 constexpr size_t FROXEL_BUFFER_WIDTH_MASK   = FROXEL_BUFFER_WIDTH - 1u;
-constexpr size_t FROXEL_BUFFER_HEIGHT       = (FROXEL_BUFFER_ENTRY_COUNT_MAX + FROXEL_BUFFER_WIDTH_MASK) / FROXEL_BUFFER_WIDTH;
 
 constexpr size_t RECORD_BUFFER_WIDTH_SHIFT  = 5u;
 constexpr size_t RECORD_BUFFER_WIDTH        = 1u << RECORD_BUFFER_WIDTH_SHIFT;
 constexpr size_t RECORD_BUFFER_WIDTH_MASK   = RECORD_BUFFER_WIDTH - 1u;
 
-constexpr size_t RECORD_BUFFER_HEIGHT       = 2048;
-constexpr size_t RECORD_BUFFER_ENTRY_COUNT  = RECORD_BUFFER_WIDTH * RECORD_BUFFER_HEIGHT; // 64K
+constexpr size_t RECORD_BUFFER_ENTRY_COUNT_MIN  = 4096;
+constexpr size_t RECORD_BUFFER_ENTRY_COUNT_MAX  = 65536;
 
-// Buffer needed for Froxelizer internal data structures (~256 KiB)
+// Number of Z slices
+constexpr size_t FROXEL_SLICE_COUNT_MIN = 4;
+constexpr size_t FROXEL_SLICE_COUNT_MAX = 64;
+
+// Number of froxels per Z slice used to pick the number of slices when not specified
+constexpr size_t FROXEL_SLICE_SIZE = FROXEL_BUFFER_ENTRY_COUNT_DEFAULT /
+                                     FEngine::CONFIG_FROXEL_SLICE_COUNT;
+
+// Maximum number of froxels horizontally
+constexpr size_t FROXEL_COUNT_X_MAX = 2048;
+
+// The per-light froxel lists are allocated from the per-render pass arena, their total size
+// is limited to what's needed for the maximum number of lights with the default froxel count
+// (~4 MiB). With more froxels, fewer lights can be used.
+constexpr size_t FROXEL_LIST_ENTRY_COUNT_MAX =
+        CONFIG_MAX_LIGHT_COUNT * (FROXEL_BUFFER_ENTRY_COUNT_DEFAULT + 1);
+
+// Buffer needed for Froxelizer internal data structures (~512 KiB)
 constexpr size_t PER_FROXELDATA_ARENA_SIZE = sizeof(float4) *
                                                  (FROXEL_BUFFER_ENTRY_COUNT_MAX +
                                                   FROXEL_BUFFER_ENTRY_COUNT_MAX + 3 +
-                                                  FEngine::CONFIG_FROXEL_SLICE_COUNT / 4 + 1);
+                                                  FROXEL_SLICE_COUNT_MAX / 4 + 1);
 
 
 // record buffer cannot be larger than 65K entries because we're using uint16_t to store indices
 // so its maximum size is 128 KiB
-static_assert(RECORD_BUFFER_ENTRY_COUNT <= 65536,
+static_assert(RECORD_BUFFER_ENTRY_COUNT_MAX <= 65536,
         "RecordBuffer cannot be larger than 65536 entries");
 
-Froxelizer::Froxelizer(FEngine& engine)
-        : mArena("froxel", PER_FROXELDATA_ARENA_SIZE) {
+// froxel buffer cannot be larger than 65K entries because we're using uint16_t to store indices
+static_assert(FROXEL_BUFFER_ENTRY_COUNT_MAX <= 65536,
+        "FroxelBuffer cannot be larger than 65536 entries");
 
-    DriverApi& driverApi = engine.getDriverApi();
+Froxelizer::Froxelizer(FEngine& engine)
+        : mArena("froxel", PER_FROXELDATA_ARENA_SIZE),
+          mFroxelCountMax(FROXEL_BUFFER_ENTRY_COUNT_DEFAULT),
+          mRecordCountMax(RECORD_BUFFER_ENTRY_COUNT_MAX),
+          mFroxelSliceCount(FEngine::CONFIG_FROXEL_SLICE_COUNT),
+          mLightCountMax(CONFIG_MAX_LIGHT_COUNT) {
+    createBuffers(engine.getDriverApi());
+}
 
+void Froxelizer::createBuffers(DriverApi& driverApi) noexcept {
     // RecordBuffer cannot be larger than 65536 entries, because indices are uint16_t
     GPUBuffer::ElementType type = std::is_same<RecordBufferType, uint8_t>::value
                                   ? GPUBuffer::ElementType::UINT8 : GPUBuffer::ElementType::UINT16;
-    mRecordsBuffer = GPUBuffer(driverApi, { type, 1 }, RECORD_BUFFER_WIDTH, RECORD_BUFFER_HEIGHT);
+    mRecordsBuffer = GPUBuffer(driverApi, { type, 1 },
+            RECORD_BUFFER_WIDTH, mRecordCountMax / RECORD_BUFFER_WIDTH);
     mFroxelBuffer  = GPUBuffer(driverApi, { GPUBuffer::ElementType::UINT16, 2 },
-            FROXEL_BUFFER_WIDTH, FROXEL_BUFFER_HEIGHT);
+            FROXEL_BUFFER_WIDTH, mFroxelCountMax / FROXEL_BUFFER_WIDTH);
 }
 
 Froxelizer::~Froxelizer() {
@@ -123,6 +152,44 @@ void Froxelizer::setOptions(float zLightNear, float zLightFar) noexcept {
 }
 
 
+void Froxelizer::setBudget(View::DynamicLightingBudget const& budget) noexcept {
+    // the buffers' sizes must be multiples of their width
+    const uint32_t froxelCount = budget.froxelCount ?
+            uint32_t(clamp(size_t(budget.froxelCount),
+                    FROXEL_BUFFER_ENTRY_COUNT_MIN, FROXEL_BUFFER_ENTRY_COUNT_MAX)
+                            & ~FROXEL_BUFFER_WIDTH_MASK) :
+            uint32_t(FROXEL_BUFFER_ENTRY_COUNT_DEFAULT);
+
+    const uint32_t recordCount = budget.recordCount ?
+            uint32_t(clamp(size_t(budget.recordCount),
+                    RECORD_BUFFER_ENTRY_COUNT_MIN, RECORD_BUFFER_ENTRY_COUNT_MAX)
+                            & ~RECORD_BUFFER_WIDTH_MASK) :
+            uint32_t(RECORD_BUFFER_ENTRY_COUNT_MAX);
+
+    // by default, keep the size of the slices constant, this gives 16 slices with the default
+    // froxel count.
+    const uint16_t sliceCount = uint16_t(clamp(
+            budget.froxelSliceCount ? size_t(budget.froxelSliceCount) :
+                                      froxelCount / FROXEL_SLICE_SIZE,
+            FROXEL_SLICE_COUNT_MIN, FROXEL_SLICE_COUNT_MAX));
+
+    const uint16_t lightCountMax = uint16_t(std::min(
+            FROXEL_LIST_ENTRY_COUNT_MAX / (froxelCount + 1), CONFIG_MAX_LIGHT_COUNT));
+    const uint16_t lightCount = budget.maxLightCount ?
+            std::min(budget.maxLightCount, lightCountMax) : lightCountMax;
+
+    if (UTILS_UNLIKELY(mFroxelCountMax != froxelCount || mRecordCountMax != recordCount)) {
+        mFroxelCountMax = froxelCount;
+        mRecordCountMax = recordCount;
+        mDirtyFlags |= VIEWPORT_CHANGED | BUFFERS_CHANGED;
+    }
+    if (UTILS_UNLIKELY(mFroxelSliceCount != sliceCount)) {
+        mFroxelSliceCount = sliceCount;
+        mDirtyFlags |= VIEWPORT_CHANGED;
+    }
+    mLightCountMax = lightCount;
+}
+
 void Froxelizer::setViewport(Viewport const& viewport) noexcept {
     if (UTILS_UNLIKELY(mViewport != viewport)) {
         mViewport = viewport;
@@ -140,13 +207,14 @@ void Froxelizer::setProjection(const mat4f& projection, float near, float far) n
 
 bool Froxelizer::prepare(
         FEngine::DriverApi& driverApi, ArenaScope& arena, Viewport const& viewport,
-        const math::mat4f& projection, float projectionNear, float projectionFar) noexcept {
+        const math::mat4f& projection, float projectionNear, float projectionFar,
+        size_t lightCount) noexcept {
     setViewport(viewport);
     setProjection(projection, projectionNear, projectionFar);
 
     bool uniformsNeedUpdating = false;
     if (UTILS_UNLIKELY(mDirtyFlags)) {
-        uniformsNeedUpdating = update();
+        uniformsNeedUpdating = update(driverApi);
     }
 
     /*
@@ -155,15 +223,15 @@ bool Froxelizer::prepare(
      */
 
     // froxel buffer (~32 KiB)
-    const uint32_t maxFroxelCount = FROXEL_BUFFER_WIDTH * FROXEL_BUFFER_HEIGHT;
+    const uint32_t maxFroxelCount = mFroxelCountMax;
     mFroxelBufferUser = {
             driverApi.allocatePod<FroxelEntry>(maxFroxelCount, CACHELINE_SIZE),
             maxFroxelCount };
 
-    // record buffer (~64 KiB)
+    // record buffer (~128 KiB)
     mRecordBufferUser = {
-            driverApi.allocatePod<RecordBufferType>(RECORD_BUFFER_ENTRY_COUNT, CACHELINE_SIZE),
-            RECORD_BUFFER_ENTRY_COUNT };
+            driverApi.allocatePod<RecordBufferType>(mRecordCountMax, CACHELINE_SIZE),
+            mRecordCountMax };
 
     /*
      * Temporary allocations for processing all froxel data
@@ -171,17 +239,20 @@ bool Froxelizer::prepare(
 
     // light records per froxel (~256 KiB)
     mLightRecords = {
-            arena.allocate<LightRecord>(FROXEL_BUFFER_ENTRY_COUNT_MAX, CACHELINE_SIZE),
-            FROXEL_BUFFER_ENTRY_COUNT_MAX };
+            arena.allocate<LightRecord>(maxFroxelCount, CACHELINE_SIZE),
+            maxFroxelCount };
 
     // indices to the per-light froxel list (~2 KiB)
     mFroxelListIndices = {
             arena.allocate<FroxelRunEntry>(CONFIG_MAX_LIGHT_COUNT, CACHELINE_SIZE),
             CONFIG_MAX_LIGHT_COUNT };
 
-    // per-light froxel list (~4 MiB)
+    // per-light froxel list (~4 MiB max)
     constexpr uint32_t EXTRA_DATA = 1;    // to store the index/type of each light
-    const uint32_t froxelListSize = uint32_t(CONFIG_MAX_LIGHT_COUNT) * (maxFroxelCount + EXTRA_DATA);
+    assert(lightCount <= mLightCountMax);
+    const uint32_t froxelListSize = uint32_t(std::max(lightCount, size_t(1))) *
+            (maxFroxelCount + EXTRA_DATA);
+    assert(froxelListSize <= FROXEL_LIST_ENTRY_COUNT_MAX);
     mFroxelList = {
             arena.allocate<uint16_t>(froxelListSize, CACHELINE_SIZE),
             froxelListSize };
@@ -204,18 +275,20 @@ bool Froxelizer::prepare(
 
 void Froxelizer::computeFroxelLayout(
         uint2* dim, uint16_t* countX, uint16_t* countY, uint16_t* countZ,
-        Viewport const& viewport) noexcept {
+        Viewport const& viewport, size_t froxelCount, size_t froxelSliceCount) noexcept {
+
+    // - Start from the maximum number of froxels we can use in the x-y plane
+    const size_t froxelPlaneCount = froxelCount / froxelSliceCount;
 
     if (SUPPORTS_NON_SQUARE_FROXELS == false) {
-        // calculate froxel dimension from FROXEL_BUFFER_ENTRY_COUNT_MAX and viewport
-        // - Start from the maximum number of froxels we can use in the x-y plane
-        size_t froxelSliceCount = FEngine::CONFIG_FROXEL_SLICE_COUNT;
-        size_t froxelPlaneCount = FROXEL_BUFFER_ENTRY_COUNT_MAX / froxelSliceCount;
+        // calculate froxel dimension from the froxel count and viewport
         // - compute the number of square froxels we need in width and height, rounded down
         //   solving: |  froxelCountX * froxelCountY == froxelPlaneCount
         //            |  froxelCountX / froxelCountY == width / height
         size_t froxelCountX = size_t(std::sqrt(froxelPlaneCount * viewport.width  / viewport.height));
         size_t froxelCountY = size_t(std::sqrt(froxelPlaneCount * viewport.height / viewport.width));
+        froxelCountX = clamp(froxelCountX, size_t(1), FROXEL_COUNT_X_MAX);
+        froxelCountY = std::max(froxelCountY, size_t(1));
         // - copmute the froxels dimensions, rounded up
         size_t froxelSizeX = (viewport.width  + froxelCountX - 1) / froxelCountX;
         size_t froxelSizeY = (viewport.height + froxelCountY - 1) / froxelCountY;
@@ -232,27 +305,36 @@ void Froxelizer::computeFroxelLayout(
         *countY = uint16_t(froxelCountY);
         *countZ = uint16_t(froxelSliceCount);
     } else {
-        // TODO: don't hardcode this
-        *countX = uint16_t(32);
-        *countY = uint16_t(16);
-        if (viewport.height > viewport.width) {
-            std::swap(*countX, *countY);
-        }
-        *countZ = uint16_t(FEngine::CONFIG_FROXEL_SLICE_COUNT);
+        // use all the froxels of the plane, following the aspect ratio of the viewport
+        size_t froxelCountX = size_t(std::sqrt(froxelPlaneCount * viewport.width  / viewport.height));
+        froxelCountX = clamp(froxelCountX, size_t(1), std::min(froxelPlaneCount, FROXEL_COUNT_X_MAX));
+        size_t froxelCountY = froxelPlaneCount / froxelCountX;
+        *countX = uint16_t(froxelCountX);
+        *countY = uint16_t(froxelCountY);
+        *countZ = uint16_t(froxelSliceCount);
          dim->x = (viewport.width  + *countX - 1) / *countX;
          dim->y = (viewport.height + *countY - 1) / *countY;
     }
 }
 
 UTILS_NOINLINE
-bool Froxelizer::update() noexcept {
+bool Froxelizer::update(DriverApi& driverApi) noexcept {
     bool uniformsNeedUpdating = false;
+    if (UTILS_UNLIKELY(mDirtyFlags & BUFFERS_CHANGED)) {
+        // the previous buffers are destroyed after the commands using them are executed
+        mRecordsBuffer.terminate(driverApi);
+        mFroxelBuffer.terminate(driverApi);
+        createBuffers(driverApi);
+        uniformsNeedUpdating = true;
+    }
+
     if (UTILS_UNLIKELY(mDirtyFlags & VIEWPORT_CHANGED)) {
         Viewport const& viewport = mViewport;
 
         uint2 froxelDimension;
         uint16_t froxelCountX, froxelCountY, froxelCountZ;
-        computeFroxelLayout(&froxelDimension, &froxelCountX, &froxelCountY, &froxelCountZ, viewport);
+        computeFroxelLayout(&froxelDimension, &froxelCountX, &froxelCountY, &froxelCountZ,
+                viewport, mFroxelCountMax, mFroxelSliceCount);
 
         mFroxelDimension = froxelDimension;
         mClipToFroxelX = (0.5f * viewport.width)  / froxelDimension.x;
@@ -262,12 +344,12 @@ bool Froxelizer::update() noexcept {
         uniformsNeedUpdating = true;
 
 #ifndef NDEBUG
-        size_t froxelSliceCount = FEngine::CONFIG_FROXEL_SLICE_COUNT;
+        size_t froxelSliceCount = froxelCountZ;
         slog.d << "Froxel: " << viewport.width << "x" << viewport.height << " / "
                << froxelDimension.x << "x" << froxelDimension.y << io::endl
                << "Froxel: " << froxelCountX << "x" << froxelCountY << "x" << froxelSliceCount
                << " = " << (froxelCountX * froxelCountY * froxelSliceCount)
-               << " (" << FROXEL_BUFFER_ENTRY_COUNT_MAX - froxelCountX * froxelCountY * froxelSliceCount << " lost)"
+               << " (" << mFroxelCountMax - froxelCountX * froxelCountY * froxelSliceCount << " lost)"
                << io::endl;
 #endif
 
@@ -360,8 +442,9 @@ bool Froxelizer::update() noexcept {
         //                      n0.(n1 x n2)
 
         // use stack memory here, it's only 16 KiB max
-        assert(mFroxelCountX <= 2048);
-        typename std::aligned_storage<sizeof(float2), alignof(float2)>::type stack[2048];
+        assert(mFroxelCountX <= FROXEL_COUNT_X_MAX);
+        typename std::aligned_storage<sizeof(float2), alignof(float2)>::type
+                stack[FROXEL_COUNT_X_MAX];
         float2* const UTILS_RESTRICT minMaxX = reinterpret_cast<float2*>(stack);
 
         float4* const        UTILS_RESTRICT boundingSpheres = mBoundingSpheres;
@@ -535,7 +618,7 @@ void Froxelizer::froxelizeLights(FEngine& engine,
             uint32_t(lightData.size() - FScene::DIRECTIONAL_LIGHTS_COUNT));
 
     froxelizeLoop(engine, mFroxelList, mFroxelListIndices, viewMatrix, lightData);
-    froxelizeAssignRecordsCompress(mFroxelList, mFroxelListIndices);
+    froxelizeAssignRecordsCompress(engine.getJobSystem(), mFroxelList, mFroxelListIndices);
 
 #ifndef NDEBUG
     if (lightData.size()) {
@@ -546,7 +629,7 @@ void Froxelizer::froxelizeLights(FEngine& engine,
             // go through every lights for that froxel
             for (size_t i = 0; i < entry.pointLightCount + entry.spotLightCount; i++) {
                 // get the light index
-                assert(entry.offset + i < RECORD_BUFFER_ENTRY_COUNT);
+                assert(entry.offset + i < mRecordCountMax);
 
                 size_t lightIndex = recordBufferUser[entry.offset + i];
                 assert(lightIndex < CONFIG_MAX_LIGHT_COUNT);
@@ -616,86 +699,159 @@ void Froxelizer::froxelizeLoop(FEngine& engine, utils::Slice<uint16_t>& froxelsL
     js.runAndWait(job);
 }
 
-void Froxelizer::froxelizeAssignRecordsCompress(
+void Froxelizer::froxelizeAssignRecordsCompress(JobSystem& js,
         const utils::Slice<uint16_t>& froxelsList,
         const utils::Slice<FroxelRunEntry>& froxelsListIndices) noexcept {
 
     SYSTRACE_CALL();
 
-    Slice<FroxelEntry> gpuFroxelEntries(mFroxelBufferUser);
-    utils::Slice<LightRecord> records(mLightRecords);
-    memset(records.data(), 0, records.sizeInBytes());
+    constexpr bool SINGLE_THREADED = false;
 
     bitset256 spotLights;
     for (size_t i = 0, c = froxelsListIndices.size(); i < c; ++i) {
-        // (skip first entry, which is the light's index)
+        // the first entry of each list is the light's index and type
         const int isSpotLight = froxelsList[froxelsListIndices[i].index] & 1;
         spotLights.set(i, (bool) isSpotLight);
-        for (size_t j = froxelsListIndices[i].index + 1,
-                     m = froxelsListIndices[i].index + froxelsListIndices[i].count; j < m; ++j) {
-            records[froxelsList[j]].lights.set(i);
+    }
+
+    /*
+     * The Z slices are processed in parallel:
+     * 1) each slice gathers the lights of its froxels and computes how many record entries
+     *    it needs,
+     * 2) the offset of each slice in the record buffer is computed with a prefix sum,
+     * 3) each slice writes its froxels and records.
+     * Identical consecutive froxels share their records, except across slices.
+     *
+     * When the record buffer is too small, the slices farthest from the camera are dropped
+     * (i.e. no lights are assigned to their froxels), this is less noticeable than dropping
+     * lights.
+     */
+
+    const size_t froxelCount = mLightRecords.size();
+    const size_t sliceSize = size_t(mFroxelCountX) * mFroxelCountY;
+    const size_t sliceCount = mFroxelCountZ;
+    assert(sliceCount <= FROXEL_SLICE_COUNT_MAX);
+    auto sliceRange = [=](size_t z) -> std::pair<size_t, size_t> {
+        const size_t begin = z * sliceSize;
+        // the last slice also handles the unused froxels at the end of the buffer
+        const size_t end = (z == sliceCount - 1) ? froxelCount : begin + sliceSize;
+        return { begin, end };
+    };
+
+    // offsets[z] is the offset of slice z in the record buffer
+    uint32_t offsets[FROXEL_SLICE_COUNT_MAX + 1];
+
+    auto gather = [this, &froxelsList, &froxelsListIndices, &sliceRange, &offsets]
+            (uint32_t s, uint32_t c) {
+        LightRecord* const UTILS_RESTRICT records = mLightRecords.data();
+        for (size_t z = s; z < s + c; z++) {
+            const auto range = sliceRange(z);
+            memset(records + range.first, 0, (range.second - range.first) * sizeof(LightRecord));
+
+            // each light's list of froxels is sorted, find the ones that belong to this slice
+            for (size_t i = 0, n = froxelsListIndices.size(); i < n; ++i) {
+                // (skip first entry, which is the light's index)
+                uint16_t const* const first =
+                        froxelsList.begin() + froxelsListIndices[i].index + 1;
+                uint16_t const* const last =
+                        froxelsList.begin() + froxelsListIndices[i].index +
+                                froxelsListIndices[i].count;
+                for (uint16_t const* it = std::lower_bound(first, last, range.first);
+                        it != last && *it < range.second; ++it) {
+                    records[*it].lights.set(i);
+                }
+            }
+
+            uint32_t size = 0;
+            for (size_t i = range.first; i < range.second; i++) {
+                if (i == range.first || records[i].lights != records[i - 1].lights) {
+                    size += uint32_t(records[i].lights.count());
+                }
+            }
+            offsets[z + 1] = size;
+        }
+    };
+
+    auto job = jobs::parallel_for(js, nullptr, 0, uint32_t(sliceCount),
+            std::cref(gather), jobs::CountSplitter<1, SINGLE_THREADED ? 0 : 8>());
+    js.runAndWait(job);
+
+    // find how many slices fit in the record buffer
+    const uint32_t recordCount = mRecordCountMax;
+    size_t visibleSliceCount = 0;
+    offsets[0] = 0;
+    for (size_t z = 0; z < sliceCount; z++) {
+        offsets[z + 1] += offsets[z];
+        if (offsets[z + 1] <= recordCount) {
+            visibleSliceCount = z + 1;
         }
     }
 
+#ifndef NDEBUG
+    if (UTILS_UNLIKELY(visibleSliceCount < sliceCount)) {
+        slog.d << "out of space: dropping " << (sliceCount - visibleSliceCount) << " slices, "
+               << offsets[sliceCount] << " records needed" << io::endl;
+    }
+#endif
+
     // note: we can't partition out the empty froxels unless we keep track of the indices.
     // It looks like empty froxels are a common case and removing them upfront, could help
     // 1/ compacting better and 2/ go through less data. In practice, it didn't seem to help
     // compaction much.
 
-    // todo: pld in main loop (not easy because variable size steps)
-
-    uint16_t offset = 0;
-    FroxelEntry* const UTILS_RESTRICT froxels = gpuFroxelEntries.data();
-    RecordBufferType* UTILS_RESTRICT froxelRecords = mRecordBufferUser.data();
-
-    // how many froxel record entries were reused (for debugging)
-    UTILS_UNUSED size_t reused = FROXEL_BUFFER_ENTRY_COUNT_MAX;
+    auto compress = [this, &spotLights, &froxelsListIndices, &sliceRange, &offsets,
+                     visibleSliceCount](uint32_t s, uint32_t c) {
+        LightRecord const* const UTILS_RESTRICT records = mLightRecords.data();
+        FroxelEntry* const UTILS_RESTRICT froxels = mFroxelBufferUser.data();
+        RecordBufferType* const UTILS_RESTRICT froxelRecords = mRecordBufferUser.data();
+
+        for (size_t z = s; z < s + c; z++) {
+            const auto range = sliceRange(z);
+            if (UTILS_UNLIKELY(z >= visibleSliceCount)) {
+                // this slice doesn't fit in the record buffer
+                memset(froxels + range.first, 0,
+                        (range.second - range.first) * sizeof(FroxelEntry));
+                continue;
+            }
 
-    for (size_t i = 0, c = records.size(); i < c;) {
-#ifndef NDEBUG
-        reused--;
-#endif
-        auto const& b = records[i];
-        const FroxelEntry entry = {
-                .offset = offset,
-                .pointLightCount = uint8_t((b.lights & ~spotLights).count()),
-                .spotLightCount  = uint8_t((b.lights &  spotLights).count())
-        };
-        const uint8_t lightCount = entry.count[0] + entry.count[1];
-        assert(lightCount <= froxelsListIndices.size());
-
-        if (UTILS_UNLIKELY(offset + lightCount >= RECORD_BUFFER_ENTRY_COUNT)) {
-#ifndef NDEBUG
-            slog.d << "out of space: " << i << ", at " << offset << io::endl;
-#endif
-            // note: instead of dropping froxels we could look for similar records we've already
-            // filed up.
-            do { // this compiles to memset()
-                froxels[i++].u32 = 0;
-            } while(i < c);
-            goto out_of_memory;
+            uint32_t offset = offsets[z];
+            for (size_t i = range.first, e = range.second; i < e;) {
+                auto const& b = records[i];
+                const FroxelEntry entry = {
+                        .offset = uint16_t(offset),
+                        .pointLightCount = uint8_t((b.lights & ~spotLights).count()),
+                        .spotLightCount  = uint8_t((b.lights &  spotLights).count())
+                };
+                const uint8_t lightCount = entry.count[0] + entry.count[1];
+                assert(lightCount <= froxelsListIndices.size());
+                assert(offset + lightCount <= offsets[z + 1]);
+
+                // iterate the bitfield
+                b.lights.forEachSetBit([&spotLights,
+                        point = froxelRecords + offset,
+                        spot = froxelRecords + offset + entry.count[0]](size_t l) mutable {
+                            (spotLights[l] ? *spot++ : *point++) = (RecordBufferType) l;
+                        });
+                offset += lightCount;
+
+                // note: we can't use partition_point() here because we're not sorted
+                do {
+                    froxels[i++].u32 = entry.u32;
+                } while (i < e && records[i].lights == b.lights);
+            }
         }
+    };
 
-        // iterate the bitfield
-        b.lights.forEachSetBit([&spotLights,
-                point = froxelRecords + offset,
-                spot = froxelRecords + offset + entry.count[0]](size_t l) mutable {
-                    (spotLights[l] ? *spot++ : *point++) = (RecordBufferType) l;
-                });
-        offset += lightCount;
-
-        // note: we can't use partition_point() here because we're not sorted
-        do {
-            froxels[i++].u32 = entry.u32;
-        } while(i < c && records[i].lights == b.lights);
-    }
-out_of_memory:
+    job = jobs::parallel_for(js, nullptr, 0, uint32_t(sliceCount),
+            std::cref(compress), jobs::CountSplitter<1, SINGLE_THREADED ? 0 : 8>());
+    js.runAndWait(job);
 
     // froxel buffer is always fully invalidated
     mFroxelBuffer.invalidate();
 
     // needed record buffer size may change at each frame
-    mRecordsBuffer.invalidate(0, (offset + RECORD_BUFFER_WIDTH_MASK) >> RECORD_BUFFER_WIDTH_SHIFT);
+    const uint32_t size = offsets[visibleSliceCount];
+    mRecordsBuffer.invalidate(0, (size + RECORD_BUFFER_WIDTH_MASK) >> RECORD_BUFFER_WIDTH_SHIFT);
 }
 
 static inline float2 project(mat4f const& p, float3 const& v) noexcept {
@@ -780,6 +936,11 @@ void Froxelizer::froxelizePointAndSpotLight(
     float4 const * const UTILS_RESTRICT planesY = mPlanesY;
     float const * const UTILS_RESTRICT planesZ = mDistancesZ;
     float4 const * const UTILS_RESTRICT boundingSpheres = mBoundingSpheres;
+
+    // per-row intersection results, use stack memory here, it's only 2 KiB max
+    assert(mFroxelCountX <= FROXEL_COUNT_X_MAX);
+    uint8_t hits[FROXEL_COUNT_X_MAX];
+
     for (size_t iz = z0 ; iz <= z1; ++iz) {
         float4 cz(s);
         if (UTILS_LIKELY(iz != zcenter)) {
@@ -801,21 +962,23 @@ void Froxelizer::froxelizePointAndSpotLight(
                     cy = spherePlaneIntersection(cz, plane.y, plane.z);
                 }
                 if (cy.w > 0) { // intersection of light with this horizontal plane
+                    // Test the sphere against all the vertical planes of the row at once, this
+                    // is cheaper than searching for the first and last intersecting planes
+                    // because clang vectorizes this loop.
+                    const size_t xb = std::min(x0, xcenter);
+                    const size_t xe = std::max(x1, xcenter + 1);
+                    for (size_t ix = xb; ix < xe; ++ix) {
+                        hits[ix - xb] = uint8_t(
+                                spherePlaneDistanceSquared(cy, planesX[ix].x, planesX[ix].z) > 0);
+                    }
+
                     size_t bx, ex; // horizontal begin/end indices
                     // find the begin index (left side)
-                    for (bx = x0; bx <= xcenter; ++bx) {
-                        if (spherePlaneDistanceSquared(cy, planesX[bx].x, planesX[bx].z) > 0) {
-                            // intersection
-                            break;
-                        }
+                    for (bx = x0; bx <= xcenter && !hits[bx - xb]; ++bx) {
                     }
 
                     // find the end index (right side), x1 is past the end
-                    for (ex = x1; --ex > xcenter;) {
-                        if (spherePlaneDistanceSquared(cy, planesX[ex].x, planesX[ex].z) > 0) {
-                            // intersection
-                            break;
-                        }
+                    for (ex = x1; --ex > xcenter && !hits[ex - xb];) {
                     }
                     ++ex;
 
@@ -832,28 +995,28 @@ void Froxelizer::froxelizePointAndSpotLight(
                     // slice later. We can't run past the end of the slice by construction.
                     uint16_t* pf = froxels.end();
 
-                    uint16_t fi = getFroxelIndex(bx, iy, iz);
+                    const uint16_t fi = getFroxelIndex(bx, iy, iz);
+                    const size_t count = ex - bx;
                     if (light.invSin != std::numeric_limits<float>::infinity()) {
                         // This is a spotlight (common case)
-                        while (bx != ex) {
-                            // Here we always write the froxel, but we only increment the pointer
-                            // if there was an intersection (i.e. it will be overwritten if not).
-                            // This allows us to avoid a branch.
-                            *pf = fi;
-                            if (sphereConeIntersectionFast(boundingSpheres[fi],
-                                    light.position, light.axis, light.invSin, light.cosSqr)) {
-                                // see if this froxel intersects the cone
-                                pf++;
-                            }
-                            ++fi;
-                            ++bx;
+                        // First test all the froxels of the row against the cone, this loop
+                        // is branch-less and gets vectorized by clang.
+                        float4 const* const UTILS_RESTRICT spheres = boundingSpheres + fi;
+                        for (size_t i = 0; i < count; ++i) {
+                            hits[i] = uint8_t(sphereConeIntersectionFast(spheres[i],
+                                    light.position, light.axis, light.invSin, light.cosSqr));
+                        }
+                        // Here we always write the froxel, but we only increment the pointer
+                        // if there was an intersection (i.e. it will be overwritten if not).
+                        // This allows us to avoid a branch.
+                        for (size_t i = 0; i < count; ++i) {
+                            *pf = uint16_t(fi + i);
+                            pf += hits[i];
                         }
                     } else {
                         // this loops gets vectorized (x8 on arm64) w/ clang
-                        while (bx != ex) {
-                            *pf++ = fi;
-                            ++fi;
-                            ++bx;
+                        for (size_t i = 0; i < count; ++i) {
+                            *pf++ = uint16_t(fi + i);
                         }
                     }
 
@@ -18,6 +18,9 @@
 
 #include "details/Engine.h"
 #include "details/DFG.h"
+#include "details/VertexBuffer.h"
+#include "MaterialCompiler.h"
+#include "RenderPass.h"
 #include "driver/Program.h"
 
 #include "FilamentAPI-impl.h"
@@ -31,9 +34,13 @@
 
 #include <filaflat/MaterialParser.h>
 
+#include <utils/algorithm.h>
 #include <utils/Panic.h>
 
+#include <atomic>
+#include <mutex>
 #include <sstream>
+#include <thread>
 
 using namespace utils;
 using namespace filaflat;
@@ -79,14 +86,26 @@ Material* Material::Builder::build(Engine& engine) {
 
     assert(upcast(engine).getBackend() != Backend::DEFAULT && "Default backend has not been resolved.");
 
+    CString name;
+    materialParser->getName(&name);
+
+    // the variants (and so the shaders) of the package must match the ones of this engine
+    uint32_t version = 0;
+    materialParser->getMaterialVersion(&version);
+    if (!ASSERT_POSTCONDITION_NON_FATAL(version == MATERIAL_VERSION,
+            "the material '%s' was built with version %u of the material format but this "
+            "engine requires version %u, rebuild it with the matching version of matc",
+            name.c_str_safe(), version, MATERIAL_VERSION)) {
+        delete materialParser;
+        return nullptr;
+    }
+
     uint32_t v;
     materialParser->getShaderModels(&v);
     utils::bitset32 shaderModels;
     shaderModels.setValue(v);
 
     uint32_t sm = static_cast<uint32_t>(upcast(engine).getDriver().getShaderModel());
-    CString name;
-    materialParser->getName(&name);
     if (!ASSERT_POSTCONDITION_NON_FATAL(shaderModels.test(sm),
             "the material '%s' does not contain shaders compatible with this platform; "
             "need shader model %d but have 0x%02x", name.c_str_safe(), sm,
@@ -225,7 +244,31 @@ FMaterial::~FMaterial() noexcept {
     delete mMaterialParser;
 }
 
+static_assert(Material::Variants::DIRECTIONAL_LIGHTING == Variant::DIRECTIONAL_LIGHTING &&
+              Material::Variants::DYNAMIC_LIGHTING == Variant::DYNAMIC_LIGHTING &&
+              Material::Variants::SHADOW_RECEIVER == Variant::SHADOW_RECEIVER &&
+              Material::Variants::SKINNING == Variant::SKINNING &&
+              Material::Variants::INSTANCING == Variant::INSTANCING &&
+              Material::Variants::SHADOW_CASCADES == Variant::SHADOW_CASCADES &&
+              Material::Variants::ALL == VARIANT_COUNT - 1,
+        "Material::Variants must match the variant keys");
+
+// The variants prepared by one call to compile()
+struct FMaterial::Compilation {
+    uint64_t variants = 0;                          // one bit per variant key
+    CompilationCallback callback = nullptr;
+    void* user = nullptr;
+    std::atomic<uint32_t> remaining = { 0 };        // variants not prepared yet
+    std::atomic<bool> cancelled = { false };        // the variants not started yet are skipped
+    // each job writes the sources of its own variant
+    std::array<CString, VARIANT_COUNT> vertexShaders;
+    std::array<CString, VARIANT_COUNT> fragmentShaders;
+};
+
 void FMaterial::terminate(FEngine& engine) {
+    // the jobs of compile() use the parser, which is destroyed with this material
+    cancelCompilations();
+
     DriverApi& driverApi = engine.getDriverApi();
     auto& cachedPrograms = mCachedPrograms;
     for (size_t i = 0, n = cachedPrograms.size(); i < n; ++i) {
@@ -255,44 +298,46 @@ bool FMaterial::hasParameter(const char* name) const noexcept {
 }
 
 Handle<HwProgram> FMaterial::getProgramSlow(uint8_t variantKey) const noexcept {
-    const ShaderModel sm = mEngine.getDriver().getShaderModel();
-
-    assert(!Variant::isReserved(variantKey));
-
-    uint8_t vertexVariantKey = Variant::filterVariantVertex(variantKey);
-    uint8_t fragmentVariantKey = Variant::filterVariantFragment(variantKey);
-
-    /*
-     * Vertex shader
-     */
+    // while compile() prepares this variant, don't stall for it if a close one is ready
+    Handle<HwProgram> const fallback = getFallbackProgram(variantKey);
+    if (fallback) {
+        return fallback;
+    }
 
     filaflat::ShaderBuilder& vsBuilder = mEngine.getVertexShaderBuilder();
+    filaflat::ShaderBuilder& fsBuilder = mEngine.getFragmentShaderBuilder();
 
-    UTILS_UNUSED_IN_RELEASE bool vsOK = mMaterialParser->getShader(sm,
-            vertexVariantKey, ShaderType::VERTEX, vsBuilder);
+    UTILS_UNUSED_IN_RELEASE bool ok = getShaders(variantKey, vsBuilder, fsBuilder);
 
-    ASSERT_POSTCONDITION(vsOK && vsBuilder.size() > 0,
+    ASSERT_POSTCONDITION(ok,
             "The material '%s' has not been compiled to include the required "
-            "GLSL or SPIR-V chunks for the vertex shader (variant=0x%x, filtered=0x%x).",
-            mName.c_str(), variantKey, vertexVariantKey);
+            "GLSL or SPIR-V chunks (variant=0x%x, vertex=0x%x, fragment=0x%x).",
+            mName.c_str(), variantKey, Variant::filterVariantVertex(variantKey),
+            Variant::filterVariantFragment(variantKey));
 
-    CString vs(vsBuilder.getShader(), (CString::size_type) vsBuilder.size());
+    return createProgram(variantKey,
+            CString(vsBuilder.getShader(), (CString::size_type) vsBuilder.size()),
+            CString(fsBuilder.getShader(), (CString::size_type) fsBuilder.size()));
+}
 
-    /*
-     * Fragment shader
-     */
+bool FMaterial::getShaders(uint8_t variantKey,
+        filaflat::ShaderBuilder& vsBuilder, filaflat::ShaderBuilder& fsBuilder) const noexcept {
+    const ShaderModel sm = mEngine.getDriver().getShaderModel();
 
-    filaflat::ShaderBuilder& fsBuilder = mEngine.getFragmentShaderBuilder();
+    assert(!Variant::isReserved(variantKey));
 
-    UTILS_UNUSED_IN_RELEASE bool fsOK = mMaterialParser->getShader(sm,
-            fragmentVariantKey, ShaderType::FRAGMENT, fsBuilder);
+    uint8_t vertexVariantKey = Variant::filterVariantVertex(variantKey);
+    uint8_t fragmentVariantKey = Variant::filterVariantFragment(variantKey);
 
-    ASSERT_POSTCONDITION(fsOK && fsBuilder.size() > 0,
-            "The material '%s' has not been compiled to include the required "
-            "GLSL or SPIR-V chunks for the fragment shader (variant=0x%x, filterer=0x%x).",
-            mName.c_str(), variantKey, fragmentVariantKey);
-    CString fs(fsBuilder.getShader(), (CString::size_type) fsBuilder.size());
+    // the parser caches the shader index and dictionary as it goes
+    std::lock_guard<utils::Mutex> lock(mParserLock);
+    bool vsOK = mMaterialParser->getShader(sm, vertexVariantKey, ShaderType::VERTEX, vsBuilder);
+    bool fsOK = mMaterialParser->getShader(sm, fragmentVariantKey, ShaderType::FRAGMENT, fsBuilder);
+    return vsOK && fsOK && vsBuilder.size() > 0 && fsBuilder.size() > 0;
+}
 
+Handle<HwProgram> FMaterial::createProgram(uint8_t variantKey,
+        CString const& vs, CString const& fs) const noexcept {
     Program pb;
     pb      .diagnostics(mName, variantKey)
             .withVertexShader(vs)
@@ -309,6 +354,10 @@ Handle<HwProgram> FMaterial::getProgramSlow(uint8_t variantKey) const noexcept {
         pb.addUniformBlock(BindingPoints::PER_RENDERABLE_BONES, &UibGenerator::getPerRenderableBonesUib());
     }
 
+    if (Variant(variantKey).hasInstancing()) {
+        pb.addUniformBlock(BindingPoints::PER_RENDERABLE_INSTANCES, &UibGenerator::getPerRenderableInstancesUib());
+    }
+
     auto program = mEngine.getDriverApi().createProgram(std::move(pb));
     assert(program);
 
@@ -316,6 +365,149 @@ Handle<HwProgram> FMaterial::getProgramSlow(uint8_t variantKey) const noexcept {
     return program;
 }
 
+Handle<HwProgram> FMaterial::getFallbackProgram(uint8_t variantKey) const noexcept {
+    if (UTILS_LIKELY(!(mPendingVariants & (1ull << variantKey)))) {
+        return {};
+    }
+
+    // The depth variant has no meaningful substitute. Otherwise, the lighting and shadowing
+    // bits can be dropped, they don't change the vertex inputs nor the uniform blocks. Their
+    // subsets are visited so that the shadows are kept first, then the dynamic lights.
+    if (Variant(variantKey).isDepthPass()) {
+        return {};
+    }
+    const uint8_t bits = variantKey & Variant::FRAGMENT_MASK;
+    for (uint8_t subset = uint8_t((bits - 1u) & bits); subset != bits;
+            subset = uint8_t((subset - 1u) & bits)) {
+        const uint8_t key = uint8_t((variantKey & ~bits) | subset);
+        if (!Variant::isReserved(key) && !Variant(key).isDepthPass() && mCachedPrograms[key]) {
+            return mCachedPrograms[key];
+        }
+    }
+    return {};
+}
+
+void FMaterial::compile(uint8_t variantMask, CompilationCallback callback, void* user) noexcept {
+    std::unique_ptr<Compilation> compilation(new Compilation);
+    compilation->callback = callback;
+    compilation->user = user;
+
+    for (uint8_t key = 0; key < VARIANT_COUNT; key++) {
+        if ((key & ~variantMask) || Variant::isReserved(key) ||
+                Variant::filterVariant(key, mIsVariantLit) != key) {
+            continue;
+        }
+        if (mCachedPrograms[key] || (mPendingVariants & (1ull << key))) {
+            continue;
+        }
+        compilation->variants |= 1ull << key;
+    }
+
+    const uint64_t variants = compilation->variants;
+    mPendingVariants |= variants;
+    compilation->remaining.store(utils::popcount(variants), std::memory_order_relaxed);
+
+    // one job per variant, so that they are picked up by several threads
+    MaterialCompiler& compiler = mEngine.getMaterialCompiler();
+    Compilation* const c = compilation.get();
+    for (uint8_t key = 0; key < VARIANT_COUNT; key++) {
+        if (variants & (1ull << key)) {
+            compiler.run([this, c, key]() {
+                prepareVariant(*c, key);
+            });
+        }
+    }
+
+    mCompilations.push_back(std::move(compilation));
+}
+
+void FMaterial::precompile(uint8_t variantMask, FVertexBuffer const* vertexBuffer,
+        PrimitiveType type) const noexcept {
+    FEngine::DriverApi& driver = mEngine.getDriverApi();
+    const Handle<HwVertexBuffer> vbh = vertexBuffer->getHwHandle();
+    const uint32_t enabledAttributes = (uint32_t)vertexBuffer->getDeclaredAttributes().getValue();
+
+    // these are the raster states RenderPass uses with this material
+    Driver::RasterState depthRasterState = RenderPass::getDepthRasterState();
+    depthRasterState.culling = mRasterState.culling;
+    // with a depth pre-pass, opaque objects don't write their depth in the color pass
+    const bool hasDepthPrePassState = mRasterState.depthWrite &&
+            !mRasterState.alphaToCoverage && !mRasterState.hasBlending();
+    Driver::RasterState depthPrePassRasterState = mRasterState;
+    depthPrePassRasterState.depthWrite = false;
+
+    for (uint8_t key = 0; key < VARIANT_COUNT; key++) {
+        if ((key & ~variantMask) || Variant::isReserved(key) ||
+                Variant::filterVariant(key, mIsVariantLit) != key) {
+            continue;
+        }
+        if (mPendingVariants & (1ull << key)) {
+            continue;
+        }
+        const Handle<HwProgram> ph = getProgram(key);
+        if (Variant(key).isDepthPass()) {
+            driver.preparePipeline(ph, depthRasterState, vbh, enabledAttributes, type);
+        } else {
+            driver.preparePipeline(ph, mRasterState, vbh, enabledAttributes, type);
+            if (hasDepthPrePassState) {
+                driver.preparePipeline(ph, depthPrePassRasterState, vbh, enabledAttributes, type);
+            }
+        }
+    }
+}
+
+void FMaterial::prepareVariant(Compilation& compilation, uint8_t variantKey) const noexcept {
+    filaflat::ShaderBuilder vsBuilder;
+    filaflat::ShaderBuilder fsBuilder;
+    if (!compilation.cancelled.load(std::memory_order_relaxed) &&
+            getShaders(variantKey, vsBuilder, fsBuilder)) {
+        compilation.vertexShaders[variantKey] =
+                CString(vsBuilder.getShader(), (CString::size_type) vsBuilder.size());
+        compilation.fragmentShaders[variantKey] =
+                CString(fsBuilder.getShader(), (CString::size_type) fsBuilder.size());
+    }
+    // a variant that failed is left to getProgramSlow(), which reports the error
+    compilation.remaining.fetch_sub(1, std::memory_order_release);
+}
+
+void FMaterial::cancelCompilations() noexcept {
+    // skip the variants not started yet, and wait for the ones being prepared (at most one per
+    // thread of the MaterialCompiler)
+    for (auto const& compilation : mCompilations) {
+        compilation->cancelled.store(true, std::memory_order_relaxed);
+    }
+    for (auto const& compilation : mCompilations) {
+        while (compilation->remaining.load(std::memory_order_acquire)) {
+            std::this_thread::yield();
+        }
+    }
+    mCompilations.clear();
+    mPendingVariants = 0;
+}
+
+void FMaterial::commitCompilationsSlow() noexcept {
+    auto& compilations = mCompilations;
+    for (auto it = compilations.begin(); it != compilations.end();) {
+        Compilation& compilation = **it;
+        if (compilation.remaining.load(std::memory_order_acquire)) {
+            ++it;
+            continue;
+        }
+        for (uint8_t key = 0; key < VARIANT_COUNT; key++) {
+            // the variant may have been created by getProgramSlow() in the meantime
+            if ((compilation.variants & (1ull << key)) &&
+                    !mCachedPrograms[key] && !compilation.vertexShaders[key].empty()) {
+                createProgram(key, compilation.vertexShaders[key], compilation.fragmentShaders[key]);
+            }
+        }
+        mPendingVariants &= ~compilation.variants;
+        if (compilation.callback) {
+            compilation.callback(this, compilation.user);
+        }
+        it = compilations.erase(it);
+    }
+}
+
 size_t FMaterial::getParameters(ParameterInfo* parameters, size_t count) const noexcept {
     count = std::min(count, getParameterCount());
 
@@ -354,6 +546,15 @@ size_t FMaterial::getParameters(ParameterInfo* parameters, size_t count) const n
 
 using namespace details;
 
+void Material::compile(uint8_t variantMask, CompilationCallback callback, void* user) noexcept {
+    upcast(this)->compile(variantMask, callback, user);
+}
+
+void Material::precompile(uint8_t variantMask, VertexBuffer const* vertexBuffer,
+        PrimitiveType type) const noexcept {
+    upcast(this)->precompile(variantMask, upcast(vertexBuffer), type);
+}
+
 MaterialInstance* Material::createInstance() const noexcept {
     return upcast(this)->createInstance();
 }
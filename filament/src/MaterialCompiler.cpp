@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "MaterialCompiler.h"
+
+#include <utils/JobSystem.h>
+
+#include <assert.h>
+
+namespace filament {
+using namespace utils;
+
+MaterialCompiler::~MaterialCompiler() {
+    requestExitAndWait();
+}
+
+void MaterialCompiler::run(Job&& job) {
+    std::unique_lock<std::mutex> lock(mLock);
+    assert(!mExitRequested);
+    mQueue.push_back(std::move(job));
+    if (mThreads.empty()) {
+        for (size_t i = 0; i < mThreadCount; i++) {
+            mThreads.emplace_back(&MaterialCompiler::loop, this);
+        }
+    }
+    lock.unlock();
+    mCondition.notify_one();
+}
+
+void MaterialCompiler::requestExitAndWait() {
+    std::unique_lock<std::mutex> lock(mLock);
+    mExitRequested = true;
+    lock.unlock();
+    mCondition.notify_all();
+    for (std::thread& thread : mThreads) {
+        thread.join();
+    }
+    mThreads.clear();
+}
+
+void MaterialCompiler::loop() {
+    JobSystem::setThreadPriority(JobSystem::Priority::NORMAL);
+    JobSystem::setThreadName("MaterialCompiler");
+    auto& queue = mQueue;
+    while (true) {
+        std::unique_lock<std::mutex> lock(mLock);
+        mCondition.wait(lock, [this, &queue]() -> bool { return mExitRequested || !queue.empty(); });
+        if (queue.empty()) {
+            // exit requested, and nothing left to do
+            break;
+        }
+        Job job(std::move(queue.front()));
+        queue.pop_front();
+        lock.unlock();
+        job();
+    }
+}
+
+} // namespace filament
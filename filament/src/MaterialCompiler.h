@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef TNT_FILAMENT_MATERIALCOMPILER_H
+#define TNT_FILAMENT_MATERIALCOMPILER_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace filament {
+
+/*
+ * A few threads preparing the variants of Material::compile() in the background.
+ *
+ * The JobSystem's jobs are all reset at the end of each frame, so they can't be used for work
+ * that spans several frames. The threads are started with the first job.
+ */
+class MaterialCompiler {
+public:
+    using Job = std::function<void()>;
+
+    explicit MaterialCompiler(size_t threadCount) noexcept : mThreadCount(threadCount) { }
+    ~MaterialCompiler();
+
+    MaterialCompiler(MaterialCompiler const& rhs) = delete;
+    MaterialCompiler& operator=(MaterialCompiler const& rhs) = delete;
+
+    // queues a job, which runs on one of the threads
+    void run(Job&& job);
+
+    // runs the jobs already queued and stops the threads, no job can be queued afterwards
+    void requestExitAndWait();
+
+private:
+    void loop();
+
+    const size_t mThreadCount;
+    std::vector<std::thread> mThreads;
+    std::mutex mLock;
+    std::condition_variable mCondition;
+    std::deque<Job> mQueue;
+    bool mExitRequested = false;
+};
+
+} // namespace filament
+
+#endif // TNT_FILAMENT_MATERIALCOMPILER_H
@@ -20,6 +20,7 @@
 #include "details/Material.h"
 #include "details/MaterialInstance.h"
 #include "details/RenderPrimitive.h"
+#include "details/ShadowAtlas.h"
 #include "details/ShadowMap.h"
 #include "details/View.h"
 
@@ -29,6 +30,9 @@
 #include <utils/JobSystem.h>
 #include <utils/Systrace.h>
 
+#include <algorithm>
+#include <type_traits>
+
 using namespace utils;
 using namespace math;
 
@@ -47,7 +51,8 @@ void RenderPass::render(
         FScene::RenderableSoa const& soa, Range<uint32_t> vr,
         uint32_t commandTypeFlags, RenderFlags renderFlags,
         const CameraInfo& camera, Viewport const& viewport,
-        GrowingSlice<Command>& commands) noexcept {
+        GrowingSlice<Command>& commands, CommandCache* cache,
+        InstanceBuffers* instanceBuffers) noexcept {
 
     SYSTRACE_CONTEXT();
 
@@ -68,10 +73,15 @@ void RenderPass::render(
     // we extract camera position/forward outside of the loop, because these are not cheap.
     const float3 cameraPosition(camera.getPosition());
     const float3 cameraForwardVector(camera.getForwardVector());
-    auto work = [commandTypeFlags, curr, &soa, renderFlags, cameraPosition, cameraForwardVector]
+    const uint8_t visibilityMask = mVisibilityMask;
+    const uint8_t visibilityBits = mVisibilityBits;
+    const uint32_t shadowAtlasTiles = mShadowAtlasTiles;
+    auto work = [commandTypeFlags, curr, &soa, renderFlags, visibilityMask, visibilityBits,
+            shadowAtlasTiles, cameraPosition, cameraForwardVector]
             (uint32_t startIndex, uint32_t indexCount) {
         RenderPass::generateCommands(commandTypeFlags, curr,
                 soa, { startIndex, startIndex + indexCount }, renderFlags,
+                visibilityMask, visibilityBits, shadowAtlasTiles,
                 cameraPosition, cameraForwardVector);
     };
 
@@ -90,15 +100,27 @@ void RenderPass::render(
 
     { // sort all commands
         SYSTRACE_NAME("sort commands");
-        std::sort(commands.begin(), commands.end());
+        // the scratch buffer is only needed during the sort, give it back right after.
+        ArenaScope arena(engine.getPerRenderPassAllocator());
+        Command* const scratch = arena.allocate<Command>(commands.size(), CACHELINE_SIZE);
+        if (cache && scratch) {
+            // the sentinel stays last, we don't need to sort it
+            RenderPass::sortCommandsRetained(js, *cache, curr, commands.end() - 1, scratch);
+        } else {
+            RenderPass::sortCommands(js, commands.begin(), commands.end(), scratch);
+        }
     }
 
+    // this uploads the instances transforms, so it must happen before beginRenderPass()
+    Command* const last = RenderPass::getDrawCommandsEnd(engine, instanceBuffers, soa,
+            commands.begin(), commands.end());
+
     // Take care not to upload data within the render pass (synchronize can commit froxel data)
     driver::DriverApi& driver = engine.getDriverApi();
     beginRenderPass(driver, viewport, camera);
 
     // Now, execute all commands
-    RenderPass::recordDriverCommands(driver, commands);
+    RenderPass::recordDriverCommands(js, driver, commands.begin(), last);
 
     endRenderPass(driver, viewport);
 
@@ -108,17 +130,467 @@ void RenderPass::render(
     engine.flush();
 }
 
+/* static */
+void RenderPass::sortCommands(JobSystem& js,
+        Command* const begin, Command* const end, Command* const scratch) noexcept {
+    if (scratch && size_t(end - begin) >= RADIX_SORT_MIN_COMMAND_COUNT) {
+        radixSort(js, begin, end, scratch);
+    } else {
+        std::sort(begin, end);
+    }
+}
+
+/* static */
+template<typename T>
+UTILS_NOINLINE
+void RenderPass::radixSort(JobSystem& js,
+        T* const begin, T* const end, T* const scratch) noexcept {
+    SYSTRACE_CALL();
+
+    /*
+     * This is a LSD radix sort on the 64-bits key, 8 bits at a time.
+     *
+     * The items are split in a fixed number of chunks, each processed by its own job.
+     * For each pass, each job first computes the histogram of its chunk, the histograms are
+     * then prefix-summed in (digit, chunk) order, and finally each job scatters its chunk
+     * to the destination buffer. Because chunks are scattered in order, each pass is stable,
+     * which is what makes the LSD radix sort correct.
+     *
+     * Many bytes of the key are constant within a render pass (e.g. the PASS_MASK byte when there
+     * is no blending, or the priority bits), we don't need to sort on those.
+     */
+
+    struct alignas(CACHELINE_SIZE) Histogram {
+        uint32_t bins[256];
+    };
+
+    struct alignas(CACHELINE_SIZE) KeyBits {
+        uint64_t setInAll;
+        uint64_t setInAny;
+    };
+
+    const uint32_t count = uint32_t(end - begin);
+    const uint32_t chunkCount = uint32_t(std::min(RADIX_SORT_MAX_CHUNK_COUNT,
+            (count + RADIX_SORT_MIN_CHUNK_SIZE - 1) / RADIX_SORT_MIN_CHUNK_SIZE));
+    const uint32_t chunkSize = (count + chunkCount - 1) / chunkCount;
+
+    Histogram histograms[RADIX_SORT_MAX_CHUNK_COUNT];
+    KeyBits keyBits[RADIX_SORT_MAX_CHUNK_COUNT];
+
+    T* src = begin;
+    T* dst = scratch;
+    uint32_t shift = 0;
+
+    auto chunkFirst = [=](uint32_t chunk) { return std::min(chunk * chunkSize, count); };
+    auto chunkLast  = [=](uint32_t chunk) { return std::min(chunk * chunkSize + chunkSize, count); };
+
+    auto runForEachChunk = [&js, chunkCount](auto const& work) {
+        auto job = jobs::parallel_for(js, nullptr, 0, chunkCount,
+                std::cref(work), jobs::CountSplitter<1, 8>());
+        js.runAndWait(job);
+    };
+
+    // find which bits of the keys actually vary
+    auto findKeyBits = [&](uint32_t first, uint32_t chunks) {
+        for (uint32_t c = first, n = first + chunks; c < n; c++) {
+            uint64_t setInAll = ~0llu;
+            uint64_t setInAny = 0;
+            T const* const UTILS_RESTRICT items = src;
+            for (uint32_t i = chunkFirst(c), e = chunkLast(c); i < e; i++) {
+                setInAll &= items[i].key;
+                setInAny |= items[i].key;
+            }
+            keyBits[c] = { setInAll, setInAny };
+        }
+    };
+
+    auto buildHistograms = [&](uint32_t first, uint32_t chunks) {
+        for (uint32_t c = first, n = first + chunks; c < n; c++) {
+            uint32_t* const UTILS_RESTRICT bins = histograms[c].bins;
+            T const* const UTILS_RESTRICT items = src;
+            std::fill(bins, bins + 256, 0);
+            for (uint32_t i = chunkFirst(c), e = chunkLast(c); i < e; i++) {
+                bins[(items[i].key >> shift) & 0xFF]++;
+            }
+        }
+    };
+
+    auto scatter = [&](uint32_t first, uint32_t chunks) {
+        for (uint32_t c = first, n = first + chunks; c < n; c++) {
+            uint32_t* const UTILS_RESTRICT offsets = histograms[c].bins;
+            T const* const UTILS_RESTRICT items = src;
+            T* const UTILS_RESTRICT out = dst;
+            for (uint32_t i = chunkFirst(c), e = chunkLast(c); i < e; i++) {
+                out[offsets[(items[i].key >> shift) & 0xFF]++] = items[i];
+            }
+        }
+    };
+
+    runForEachChunk(findKeyBits);
+
+    uint64_t setInAll = ~0llu;
+    uint64_t setInAny = 0;
+    for (uint32_t c = 0; c < chunkCount; c++) {
+        setInAll &= keyBits[c].setInAll;
+        setInAny |= keyBits[c].setInAny;
+    }
+    const uint64_t varyingBits = setInAll ^ setInAny;
+
+    for (shift = 0; shift < 64; shift += 8) {
+        if (!((varyingBits >> shift) & 0xFF)) {
+            // all keys have the same value for this byte, skip this pass entirely
+            continue;
+        }
+
+        runForEachChunk(buildHistograms);
+
+        // exclusive prefix-sum, in digit then chunk order, which gives us the destination
+        // offset of each chunk's digits.
+        uint32_t sum = 0;
+        for (uint32_t d = 0; d < 256; d++) {
+            for (uint32_t c = 0; c < chunkCount; c++) {
+                const uint32_t n = histograms[c].bins[d];
+                histograms[c].bins[d] = sum;
+                sum += n;
+            }
+        }
+
+        runForEachChunk(scatter);
+
+        std::swap(src, dst);
+    }
+
+    // an odd number of passes leaves the sorted items in the scratch buffer
+    if (src != begin) {
+        std::copy(src, src + count, begin);
+    }
+}
+
+/* static */
+UTILS_NOINLINE
+void RenderPass::sortCommandsRetained(JobSystem& js, CommandCache& cache,
+        Command* const begin, Command* const end, Command* const scratch) noexcept {
+    SYSTRACE_CALL();
+
+    const uint32_t count = uint32_t(end - begin);
+    std::vector<CommandKey>& keys = cache.mKeys;
+    std::vector<uint32_t>& sortedIndices = cache.mSortedIndices;
+    std::vector<uint32_t>& changedIndices = cache.mChangedIndices;
+
+    // find which commands changed since last frame
+    bool rebuild = keys.size() != count;
+    if (!rebuild) {
+        std::vector<uint8_t>& changed = cache.mChanged;
+        changed.resize(count);
+        changedIndices.clear();
+        for (uint32_t i = 0; i < count; i++) {
+            changed[i] = uint8_t(begin[i].key != keys[i]);
+            if (UTILS_UNLIKELY(changed[i])) {
+                changedIndices.push_back(i);
+            }
+        }
+        rebuild = changedIndices.size() > count / RETAINED_SORT_MAX_CHANGED_RATIO;
+
+        if (!rebuild) {
+            SYSTRACE_VALUE32("changedCommands", changedIndices.size());
+
+            // sort the commands that changed
+            auto byKey = [begin](uint32_t lhs, uint32_t rhs) {
+                return begin[lhs].key < begin[rhs].key;
+            };
+            std::sort(changedIndices.begin(), changedIndices.end(), byKey);
+
+            // remove them from last frame's order, which is still sorted
+            std::vector<uint32_t>& keptIndices = cache.mKeptIndices;
+            keptIndices.clear();
+            for (uint32_t index : sortedIndices) {
+                if (!changed[index]) {
+                    keptIndices.push_back(index);
+                }
+            }
+
+            // and merge them back in
+            std::merge(keptIndices.begin(), keptIndices.end(),
+                    changedIndices.begin(), changedIndices.end(), sortedIndices.begin(), byKey);
+
+            for (uint32_t index : changedIndices) {
+                keys[index] = begin[index].key;
+            }
+        }
+    }
+
+    if (rebuild) {
+        // too many changes, or first time: sort everything, remembering the order
+        std::vector<CommandCache::SortEntry>& entries = cache.mEntries;
+        std::vector<CommandCache::SortEntry>& entriesScratch = cache.mEntriesScratch;
+        entries.resize(count);
+        entriesScratch.resize(count);
+        keys.resize(count);
+        for (uint32_t i = 0; i < count; i++) {
+            keys[i] = begin[i].key;
+            entries[i] = { begin[i].key, i };
+        }
+        if (count >= RADIX_SORT_MIN_COMMAND_COUNT) {
+            radixSort(js, entries.data(), entries.data() + count, entriesScratch.data());
+        } else {
+            std::sort(entries.begin(), entries.end(),
+                    [](CommandCache::SortEntry const& lhs, CommandCache::SortEntry const& rhs) {
+                        return lhs.key < rhs.key;
+                    });
+        }
+        sortedIndices.resize(count);
+        for (uint32_t i = 0; i < count; i++) {
+            sortedIndices[i] = entries[i].index;
+        }
+    }
+
+    // finally, reorder the commands -- they might have changed even if their key didn't
+    for (uint32_t i = 0; i < count; i++) {
+        scratch[i] = begin[sortedIndices[i]];
+    }
+    std::copy(scratch, scratch + count, begin);
+}
+
+UTILS_ALWAYS_INLINE
+static inline bool isInstanceable(RenderPass::PrimitiveInfo const& info,
+        mat4f const& worldTransform) noexcept {
+    // skinned and already instanced renderables can't be merged
+    if (info.perRenderableBones || info.instanceCount > 1) {
+        return false;
+    }
+    // The instanced vertex shader derives the normal matrix from the instance's transform,
+    // which is only correct for rigid or uniformly scaled transforms.
+    float3 const x = worldTransform[0].xyz;
+    float3 const y = worldTransform[1].xyz;
+    float3 const z = worldTransform[2].xyz;
+    float const xx = dot(x, x);
+    float const e = xx * 1e-4f;
+    return std::abs(dot(y, y) - xx) <= e && std::abs(dot(z, z) - xx) <= e &&
+           std::abs(dot(x, y)) <= e && std::abs(dot(x, z)) <= e && std::abs(dot(y, z)) <= e;
+}
+
+/* static */
+RenderPass::Command* RenderPass::getDrawCommandsEnd(FEngine& engine,
+        InstanceBuffers* instanceBuffers, FScene::RenderableSoa const& soa,
+        Command* const begin, Command* const end) noexcept {
+    // the culled commands are sorted last, with the sentinel, only the commands before them
+    // are instanced and drawn
+    Command* const last = std::partition_point(begin, end,
+            [](Command const& c) { return c.key != uint64_t(Pass::SENTINEL); });
+    if (instanceBuffers) {
+        return RenderPass::instanceCommands(engine, *instanceBuffers, soa, begin, last);
+    }
+    return last;
+}
+
+/* static */
+UTILS_NOINLINE
+RenderPass::Command* RenderPass::instanceCommands(FEngine& engine, InstanceBuffers& buffers,
+        FScene::RenderableSoa const& soa, Command* const begin, Command* const end) noexcept {
+    SYSTRACE_CALL();
+
+    DriverApi& driver = engine.getDriverApi();
+    auto const* const UTILS_RESTRICT soaWorldTransform = soa.data<FScene::WORLD_TRANSFORM>();
+
+    const uint32_t frameId = engine.getFrameId();
+    Command* UTILS_RESTRICT out = begin;
+    Command const* UTILS_RESTRICT curr = begin;
+    while (curr != end) {
+        // the cancelled commands' primitive isn't initialized
+        assert(curr->key != uint64_t(Pass::SENTINEL));
+        PrimitiveInfo const& info = curr->primitive;
+        Command const* last = curr + 1;
+        if (isInstanceable(info, soaWorldTransform[info.index])) {
+            // find the run of commands that only differ by their renderable
+            Command const* const maxLast =
+                    curr + std::min(size_t(end - curr), CONFIG_MAX_INSTANCE_COUNT);
+            while (last != maxLast &&
+                   !((last->key ^ curr->key) & PASS_MASK) &&
+                   last->primitive.mi == info.mi &&
+                   last->primitive.primitiveHandle.getId() == info.primitiveHandle.getId() &&
+                   last->primitive.rasterState == info.rasterState &&
+                   last->primitive.materialVariant.key == info.materialVariant.key &&
+                   isInstanceable(last->primitive, soaWorldTransform[last->primitive.index])) {
+                ++last;
+            }
+        }
+
+        const size_t count = size_t(last - curr);
+        *out = *curr;
+        if (count > 1) {
+            if (UTILS_UNLIKELY(!buffers.mIdentityUbh)) {
+                UniformBuffer identity(engine.getPerRenderableUib());
+                identity.setUniform(
+                        offsetof(FEngine::PerRenderableUib, worldFromModelMatrix), mat4f{});
+                identity.setUniform(
+                        offsetof(FEngine::PerRenderableUib, worldFromModelNormalMatrix), mat3f{});
+                buffers.mIdentityUbh = driver.createUniformBuffer(identity.getSize());
+                driver.updateUniformBuffer(buffers.mIdentityUbh, std::move(identity));
+            }
+            Handle<HwUniformBuffer> const ubh = buffers.acquire(driver, frameId);
+
+            // only upload the transforms we need
+            UniformBuffer transforms(count * sizeof(mat4f));
+            mat4f* UTILS_RESTRICT p =
+                    (mat4f*)transforms.invalidateUniforms(0, count * sizeof(mat4f));
+            for (size_t i = 0; i < count; i++) {
+                p[i] = soaWorldTransform[curr[i].primitive.index];
+            }
+            driver.updateUniformBuffer(ubh, std::move(transforms));
+
+            out->primitive.perRenderableUniforms = buffers.mIdentityUbh;
+            out->primitive.perRenderableInstances = ubh;
+            out->primitive.instanceCount = uint16_t(count);
+            out->primitive.materialVariant.setInstancing(true);
+        }
+        ++out;
+        curr = last;
+    }
+
+    SYSTRACE_VALUE32("instancedCommands", (end - begin) - (out - begin));
+    return out;
+}
+
+Handle<HwUniformBuffer> RenderPass::InstanceBuffers::acquire(
+        DriverApi& driver, uint32_t frameId) noexcept {
+    if (mFrameId != frameId) {
+        // the buffers of the previous frame are left alone until the next one
+        mFrameId = frameId;
+        mCurrent ^= 1u;
+        mUsedCount = 0;
+    }
+    std::vector<Handle<HwUniformBuffer>>& buffers = mBuffers[mCurrent];
+    if (mUsedCount == buffers.size()) {
+        buffers.push_back(driver.createUniformBuffer(CONFIG_MAX_INSTANCE_COUNT * sizeof(mat4f)));
+    }
+    return buffers[mUsedCount++];
+}
+
+void RenderPass::InstanceBuffers::terminate(DriverApi& driver) noexcept {
+    driver.destroyUniformBuffer(mIdentityUbh);
+    for (auto& buffers : mBuffers) {
+        for (Handle<HwUniformBuffer> ubh : buffers) {
+            driver.destroyUniformBuffer(ubh);
+        }
+        buffers.clear();
+    }
+    mIdentityUbh.clear();
+    mUsedCount = 0;
+}
+
+void RenderPass::recordDriverCommands(JobSystem& js, FEngine::DriverApi& driver,
+        Command const* const begin, Command const* const end) noexcept {
+    const uint32_t count = uint32_t(end - begin);
+    const uint32_t chunkCount = uint32_t(std::min(RECORD_MAX_CHUNK_COUNT,
+            count / RECORD_MIN_CHUNK_SIZE));
+    if (chunkCount < 2) {
+        recordDriverCommands(driver, begin, end);
+        return;
+    }
+
+    SYSTRACE_CALL();
+
+    /*
+     * Each chunk of commands is recorded by its own job, in a SecondaryCommandStream. Their
+     * space is reserved in the command stream in order, so that the commands execute in order.
+     * This requires knowing beforehand how much space each chunk needs, which costs a first,
+     * much cheaper, pass over the commands.
+     */
+
+    const uint32_t chunkSize = (count + chunkCount - 1) / chunkCount;
+    auto chunkFirst = [=](uint32_t chunk) { return begin + std::min(chunk * chunkSize, count); };
+    auto chunkLast  = [=](uint32_t chunk) { return begin + std::min(chunk * chunkSize + chunkSize, count); };
+
+    auto runForEachChunk = [&js, chunkCount](auto const& work) {
+        auto job = jobs::parallel_for(js, nullptr, 0, chunkCount,
+                std::cref(work), jobs::CountSplitter<1, 8>());
+        js.runAndWait(job);
+    };
+
+    size_t sizes[RECORD_MAX_CHUNK_COUNT];
+    bool hasPrograms[RECORD_MAX_CHUNK_COUNT];
+    runForEachChunk([&](uint32_t first, uint32_t chunks) {
+        for (uint32_t c = first, n = first + chunks; c < n; c++) {
+            hasPrograms[c] = true;
+            sizes[c] = getDriverCommandsSize(chunkFirst(c), chunkLast(c), hasPrograms[c]);
+        }
+    });
+
+    if (!std::all_of(hasPrograms, hasPrograms + chunkCount, [](bool b) { return b; })) {
+        // Programs are created with the engine's command stream, which can only be used from
+        // this thread. This only happens the first time a material variant is used.
+        recordDriverCommands(driver, begin, end);
+        return;
+    }
+
+    // SecondaryCommandStream can't be moved, construct them in place
+    using Storage = std::aligned_storage<
+            sizeof(SecondaryCommandStream), alignof(SecondaryCommandStream)>::type;
+    Storage storage[RECORD_MAX_CHUNK_COUNT];
+    SecondaryCommandStream* const secondaries = reinterpret_cast<SecondaryCommandStream*>(storage);
+    for (uint32_t c = 0; c < chunkCount; c++) {
+        new(&secondaries[c]) SecondaryCommandStream(driver, sizes[c]);
+    }
+
+    runForEachChunk([&](uint32_t first, uint32_t chunks) {
+        for (uint32_t c = first, n = first + chunks; c < n; c++) {
+            FEngine::DriverApi& stream = secondaries[c].getStream();
+            stream.debugThreading();
+            recordDriverCommands(stream, chunkFirst(c), chunkLast(c));
+            secondaries[c].finish();
+        }
+    });
+
+    for (uint32_t c = 0; c < chunkCount; c++) {
+        secondaries[c].~SecondaryCommandStream();
+    }
+}
+
+size_t RenderPass::getDriverCommandsSize(
+        Command const* const begin, Command const* const end, bool& hasPrograms) noexcept {
+    // this must match recordDriverCommands() below, FMaterialInstance::use() is counted
+    // with all its commands, which can only overestimate the size. An underestimate is caught
+    // by SecondaryCommandStream::finish(), in all builds.
+    constexpr size_t bindUniformsSize =
+            CommandStream::getCommandSize<decltype(&Driver::bindUniforms), &Driver::bindUniforms>();
+    constexpr size_t useSize = bindUniformsSize +
+            CommandStream::getCommandSize<decltype(&Driver::bindSamplers), &Driver::bindSamplers>() +
+            CommandStream::getCommandSize<decltype(&Driver::setViewportScissor), &Driver::setViewportScissor>();
+    constexpr size_t drawSize =
+            CommandStream::getCommandSize<decltype(&Driver::draw), &Driver::draw>();
+    constexpr size_t drawInstancedSize =
+            CommandStream::getCommandSize<decltype(&Driver::drawInstanced), &Driver::drawInstanced>();
+
+    size_t size = 0;
+    bool programs = true;
+    FMaterialInstance const* previousMi = nullptr;
+    FMaterial const* ma = nullptr;
+    for (Command const* c = begin; c != end; ++c) {
+        PrimitiveInfo const& info = c->primitive;
+        size += bindUniformsSize * (1 + bool(info.perRenderableBones) + bool(info.perRenderableInstances));
+        if (info.mi != previousMi) {
+            previousMi = info.mi;
+            ma = info.mi->getMaterial();
+            size += useSize;
+        }
+        programs &= ma->hasProgram(info.materialVariant.key);
+        size += info.instanceCount <= 1 ? drawSize : drawInstancedSize;
+    }
+    hasPrograms &= programs;
+    return size;
+}
+
 UTILS_NOINLINE // no need to be inlined
 void RenderPass::recordDriverCommands(
         FEngine::DriverApi& UTILS_RESTRICT driver,  // using restrict here is very important
-        Slice<Command> const& commands) noexcept {
+        Command const* const begin, Command const* const end) noexcept {
     SYSTRACE_CALL();
 
-    if (commands.size()) {
+    if (begin != end) {
         FMaterialInstance const* UTILS_RESTRICT previousMi = nullptr;
         FMaterial const* UTILS_RESTRICT ma = nullptr;
         Command const* UTILS_RESTRICT c;
-        for (c = commands.cbegin(); c->key != -1LLU; ++c) {
+        for (c = begin; c != end; ++c) {
             /*
              * Be careful when changing code below, this is the hot inner-loop
              */
@@ -129,6 +601,9 @@ void RenderPass::recordDriverCommands(
             if (info.perRenderableBones) {
                 driver.bindUniforms(BindingPoints::PER_RENDERABLE_BONES, info.perRenderableBones);
             }
+            if (info.perRenderableInstances) {
+                driver.bindUniforms(BindingPoints::PER_RENDERABLE_INSTANCES, info.perRenderableInstances);
+            }
 
             FMaterialInstance const* const UTILS_RESTRICT mi = info.mi;
             if (UTILS_UNLIKELY(mi != previousMi)) {
@@ -139,13 +614,26 @@ void RenderPass::recordDriverCommands(
             }
 
             Handle<HwProgram> const ph = ma->getProgram(info.materialVariant.key);
-            driver.draw(ph, info.rasterState, info.primitiveHandle);
+            if (UTILS_LIKELY(info.instanceCount <= 1)) {
+                driver.draw(ph, info.rasterState, info.primitiveHandle);
+            } else {
+                driver.drawInstanced(ph, info.rasterState, info.primitiveHandle, info.instanceCount);
+            }
         }
 
-        SYSTRACE_VALUE32("commandCount", c - commands.cbegin());
+        SYSTRACE_VALUE32("commandCount", c - begin);
     }
 }
 
+Driver::RasterState RenderPass::getDepthRasterState() noexcept {
+    Driver::RasterState rasterState;
+    rasterState.colorWrite = false;
+    rasterState.depthWrite = true;
+    rasterState.depthFunc = Driver::RasterState::DepthFunc::L;
+    rasterState.alphaToCoverage = false;
+    return rasterState;
+}
+
 /* static */
 UTILS_ALWAYS_INLINE // this function exists only to make the code more readable. we want it inlined.
 inline              // and we don't need it in the compilation unit
@@ -198,6 +686,7 @@ void RenderPass::setupColorCommand(Command& cmdDraw, bool hasDepthPass,
 UTILS_NOINLINE
 void RenderPass::generateCommands(uint32_t commandTypeFlags, Command* const commands,
         FScene::RenderableSoa const& soa, utils::Range<uint32_t> range, RenderFlags renderFlags,
+        uint8_t visibilityMask, uint8_t visibilityBits, uint32_t shadowAtlasTiles,
         math::float3 cameraPosition, math::float3 cameraForward) noexcept {
 
     // generateCommands() writes both the draw and depth commands simultaneously such that
@@ -233,15 +722,18 @@ void RenderPass::generateCommands(uint32_t commandTypeFlags, Command* const comm
         default: // squash IDE warning -- should never happen.
         case CommandTypeFlags::COLOR:
             generateCommandsImpl<CommandTypeFlags::COLOR>(commandTypeFlags, curr,
-                    soa, range, renderFlags, cameraPosition, cameraForward);
+                    soa, range, renderFlags, visibilityMask, visibilityBits, shadowAtlasTiles,
+                    cameraPosition, cameraForward);
             break;
         case CommandTypeFlags::DEPTH_AND_COLOR:
             generateCommandsImpl<CommandTypeFlags::DEPTH_AND_COLOR>(commandTypeFlags, curr,
-                    soa, range, renderFlags, cameraPosition, cameraForward);
+                    soa, range, renderFlags, visibilityMask, visibilityBits, shadowAtlasTiles,
+                    cameraPosition, cameraForward);
             break;
         case CommandTypeFlags::SHADOW:
             generateCommandsImpl<CommandTypeFlags::SHADOW>(commandTypeFlags, curr,
-                    soa, range, renderFlags, cameraPosition, cameraForward);
+                    soa, range, renderFlags, visibilityMask, visibilityBits, shadowAtlasTiles,
+                    cameraPosition, cameraForward);
             break;
     }
 }
@@ -252,8 +744,8 @@ UTILS_NOINLINE
 void RenderPass::generateCommandsImpl(uint32_t,
         Command* UTILS_RESTRICT curr,
         FScene::RenderableSoa const& UTILS_RESTRICT soa, utils::Range<uint32_t> range,
-        RenderFlags renderFlags,
-        float3 cameraPosition, float3 cameraForward) noexcept {
+        RenderFlags renderFlags, uint8_t visibilityMask, uint8_t visibilityBits,
+        uint32_t shadowAtlasTiles, float3 cameraPosition, float3 cameraForward) noexcept {
 
     // generateCommands() writes both the draw and depth commands simultaneously such that
     // we go throw the list of renderables just once.
@@ -269,22 +761,23 @@ void RenderPass::generateCommandsImpl(uint32_t,
     auto const* const UTILS_RESTRICT soaPrimitives      = soa.data<FScene::PRIMITIVES>();
     auto const* const UTILS_RESTRICT soaUbh             = soa.data<FScene::UBH>();
     auto const* const UTILS_RESTRICT soaBonesUbh        = soa.data<FScene::BONES_UBH>();
+    auto const* const UTILS_RESTRICT soaInstancesUbh    = soa.data<FScene::INSTANCES_UBH>();
+    auto const* const UTILS_RESTRICT soaInstanceCount   = soa.data<FScene::INSTANCE_COUNT>();
+    auto const* const UTILS_RESTRICT soaVisibleMask     = soa.data<FScene::VISIBLE_MASK>();
+    auto const* const UTILS_RESTRICT soaShadowAtlasMask = soa.data<FScene::SHADOW_ATLAS_MASK>();
 
     const bool hasShadowing = renderFlags & HAS_SHADOWING;
     Variant materialVariant;
     materialVariant.setDirectionalLighting(renderFlags & HAS_DIRECTIONAL_LIGHT);
     materialVariant.setDynamicLighting(renderFlags & HAS_DYNAMIC_LIGHTING);
+    materialVariant.setShadowCascades(renderFlags & HAS_SHADOW_CASCADES);
     materialVariant.setShadowReceiver(false); // this is set per Renderable
 
     Command cmdColor;
 
     Command cmdDepth;
     cmdDepth.primitive.materialVariant = { Variant::DEPTH_VARIANT };
-    cmdDepth.primitive.rasterState = Driver::RasterState();
-    cmdDepth.primitive.rasterState.colorWrite = false;
-    cmdDepth.primitive.rasterState.depthWrite = true;
-    cmdDepth.primitive.rasterState.depthFunc = Driver::RasterState::DepthFunc::L;
-    cmdDepth.primitive.rasterState.alphaToCoverage = false;
+    cmdDepth.primitive.rasterState = getDepthRasterState();
 
     for (uint32_t i = range.first; i < range.last; ++i) {
         // Signed distance from camera to object's center. Positive distances are in front of
@@ -319,9 +812,13 @@ void RenderPass::generateCommandsImpl(uint32_t,
 
         cmdColor.key = makeField(soaVisibility[i].priority, PRIORITY_MASK, PRIORITY_SHIFT);
         cmdColor.primitive.perRenderableUniforms = soaUbh[i];
+        cmdColor.primitive.index = i;
         cmdColor.primitive.perRenderableBones = soaBonesUbh[i];
+        cmdColor.primitive.perRenderableInstances = soaInstancesUbh[i];
+        cmdColor.primitive.instanceCount = soaInstanceCount[i];
         materialVariant.setShadowReceiver(soaVisibility[i].receiveShadows & hasShadowing);
         materialVariant.setSkinning(soaVisibility[i].skinning);
+        materialVariant.setInstancing(soaVisibility[i].instancing);
 
         // we're assuming we're always doing the depth (either way, it's correct)
         // this will generate front to back rendering
@@ -329,11 +826,17 @@ void RenderPass::generateCommandsImpl(uint32_t,
         cmdDepth.key |= makeField(soaVisibility[i].priority, PRIORITY_MASK, PRIORITY_SHIFT);
         cmdDepth.key |= makeField(distanceBits, DISTANCE_BITS_MASK, DISTANCE_BITS_SHIFT);
         cmdDepth.primitive.perRenderableUniforms = soaUbh[i];
+        cmdDepth.primitive.index = i;
         cmdDepth.primitive.perRenderableBones = soaBonesUbh[i];
+        cmdDepth.primitive.perRenderableInstances = soaInstancesUbh[i];
+        cmdDepth.primitive.instanceCount = soaInstanceCount[i];
         cmdDepth.primitive.materialVariant.setSkinning(soaVisibility[i].skinning);
+        cmdDepth.primitive.materialVariant.setInstancing(soaVisibility[i].instancing);
 
         const bool shadowCaster = soaVisibility[i].castShadows & hasShadowing;
         const bool writeDepthForShadows = shadowPass & shadowCaster;
+        const bool inPass = ((soaVisibleMask[i] & visibilityMask) == visibilityBits) &
+                ((soaShadowAtlasMask[i] & shadowAtlasTiles) == shadowAtlasTiles);
 
         const Slice<FRenderPrimitive>& primitives = soaPrimitives[i];
 
@@ -442,8 +945,8 @@ void RenderPass::generateCommandsImpl(uint32_t,
                 // Also, depth-write could be disabled by the material,
                 // in this case undo the command.
                 bool issueDepth =
-                        (rs.depthWrite & !(colorPass & (rs.alphaToCoverage | rs.hasBlending())))
-                        | writeDepthForShadows;
+                        ((rs.depthWrite & !(colorPass & (rs.alphaToCoverage | rs.hasBlending())))
+                        | writeDepthForShadows) & inPass;
                 curr->key |= select(!issueDepth);
 
                 // handle the case where this primitive is empty / no-op
@@ -560,6 +1063,7 @@ void FRenderer::ColorPass::renderColorPass(FEngine& engine, JobSystem& js,
     if (view->hasShadowing())           flags |= RenderPass::HAS_SHADOWING;
     if (view->hasDirectionalLight())    flags |= RenderPass::HAS_DIRECTIONAL_LIGHT;
     if (view->hasDynamicLighting())     flags |= RenderPass::HAS_DYNAMIC_LIGHTING;
+    if (view->hasShadowCascades())      flags |= RenderPass::HAS_SHADOW_CASCADES;
 
     CommandTypeFlags commandType;
     switch (view->getDepthPrepass()) {
@@ -581,19 +1085,38 @@ void FRenderer::ColorPass::renderColorPass(FEngine& engine, JobSystem& js,
 
     ColorPass colorPass("ColorPass", js, jobFroxelize, view, rth);
     driver.pushGroupMarker("Color Pass");
-    colorPass.render(engine, js, soa, vr, commandType, flags, cameraInfo, scaledViewport, commands);
+    colorPass.render(engine, js, soa, vr, commandType, flags, cameraInfo, scaledViewport, commands,
+            view->getColorPassCommandCache(), view->getColorPassInstanceBuffers());
     driver.popGroupMarker();
 }
 
 // ------------------------------------------------------------------------------------------------
 
 FRenderer::ShadowPass::ShadowPass(const char* name,
-        ShadowMap const& shadowMap) noexcept
-        : RenderPass(name), shadowMap(shadowMap) {
+        ShadowMap& shadowMap, size_t cascade, Casters casters, bool clear) noexcept
+        : RenderPass(name,
+                getVisibilityMask(cascade, casters), getVisibilityBits(cascade, casters)),
+          shadowMap(shadowMap), cascade(cascade), casters(casters), clear(clear) {
+}
+
+uint8_t FRenderer::ShadowPass::getVisibilityMask(size_t cascade, Casters casters) noexcept {
+    const uint8_t cascadeBit = uint8_t(1u << (FView::VISIBLE_SHADOW_CASCADE_BIT + cascade));
+    const uint8_t staticBit = uint8_t(1u << FView::VISIBLE_STATIC_SHADOW_CASTER_BIT);
+    return casters == Casters::ALL ? cascadeBit : uint8_t(cascadeBit | staticBit);
+}
+
+uint8_t FRenderer::ShadowPass::getVisibilityBits(size_t cascade, Casters casters) noexcept {
+    const uint8_t cascadeBit = uint8_t(1u << (FView::VISIBLE_SHADOW_CASCADE_BIT + cascade));
+    const uint8_t staticBit = uint8_t(1u << FView::VISIBLE_STATIC_SHADOW_CASTER_BIT);
+    return casters == Casters::STATIC ? uint8_t(cascadeBit | staticBit) : cascadeBit;
 }
 
 void FRenderer::ShadowPass::beginRenderPass(driver::DriverApi& driver, Viewport const&, const CameraInfo&) noexcept {
-    shadowMap.beginRenderPass(driver);
+    if (casters == Casters::STATIC) {
+        shadowMap.beginStaticRenderPass(driver, cascade);
+    } else {
+        shadowMap.beginRenderPass(driver, cascade, clear);
+    }
 }
 
 void FRenderer::ShadowPass::renderShadowMap(FEngine& engine, JobSystem& js,
@@ -601,38 +1124,144 @@ void FRenderer::ShadowPass::renderShadowMap(FEngine& engine, JobSystem& js,
 
     auto& soa = view->getScene()->getRenderableData();
     auto vr = view->getVisibleShadowCasters();
-    ShadowMap const& shadowMap = view->getShadowMap();
-    Viewport const& viewport = shadowMap.getViewport();
-    FCamera const& camera = shadowMap.getCamera();
-
-    CameraInfo cameraInfo = {
-            .projection         = mat4f{ camera.getProjectionMatrix() },
-            .cullingProjection  = mat4f{ camera.getCullingProjectionMatrix() },
-            .model              = camera.getModelMatrix(),
-            .view               = camera.getViewMatrix(),
-            .zn                 = camera.getNear(),
-            .zf                 = camera.getCullingFar(),
-    };
+    ShadowMap& shadowMap = view->getShadowMap();
+    driver::DriverApi& driver = engine.getDriverApi();
 
-    // populate the RenderPrimitive array with the proper LOD
-    view->updatePrimitivesLod(engine, cameraInfo, soa, vr);
+    RenderPass::RenderFlags flags = 0;
+    if (view->hasShadowing())           flags |= RenderPass::HAS_SHADOWING;
+    if (view->hasDirectionalLight())    flags |= RenderPass::HAS_DIRECTIONAL_LIGHT;
+    if (view->hasDynamicLighting())     flags |= RenderPass::HAS_DYNAMIC_LIGHTING;
 
+    // The cascades using a cache of their static casters are rendered last, because the cache
+    // is copied into the shadow map, which mustn't be cleared afterwards.
+    using StaticCasters = ShadowMap::StaticCasters;
+    size_t cascades[CONFIG_MAX_SHADOW_CASCADES];
+    size_t cascadeCount = 0;
+    for (size_t c = 0, n = shadowMap.getCascadeCount(); c < n; c++) {
+        if (shadowMap.hasVisibleShadows(c) &&
+                shadowMap.getStaticCasters(c) == StaticCasters::NONE) {
+            cascades[cascadeCount++] = c;
+        }
+    }
+    for (size_t c = 0, n = shadowMap.getCascadeCount(); c < n; c++) {
+        if (shadowMap.hasVisibleShadows(c) &&
+                shadowMap.getStaticCasters(c) != StaticCasters::NONE) {
+            cascades[cascadeCount++] = c;
+        }
+    }
+
+    // The whole texture is cleared before the first cascade, so that nothing is left from the
+    // previous frame. When it starts from its cache, the copy mustn't be cleared afterwards.
+    if (cascadeCount && shadowMap.getStaticCasters(cascades[0]) != StaticCasters::NONE) {
+        shadowMap.clear(driver);
+    }
+
+    // Each cascade is rendered in its own pass, in its own viewport of the shadow map texture.
+    bool clear = true;
+    for (size_t i = 0; i < cascadeCount; i++) {
+        const size_t c = cascades[i];
+        const StaticCasters staticCasters = shadowMap.getStaticCasters(c);
+        Viewport const& viewport = shadowMap.getViewport(c);
+        FCamera const& camera = shadowMap.getCamera(c);
+
+        CameraInfo cameraInfo = {
+                .projection         = mat4f{ camera.getProjectionMatrix() },
+                .cullingProjection  = mat4f{ camera.getCullingProjectionMatrix() },
+                .model              = camera.getModelMatrix(),
+                .view               = camera.getViewMatrix(),
+                .zn                 = camera.getNear(),
+                .zf                 = camera.getCullingFar(),
+        };
+
+        // populate the RenderPrimitive array with the proper LOD
+        view->updatePrimitivesLod(engine, cameraInfo, soa, vr);
+
+        view->prepareCamera(cameraInfo, viewport);
+        view->commitUniforms(driver);
+
+        if (staticCasters == StaticCasters::RENDER) {
+            // the cache is rarely updated, it doesn't need the retained commands nor instancing
+            commands.clear();
+            ShadowPass staticPass("StaticShadowPass", shadowMap, c, ShadowPass::Casters::STATIC, true);
+            driver.pushGroupMarker("Static shadow casters Pass");
+            staticPass.render(engine, js, soa, vr, CommandTypeFlags::SHADOW, flags, cameraInfo, viewport, commands);
+            driver.popGroupMarker();
+        }
+        if (staticCasters != StaticCasters::NONE) {
+            // this overwrites the whole cascade, including its border
+            shadowMap.copyStaticCasters(driver, c);
+            clear = false;
+        }
+
+        // the commands of the previous pass have already been recorded
+        commands.clear();
+
+        ShadowPass shadowPass("ShadowPass", shadowMap, c,
+                staticCasters == StaticCasters::NONE ?
+                        ShadowPass::Casters::ALL : ShadowPass::Casters::DYNAMIC, clear);
+        driver.pushGroupMarker("Shadow map Pass");
+        shadowPass.render(engine, js, soa, vr, CommandTypeFlags::SHADOW, flags, cameraInfo, viewport, commands,
+                view->getShadowPassCommandCache(c), view->getShadowPassInstanceBuffers(c));
+        driver.popGroupMarker();
+        clear = false;
+    }
+}
+
+void FRenderer::ShadowPass::endRenderPass(DriverApi& driver, Viewport const& viewport) noexcept {
+    driver.endRenderPass();
+}
+
+// ------------------------------------------------------------------------------------------------
+
+FRenderer::ShadowAtlasPass::ShadowAtlasPass(const char* name,
+        ShadowAtlas const& shadowAtlas, size_t tile, bool clear) noexcept
+        : RenderPass(name,
+                uint8_t(1u << FView::VISIBLE_SHADOW_ATLAS_BIT),
+                uint8_t(1u << FView::VISIBLE_SHADOW_ATLAS_BIT),
+                uint32_t(1u << tile)),
+          shadowAtlas(shadowAtlas), tile(tile), clear(clear) {
+}
+
+void FRenderer::ShadowAtlasPass::beginRenderPass(driver::DriverApi& driver, Viewport const&, const CameraInfo&) noexcept {
+    shadowAtlas.beginRenderPass(driver, tile, clear);
+}
+
+void FRenderer::ShadowAtlasPass::renderShadowAtlas(FEngine& engine, JobSystem& js,
+        FView* view, GrowingSlice<Command>& commands) noexcept {
+
+    auto& soa = view->getScene()->getRenderableData();
+    auto vr = view->getVisibleShadowCasters();
+    ShadowAtlas const& shadowAtlas = view->getShadowAtlas();
     driver::DriverApi& driver = engine.getDriverApi();
-    view->prepareCamera(cameraInfo, viewport);
-    view->commitUniforms(driver);
 
     RenderPass::RenderFlags flags = 0;
     if (view->hasShadowing())           flags |= RenderPass::HAS_SHADOWING;
     if (view->hasDirectionalLight())    flags |= RenderPass::HAS_DIRECTIONAL_LIGHT;
     if (view->hasDynamicLighting())     flags |= RenderPass::HAS_DYNAMIC_LIGHTING;
 
-    ShadowPass shadowPass("ShadowPass", shadowMap);
-    driver.pushGroupMarker("Shadow map Pass");
-    shadowPass.render(engine, js, soa, vr, CommandTypeFlags::SHADOW, flags, cameraInfo, viewport, commands);
-    driver.popGroupMarker();
+    // Each tile is rendered in its own pass, in its own viewport of the atlas texture. The tiles
+    // change every frame, so they don't use the retained commands nor the instancing.
+    for (size_t t = 0, n = shadowAtlas.getTileCount(); t < n; t++) {
+        Viewport const& viewport = shadowAtlas.getViewport(t);
+        CameraInfo const& cameraInfo = shadowAtlas.getCameraInfo(t);
+
+        // populate the RenderPrimitive array with the proper LOD
+        view->updatePrimitivesLod(engine, cameraInfo, soa, vr);
+
+        view->prepareCamera(cameraInfo, viewport);
+        view->commitUniforms(driver);
+
+        // the commands of the previous tile have already been recorded
+        commands.clear();
+
+        ShadowAtlasPass shadowAtlasPass("ShadowAtlasPass", shadowAtlas, t, t == 0);
+        driver.pushGroupMarker("Shadow atlas Pass");
+        shadowAtlasPass.render(engine, js, soa, vr, CommandTypeFlags::SHADOW, flags, cameraInfo, viewport, commands);
+        driver.popGroupMarker();
+    }
 }
 
-void FRenderer::ShadowPass::endRenderPass(DriverApi& driver, Viewport const& viewport) noexcept {
+void FRenderer::ShadowAtlasPass::endRenderPass(DriverApi& driver, Viewport const& viewport) noexcept {
     driver.endRenderPass();
 }
 
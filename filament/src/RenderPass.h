@@ -30,6 +30,9 @@
 #include <utils/compiler.h>
 #include <utils/Slice.h>
 
+#include <array>
+#include <vector>
+
 namespace utils {
 class JobSystem;
 }
@@ -51,11 +54,11 @@ public:
     static constexpr uint64_t MATERIAL_INSTANCE_ID_MASK     = 0x0000FFFFllu;
     static constexpr int MATERIAL_INSTANCE_ID_SHIFT         = 0;
 
-    static constexpr uint64_t MATERIAL_VARIANT_KEY_MASK     = 0x001F0000llu;
+    static constexpr uint64_t MATERIAL_VARIANT_KEY_MASK     = 0x003F0000llu;
     static constexpr int MATERIAL_VARIANT_KEY_SHIFT         = 16;
 
-    static constexpr uint64_t MATERIAL_ID_MASK              = 0xFFE00000llu;
-    static constexpr int MATERIAL_ID_SHIFT                  = 21;
+    static constexpr uint64_t MATERIAL_ID_MASK              = 0xFFC00000llu;
+    static constexpr int MATERIAL_ID_SHIFT                  = 22;
 
     static constexpr uint64_t BLEND_DISTANCE_MASK           = 0xFFFFFFFF0000llu;
     static constexpr int BLEND_DISTANCE_SHIFT               = 16;
@@ -142,10 +145,10 @@ public:
 
     // The sorting material key is 32 bits and encoded as:
     //
-    // |    11     |  5  |       16       |
-    // +-----------+-----+----------------+
-    // | material  | var |   instance     |
-    // +-----------+-----+----------------+
+    // |    10    |   6  |       16       |
+    // +----------+------+----------------+
+    // | material | var  |   instance     |
+    // +----------+------+----------------+
     //
     // The variant is inserted while building the commands, because we don't know it before that
     //
@@ -172,19 +175,22 @@ public:
         return boolish ? -1llu : 0llu;
     }
 
-    struct PrimitiveInfo { // 28 bytes
+    struct PrimitiveInfo { // 36 bytes
         FMaterialInstance const* mi = nullptr;              // 8 bytes (4)
         Handle<HwRenderPrimitive> primitiveHandle;          // 4 bytes
         Handle<HwUniformBuffer> perRenderableUniforms;      // 4 bytes
         Handle<HwUniformBuffer> perRenderableBones;         // 4 bytes
+        Handle<HwUniformBuffer> perRenderableInstances;     // 4 bytes
         Driver::RasterState rasterState;                    // 4 bytes
+        uint32_t index = 0;                                 // 4 bytes, index in the RenderableSoa
         Variant materialVariant;                            // 1 byte
-        uint8_t reserved[3] = { };                          // 3 bytes (that helps the compiler)
+        uint8_t reserved = 0;                               // 1 byte (that helps the compiler)
+        uint16_t instanceCount = 1;                         // 2 bytes
     };
 
-    struct alignas(8) Command {     // 32 bytes
+    struct alignas(8) Command {     // 48 bytes
         CommandKey key = 0;         //  8 bytes
-        PrimitiveInfo primitive;    // 24 bytes
+        PrimitiveInfo primitive;    // 40 bytes
         bool operator < (Command const& rhs) const noexcept { return key < rhs.key; }
         // placement new declared as "throw" to avoid the compiler's null-check
         inline void* operator new (std::size_t size, void* ptr) {
@@ -196,13 +202,65 @@ public:
             "Command isn't trivially destructible");
 
 
+    // Keeps the sort order of a pass' commands from one frame to the next. When most command
+    // keys are the same as in the previous frame, only the commands whose key changed are
+    // sorted and then merged into the previous order, instead of sorting all the commands.
+    // The cache is only effective when commands are generated in the same order each frame,
+    // which is the case as long as the scene and the visible renderables don't change.
+    // It's always correct though, since keys are checked each frame.
+    // Only the sort is retained, the commands themselves are still generated for all the
+    // visible renderables and all their keys are compared every frame.
+    class CommandCache {
+        friend class RenderPass;
+        struct SortEntry {
+            CommandKey key;
+            uint32_t index;
+        };
+        std::vector<CommandKey> mKeys;              // previous frame keys, in generation order
+        std::vector<uint32_t> mSortedIndices;       // previous frame sort order
+        // these are just scratch buffers, kept here to avoid reallocating them each frame
+        std::vector<uint32_t> mKeptIndices;
+        std::vector<uint32_t> mChangedIndices;
+        std::vector<uint8_t> mChanged;
+        std::vector<SortEntry> mEntries;
+        std::vector<SortEntry> mEntriesScratch;
+    };
+
+    // Uniform buffers used to draw runs of identical primitives with a single instanced draw
+    // call. Each run gets its own buffer holding the world transforms of its renderables. The
+    // merged commands use an identity per-renderable uniform buffer instead of their own.
+    // Some backends (e.g. Vulkan) update uniform buffers immediately rather than in order with
+    // the draws, so a buffer is never updated twice in the same frame, even by another pass,
+    // nor in the frame following the one that used it: the buffers are double-buffered.
+    class InstanceBuffers {
+    public:
+        void terminate(driver::DriverApi& driver) noexcept;
+    private:
+        friend class RenderPass;
+        // returns a buffer not used yet by this frame, nor by the previous one
+        Handle<HwUniformBuffer> acquire(driver::DriverApi& driver, uint32_t frameId) noexcept;
+        Handle<HwUniformBuffer> mIdentityUbh;
+        std::array<std::vector<Handle<HwUniformBuffer>>, 2> mBuffers;
+        uint32_t mFrameId = 0;
+        uint8_t mCurrent = 0;       // the set of mBuffers used by the current frame
+        size_t mUsedCount = 0;      // how many of its buffers the current frame has used
+    };
+
     using RenderFlags = uint8_t;
     static constexpr RenderFlags HAS_SHADOWING          = 0x01;
     static constexpr RenderFlags HAS_DIRECTIONAL_LIGHT  = 0x02;
     static constexpr RenderFlags HAS_DYNAMIC_LIGHTING   = 0x04;
+    static constexpr RenderFlags HAS_SHADOW_CASCADES    = 0x08;
 
 
-    RenderPass(const char* name) noexcept : mName(name) { }
+    // Only the renderables whose VISIBLE_MASK bits selected by 'visibilityMask' are equal to
+    // 'visibilityBits' write their depth (this doesn't apply to the color commands). Likewise,
+    // they must have all the bits of 'shadowAtlasTiles' set in their SHADOW_ATLAS_MASK.
+    explicit RenderPass(const char* name,
+            uint8_t visibilityMask = 0, uint8_t visibilityBits = 0,
+            uint32_t shadowAtlasTiles = 0) noexcept
+            : mName(name), mVisibilityMask(visibilityMask), mVisibilityBits(visibilityBits),
+              mShadowAtlasTiles(shadowAtlasTiles) { }
 
     virtual ~RenderPass() noexcept;
 
@@ -212,7 +270,24 @@ public:
             FScene::RenderableSoa const& soa, utils::Range<uint32_t> visibleRenderables,
             uint32_t commandTypeFlags, RenderFlags renderFlags,
             const CameraInfo& camera, Viewport const& viewport,
-            utils::GrowingSlice<Command>& commands) noexcept;
+            utils::GrowingSlice<Command>& commands, CommandCache* cache = nullptr,
+            InstanceBuffers* instanceBuffers = nullptr) noexcept;
+
+    // Sorts commands by key. This uses a parallel LSD radix sort over the 64-bits key when
+    // a scratch buffer (of the same size as the commands) is provided and there are enough
+    // commands to make it worthwhile, otherwise it falls back to std::sort.
+    static void sortCommands(utils::JobSystem& js,
+            Command* begin, Command* end, Command* scratch) noexcept;
+
+    // Returns the end of the commands to draw among the sorted commands [begin, end), they
+    // precede the cancelled commands and the sentinel. If instanceBuffers isn't null they are
+    // first merged into instanced commands, see instanceCommands().
+    static Command* getDrawCommandsEnd(FEngine& engine, InstanceBuffers* instanceBuffers,
+            FScene::RenderableSoa const& soa, Command* begin, Command* end) noexcept;
+
+    // The raster state of the depth-only commands, but for the culling mode which is the
+    // material's.
+    static Driver::RasterState getDepthRasterState() noexcept;
 
 private:
     // Called just before rendering, make sure all needed asynchronous tasks are finished.
@@ -237,25 +312,70 @@ private:
     static_assert(JOBS_PARALLEL_FOR_COMMANDS_SIZE % utils::CACHELINE_SIZE == 0,
             "Size of Commands jobs must be multiple of a cache-line size");
 
+    // below this many commands, std::sort() is faster than the radix sort
+    static constexpr size_t RADIX_SORT_MIN_COMMAND_COUNT = 1024;
+    // the radix sort splits the commands in at most this many chunks, each with its own
+    // histogram. each chunk has at least RADIX_SORT_MIN_CHUNK_SIZE commands.
+    static constexpr size_t RADIX_SORT_MAX_CHUNK_COUNT = 8;
+    static constexpr size_t RADIX_SORT_MIN_CHUNK_SIZE = 1024;
+
+    // when more than 1/RETAINED_SORT_MAX_CHANGED_RATIO commands changed since the previous
+    // frame, it's faster to sort all the commands again. The retained sort runs on one thread
+    // and does several passes over all the commands (finding the changed keys, removing them
+    // from the previous order, merging, gathering), the radix sort runs on several threads
+    // and skips the key bytes that are the same in all commands, so it only pays off when
+    // few keys changed.
+    static constexpr size_t RETAINED_SORT_MAX_CHANGED_RATIO = 32;
+
+    // the driver commands are recorded by at most this many threads, each with at least
+    // RECORD_MIN_CHUNK_SIZE commands.
+    static constexpr size_t RECORD_MAX_CHUNK_COUNT = 8;
+    static constexpr size_t RECORD_MIN_CHUNK_SIZE = 512;
+
+    template<typename T>
+    static void radixSort(utils::JobSystem& js, T* begin, T* end, T* scratch) noexcept;
+
+    static void sortCommandsRetained(utils::JobSystem& js, CommandCache& cache,
+            Command* begin, Command* end, Command* scratch) noexcept;
+
+    // Merges runs of sorted commands that only differ by their renderable into instanced
+    // commands, the commands are compacted in place. Returns the new end.
+    static Command* instanceCommands(FEngine& engine, InstanceBuffers& buffers,
+            FScene::RenderableSoa const& soa, Command* begin, Command* end) noexcept;
+
     static inline void generateCommands(uint32_t commandTypeFlags, Command* const commands,
             FScene::RenderableSoa const& soa, utils::Range<uint32_t> range, RenderFlags renderFlags,
+            uint8_t visibilityMask, uint8_t visibilityBits, uint32_t shadowAtlasTiles,
             math::float3 cameraPosition, math::float3 cameraForward) noexcept;
 
     template<uint32_t commandTypeFlags>
     static inline void generateCommandsImpl(uint32_t, Command* commands, FScene::RenderableSoa const& soa,
-            utils::Range<uint32_t> range, RenderFlags renderFlags, math::float3 cameraPosition,
-            math::float3 cameraForward) noexcept;
+            utils::Range<uint32_t> range, RenderFlags renderFlags,
+            uint8_t visibilityMask, uint8_t visibilityBits, uint32_t shadowAtlasTiles,
+            math::float3 cameraPosition, math::float3 cameraForward) noexcept;
 
     static void setupColorCommand(Command& cmdDraw, bool hasDepthPass,
             FMaterialInstance const* const mi) noexcept;
 
+    // Records the driver commands of the range, from several threads if there are enough.
+    static void recordDriverCommands(utils::JobSystem& js, FEngine::DriverApi& driver,
+            Command const* begin, Command const* end) noexcept;
+
     static void recordDriverCommands(FEngine::DriverApi& driver,
-            utils::Slice<Command> const& commands) noexcept;
+            Command const* begin, Command const* end) noexcept;
+
+    // Returns the space recordDriverCommands() needs in the command stream. 'hasPrograms' is
+    // cleared if recording the commands would create programs.
+    static size_t getDriverCommandsSize(
+            Command const* begin, Command const* end, bool& hasPrograms) noexcept;
 
     static void updateSummedPrimitiveCounts(
             FScene::RenderableSoa& renderableData, utils::Range<uint32_t> vr) noexcept;
 
     const char* const mName;
+    const uint8_t mVisibilityMask;
+    const uint8_t mVisibilityBits;
+    const uint32_t mShadowAtlasTiles;
 };
 
 } // namespace details
@@ -155,13 +155,20 @@ void FRenderer::renderJob(ArenaScope& arena, FView* view) {
      * Shadow pass
      */
 
-    if (view->hasShadowing()) {
+    if (view->hasDirectionalShadows()) {
         ShadowPass::renderShadowMap(engine, js, view, commands);
         recordHighWatermark(commands); // for debugging
         // reset the command buffer
         commands.clear();
     }
 
+    if (view->hasLocalShadows()) {
+        ShadowAtlasPass::renderShadowAtlas(engine, js, view, commands);
+        recordHighWatermark(commands); // for debugging
+        // reset the command buffer
+        commands.clear();
+    }
+
     /*
      * Depth + Color passes
      */
@@ -27,10 +27,15 @@
 
 #include <utils/compiler.h>
 #include <utils/EntityManager.h>
+#include <utils/JobSystem.h>
 #include <utils/Range.h>
 #include <utils/Zip2Iterator.h>
 
 #include <algorithm>
+#include <atomic>
+#include <limits>
+
+#include <string.h>
 
 using namespace math;
 using namespace utils;
@@ -49,10 +54,79 @@ FScene::FScene(FEngine& engine) :
 FScene::~FScene() noexcept = default;
 
 
+template<typename WORK>
+uint32_t FScene::forEachChunk(size_t count, WORK const& work) const {
+    // split [0, count) in at most PREPARE_MAX_CHUNK_COUNT chunks processed in parallel,
+    // work(chunk, begin, end) is called for each of them.
+    const size_t chunkSize = std::max(PREPARE_MIN_CHUNK_SIZE,
+            (count + PREPARE_MAX_CHUNK_COUNT - 1) / PREPARE_MAX_CHUNK_COUNT);
+    const uint32_t chunkCount = uint32_t((count + chunkSize - 1) / chunkSize);
+    auto chunks = [&work, count, chunkSize](uint32_t first, uint32_t n) {
+        for (uint32_t c = first; c < first + n; c++) {
+            const size_t begin = c * chunkSize;
+            work(c, begin, std::min(begin + chunkSize, count));
+        }
+    };
+    JobSystem& js = mEngine.getJobSystem();
+    auto* job = jobs::parallel_for(js, nullptr, 0, chunkCount, std::cref(chunks),
+            jobs::CountSplitter<1, PREPARE_MAX_CHUNK_COUNT>());
+    js.runAndWait(job);
+    return chunkCount;
+}
+
 void FScene::prepare(const math::mat4f& worldOriginTansform) {
-    // TODO: can we skip this in most cases? Since we rely on indices staying the same,
-    //       we could only skip, if nothing changed in the RCM.
+    FEngine& engine = mEngine;
+    FRenderableManager& rcm = engine.getRenderableManager();
+    FTransformManager& tcm = engine.getTransformManager();
+    FLightManager& lcm = engine.getLightManager();
+
+    // The renderables can only be updated in place if the scene still has the same entities,
+    // with the same components. Note that the world origin applies to everything.
+    const bool rebuild = mEntityListDirty ||
+            mTransformComponentGeneration != tcm.getComponentGeneration() ||
+            mRenderableComponentGeneration != rcm.getComponentGeneration() ||
+            mLightComponentGeneration != lcm.getComponentGeneration() ||
+            memcmp(&mWorldOrigin, &worldOriginTansform, sizeof(mat4f)) != 0;
+
+    if (rebuild || !updateRenderables(worldOriginTansform)) {
+        prepareAll(worldOriginTansform);
+    }
+    prepareLightData(worldOriginTansform);
+
+    mWorldOrigin = worldOriginTansform;
+    mTransformGeneration = tcm.getGeneration();
+    mRenderableGeneration = rcm.getGeneration();
+    mTransformComponentGeneration = tcm.getComponentGeneration();
+    mRenderableComponentGeneration = rcm.getComponentGeneration();
+    mLightComponentGeneration = lcm.getComponentGeneration();
+}
+
+void FScene::setRenderableData(size_t index, FRenderableManager::Instance ri,
+        FTransformManager::Instance ti, const math::mat4f& worldTransform) noexcept {
+    FRenderableManager& rcm = mEngine.getRenderableManager();
+    auto& sceneData = mRenderableData;
+
+    // compute the world AABB so we can perform culling
+    const Box worldAABB = rigidTransform(rcm.getAABB(ri), worldTransform);
+
+    sceneData.elementAt<RENDERABLE_INSTANCE>(index)    = ri;
+    sceneData.elementAt<WORLD_TRANSFORM>(index)        = worldTransform;
+    sceneData.elementAt<VISIBILITY_STATE>(index)       = rcm.getVisibility(ri);
+    sceneData.elementAt<UBH>(index)                    = rcm.getUbh(ri);
+    sceneData.elementAt<BONES_UBH>(index)              = rcm.getBonesUbh(ri);
+    sceneData.elementAt<INSTANCES_UBH>(index)          = rcm.getInstancesUbh(ri);
+    sceneData.elementAt<INSTANCE_COUNT>(index)         = rcm.getInstanceCount(ri);
+    sceneData.elementAt<WORLD_AABB_CENTER>(index)      = worldAABB.center;
+    sceneData.elementAt<VISIBLE_MASK>(index)           = 0;
+    sceneData.elementAt<SHADOW_ATLAS_MASK>(index)      = 0;
+    sceneData.elementAt<LAYERS>(index)                 = rcm.getLayerMask(ri);
+    sceneData.elementAt<WORLD_AABB_EXTENT>(index)      = worldAABB.halfExtent;
+    sceneData.elementAt<TRANSFORM_INSTANCE>(index)     = ti;
+    sceneData.elementAt<PRIMITIVES>(index)             = {};
+    sceneData.elementAt<SUMMED_PRIMITIVE_COUNT>(index) = {};
+}
 
+void FScene::prepareAll(const math::mat4f& worldOriginTansform) {
     FEngine& engine = mEngine;
     EntityManager& em = engine.getEntityManager();
     FRenderableManager& rcm = engine.getRenderableManager();
@@ -60,15 +134,21 @@ void FScene::prepare(const math::mat4f& worldOriginTansform) {
     FLightManager& lcm = engine.getLightManager();
     // go through the list of entities, and gather the data of those that are renderables
     auto& sceneData = mRenderableData;
-    auto& lightData = mLightData;
-    auto const& entities = mEntities;
+    auto& lightEntities = mLightEntities;
+
+    if (mEntityListDirty) {
+        mEntityListDirty = false;
+        mEntityList.assign(mEntities.begin(), mEntities.end());
+    }
+    Entity const* const entities = mEntityList.data();
+    const size_t entityCount = mEntityList.size();
 
 
     // NOTE: we can't know in advance how many entities are renderable or lights because the corresponding
     // component can be added after the entity is added to the scene.
 
     // for the purpose of allocation, we'll assume all our entities are renderables
-    size_t capacity = entities.size();
+    size_t capacity = entityCount;
     // we need the capacity to be multiple of 16 for SIMD loops
     capacity = (capacity + 0xF) & ~0xF;
     // we need 1 extra entry at the end for teh summed primitive count
@@ -79,6 +159,168 @@ void FScene::prepare(const math::mat4f& worldOriginTansform) {
         sceneData.setCapacity(capacity);
     }
 
+    /*
+     * The entities are processed in chunks, in parallel and in 3 steps:
+     * - each chunk counts its renderables and lights
+     * - a prefix sum of the counts gives the offset of each chunk in the outputs
+     * - each chunk writes its renderables and lights at its offset
+     * This fills the outputs without locks, in the same order as a serial loop would.
+     */
+
+    struct alignas(CACHELINE_SIZE) Chunk {
+        uint32_t renderableCount;
+        uint32_t renderableOffset;
+        uint32_t lightCount;
+        uint32_t lightOffset;
+    };
+    Chunk chunks[PREPARE_MAX_CHUNK_COUNT];
+
+    auto count = [&](uint32_t c, size_t begin, size_t end) {
+        Chunk& chunk = chunks[c];
+        chunk.renderableCount = 0;
+        chunk.lightCount = 0;
+        for (size_t i = begin; i < end; i++) {
+            Entity const entity = entities[i];
+            if (!em.isAlive(entity))
+                continue;
+
+            // getInstance() always returns null if the entity is the Null entity
+            // so we don't need to check for that, but we need to check it's alive
+
+            // don't even draw this object if it doesn't have a transform (which shouldn't
+            // happen because one is always created when creating a Renderable component).
+            if (rcm.getInstance(entity) && tcm.getInstance(entity)) {
+                chunk.renderableCount++;
+            }
+            if (lcm.getInstance(entity)) {
+                chunk.lightCount++;
+            }
+        }
+    };
+
+    const uint32_t chunkCount = forEachChunk(entityCount, count);
+
+    uint32_t renderableCount = 0;
+    uint32_t lightCount = 0;
+    for (uint32_t c = 0; c < chunkCount; c++) {
+        Chunk& chunk = chunks[c];
+        chunk.renderableOffset = renderableCount;
+        chunk.lightOffset = lightCount;
+        renderableCount += chunk.renderableCount;
+        lightCount += chunk.lightCount;
+    }
+
+    // we know there is enough space in the array
+    sceneData.resize(renderableCount);
+    lightEntities.resize(lightCount);
+
+    auto scatter = [&](uint32_t c, size_t begin, size_t end) {
+        Chunk const& chunk = chunks[c];
+        size_t r = chunk.renderableOffset;
+        size_t l = chunk.lightOffset;
+        for (size_t i = begin; i < end; i++) {
+            Entity const entity = entities[i];
+            if (!em.isAlive(entity))
+                continue;
+
+            auto ri = rcm.getInstance(entity);
+            auto ti = tcm.getInstance(entity);
+            if (ri && ti) {
+                setRenderableData(r++, ri, ti,
+                        worldOriginTansform * tcm.getWorldTransform(ti));
+            }
+            if (lcm.getInstance(entity)) {
+                lightEntities[l++] = entity;
+            }
+        }
+        assert(r == chunk.renderableOffset + chunk.renderableCount);
+        assert(l == chunk.lightOffset + chunk.lightCount);
+    };
+
+    forEachChunk(entityCount, scatter);
+
+    buildBvh();
+}
+
+void FScene::buildBvh() {
+    auto const& sceneData = mRenderableData;
+    if (sceneData.size() >= BVH_MIN_RENDERABLE_COUNT) {
+        mBvh.build(sceneData.data<RENDERABLE_INSTANCE>(),
+                sceneData.data<WORLD_AABB_CENTER>(), sceneData.data<WORLD_AABB_EXTENT>(),
+                sceneData.size());
+    } else {
+        mBvh.clear();
+    }
+}
+
+bool FScene::updateRenderables(const math::mat4f& worldOriginTansform) {
+    FEngine& engine = mEngine;
+    EntityManager& em = engine.getEntityManager();
+    FRenderableManager& rcm = engine.getRenderableManager();
+    FTransformManager& tcm = engine.getTransformManager();
+    auto& sceneData = mRenderableData;
+
+    // Only the entries modified since the last prepare() are rewritten. The views reorder
+    // mRenderableData, so the instances are read back from it rather than from the entities.
+    // Generations are compared modulo 2^32.
+    const uint32_t transformGeneration = mTransformGeneration;
+    const uint32_t renderableGeneration = mRenderableGeneration;
+    Bvh* const bvh = mBvh.empty() ? nullptr : &mBvh;
+    std::atomic_bool valid = { true };
+
+    auto update = [&](uint32_t, size_t begin, size_t end) {
+        auto const* const UTILS_RESTRICT renderables = sceneData.data<RENDERABLE_INSTANCE>();
+        auto const* const UTILS_RESTRICT transforms = sceneData.data<TRANSFORM_INSTANCE>();
+        for (size_t i = begin; i < end; i++) {
+            auto ri = renderables[i];
+            auto ti = transforms[i];
+            if (UTILS_UNLIKELY(!em.isAlive(rcm.getEntity(ri)))) {
+                // the entity was destroyed and must be removed, we need to rebuild everything
+                valid.store(false, std::memory_order_relaxed);
+                return;
+            }
+            if (int32_t(rcm.getGeneration(ri) - renderableGeneration) > 0 ||
+                int32_t(tcm.getGeneration(ti) - transformGeneration) > 0) {
+                setRenderableData(i, ri, ti, worldOriginTansform * tcm.getWorldTransform(ti));
+                if (bvh) {
+                    bvh->invalidate(ri);
+                }
+            }
+            if (bvh) {
+                bvh->setIndex(ri, uint32_t(i));
+            }
+        }
+    };
+
+    forEachChunk(sceneData.size(), update);
+
+    if (!valid.load(std::memory_order_relaxed)) {
+        return false;
+    }
+
+    if (bvh) {
+        // moving renderables degrade the hierarchy, rebuild it once they moved enough
+        bvh->refit(sceneData.data<WORLD_AABB_CENTER>(), sceneData.data<WORLD_AABB_EXTENT>());
+        if (bvh->needsRebuild()) {
+            buildBvh();
+        }
+    }
+    return true;
+}
+
+void FScene::prepareLightData(const math::mat4f& worldOriginTansform) {
+    FEngine& engine = mEngine;
+    EntityManager& em = engine.getEntityManager();
+    FTransformManager& tcm = engine.getTransformManager();
+    FLightManager& lcm = engine.getLightManager();
+    auto& lightData = mLightData;
+    auto const& lightEntities = mLightEntities;
+
+    // we store the non-directional lights, after the dominant directional light
+    size_t capacity = lightEntities.size() + DIRECTIONAL_LIGHTS_COUNT;
+    // we need the capacity to be multiple of 16 for SIMD loops
+    capacity = (capacity + 0xF) & ~0xF;
+
     lightData.clear();
     if (lightData.capacity() < capacity) {
         lightData.setCapacity(capacity);
@@ -86,70 +328,43 @@ void FScene::prepare(const math::mat4f& worldOriginTansform) {
     // the first entries are reserved for the directional lights (currently only one)
     lightData.resize(DIRECTIONAL_LIGHTS_COUNT);
 
-
     // find the max intensity directional light index in our local array
     float maxIntensity = 0;
 
-    for (Entity e : entities) {
+    for (Entity e : lightEntities) {
         if (!em.isAlive(e))
             continue;
 
-        // getInstance() always returns null if the entity is the Null entity
-        // so we don't need to check for that, but we need to check it's alive
-        auto ri = rcm.getInstance(e);
-        auto li = lcm.getInstance(e);
-        if (!ri & !li)
-            continue;
-
         // get the world transform
+        auto li = lcm.getInstance(e);
         auto ti = tcm.getInstance(e);
         const mat4f worldTransform = worldOriginTansform * tcm.getWorldTransform(ti);
 
-        // don't even draw this object if it doesn't have a transform (which shouldn't happen
-        // because one is always created when creating a Renderable component).
-        if (ri && ti) {
-            // compute the world AABB so we can perform culling
-            const Box worldAABB = rigidTransform(rcm.getAABB(ri), worldTransform);
-
-            // we know there is enough space in the array
-            sceneData.push_back_unsafe(
-                    ri,
-                    worldTransform,
-                    rcm.getVisibility(ri),
-                    rcm.getUbh(ri),
-                    rcm.getBonesUbh(ri),
-                    worldAABB.center,
-                    0,
-                    rcm.getLayerMask(ri),
-                    worldAABB.halfExtent,
-                    {}, {});
-        }
-
-        if (li) {
-            // find the dominant directional light
-            if (UTILS_UNLIKELY(lcm.isDirectionalLight(li))) {
-                // we don't store the directional lights, because we only have a single one
-                if (lcm.getIntensity(li) >= maxIntensity) {
-                    float3 d = lcm.getLocalDirection(li);
-                    // using the inverse-transpose handles non-uniform scaling
-                    d = normalize(transpose(inverse(worldTransform.upperLeft())) * d);
-                    // TODO: allow lightData.front() = { ... } syntax
-                    lightData.elementAt<FScene::POSITION_RADIUS>(0) = {};
-                    lightData.elementAt<FScene::DIRECTION>(0)       = d;
-                    lightData.elementAt<FScene::LIGHT_INSTANCE>(0)  = li;
-                    lightData.elementAt<FScene::VISIBILITY>(0)      = {};
-                }
-            } else {
-                const float4 p = worldTransform * float4{ lcm.getLocalPosition(li), 1 };
-                float3 d = 0;
-                if (!lcm.isPointLight(li) || lcm.isIESLight(li)) {
-                    d = lcm.getLocalDirection(li);
-                    // using the inverse-transpose handles non-uniform scaling
-                    d = normalize(transpose(inverse(worldTransform.upperLeft())) * d);
-                }
-                lightData.push_back_unsafe(
-                        float4{ p.xyz, lcm.getRadius(li) }, d, li, {});
+        // find the dominant directional light
+        if (UTILS_UNLIKELY(lcm.isDirectionalLight(li))) {
+            // we don't store the directional lights, because we only have a single one
+            if (lcm.getIntensity(li) >= maxIntensity) {
+                maxIntensity = lcm.getIntensity(li);
+                float3 d = lcm.getLocalDirection(li);
+                // using the inverse-transpose handles non-uniform scaling
+                d = normalize(transpose(inverse(worldTransform.upperLeft())) * d);
+                // TODO: allow lightData.front() = { ... } syntax
+                lightData.elementAt<FScene::POSITION_RADIUS>(0) = {};
+                lightData.elementAt<FScene::DIRECTION>(0)       = d;
+                lightData.elementAt<FScene::LIGHT_INSTANCE>(0)  = li;
+                lightData.elementAt<FScene::VISIBILITY>(0)      = {};
+                lightData.elementAt<FScene::SHADOW_INFO>(0)     = { -1, 0 };
+            }
+        } else {
+            const float4 p = worldTransform * float4{ lcm.getLocalPosition(li), 1 };
+            float3 d = 0;
+            if (!lcm.isPointLight(li) || lcm.isIESLight(li)) {
+                d = lcm.getLocalDirection(li);
+                // using the inverse-transpose handles non-uniform scaling
+                d = normalize(transpose(inverse(worldTransform.upperLeft())) * d);
             }
+            lightData.push_back_unsafe(
+                    float4{ p.xyz, lcm.getRadius(li) }, d, li, {}, float2{ -1, 0 });
         }
     }
 }
@@ -168,14 +383,15 @@ void FScene::terminate(FEngine& engine) {
     mGpuLightData.terminate(engine);
 }
 
-void FScene::prepareLights(const CameraInfo& camera) noexcept {
+void FScene::prepareLights(const CameraInfo& camera, ArenaScope& arena,
+        size_t maxLightCount) noexcept {
     FLightManager& lcm = mEngine.getLightManager();
     GpuLightBuffer& gpuLightData = mGpuLightData;
     FScene::LightSoa& lightData = getLightData();
 
     /*
      * Here we copy our lights data into the GPU buffer, some lights might be left out if there
-     * are more than the GPU buffer allows (i.e. 255).
+     * are more than the GPU buffer allows (i.e. 256), or than the view's budget.
      *
      * Sorting light by distance to the camera for dropping the ones in excess doesn't
      * work well because a light far from the camera could light an object close to it
@@ -183,14 +399,16 @@ void FScene::prepareLights(const CameraInfo& camera) noexcept {
      *
      * When we have too many lights, there is nothing better we can do though.
      * However, when the froxelization "record buffer" runs out of space, it's better to drop
-     * froxels far from the camera instead. This would happen during froxelization.
+     * froxels far from the camera instead. This happens during froxelization.
      */
 
+    assert(maxLightCount <= CONFIG_MAX_LIGHT_COUNT);
+
     // don't count the directional light
-    if (UTILS_UNLIKELY(lightData.size() > CONFIG_MAX_LIGHT_COUNT + DIRECTIONAL_LIGHTS_COUNT)) {
+    if (UTILS_UNLIKELY(lightData.size() > maxLightCount + DIRECTIONAL_LIGHTS_COUNT)) {
         // pre-compute the lights' distance to the camera, for sorting below.
         float3 const position = camera.getPosition();
-        float distances[CONFIG_MAX_LIGHT_COUNT]; // 1 KiB
+        float* const distances = arena.allocate<float>(lightData.size());
         // skip directional light
         for (size_t i = DIRECTIONAL_LIGHTS_COUNT, c = lightData.size(); i < c; ++i) {
             // TODO: this should take spot-light direction into account
@@ -204,14 +422,15 @@ void FScene::prepareLights(const CameraInfo& camera) noexcept {
         std::sort(b + DIRECTIONAL_LIGHTS_COUNT, b + lightData.size(),
                 [](auto const& lhs, auto const& rhs) { return lhs.second < rhs.second; });
 
-        lightData.resize(std::min(lightData.size(), CONFIG_MAX_LIGHT_COUNT + DIRECTIONAL_LIGHTS_COUNT));
+        lightData.resize(maxLightCount + DIRECTIONAL_LIGHTS_COUNT);
     }
 
-    assert(lightData.size() <= CONFIG_MAX_LIGHT_COUNT + 1);
+    assert(lightData.size() <= maxLightCount + DIRECTIONAL_LIGHTS_COUNT);
 
     auto const* UTILS_RESTRICT positions    = lightData.data<FScene::POSITION_RADIUS>();
     auto const* UTILS_RESTRICT directions   = lightData.data<FScene::DIRECTION>();
     auto const* UTILS_RESTRICT instances    = lightData.data<FScene::LIGHT_INSTANCE>();
+    auto const* UTILS_RESTRICT shadowInfo   = lightData.data<FScene::SHADOW_INFO>();
     for (size_t i = DIRECTIONAL_LIGHTS_COUNT, c = lightData.size(); i < c; ++i) {
         GpuLightBuffer::LightIndex gpuIndex = GpuLightBuffer::LightIndex(i - DIRECTIONAL_LIGHTS_COUNT);
         GpuLightBuffer::LightParameters& lp = gpuLightData.getLightParameters(gpuIndex);
@@ -220,6 +439,8 @@ void FScene::prepareLights(const CameraInfo& camera) noexcept {
         lp.colorIntensity       = { lcm.getColor(li), lcm.getIntensity(li) };
         lp.directionIES         = { directions[i], 0 };
         lp.spotScaleOffset.xy   = { lcm.getSpotParams(li).scaleOffset };
+        lp.spotScaleOffset.z    = shadowInfo[i].x;
+        lp.spotScaleOffset.w    = shadowInfo[i].y;
     }
 
     gpuLightData.invalidate(0, lightData.size());
@@ -228,10 +449,12 @@ void FScene::prepareLights(const CameraInfo& camera) noexcept {
 
 void FScene::addEntity(Entity entity) {
     mEntities.insert(entity);
+    mEntityListDirty = true;
 }
 
 void FScene::remove(Entity entity) {
     mEntities.erase(entity);
+    mEntityListDirty = true;
 }
 
 size_t FScene::getRenderableCount() const noexcept {
@@ -297,6 +520,82 @@ void FScene::computeBounds(
     }
 }
 
+void FScene::computeLightSpaceBounds(
+        Aabb& UTILS_RESTRICT castersBox,
+        Aabb& UTILS_RESTRICT receiversBox,
+        mat4f const& lightView, uint8_t visibleLayers,
+        uint8_t receiversVisibleMask) const noexcept {
+    using State = FRenderableManager::Visibility;
+
+    // The boxes are reduced in LANE_COUNT independent lanes, stored as arrays of floats, so
+    // that the compiler keeps each bound in a SIMD register and only needs selects in the
+    // loop. The lanes are reduced together at the end.
+    constexpr size_t LANE_COUNT = 8;
+
+    // Rows of the light's rotation, and their absolute values which transform the extent
+    // of a box to the extent of its bounding box in light space.
+    float3 rows[3];
+    float3 absRows[3];
+    float translation[3];
+    for (size_t k = 0; k < 3; k++) {
+        rows[k] = { lightView[0][k], lightView[1][k], lightView[2][k] };
+        absRows[k] = abs(rows[k]);
+        translation[k] = lightView[3][k];
+    }
+
+    float castersMin[3][LANE_COUNT], castersMax[3][LANE_COUNT];
+    float receiversMin[3][LANE_COUNT], receiversMax[3][LANE_COUNT];
+    for (size_t k = 0; k < 3; k++) {
+        std::fill_n(castersMin[k], LANE_COUNT, std::numeric_limits<float>::max());
+        std::fill_n(castersMax[k], LANE_COUNT, std::numeric_limits<float>::lowest());
+        std::fill_n(receiversMin[k], LANE_COUNT, std::numeric_limits<float>::max());
+        std::fill_n(receiversMax[k], LANE_COUNT, std::numeric_limits<float>::lowest());
+    }
+
+    RenderableSoa const& UTILS_RESTRICT soa = mRenderableData;
+    float3 const* const UTILS_RESTRICT worldAABBCenter = soa.data<WORLD_AABB_CENTER>();
+    float3 const* const UTILS_RESTRICT worldAABBExtent = soa.data<WORLD_AABB_EXTENT>();
+    uint8_t const* const UTILS_RESTRICT layers = soa.data<LAYERS>();
+    uint8_t const* const UTILS_RESTRICT visibleMask = soa.data<VISIBLE_MASK>();
+    State const* const UTILS_RESTRICT visibility = soa.data<VISIBILITY_STATE>();
+
+    // the capacity is a multiple of 16 (so of LANE_COUNT), the last lanes are masked out
+    const size_t c = soa.size();
+    for (size_t i = 0; i < c; i += LANE_COUNT) {
+        for (size_t l = 0; l < LANE_COUNT; l++) {
+            const size_t j = i + l;
+            const State v = visibility[j];
+            const bool inScene = (j < c) && (layers[j] & visibleLayers);
+            const bool caster = inScene && v.castShadows;
+            const bool receiver = inScene && v.receiveShadows &&
+                    ((visibleMask[j] & receiversVisibleMask) || !v.culling);
+            const float3 center = worldAABBCenter[j];
+            const float3 extent = worldAABBExtent[j];
+            for (size_t k = 0; k < 3; k++) {
+                const float lsCenter = dot(rows[k], center) + translation[k];
+                const float lsExtent = dot(absRows[k], extent);
+                const float lsMin = lsCenter - lsExtent;
+                const float lsMax = lsCenter + lsExtent;
+                castersMin[k][l] = caster ? std::min(castersMin[k][l], lsMin) : castersMin[k][l];
+                castersMax[k][l] = caster ? std::max(castersMax[k][l], lsMax) : castersMax[k][l];
+                receiversMin[k][l] = receiver ?
+                        std::min(receiversMin[k][l], lsMin) : receiversMin[k][l];
+                receiversMax[k][l] = receiver ?
+                        std::max(receiversMax[k][l], lsMax) : receiversMax[k][l];
+            }
+        }
+    }
+
+    for (size_t k = 0; k < 3; k++) {
+        for (size_t l = 0; l < LANE_COUNT; l++) {
+            castersBox.min[k] = std::min(castersBox.min[k], castersMin[k][l]);
+            castersBox.max[k] = std::max(castersBox.max[k], castersMax[k][l]);
+            receiversBox.min[k] = std::min(receiversBox.min[k], receiversMin[k][l]);
+            receiversBox.max[k] = std::max(receiversBox.max[k], receiversMax[k][l]);
+        }
+    }
+}
+
 } // namespace details
 
 // ------------------------------------------------------------------------------------------------
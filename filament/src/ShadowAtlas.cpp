@@ -0,0 +1,244 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "details/ShadowAtlas.h"
+
+#include "components/LightManager.h"
+
+#include "details/Culler.h"
+#include "details/Engine.h"
+#include "details/ShadowMap.h"
+
+#include <filament/driver/DriverEnums.h>
+
+#include <utils/algorithm.h>
+
+#include <algorithm>
+#include <limits>
+
+#include <math.h>
+
+using namespace math;
+using namespace utils;
+
+namespace filament {
+using namespace driver;
+
+namespace details {
+
+// The direction and up vector of each face of a point light's cube. The shaders select the face
+// from the major axis of the light to fragment vector, in the same order.
+struct CubeFace {
+    float3 direction;
+    float3 up;
+};
+static const CubeFace sCubeFaces[6] = {
+        { {  1,  0,  0 }, { 0, -1,  0 } },
+        { { -1,  0,  0 }, { 0, -1,  0 } },
+        { {  0,  1,  0 }, { 0,  0,  1 } },
+        { {  0, -1,  0 }, { 0,  0, -1 } },
+        { {  0,  0,  1 }, { 0, -1,  0 } },
+        { {  0,  0, -1 }, { 0, -1,  0 } },
+};
+
+// returns the coordinates of the point at the given index of a Z-order curve
+static uint2 decodeMorton(uint32_t index) noexcept {
+    uint2 p = 0;
+    for (uint32_t bit = 0; index >> (2 * bit); bit++) {
+        p.x |= ((index >> (2 * bit)) & 1u) << bit;
+        p.y |= ((index >> (2 * bit + 1)) & 1u) << bit;
+    }
+    return p;
+}
+
+ShadowAtlas::ShadowAtlas(FEngine& engine) noexcept :
+        mEngine(engine),
+        mClipSpaceFlipped(engine.getBackend() == Backend::VULKAN) {
+}
+
+ShadowAtlas::~ShadowAtlas() = default;
+
+void ShadowAtlas::terminate(DriverApi& driverApi) noexcept {
+    if (mRenderTarget) {
+        driverApi.destroyRenderTarget(mRenderTarget);
+    }
+    if (mTexture) {
+        driverApi.destroyTexture(mTexture);
+    }
+}
+
+void ShadowAtlas::update(FScene::LightSoa& lightData,
+        CameraInfo const& camera, Frustum const& cullingFrustum) noexcept {
+    FLightManager& lcm = mEngine.getLightManager();
+    auto const* positions  = lightData.data<FScene::POSITION_RADIUS>();
+    auto const* directions = lightData.data<FScene::DIRECTION>();
+    auto const* instances  = lightData.data<FScene::LIGHT_INSTANCE>();
+    auto* shadowInfo       = lightData.data<FScene::SHADOW_INFO>();
+
+    // The importance of a light is the size on screen of its sphere of influence, relative to
+    // the height of the screen. Lights whose sphere contains the camera come first.
+    const float3 eye = camera.getPosition();
+    const float scale = std::abs(camera.projection[1][1]);
+    std::vector<Candidate>& candidates = mCandidates;
+    candidates.clear();
+    for (size_t i = FScene::DIRECTIONAL_LIGHTS_COUNT, c = lightData.size(); i < c; i++) {
+        float4 const& sphere = positions[i];
+        if (!lcm.isShadowCaster(instances[i]) || !Culler::intersects(cullingFrustum, sphere)) {
+            continue;
+        }
+        const float d2 = length2(sphere.xyz - eye);
+        const float r2 = sphere.w * sphere.w;
+        const float importance = d2 > r2 ?
+                sphere.w * scale / std::sqrt(d2 - r2) : std::numeric_limits<float>::infinity();
+        candidates.push_back({ importance, uint32_t(i) });
+    }
+    std::sort(candidates.begin(), candidates.end(),
+            [](Candidate const& lhs, Candidate const& rhs) {
+                return lhs.importance > rhs.importance;
+            });
+
+    // Tiles are allocated along a Z-order curve of the smallest tiles. Because their dimensions
+    // never increase, each tile starts at a multiple of its own size, i.e. on its own square.
+    constexpr uint32_t GRID_SIZE = ATLAS_DIMENSION / MIN_TILE_DIMENSION;
+    uint32_t offset = 0;
+    uint32_t maxDimension = MAX_TILE_DIMENSION;
+    mTileCount = 0;
+    for (Candidate const& candidate : candidates) {
+        const size_t i = candidate.index;
+        FLightManager::Instance li = instances[i];
+        const bool isSpotLight = lcm.isSpotLight(li);
+        const uint32_t faceCount = isSpotLight ? 1 : 6;
+        if (mTileCount + faceCount > CONFIG_MAX_SHADOW_ATLAS_TILES) {
+            continue;
+        }
+
+        // the tiles have about as many texels as the light covers pixels on screen, up to the
+        // light's shadow map size, and no more than the tiles of a more important light
+        const float size = std::min(1.0f, candidate.importance) * lcm.getShadowMapSize(li);
+        uint32_t dimension = std::max(MIN_TILE_DIMENSION, uint32_t(size));
+        dimension = std::min(maxDimension, 1u << (31u - utils::clz(dimension)));
+        uint32_t tileSize = (dimension / MIN_TILE_DIMENSION) * (dimension / MIN_TILE_DIMENSION);
+        while (offset + faceCount * tileSize > GRID_SIZE * GRID_SIZE &&
+               dimension > MIN_TILE_DIMENSION) {
+            dimension /= 2;
+            tileSize /= 4;
+        }
+        if (offset + faceCount * tileSize > GRID_SIZE * GRID_SIZE) {
+            // the atlas is full, but a spot light may still fit after a point light
+            continue;
+        }
+        maxDimension = dimension;
+
+        const float3 position = positions[i].xyz;
+        const float radius = positions[i].w;
+        float fov = 90.0f;
+        if (isSpotLight) {
+            // the cone's angle, limited so that the projection doesn't degenerate
+            const float halfAngle = std::min(
+                    std::acos(std::sqrt(lcm.getCosOuterSquared(li))), float(M_PI * 0.45));
+            fov = 2.0f * halfAngle * float(180.0 / M_PI);
+            setTile(mTiles[mTileCount], position, directions[i], { 0, 1, 0 },
+                    fov, radius, offset, dimension);
+        } else {
+            for (size_t f = 0; f < 6; f++) {
+                setTile(mTiles[mTileCount + f], position, sCubeFaces[f].direction,
+                        sCubeFaces[f].up, fov, radius, offset + uint32_t(f) * tileSize, dimension);
+            }
+        }
+
+        // the normal bias is in texels, the shader scales the size of a texel at a distance of
+        // 1 from the light by the actual distance
+        const float texelSize = 2.0f * std::tan(fov * float(M_PI / 360.0)) / (dimension - 2);
+        shadowInfo[i] = { float(mTileCount), lcm.getShadowNormalBias(li) * texelSize };
+
+        offset += faceCount * tileSize;
+        mTileCount += faceCount;
+    }
+}
+
+void ShadowAtlas::setTile(Tile& tile, float3 const& position, float3 const& direction,
+        float3 const& up, float fov, float radius,
+        uint32_t offset, uint32_t dimension) noexcept {
+    // The light doesn't reach past its radius. The near plane trades depth precision for the
+    // casters very close to the light, which are clipped.
+    const float zf = radius;
+    const float zn = zf * 0.005f;
+    const mat4f projection = mat4f::perspective(fov, 1.0f, zn, zf);
+    const mat4f model = mat4f::lookAt(position, position + direction, up);
+    const mat4f view = FCamera::getViewMatrix(model);
+
+    tile.camera = CameraInfo{
+            .projection         = projection,
+            .cullingProjection  = projection,
+            .model              = model,
+            .view               = view,
+            .zn                 = zn,
+            .zf                 = zf
+    };
+    tile.frustum = Frustum(projection * view);
+
+    // we set a viewport with a 1-texel border, so that filtering doesn't read the other tiles
+    const uint2 xy = decodeMorton(offset) * MIN_TILE_DIMENSION;
+    tile.viewport = { int32_t(xy.x + 1), int32_t(xy.y + 1), dimension - 2, dimension - 2 };
+    tile.lightSpace = ShadowMap::getTextureCoordsMapping(tile.viewport,
+            uint2(ATLAS_DIMENSION), mClipSpaceFlipped) * projection * view;
+}
+
+void ShadowAtlas::prepare(DriverApi& driver, SamplerBuffer& sb, bool bindShadowMap) noexcept {
+    if (!mTexture) {
+        // the perspective projections need more depth precision than the directional light
+        mTexture = driver.createTexture(
+                Driver::SamplerType::SAMPLER_2D, 1, Driver::TextureFormat::DEPTH24, 1,
+                ATLAS_DIMENSION, ATLAS_DIMENSION, 1, TextureUsage::DEPTH_ATTACHMENT);
+
+        mRenderTarget = driver.createRenderTarget(
+                TargetBufferFlags::SHADOW, ATLAS_DIMENSION, ATLAS_DIMENSION, 1,
+                Driver::TextureFormat::DEPTH24, {}, { mTexture }, {});
+
+        sb.setSampler(FEngine::PerViewSib::SHADOW_ATLAS,
+                { mTexture, ShadowMap::getSamplerParams() });
+    }
+
+    if (bindShadowMap) {
+        // the receivers only sample it outside of the cascades, where it's never in shadow
+        sb.setSampler(FEngine::PerViewSib::SHADOW_MAP,
+                { mTexture, ShadowMap::getSamplerParams() });
+    }
+}
+
+void ShadowAtlas::beginRenderPass(DriverApi& driver, size_t tile, bool clear) const noexcept {
+    RenderPassParams params = {};
+    if (clear) {
+        // The first pass clears the whole texture (including the borders of all the tiles),
+        // the following ones must keep the tiles already rendered.
+        params.clear = TargetBufferFlags::SHADOW;
+        params.discardStart = TargetBufferFlags::DEPTH;
+    } else {
+        params.clear = TargetBufferFlags::SHADOW & ~TargetBufferFlags::DEPTH;
+    }
+    params.discardEnd = TargetBufferFlags::COLOR_AND_STENCIL;
+    params.clearDepth = 1.0;
+    params.width = ATLAS_DIMENSION;
+    params.height = ATLAS_DIMENSION;
+    params.clear |= RenderPassParams::IGNORE_SCISSOR | RenderPassParams::IGNORE_VIEWPORT;
+    driver.beginRenderPass(mRenderTarget, params);
+
+    Viewport const& viewport = mTiles[tile].viewport;
+    driver.viewport(viewport.left, viewport.bottom, viewport.width, viewport.height);
+}
+
+} // namespace details
+} // namespace filament
@@ -21,9 +21,12 @@
 #include "details/Engine.h"
 #include "details/ShadowMap.h"
 #include "details/Scene.h"
+#include "details/View.h"
 
 #include <filament/driver/DriverEnums.h>
 
+#include <utils/Log.h>
+
 #include <limits>
 
 using namespace math;
@@ -42,8 +45,13 @@ static constexpr bool ENABLE_LISPSM = true;
 
 ShadowMap::ShadowMap(FEngine& engine) noexcept :
         mEngine(engine),
-        mClipSpaceFlipped(engine.getBackend() == Backend::VULKAN) {
-    mCamera = mEngine.createCamera(EntityManager::get().create());
+        mClipSpaceFlipped(engine.getBackend() == Backend::VULKAN),
+        // the cache is copied into the shadow map with blit(), which is only implemented by GL
+        mStaticCachingSupported(engine.getBackend() == Backend::OPENGL),
+        mMaxTextureSize(engine.getDriverApi().getMaxTextureSize()) {
+    for (Cascade& cascade : mCascades) {
+        cascade.camera = mEngine.createCamera(EntityManager::get().create());
+    }
     mDebugCamera = mEngine.createCamera(EntityManager::get().create());
     FDebugRegistry& debugRegistry = engine.getDebugRegistry();
     debugRegistry.registerProperty("d.shadowmap.focus_shadowcasters", &engine.debug.shadowmap.focus_shadowcasters);
@@ -56,50 +64,50 @@ ShadowMap::ShadowMap(FEngine& engine) noexcept :
 }
 
 ShadowMap::~ShadowMap() {
-    mEngine.destroy(mCamera->getEntity());
+    for (Cascade& cascade : mCascades) {
+        mEngine.destroy(cascade.camera->getEntity());
+    }
     mEngine.destroy(mDebugCamera->getEntity());
 }
 
 void ShadowMap::prepare(DriverApi& driver, SamplerBuffer& sb) noexcept {
     assert(mShadowMapDimension);
 
-    uint32_t dim = mShadowMapDimension;
-    uint32_t currentDimension = mViewport.width + 2;
-    if (currentDimension == dim) {
-        // nothing to do here.
-        assert(mShadowMapHandle);
-        return;
-    }
+    const uint2 dim = mTextureDimension;
+    if (mAllocatedDimension != dim) {
+        // destroy the current rendertarget and texture
+        if (mShadowMapRenderTarget) {
+            driver.destroyRenderTarget(mShadowMapRenderTarget);
+        }
+        if (mShadowMapHandle) {
+            driver.destroyTexture(mShadowMapHandle);
+        }
 
-    // destroy the current rendertarget and texture
-    if (mShadowMapRenderTarget) {
-        driver.destroyRenderTarget(mShadowMapRenderTarget);
-    }
-    if (mShadowMapHandle) {
-        driver.destroyTexture(mShadowMapHandle);
-    }
+        // allocate new ones...
+        mAllocatedDimension = dim;
 
-    // allocate new ones...
-    // we set a viewport with a 1-texel border for when we index outside of the texture
-    // DON'T CHANGE this unless computeLightSpaceMatrix() is updated too.
-    // see: computeLightSpaceMatrix()
-    mViewport = { 1, 1, dim - 2, dim - 2 };
+        mShadowMapHandle = driver.createTexture(
+                Driver::SamplerType::SAMPLER_2D, 1, Driver::TextureFormat::DEPTH16, 1, dim.x, dim.y, 1,
+                TextureUsage::DEPTH_ATTACHMENT);
 
-    mShadowMapHandle = driver.createTexture(
-            Driver::SamplerType::SAMPLER_2D, 1, Driver::TextureFormat::DEPTH16, 1, dim, dim, 1,
-            TextureUsage::DEPTH_ATTACHMENT);
+        mShadowMapRenderTarget = driver.createRenderTarget(
+                TargetBufferFlags::SHADOW, dim.x, dim.y, 1, Driver::TextureFormat::DEPTH16,
+                {}, { mShadowMapHandle }, {});
+    }
 
-    mShadowMapRenderTarget = driver.createRenderTarget(
-            TargetBufferFlags::SHADOW, dim, dim, 1, Driver::TextureFormat::DEPTH16,
-            {}, { mShadowMapHandle }, {});
+    // this is set every time, because the shadow atlas is bound in its place in the frames
+    // where the directional light doesn't cast shadows (see ShadowAtlas::prepare())
+    sb.setSampler(FEngine::PerViewSib::SHADOW_MAP, { mShadowMapHandle, getSamplerParams() });
+}
 
+SamplerParams ShadowMap::getSamplerParams() noexcept {
     SamplerParams s;
     s.filterMag = SamplerMagFilter::LINEAR;
     s.filterMin = SamplerMinFilter::LINEAR;
     s.compareFunc = SamplerCompareFunc::LE;
     s.compareMode = SamplerCompareMode::COMPARE_TO_TEXTURE;
     s.depthStencil = true;
-    sb.setSampler(FEngine::PerViewSib::SHADOW_MAP, { mShadowMapHandle, s });
+    return s;
 }
 
 void ShadowMap::terminate(DriverApi& driverApi) noexcept {
@@ -109,22 +117,103 @@ void ShadowMap::terminate(DriverApi& driverApi) noexcept {
     if (mShadowMapHandle) {
         driverApi.destroyTexture(mShadowMapHandle);
     }
+    for (Cascade& cascade : mCascades) {
+        if (cascade.cache.target) {
+            driverApi.destroyRenderTarget(cascade.cache.target);
+        }
+        if (cascade.cache.texture) {
+            driverApi.destroyTexture(cascade.cache.texture);
+        }
+    }
 }
 
-void ShadowMap::beginRenderPass(DriverApi& driver) const noexcept {
+void ShadowMap::beginRenderPass(DriverApi& driver, size_t cascade, bool clear) const noexcept {
     RenderPassParams params = {};
-    params.clear = TargetBufferFlags::SHADOW;
-    params.discardStart = TargetBufferFlags::DEPTH;
+    if (clear) {
+        // The first pass clears the whole texture (including the borders of all the cascades),
+        // the following ones must keep the cascades already rendered.
+        params.clear = TargetBufferFlags::SHADOW;
+        params.discardStart = TargetBufferFlags::DEPTH;
+    } else {
+        params.clear = TargetBufferFlags::SHADOW & ~TargetBufferFlags::DEPTH;
+    }
     params.discardEnd = TargetBufferFlags::COLOR_AND_STENCIL;
     params.clearDepth = 1.0;
-    params.width = params.height = mShadowMapDimension;
+    params.width = mTextureDimension.x;
+    params.height = mTextureDimension.y;
     // Disable scissor and viewport to avoid bugs in some drivers where the GPU memory is reloaded
     // needlessly.
     params.clear |= RenderPassParams::IGNORE_SCISSOR | RenderPassParams::IGNORE_VIEWPORT;
     driver.beginRenderPass(mShadowMapRenderTarget, params);
 
-    driver.viewport(mViewport.left, mViewport.bottom,
-            mViewport.width, mViewport.height);
+    Viewport const& viewport = mCascades[cascade].viewport;
+    driver.viewport(viewport.left, viewport.bottom, viewport.width, viewport.height);
+}
+
+void ShadowMap::clear(DriverApi& driver) const noexcept {
+    beginRenderPass(driver, 0, true);
+    driver.endRenderPass();
+}
+
+void ShadowMap::setStaticCasters(size_t c, uint64_t signature) noexcept {
+    Cascade& cascade = mCascades[c];
+    StaticCache& cache = cascade.cache;
+    if (!mStaticCachingSupported || !signature || !cascade.hasVisibleShadows) {
+        cascade.staticCasters = StaticCasters::NONE;
+        cache.signature = 0;
+        return;
+    }
+
+    // The light space matrix changes with the light and the camera (but is stable within the
+    // snapping of snapLightFrustum() and quantizeLightFrustum()), 'signature' changes when the
+    // static casters do.
+    bool upToDate = cache.signature == signature && cache.dimension == mShadowMapDimension;
+    for (size_t i = 0; i < 4; i++) {
+        upToDate = upToDate && cache.lightSpace[i] == cascade.lightSpace[i];
+    }
+    cascade.staticCasters = upToDate ? StaticCasters::CACHED : StaticCasters::RENDER;
+    cache.lightSpace = cascade.lightSpace;
+    cache.signature = signature;
+}
+
+void ShadowMap::beginStaticRenderPass(DriverApi& driver, size_t c) noexcept {
+    StaticCache& cache = mCascades[c].cache;
+    const uint32_t dim = mShadowMapDimension;
+    if (cache.dimension != dim) {
+        if (cache.target) {
+            driver.destroyRenderTarget(cache.target);
+        }
+        if (cache.texture) {
+            driver.destroyTexture(cache.texture);
+        }
+        cache.dimension = dim;
+        cache.texture = driver.createTexture(
+                Driver::SamplerType::SAMPLER_2D, 1, Driver::TextureFormat::DEPTH16, 1, dim, dim, 1,
+                TextureUsage::DEPTH_ATTACHMENT);
+        cache.target = driver.createRenderTarget(
+                TargetBufferFlags::SHADOW, dim, dim, 1, Driver::TextureFormat::DEPTH16,
+                {}, { cache.texture }, {});
+    }
+
+    RenderPassParams params = {};
+    params.clear = TargetBufferFlags::SHADOW;
+    params.discardStart = TargetBufferFlags::DEPTH;
+    params.discardEnd = TargetBufferFlags::COLOR_AND_STENCIL;
+    params.clearDepth = 1.0;
+    params.width = params.height = dim;
+    params.clear |= RenderPassParams::IGNORE_SCISSOR | RenderPassParams::IGNORE_VIEWPORT;
+    driver.beginRenderPass(cache.target, params);
+
+    // same 1-texel border as the cascade's viewport, so the cache can be copied as a whole
+    driver.viewport(1, 1, dim - 2, dim - 2);
+}
+
+void ShadowMap::copyStaticCasters(DriverApi& driver, size_t c) const noexcept {
+    Cascade const& cascade = mCascades[c];
+    const uint32_t dim = mShadowMapDimension;
+    driver.blit(TargetBufferFlags::DEPTH,
+            mShadowMapRenderTarget, cascade.viewport.left - 1, cascade.viewport.bottom - 1, dim, dim,
+            cascade.cache.target, 0, 0, dim, dim);
 }
 
 void ShadowMap::update(
@@ -135,23 +224,38 @@ void ShadowMap::update(
     auto& lcm = mEngine.getLightManager();
 
     FLightManager::Instance li = lightData.elementAt<FScene::LIGHT_INSTANCE>(index);
-    mShadowMapDimension = std::max(1u, lcm.getShadowMapSize(li));
+    mCascadeCount = lcm.isDirectionalLight(li) ? lcm.getShadowCascades(li) : 1;
+
+    // The cascades are stored in a single texture, on (up to) 2 columns, which must fit in the
+    // device's maximum texture size (0 if unknown).
+    const uint32_t columns = uint32_t(std::min(mCascadeCount, size_t(2)));
+    const uint32_t rows = uint32_t((mCascadeCount + 1) / 2);
+    uint32_t dim = std::max(1u, lcm.getShadowMapSize(li));
+    if (mMaxTextureSize && dim * std::max(columns, rows) > mMaxTextureSize) {
+        const uint32_t maxDim = mMaxTextureSize / std::max(columns, rows);
+        if (mShadowMapDimension != maxDim) {
+            slog.w << "shadow map size " << dim << " x " << mCascadeCount
+                   << " cascades exceeds the maximum texture size ("
+                   << mMaxTextureSize << "), using " << maxDim << io::endl;
+        }
+        dim = maxDim;
+    }
+    mShadowMapDimension = dim;
+    mTextureDimension = { dim * columns, dim * rows };
+    for (size_t c = 0; c < mCascadeCount; c++) {
+        // we set a viewport with a 1-texel border for when we index outside of the texture
+        // DON'T CHANGE this unless getTextureCoordsMapping() is updated too.
+        mCascades[c].viewport = {
+                int32_t((c % 2) * dim + 1), int32_t((c / 2) * dim + 1), dim - 2, dim - 2 };
+    }
 
     FLightManager::ShadowParams params = lcm.getShadowParams(li);
     mat4f projection(camera.cullingProjection);
     if (params.shadowFar > 0.0f) {
-        float n = camera.zn;
-        float f = params.shadowFar;
-        if (std::abs(projection[2].w) <= std::numeric_limits<float>::epsilon()) {
-            // perspective projection
-            projection[2].z =     (f + n) / (n - f);
-            projection[3].z = (2 * f * n) / (n - f);
-        } else {
-            // ortho projection
-            projection[2].z =    2.0f / (n - f);
-            projection[3].z = (f + n) / (n - f);
-        }
+        projection = setProjectionNearFar(projection, camera.zn, params.shadowFar);
     }
+    mCascadeSplits = computeCascadeSplits(camera.zn,
+            params.shadowFar > 0.0f ? params.shadowFar : camera.zf, mCascadeCount);
 
     CameraInfo cameraInfo = {
             .projection = projection,
@@ -175,33 +279,97 @@ void ShadowMap::update(
     else            cameraInfo.dzf =-dzf * dz;
 
 
+    for (Cascade& cascade : mCascades) {
+        cascade.hasVisibleShadows = false;
+    }
+
     using Type = FLightManager::Type;
     switch (lcm.getType(li)) {
         case Type::SUN:
-        case Type::DIRECTIONAL:
-            computeShadowCameraDirectional(
-                    lightData.elementAt<FScene::DIRECTION>(index), scene, cameraInfo,
-                    visibleLayers);
+        case Type::DIRECTIONAL: {
+            // scene bounds in world space, these are shared by all the cascades
+            Aabb wsShadowCastersVolume, wsShadowReceiversVolume;
+            scene->computeBounds(wsShadowCastersVolume, wsShadowReceiversVolume, visibleLayers);
+            if (wsShadowCastersVolume.isEmpty() || wsShadowReceiversVolume.isEmpty()) {
+                break;
+            }
+
+            // Bounds of the casters and of the receivers visible from the camera, in light
+            // space. These are much tighter than the world space bounds above, because each
+            // box is transformed on its own. The light space doesn't depend on the cascade.
+            const float3 dir = lightData.elementAt<FScene::DIRECTION>(index);
+            const mat4f LMv = computeLightView(dir, camera.getForwardVector());
+            Aabb lsShadowCastersBounds, lsShadowReceiversBounds;
+            scene->computeLightSpaceBounds(lsShadowCastersBounds, lsShadowReceiversBounds, LMv,
+                    visibleLayers, uint8_t(1u << FView::VISIBLE_RENDERABLE_BIT));
+            if (lsShadowCastersBounds.isEmpty() || lsShadowReceiversBounds.isEmpty()) {
+                break;
+            }
+            for (size_t c = 0; c < mCascadeCount; c++) {
+                CameraInfo cascadeCameraInfo = cameraInfo;
+                if (mCascadeCount > 1) {
+                    // each cascade only covers its slice of the view frustum
+                    const float n = c ? mCascadeSplits[c - 1] : camera.zn;
+                    const float f = mCascadeSplits[c];
+                    cascadeCameraInfo.projection = setProjectionNearFar(projection, n, f);
+                    cascadeCameraInfo.frustum = Frustum(cascadeCameraInfo.projection * camera.view);
+                    cascadeCameraInfo.zn = n;
+                    cascadeCameraInfo.zf = f;
+                }
+                computeShadowCameraDirectional(dir, cascadeCameraInfo,
+                        wsShadowCastersVolume, wsShadowReceiversVolume,
+                        lsShadowCastersBounds, lsShadowReceiversBounds, c);
+            }
             break;
+        }
         case Type::FOCUSED_SPOT:
         case Type::SPOT:
             break;
         case Type::POINT:
             break;
     }
+
+    mHasVisibleShadows = false;
+    for (size_t c = 0; c < mCascadeCount; c++) {
+        mHasVisibleShadows |= mCascades[c].hasVisibleShadows;
+    }
 }
 
-void ShadowMap::computeShadowCameraDirectional(
-        math::float3 const& dir, FScene const* scene, CameraInfo const& camera,
-        uint8_t visibleLayers) noexcept {
-
-    // scene bounds in world space
-    Aabb wsShadowCastersVolume, wsShadowReceiversVolume;
-    scene->computeBounds(wsShadowCastersVolume, wsShadowReceiversVolume, visibleLayers);
-    if (wsShadowCastersVolume.isEmpty() || wsShadowReceiversVolume.isEmpty()) {
-        mHasVisibleShadows = false;
-        return;
+float4 ShadowMap::computeCascadeSplits(float zn, float zf, size_t count) noexcept {
+    // The "practical split scheme": halfway between the logarithmic distribution, which
+    // matches the perspective aliasing, and the uniform one, which doesn't give all the
+    // resolution to the first meters.
+    constexpr float lambda = 0.5f;
+    const float n = std::max(zn, std::numeric_limits<float>::epsilon());
+    float4 splits(zf);
+    for (size_t c = 0; c < count - 1; c++) {
+        const float t = float(c + 1) / count;
+        const float logarithmic = n * std::pow(zf / n, t);
+        const float uniform = zn + (zf - zn) * t;
+        splits[c] = lambda * logarithmic + (1.0f - lambda) * uniform;
+    }
+    return splits;
+}
+
+mat4f ShadowMap::setProjectionNearFar(mat4f projection, float n, float f) noexcept {
+    if (std::abs(projection[2].w) <= std::numeric_limits<float>::epsilon()) {
+        // perspective projection
+        projection[2].z =     (f + n) / (n - f);
+        projection[3].z = (2 * f * n) / (n - f);
+    } else {
+        // ortho projection
+        projection[2].z =    2.0f / (n - f);
+        projection[3].z = (f + n) / (n - f);
     }
+    return projection;
+}
+
+void ShadowMap::computeShadowCameraDirectional(
+        math::float3 const& dir, CameraInfo const& camera,
+        Aabb const& wsShadowCastersVolume, Aabb const& wsShadowReceiversVolume,
+        Aabb const& lsShadowCastersBounds, Aabb const& lsShadowReceiversBounds,
+        size_t c) noexcept {
+    Cascade& cascade = mCascades[c];
 
     float3 wsViewFrustumCorners[8];
     computeFrustumCorners(wsViewFrustumCorners,
@@ -212,34 +380,18 @@ void ShadowMap::computeShadowCameraDirectional(
     size_t vertexCount = intersectFrustumWithBox(mWsClippedShadowReceiverVolume,
             camera.frustum, wsViewFrustumCorners, wsShadowReceiversVolume);
 
-    mHasVisibleShadows = vertexCount >= 2;
-    if (mHasVisibleShadows) {
-        const bool USE_LISPSM = ENABLE_LISPSM && mEngine.debug.shadowmap.lispsm;
+    cascade.hasVisibleShadows = vertexCount >= 2;
+    if (cascade.hasVisibleShadows) {
+        // LiSPSM isn't tuned for the short slices of the cascades
+        const bool USE_LISPSM = ENABLE_LISPSM && mEngine.debug.shadowmap.lispsm &&
+                mCascadeCount == 1;
 
         /*
          * Compute the light's model matrix
          * (direction & position)
          */
-        // the light's model matrix contains the light position and direction.
-        const mat4f M = mat4f::lookAt(float3{ 0, 0, 0 }, dir, float3{ 0, 1, 0 });
-        const mat4f Mv = FCamera::rigidTransformInverse(M);
-
-        // Orient the shadow map in the direction of the view vector by constructing a
-        // rotation matrix around the z-axis, that aligns the y-axis with the camera's
-        // forward vector (V) -- this gives the wrap direction for LiSPSM.
-        //
-        // If the light and view vector are parallel, this rotation becomes
-        // meaningless. Just use identity.
-        // (LdotV == (Mv*V).z, because L = {0,0,1} in light-space)
         mat4f L;
-        const float3 wsCameraFwd(camera.getForwardVector());
-        const float3 lsCameraFwd = mat4f::project(Mv, wsCameraFwd);
-        if (UTILS_LIKELY(std::abs(lsCameraFwd.z) < 0.9997f)) { // this is |dot(L, V)|
-            L[0].xyz = normalize(cross(lsCameraFwd, float3{ 0, 0, 1 }));
-            L[1].xyz = cross(float3{ 0, 0, 1 }, L[0].xyz);
-            L[2].xyz = { 0, 0, 1 };
-        }
-        L = transpose(L);
+        const mat4f Mv = computeLightView(dir, camera.getForwardVector(), &L);
 
         // lights space matrix used for finding the near and far planes
         const mat4f LMv(L * Mv);
@@ -257,12 +409,14 @@ void ShadowMap::computeShadowCameraDirectional(
         //
         //    If "depth clamp" is supported, we can further tighten the near plane to the
         //    shadow receiver.
+        //
+        //    The light space bounds of the casters and visible receivers are in the same space
+        //    as LMv, they tighten the planes given by the view volume.
 
         Aabb lsLightFrustum;
-        const float2 nearFar = computeNearFar(LMv, wsShadowCastersVolume);
         if (!USE_DEPTH_CLAMP) {
             // near plane from shadow caster volume
-            lsLightFrustum.max.z = nearFar[0];
+            lsLightFrustum.max.z = lsShadowCastersBounds.max.z;
         }
         for (size_t i = 0; i < vertexCount; ++i) {
             // far: figure out farthest shadow receivers
@@ -273,9 +427,29 @@ void ShadowMap::computeShadowCameraDirectional(
                 lsLightFrustum.max.z = std::max(lsLightFrustum.max.z, v.z);
             }
         }
+        // far: no farther than the farthest visible receiver
+        lsLightFrustum.min.z = std::max(lsLightFrustum.min.z, lsShadowReceiversBounds.min.z);
+        if (USE_DEPTH_CLAMP) {
+            lsLightFrustum.max.z = std::min(lsLightFrustum.max.z, lsShadowReceiversBounds.max.z);
+        }
         if (mEngine.debug.shadowmap.far_uses_shadowcasters) {
             // far: closest of the farthest shadow casters and receivers
-            lsLightFrustum.min.z = std::max(lsLightFrustum.min.z, nearFar[1]);
+            lsLightFrustum.min.z = std::max(lsLightFrustum.min.z, lsShadowCastersBounds.min.z);
+        }
+
+        if (UTILS_UNLIKELY(lsLightFrustum.min.z >= lsLightFrustum.max.z)) {
+            // the visible receivers are all in front of the casters
+            cascade.hasVisibleShadows = false;
+            return;
+        }
+
+        // The light space is the key of the cache of static casters (see setStaticCasters()), but
+        // the bounds above follow all the casters. Once a cascade caches its static casters, its
+        // bounds are rounded outwards, so that the other casters moving within them don't
+        // invalidate the cache every frame.
+        const bool quantizeBounds = mStaticCachingSupported && cascade.cache.signature;
+        if (quantizeBounds) {
+            quantizeLightFrustum(lsLightFrustum.min.z, lsLightFrustum.max.z);
         }
 
         // near / far planes are specified relative to the direction the eye is looking at
@@ -329,25 +503,42 @@ void ShadowMap::computeShadowCameraDirectional(
             lsLightFrustum.max.xy = max(lsLightFrustum.max.xy, v.xy);
         }
 
+        // Without warping, the xy of the light space bounds are the same as in WLMpMv (Mp
+        // only changes z), so the view volume can be tightened to the visible receivers.
+        if (!USE_LISPSM) {
+            lsLightFrustum.min.xy = max(lsLightFrustum.min.xy, lsShadowReceiversBounds.min.xy);
+            lsLightFrustum.max.xy = min(lsLightFrustum.max.xy, lsShadowReceiversBounds.max.xy);
+        }
+
         // For directional lights, we further constraint the light frustum to the
         // intersection of the shadow casters & receivers in light-space.
-        // However, since this relies on the 1-texel shadow map border, this wouldn't directly
-        // work if we were storing several shadow maps in a single texture.
-        if (mEngine.debug.shadowmap.focus_shadowcasters) {
-            intersectWithShadowCasters(lsLightFrustum, WLMpMv, wsShadowCastersVolume);
+        // However, since this relies on the 1-texel shadow map border, this doesn't directly
+        // work when several cascades are stored in a single texture.
+        if (mEngine.debug.shadowmap.focus_shadowcasters && mCascadeCount == 1) {
+            if (USE_LISPSM) {
+                intersectWithShadowCasters(lsLightFrustum, WLMpMv, wsShadowCastersVolume);
+            } else {
+                lsLightFrustum.min.xy = max(lsLightFrustum.min.xy, lsShadowCastersBounds.min.xy);
+                lsLightFrustum.max.xy = min(lsLightFrustum.max.xy, lsShadowCastersBounds.max.xy);
+            }
         }
 
         if (UTILS_UNLIKELY((lsLightFrustum.min.x >= lsLightFrustum.max.x) ||
                            (lsLightFrustum.min.y >= lsLightFrustum.max.y))) {
             // this could happen if the only thing visible is a perfectly horizontal or
             // vertical thin line
-            mHasVisibleShadows = false;
+            cascade.hasVisibleShadows = false;
             return;
         }
 
         assert(lsLightFrustum.min.x < lsLightFrustum.max.x);
         assert(lsLightFrustum.min.y < lsLightFrustum.max.y);
 
+        if (quantizeBounds) {
+            quantizeLightFrustum(lsLightFrustum.min.x, lsLightFrustum.max.x);
+            quantizeLightFrustum(lsLightFrustum.min.y, lsLightFrustum.max.y);
+        }
+
         // compute focus scale and offset
         float2 s = 2.0f / float2(lsLightFrustum.max.xy - lsLightFrustum.min.xy);
         float2 o =   -s * float2(lsLightFrustum.max.xy + lsLightFrustum.min.xy) * 0.5f;
@@ -372,18 +563,26 @@ void ShadowMap::computeShadowCameraDirectional(
         const mat4f S = F * WLMpMv;
 
         // Compute shadow-map texture access transform
-        const mat4f MbMt = getTextureCoordsMapping();
+        Viewport const& viewport = cascade.viewport;
+        const mat4f MbMt = getTextureCoordsMapping(viewport, mTextureDimension, mClipSpaceFlipped);
 
         // Final shadowmap texture transform
         const mat4f St = mat4f(MbMt * S);
 
-        mTexelSizeWs = texelSizeWorldSpace(St, float3{ 0.5f });
-        mLightSpace = St;
-        mSceneRange = (zfar - znear);
-        mCamera->setCustomProjection(mat4(S), znear, zfar);
-
-        // for the debug camera, we need to undo the world origin
-        mDebugCamera->setCustomProjection(mat4(S * camera.worldOrigin), znear, zfar);
+        // the size of the texel at the center of the cascade
+        const float3 str = {
+                (viewport.left + viewport.width * 0.5f) / mTextureDimension.x,
+                (viewport.bottom + viewport.height * 0.5f) / mTextureDimension.y,
+                0.5f };
+        cascade.texelSizeWs = texelSizeWorldSpace(St, str);
+        cascade.lightSpace = St;
+        cascade.sceneRange = (zfar - znear);
+        cascade.camera->setCustomProjection(mat4(S), znear, zfar);
+
+        if (c == 0) {
+            // for the debug camera, we need to undo the world origin
+            mDebugCamera->setCustomProjection(mat4(S * camera.worldOrigin), znear, zfar);
+        }
     }
 }
 
@@ -461,11 +660,12 @@ mat4f ShadowMap::applyLISPSM(CameraInfo const& camera, float dzn, float dzf, mat
 }
 
 
-mat4f ShadowMap::getTextureCoordsMapping() const noexcept {
+mat4f ShadowMap::getTextureCoordsMapping(Viewport const& viewport,
+        uint2 textureDimension, bool clipSpaceFlipped) noexcept {
     // Computes St the transform to use in the shader to access the shadow map texture
     // i.e. it transform a world-space vertex to a texture coordinate in the shadow-map
     // remapping from NDC to texture coordinates (i.e. [-1,1] -> [0, 1])
-    const mat4f Mt(mClipSpaceFlipped ? mat4f::row_major_init{
+    const mat4f Mt(clipSpaceFlipped ? mat4f::row_major_init{
             0.5f,   0,    0,  0.5f,
               0, -0.5f,   0,  0.5f,
               0,    0,  0.5f, 0.5f,
@@ -477,14 +677,15 @@ mat4f ShadowMap::getTextureCoordsMapping() const noexcept {
               0,    0,    0,    1
     });
 
-    // apply the 1-texel border viewport transform
-    const float o = 1.0f / mShadowMapDimension;
-    const float s = 1.0f - 2.0f * o;
+    // apply the viewport transform, i.e. the 1-texel border and the cascade's position in the
+    // texture
+    const float2 o = float2(viewport.left, viewport.bottom) / float2(textureDimension);
+    const float2 s = float2(viewport.width, viewport.height) / float2(textureDimension);
     const mat4f Mb(mat4f::row_major_init{
-             s, 0, 0, o,
-             0, s, 0, o,
-             0, 0, 1, 0,
-             0, 0, 0, 1
+             s.x,   0, 0, o.x,
+               0, s.y, 0, o.y,
+               0,   0, 1,   0,
+               0,   0, 0,   1
     });
 
     return Mb * Mt;
@@ -505,6 +706,35 @@ mat4f ShadowMap::warpFrustum(float n, float f) noexcept {
     return Wp;
 }
 
+mat4f ShadowMap::computeLightView(float3 const& dir, float3 const& wsCameraFwd,
+        mat4f* lightRotation) noexcept {
+    // the light's model matrix contains the light position and direction.
+    const mat4f M = mat4f::lookAt(float3{ 0, 0, 0 }, dir, float3{ 0, 1, 0 });
+    const mat4f Mv = FCamera::rigidTransformInverse(M);
+
+    // Orient the shadow map in the direction of the view vector by constructing a
+    // rotation matrix around the z-axis, that aligns the y-axis with the camera's
+    // forward vector (V) -- this gives the wrap direction for LiSPSM.
+    //
+    // If the light and view vector are parallel, this rotation becomes
+    // meaningless. Just use identity.
+    // (LdotV == (Mv*V).z, because L = {0,0,1} in light-space)
+    mat4f L;
+    const float3 lsCameraFwd = mat4f::project(Mv, wsCameraFwd);
+    if (UTILS_LIKELY(std::abs(lsCameraFwd.z) < 0.9997f)) { // this is |dot(L, V)|
+        L[0].xyz = normalize(cross(lsCameraFwd, float3{ 0, 0, 1 }));
+        L[1].xyz = cross(float3{ 0, 0, 1 }, L[0].xyz);
+        L[2].xyz = { 0, 0, 1 };
+    }
+    L = transpose(L);
+
+    if (lightRotation) {
+        *lightRotation = L;
+        return Mv;
+    }
+    return L * Mv;
+}
+
 float2 ShadowMap::computeNearFar(const mat4f& lightView,
         Aabb const& wsShadowCastersVolume) noexcept {
     float2 nearFar = { std::numeric_limits<float>::lowest(), std::numeric_limits<float>::max() };
@@ -704,6 +934,14 @@ void ShadowMap::snapLightFrustum(math::float2& s, math::float2& o,
     o = ceil(o * r) / r;
 }
 
+void ShadowMap::quantizeLightFrustum(float& min, float& max) noexcept {
+    // Round the bounds outwards to 1/8th of the next power of two of their extent: they only
+    // change when they cross a step, and grow by at most a quarter of their extent on each side.
+    const float step = std::exp2(std::ceil(std::log2(max - min))) * 0.125f;
+    min = std::floor(min / step) * step;
+    max = std::ceil(max / step) * step;
+}
+
 
 constexpr const ShadowMap::Segment ShadowMap::sBoxSegments[12];
 constexpr const ShadowMap::Quad ShadowMap::sBoxQuads[6];
@@ -806,8 +1044,9 @@ bool ShadowMap::intersectSegmentWithPlane(float3& UTILS_RESTRICT p,
 float ShadowMap::texelSizeWorldSpace(const math::mat4f& lightSpaceMatrix) const noexcept {
     // this version works only for orthographic projections
     const mat3f shadowmapToWorldMatrix(inverse(lightSpaceMatrix.upperLeft()));
-    const float3 texelSizeWs = shadowmapToWorldMatrix * float3{ 1, 1, 0 };
-    const float s = length(texelSizeWs) / mShadowMapDimension;
+    const float3 texelSizeWs = shadowmapToWorldMatrix *
+            float3{ 1.0f / float2(mTextureDimension), 0 };
+    const float s = length(texelSizeWs);
     return s;
 }
 
@@ -816,7 +1055,8 @@ float ShadowMap::texelSizeWorldSpace(const math::mat4f& lightSpaceMatrix, float3
     // therefore we need to specify which texel we want to back-project.
     const mat4f shadowmapToWorldMatrix(inverse(lightSpaceMatrix));
     const float3 p0 = mat4f::project(shadowmapToWorldMatrix, str);
-    const float3 p1 = mat4f::project(shadowmapToWorldMatrix, str + float3{ 1, 1, 0 } / mShadowMapDimension);
+    const float3 p1 = mat4f::project(shadowmapToWorldMatrix,
+            str + float3{ 1.0f / float2(mTextureDimension), 0 });
     const float s = length(p1 - p0);
     return s;
 }
@@ -29,6 +29,7 @@
 #include <filament/Exposure.h>
 
 #include <utils/Allocator.h>
+#include <utils/Hash.h>
 #include <utils/Systrace.h>
 #include <utils/Profiler.h>
 #include <utils/Slice.h>
@@ -46,18 +47,30 @@ using namespace driver;
 namespace details {
 
 // values of the 'VISIBLE_MASK' after culling (0: not visible)
-static constexpr size_t VISIBLE_RENDERABLE_BIT = 0u;
 static constexpr size_t VISIBLE_SHADOW_CASTER_BIT = 1u;
-static constexpr uint8_t VISIBLE_RENDERABLE = 1u << VISIBLE_RENDERABLE_BIT;
+static constexpr uint8_t VISIBLE_RENDERABLE = 1u << FView::VISIBLE_RENDERABLE_BIT;
 static constexpr uint8_t VISIBLE_SHADOW_CASTER = 1u << VISIBLE_SHADOW_CASTER_BIT;
 static constexpr uint8_t VISIBLE_ALL = VISIBLE_RENDERABLE | VISIBLE_SHADOW_CASTER;
+// shadow casters of each cascade, these are only set along with VISIBLE_SHADOW_CASTER
+static constexpr uint8_t VISIBLE_SHADOW_CASCADES =
+        ((1u << CONFIG_MAX_SHADOW_CASCADES) - 1u) << FView::VISIBLE_SHADOW_CASCADE_BIT;
+static_assert(FView::VISIBLE_SHADOW_CASCADE_BIT + CONFIG_MAX_SHADOW_CASCADES <=
+        FView::VISIBLE_STATIC_SHADOW_CASTER_BIT, "the cascades don't fit in the VISIBLE_MASK");
+static constexpr uint8_t VISIBLE_STATIC_SHADOW_CASTER = 1u << FView::VISIBLE_STATIC_SHADOW_CASTER_BIT;
+// shadow casters of any tile of the shadow atlas, also only set along with VISIBLE_SHADOW_CASTER
+static constexpr uint8_t VISIBLE_SHADOW_ATLAS = 1u << FView::VISIBLE_SHADOW_ATLAS_BIT;
+static_assert(CONFIG_MAX_SHADOW_ATLAS_TILES <= 32, "the tiles don't fit in the SHADOW_ATLAS_MASK");
+
+// maps any point to the center of the shadow map's near plane, which is never in shadow
+static const mat4f NEVER_IN_SHADOW{ float4{ 0 }, float4{ 0 }, float4{ 0 }, float4{ 0.5f, 0.5f, 0, 1 } };
 
 FView::FView(FEngine& engine)
     : mFroxelizer(engine),
       mPerViewUb(engine.getPerViewUib()),
       mPerViewSb(engine.getPerViewSib()),
       mClipSpace01(engine.getBackend() == Backend::VULKAN),
-      mDirectionalShadowMap(engine) {
+      mDirectionalShadowMap(engine),
+      mShadowAtlas(engine) {
     DriverApi& driverApi = engine.getDriverApi();
 
     mPerViewUbh = driverApi.createUniformBuffer(mPerViewUb.getSize());
@@ -85,7 +98,12 @@ void FView::terminate(FEngine& engine) {
     driverApi.destroyUniformBuffer(mPerViewUbh);
     driverApi.destroySamplerBuffer(mPerViewSbh);
     mDirectionalShadowMap.terminate(driverApi);
+    mShadowAtlas.terminate(driverApi);
     mFroxelizer.terminate(driverApi);
+    mColorPassInstanceBuffers.terminate(driverApi);
+    for (auto& instanceBuffers : mShadowPassInstanceBuffers) {
+        instanceBuffers.terminate(driverApi);
+    }
 }
 
 void FView::setViewport(Viewport const& viewport) noexcept {
@@ -140,6 +158,11 @@ void FView::setDynamicLightingOptions(float zLightNear, float zLightFar) noexcep
     mFroxelizer.setOptions(zLightNear, zLightFar);
 }
 
+void FView::setDynamicLightingBudget(DynamicLightingBudget const& budget) noexcept {
+    mDynamicLightingBudget = budget;
+    mFroxelizer.setBudget(budget);
+}
+
 
 math::float2 FView::updateScale(duration frameTime) noexcept {
     DynamicResolutionOptions const& options = mDynamicResolution;
@@ -257,7 +280,7 @@ bool FView::isSkyboxVisible() const noexcept {
 }
 
 void FView::prepareShadowing(FEngine& engine, driver::DriverApi& driver,
-        FScene::RenderableSoa& renderableData, FScene::LightSoa const& lightData) noexcept {
+        FScene::RenderableSoa& renderableData, FScene::LightSoa& lightData) noexcept {
     SYSTRACE_CALL();
 
     // setup shadow mapping
@@ -275,24 +298,72 @@ void FView::prepareShadowing(FEngine& engine, driver::DriverApi& driver,
         ShadowMap& shadowMap = mDirectionalShadowMap;
         shadowMap.update(lightData, 0, scene, mViewingCameraInfo, mVisibleLayers);
         if (shadowMap.hasVisibleShadows()) {
-            // Cull shadow casters
-            Frustum const& frustum = shadowMap.getCamera().getFrustum();
-            prepareVisibleShadowCasters(engine.getJobSystem(), renderableData, frustum);
-
             // allocates shadowmap driver resources
             shadowMap.prepare(driver, getUs());
 
-            mat4f const& lightFromWorldMatrix = shadowMap.getLightSpaceMatrix();
-            u.setUniform(offsetof(FEngine::PerViewUib, lightFromWorldMatrix), lightFromWorldMatrix);
-
-            // the 2x bias is needed in opengl because the depth maps to -1/1. It may not be
-            // needed with other APIs, but at least it won't worsen the acnee there.
-            const float sceneRange = shadowMap.getSceneRange();
-            const float texelSizeWorldSpace = shadowMap.getTexelSizeWorldSpace();
             const float constantBias = lcm.getShadowConstantBias(directionalLight);
             const float normalBias = lcm.getShadowNormalBias(directionalLight);
-            u.setUniform(offsetof(FEngine::PerViewUib, shadowBias),
-                    float3{ 2 * constantBias / sceneRange, normalBias * texelSizeWorldSpace, 0 });
+            float4 cascadeConstantBias = 0;
+            float4 cascadeNormalBias = 0;
+            for (size_t c = 0, n = shadowMap.getCascadeCount(); c < n; c++) {
+                if (!shadowMap.hasVisibleShadows(c)) {
+                    // nothing is rendered in this cascade this frame, the fragments that select
+                    // it mustn't use the previous frame's matrix
+                    u.setUniform(offsetof(FEngine::PerViewUib, lightFromWorldMatrix) +
+                            c * sizeof(mat4f), NEVER_IN_SHADOW);
+                    continue;
+                }
+
+                // Cull shadow casters, each cascade only renders the casters of its own slice.
+                // The cascades are culled one after the other because they write to different
+                // bits of the same bytes, but each culling runs on multiple threads.
+                Frustum const& frustum = shadowMap.getCamera(c).getFrustum();
+                prepareVisibleShadowCasters(engine.getJobSystem(), renderableData, frustum, c);
+
+                mat4f const& lightFromWorldMatrix = shadowMap.getLightSpaceMatrix(c);
+                u.setUniform(offsetof(FEngine::PerViewUib, lightFromWorldMatrix) +
+                        c * sizeof(mat4f), lightFromWorldMatrix);
+
+                // the 2x bias is needed in opengl because the depth maps to -1/1. It may not be
+                // needed with other APIs, but at least it won't worsen the acnee there.
+                const float sceneRange = shadowMap.getSceneRange(c);
+                const float texelSizeWorldSpace = shadowMap.getTexelSizeWorldSpace(c);
+                cascadeConstantBias[c] = 2 * constantBias / sceneRange;
+                cascadeNormalBias[c] = normalBias * texelSizeWorldSpace;
+            }
+            u.setUniform(offsetof(FEngine::PerViewUib, cascadeSplits),
+                    shadowMap.getCascadeSplits());
+            u.setUniform(offsetof(FEngine::PerViewUib, cascadeConstantBias), cascadeConstantBias);
+            u.setUniform(offsetof(FEngine::PerViewUib, cascadeNormalBias), cascadeNormalBias);
+        }
+    }
+
+    // setup the shadows of the spot and point lights
+    if (mShadowingEnabled) {
+        ShadowAtlas& shadowAtlas = mShadowAtlas;
+        shadowAtlas.update(lightData, mViewingCameraInfo, mCullingFrustum);
+        if (shadowAtlas.hasVisibleShadows()) {
+            const bool hasDirectionalShadows = this->hasDirectionalShadows();
+            shadowAtlas.prepare(driver, getUs(), !hasDirectionalShadows);
+            if (!hasDirectionalShadows) {
+                // All the fragments are past the last cascade, i.e. never in the shadow of the
+                // directional light. With a single cascade the splits aren't used, the matrices
+                // must not be left from a previous frame either.
+                u.setUniform(offsetof(FEngine::PerViewUib, cascadeSplits), float4{ 0 });
+                u.setUniform(offsetof(FEngine::PerViewUib, cascadeConstantBias), float4{ 0 });
+                u.setUniform(offsetof(FEngine::PerViewUib, cascadeNormalBias), float4{ 0 });
+                for (size_t c = 0; c < CONFIG_MAX_SHADOW_CASCADES; c++) {
+                    u.setUniform(offsetof(FEngine::PerViewUib, lightFromWorldMatrix) +
+                            c * sizeof(mat4f), NEVER_IN_SHADOW);
+                }
+            }
+
+            prepareShadowAtlasCasters(engine.getJobSystem(), renderableData);
+
+            for (size_t t = 0, n = shadowAtlas.getTileCount(); t < n; t++) {
+                u.setUniform(offsetof(FEngine::PerViewUib, atlasFromWorldMatrix) +
+                        t * sizeof(mat4f), shadowAtlas.getLightSpaceMatrix(t));
+            }
         }
     }
 }
@@ -305,9 +376,9 @@ void FView::prepareLighting(FEngine& engine, FEngine::DriverApi& driver, ArenaSc
     const CameraInfo& camera = mViewingCameraInfo;
     FScene* const scene = mScene;
 
-    scene->prepareLights(camera);
+    scene->prepareLights(camera, arena, mFroxelizer.getLightCountMax());
 
-    // here the array of visible lights has been shrunk to CONFIG_MAX_LIGHT_COUNT
+    // here the array of visible lights has been shrunk to the froxelizer's light budget
     auto const& lightData = scene->getLightData();
 
     // trace the number of visible lights
@@ -372,8 +443,10 @@ void FView::prepareLighting(FEngine& engine, FEngine::DriverApi& driver, ArenaSc
     // Dynamic lighting
     if (mHasDynamicLighting) {
         Froxelizer& froxelizer = mFroxelizer;
-        if (froxelizer.prepare(driver, arena, viewport, camera.projection, camera.zn, camera.zf)) {
+        if (froxelizer.prepare(driver, arena, viewport, camera.projection, camera.zn, camera.zf,
+                lightData.size() - FScene::DIRECTIONAL_LIGHTS_COUNT)) {
             froxelizer.updateUniforms(u); // update our uniform buffer if needed
+            froxelizer.updateSamplers(mPerViewSb);
         }
     }
 }
@@ -454,8 +527,9 @@ void FView::prepare(FEngine& engine, driver::DriverApi& driver, ArenaScope& aren
     prepareVisibleRenderables(js, renderableData);
 
     /*
-     * Shadowing: compute the shadow camera and cull shadow casters
-     * (this will set the VISIBLE_SHADOW_CASTER bit)
+     * Shadowing: compute the shadow cameras and cull shadow casters
+     * (this will set the bits of the shadow cascades, see VISIBLE_SHADOW_CASCADE_BIT, and of
+     * the shadow atlas, see VISIBLE_SHADOW_ATLAS_BIT)
      */
 
     prepareShadowing(engine, driver, renderableData, scene->getLightData());
@@ -489,6 +563,10 @@ void FView::prepare(FEngine& engine, driver::DriverApi& driver, ArenaScope& aren
     // update those UBOs
     scene->updateUBOs(merged);
 
+    if (hasDirectionalShadows()) {
+        prepareStaticShadowCasters(renderableData);
+    }
+
     /*
      * Light culling
      *
@@ -533,10 +611,16 @@ void FView::computeVisibilityMasks(
         Culler::result_type mask = visibleMask[i];
         FRenderableManager::Visibility v = visibility[i];
         bool inVisibleLayer = layers[i] & visibleLayers;
-        bool visRenderables   = (!v.culling || (mask & VISIBLE_RENDERABLE))    && inVisibleLayer;
-        bool visShadowCasters = (!v.culling || (mask & VISIBLE_SHADOW_CASTER)) && inVisibleLayer && v.castShadows;
+        Culler::result_type cascades = v.culling ? (mask & VISIBLE_SHADOW_CASCADES) : VISIBLE_SHADOW_CASCADES;
+        // the atlas bit already accounts for v.culling, see prepareShadowAtlasCasters()
+        Culler::result_type shadowMaps = cascades | (mask & VISIBLE_SHADOW_ATLAS);
+        bool visRenderables   = (!v.culling || (mask & VISIBLE_RENDERABLE)) && inVisibleLayer;
+        bool visShadowCasters = shadowMaps && inVisibleLayer && v.castShadows;
+        Culler::result_type casterBits = shadowMaps |
+                Culler::result_type(v.staticShadowCaster << FView::VISIBLE_STATIC_SHADOW_CASTER_BIT);
         visibleMask[i] = Culler::result_type(visRenderables) |
-                         Culler::result_type(visShadowCasters << 1);
+                         Culler::result_type(visShadowCasters << 1) |
+                         Culler::result_type(casterBits & -Culler::result_type(visShadowCasters));
     }
 }
 
@@ -545,8 +629,9 @@ UTILS_NOINLINE
         FScene::RenderableSoa::iterator begin,
         FScene::RenderableSoa::iterator end,
         uint8_t mask) noexcept {
+    // the cascades bits are ignored, they're only used by the shadow passes
     return std::partition(begin, end, [mask](auto it) {
-        return it.template get<FScene::VISIBLE_MASK>() == mask;
+        return (it.template get<FScene::VISIBLE_MASK>() & VISIBLE_ALL) == mask;
     });
 }
 
@@ -617,27 +702,122 @@ void FView::prepareVisibleRenderables(JobSystem& js,
         FScene::RenderableSoa& renderableData) const noexcept {
     SYSTRACE_CALL();
     if (UTILS_LIKELY(isCullingEnabled())) {
-        cullRenderables(js, renderableData, mCullingFrustum, VISIBLE_RENDERABLE_BIT);
+        cullRenderables(js, renderableData, mScene->getBvh(),
+                mCullingFrustum, VISIBLE_RENDERABLE_BIT);
     } else {
         std::fill(renderableData.begin<FScene::VISIBLE_MASK>(),
                   renderableData.end<FScene::VISIBLE_MASK>(), VISIBLE_RENDERABLE);
     }
 }
 
+void FView::prepareStaticShadowCasters(
+        FScene::RenderableSoa const& renderableData) const noexcept {
+    SYSTRACE_CALL();
+
+    // Identify the static casters of each cascade, so the shadow map knows when its cache is
+    // out of date. The signature of a cascade is the sum of the hashes of its static casters
+    // (so it doesn't depend on their order), which includes their world space AABB to detect
+    // when they move.
+    struct Key {
+        uint32_t instance;
+        float3 center;
+        float3 extent;
+    };
+    static_assert(sizeof(Key) == 7 * sizeof(uint32_t), "Key must not have padding");
+
+    uint64_t signatures[CONFIG_MAX_SHADOW_CASCADES] = {};
+    auto const* visibleMask = renderableData.data<FScene::VISIBLE_MASK>();
+    auto const* instances = renderableData.data<FScene::RENDERABLE_INSTANCE>();
+    auto const* worldAABBCenter = renderableData.data<FScene::WORLD_AABB_CENTER>();
+    auto const* worldAABBExtent = renderableData.data<FScene::WORLD_AABB_EXTENT>();
+    for (uint32_t i : mVisibleShadowCasters) {
+        const uint8_t mask = visibleMask[i];
+        if (mask & VISIBLE_STATIC_SHADOW_CASTER) {
+            const Key key = { instances[i].asValue(), worldAABBCenter[i], worldAABBExtent[i] };
+            const uint64_t h = uint64_t(hash::murmur3((uint32_t const*)&key, 7, 0)) + 1;
+            for (size_t c = 0; c < CONFIG_MAX_SHADOW_CASCADES; c++) {
+                signatures[c] += (mask & (1u << (VISIBLE_SHADOW_CASCADE_BIT + c))) ? h : 0;
+            }
+        }
+    }
+
+    ShadowMap& shadowMap = mDirectionalShadowMap;
+    for (size_t c = 0, n = shadowMap.getCascadeCount(); c < n; c++) {
+        shadowMap.setStaticCasters(c, signatures[c]);
+    }
+}
+
+UTILS_NOINLINE
+void FView::prepareShadowAtlasCasters(JobSystem& js,
+        FScene::RenderableSoa& renderableData) const noexcept {
+    SYSTRACE_CALL();
+
+    ShadowAtlas const& shadowAtlas = mShadowAtlas;
+    const size_t tileCount = shadowAtlas.getTileCount();
+    const uint32_t allTiles = uint32_t((uint64_t(1) << tileCount) - 1u);
+    float3 const* worldAABBCenter = renderableData.data<FScene::WORLD_AABB_CENTER>();
+    float3 const* worldAABBExtent = renderableData.data<FScene::WORLD_AABB_EXTENT>();
+    auto const* visibility        = renderableData.data<FScene::VISIBILITY_STATE>();
+    uint8_t     * visibleArray    = renderableData.data<FScene::VISIBLE_MASK>();
+    uint32_t    * atlasMaskArray  = renderableData.data<FScene::SHADOW_ATLAS_MASK>();
+
+    // There can be many more tiles than cascades, so unlike the cascades they're not culled one
+    // after the other: each job culls its renderables against all the tiles, a batch at a time
+    // so that the bounding boxes stay in the cache. Each tile has its own bit of the
+    // SHADOW_ATLAS_MASK, and VISIBLE_SHADOW_ATLAS is set when any of them is.
+    auto functor = [&shadowAtlas, tileCount, allTiles, worldAABBCenter, worldAABBExtent,
+            visibility, visibleArray, atlasMaskArray](uint32_t index, uint32_t c) {
+        constexpr uint32_t BATCH_SIZE = 64;
+        Culler::result_type results[BATCH_SIZE];
+        uint32_t atlasMasks[BATCH_SIZE];
+        for (uint32_t first = index, last = index + c; first < last; first += BATCH_SIZE) {
+            const uint32_t count = std::min(BATCH_SIZE, last - first);
+            // the culler processes multiples of Culler::MODULO, the SoA has room for it
+            const size_t culledCount = Culler::round(count);
+            std::fill_n(atlasMasks, count, 0u);
+            for (size_t t = 0; t < tileCount; t++) {
+                std::fill_n(results, culledCount, Culler::result_type(0));
+                Culler::intersects(results, shadowAtlas.getFrustum(t),
+                        worldAABBCenter + first, worldAABBExtent + first, culledCount, 0);
+                for (uint32_t i = 0; i < count; i++) {
+                    atlasMasks[i] |= uint32_t(results[i] & 1u) << t;
+                }
+            }
+            for (uint32_t i = 0; i < count; i++) {
+                const uint32_t atlasMask = visibility[first + i].culling ? atlasMasks[i] : allTiles;
+                atlasMaskArray[first + i] = atlasMask;
+                visibleArray[first + i] |= atlasMask ? VISIBLE_SHADOW_ATLAS : 0u;
+            }
+        }
+    };
+
+    auto job = jobs::parallel_for(js, nullptr, 0, (uint32_t)renderableData.size(),
+            std::ref(functor), jobs::CountSplitter<Culler::MODULO * Culler::MIN_LOOP_COUNT_HINT, 8>());
+    js.runAndWait(job);
+}
+
 UTILS_NOINLINE
 void FView::prepareVisibleShadowCasters(JobSystem& js,
-        FScene::RenderableSoa& renderableData, Frustum const& lightFrustum) const noexcept {
+        FScene::RenderableSoa& renderableData, Frustum const& lightFrustum,
+        size_t cascade) const noexcept {
     SYSTRACE_CALL();
-    cullRenderables(js, renderableData, lightFrustum, VISIBLE_SHADOW_CASTER_BIT);
+    cullRenderables(js, renderableData, mScene->getBvh(),
+            lightFrustum, VISIBLE_SHADOW_CASCADE_BIT + cascade);
 }
 
-void FView::cullRenderables(JobSystem& js,
-        FScene::RenderableSoa& renderableData, Frustum const& frustum, size_t bit) noexcept {
+void FView::cullRenderables(JobSystem& js, FScene::RenderableSoa& renderableData,
+        Bvh const* bvh, Frustum const& frustum, size_t bit) noexcept {
 
     float3 const* worldAABBCenter = renderableData.data<FScene::WORLD_AABB_CENTER>();
     float3 const* worldAABBExtent = renderableData.data<FScene::WORLD_AABB_EXTENT>();
     uint8_t     * visibleArray    = renderableData.data<FScene::VISIBLE_MASK>();
 
+    if (bvh) {
+        // large scenes: reject whole groups of renderables before testing each of them
+        bvh->cull(js, visibleArray, frustum, worldAABBCenter, worldAABBExtent, bit);
+        return;
+    }
+
     // culling job (this runs on multiple threads)
     auto functor = [&frustum, worldAABBCenter, worldAABBExtent, visibleArray, bit]
             (uint32_t index, uint32_t c) {
@@ -768,6 +948,14 @@ void View::setClearTargets(bool color, bool depth, bool stencil) noexcept {
     return upcast(this)->setClearTargets(color, depth, stencil);
 }
 
+void View::setAutomaticInstancingEnabled(bool enabled) noexcept {
+    upcast(this)->setAutomaticInstancingEnabled(enabled);
+}
+
+bool View::isAutomaticInstancingEnabled() const noexcept {
+    return upcast(this)->isAutomaticInstancingEnabled();
+}
+
 void View::setCulling(bool culling) noexcept {
     upcast(this)->setCulling(culling);
 }
@@ -840,5 +1028,13 @@ void View::setDynamicLightingOptions(float zLightNear, float zLightFar) noexcept
     upcast(this)->setDynamicLightingOptions(zLightNear, zLightFar);
 }
 
+void View::setDynamicLightingBudget(DynamicLightingBudget const& budget) noexcept {
+    upcast(this)->setDynamicLightingBudget(budget);
+}
+
+View::DynamicLightingBudget View::getDynamicLightingBudget() const noexcept {
+    return upcast(this)->getDynamicLightingBudget();
+}
+
 
 } // namespace filament
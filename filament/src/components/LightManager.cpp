@@ -155,6 +155,7 @@ void FLightManager::create(const FLightManager::Builder& builder, utils::Entity
     }
     Instance i = manager.addComponent(entity);
     assert(i);
+    mComponentGeneration++;
 
     if (i) {
         // This needs to happen before we call the set() methods below
@@ -171,6 +172,8 @@ void FLightManager::create(const FLightManager::Builder& builder, utils::Entity
         shadowParams.shadowFar = std::max(builder->mShadowOptions.shadowFar, 0.0f);
         shadowParams.shadowNearHint = std::max(builder->mShadowOptions.shadowNearHint, 0.0f);
         shadowParams.shadowFarHint = std::max(builder->mShadowOptions.shadowFarHint, 0.0f);
+        shadowParams.shadowCascades = uint8_t(clamp(size_t(builder->mShadowOptions.shadowCascades),
+                size_t(1), CONFIG_MAX_SHADOW_CASCADES));
 
         // set default values by calling the setters
         setLocalPosition(i, builder->mPosition);
@@ -196,6 +199,7 @@ void FLightManager::destroy(utils::Entity e) noexcept {
     if (i) {
         auto& manager = mManager;
         manager.removeComponent(e);
+        mComponentGeneration++;
     }
 }
 
@@ -60,7 +60,17 @@ public:
     void prepare(driver::DriverApi& driver) const noexcept;
 
     void gc(utils::EntityManager& em) noexcept {
+        const size_t count = mManager.getComponentCount();
         mManager.gc(em);
+        if (mManager.getComponentCount() != count) {
+            mComponentGeneration++;
+        }
+    }
+
+    // incremented each time instances are created or destroyed, i.e. when previously
+    // returned instances may have become invalid.
+    uint32_t getComponentGeneration() const noexcept {
+        return mComponentGeneration;
     }
 
     struct LightType {
@@ -84,6 +94,7 @@ public:
         float shadowFar;
         float shadowNearHint;
         float shadowFarHint;
+        uint8_t shadowCascades;
     };
 
     UTILS_NOINLINE void setLocalPosition(Instance i, const math::float3& position) noexcept;
@@ -154,6 +165,10 @@ public:
         return getShadowParams(i).shadowFar;
     }
 
+    constexpr size_t getShadowCascades(Instance i) const noexcept {
+        return getShadowParams(i).shadowCascades;
+    }
+
     constexpr const math::float3& getColor(Instance i) const noexcept {
         return mManager[i].color;
     }
@@ -269,6 +284,7 @@ private:
 
     Sim mManager;
     FEngine& mEngine;
+    uint32_t mComponentGeneration = 0;
 };
 
 FILAMENT_UPCAST(LightManager)
@@ -44,12 +44,16 @@ struct RenderableManager::BuilderDetails {
     bool mCulling : 1;
     bool mCastShadows : 1;
     bool mReceiveShadows : 1;
+    bool mStaticShadowCaster : 1;
     uint8_t mSkinningBoneCount = 0;
     Bone const* mBones = nullptr;
     math::mat4f const* mBoneMatrices = nullptr;
+    uint16_t mInstanceCount = 1;
+    math::mat4f const* mInstanceTransforms = nullptr;
 
     explicit BuilderDetails(size_t count)
-            : mEntriesCount(count), mCulling(true), mCastShadows(false), mReceiveShadows(true) {
+            : mEntriesCount(count), mCulling(true), mCastShadows(false), mReceiveShadows(true),
+              mStaticShadowCaster(false) {
     }
     // this is only needed for the explicit instantiation below
     BuilderDetails() = default;
@@ -133,6 +137,11 @@ RenderableManager::Builder& RenderableManager::Builder::receiveShadows(bool enab
     return *this;
 }
 
+RenderableManager::Builder& RenderableManager::Builder::staticShadowCaster(bool enable) noexcept {
+    mImpl->mStaticShadowCaster = enable;
+    return *this;
+}
+
 RenderableManager::Builder& RenderableManager::Builder::skinning(size_t boneCount) noexcept {
     mImpl->mSkinningBoneCount = (uint8_t)std::min(size_t(255), boneCount);
     return *this;
@@ -152,6 +161,18 @@ RenderableManager::Builder& RenderableManager::Builder::skinning(
     return *this;
 }
 
+RenderableManager::Builder& RenderableManager::Builder::instances(size_t instanceCount) noexcept {
+    mImpl->mInstanceCount = (uint16_t)std::max(size_t(1), std::min(CONFIG_MAX_INSTANCE_COUNT, instanceCount));
+    return *this;
+}
+
+RenderableManager::Builder& RenderableManager::Builder::instances(
+        size_t instanceCount, math::mat4f const* transforms) noexcept {
+    mImpl->mInstanceCount = (uint16_t)std::max(size_t(1), std::min(CONFIG_MAX_INSTANCE_COUNT, instanceCount));
+    mImpl->mInstanceTransforms = transforms;
+    return *this;
+}
+
 RenderableManager::Builder& RenderableManager::Builder::blendOrder(size_t index, uint16_t blendOrder) noexcept {
     if (index < mImpl->mEntriesCount) {
         mImpl->mEntries[index].blendOrder = blendOrder;
@@ -259,10 +280,17 @@ void FRenderableManager::create(
         if (bones && !builder->mSkinningBoneCount) {
             driver.destroyUniformBuffer(bones->handle);
         }
+        std::unique_ptr<Instances>& instances = manager[ci].instances;
+        if (instances && builder->mInstanceCount <= 1) {
+            driver.destroyUniformBuffer(instances->handle);
+            instances.reset();
+        }
     }
 
     ci = manager.addComponent(entity);
     assert(ci);
+    // even when reused, the instance's buffers may have changed
+    mComponentGeneration++;
 
     if (ci) {
         // create and initialize all needed RenderPrimitives
@@ -279,8 +307,10 @@ void FRenderableManager::create(
         setPriority(ci, builder->mPriority);
         setCastShadows(ci, builder->mCastShadows);
         setReceiveShadows(ci, builder->mReceiveShadows);
+        setStaticShadowCaster(ci, builder->mStaticShadowCaster);
         setCulling(ci, builder->mCulling);
         static_cast<Visibility&>(manager[ci].visibility).skinning = builder->mSkinningBoneCount > 0;
+        static_cast<Visibility&>(manager[ci].visibility).instancing = builder->mInstanceCount > 1;
 
         if (!canReuse) {
             getUniformBuffer(ci) = UniformBuffer(engine.getPerRenderableUib());
@@ -308,6 +338,24 @@ void FRenderableManager::create(
                 std::fill_n(out, bones->count, Bone{});
             }
         }
+        if (builder->mInstanceCount > 1) {
+            std::unique_ptr<Instances>& instances = manager[ci].instances;
+            if (!instances) {
+                instances.reset(new Instances);
+                instances->transforms = UniformBuffer(CONFIG_MAX_INSTANCE_COUNT * sizeof(mat4f));
+                instances->handle = driver.createUniformBuffer(
+                        CONFIG_MAX_INSTANCE_COUNT * sizeof(mat4f));
+            }
+            instances->count = builder->mInstanceCount;
+            if (builder->mInstanceTransforms) {
+                setInstanceTransforms(ci, builder->mInstanceTransforms, builder->mInstanceCount);
+            } else {
+                // initialize the instances to identity
+                mat4f* UTILS_RESTRICT out = (mat4f*)instances->transforms.invalidateUniforms(
+                        0, instances->count * sizeof(mat4f));
+                std::fill_n(out, instances->count, mat4f{});
+            }
+        }
     }
 }
 
@@ -317,6 +365,7 @@ void FRenderableManager::destroy(utils::Entity e) noexcept {
     if (ci) {
         destroyComponent(ci);
         mManager.removeComponent(e);
+        mComponentGeneration++;
     }
 }
 
@@ -352,6 +401,12 @@ void FRenderableManager::destroyComponent(Instance ci) noexcept {
     if (bones) {
         driver.destroyUniformBuffer(bones->handle);
     }
+
+    // destroy the instances structures if any
+    std::unique_ptr<Instances> const& instances = manager[ci].instances;
+    if (instances) {
+        driver.destroyUniformBuffer(instances->handle);
+    }
 }
 
 void FRenderableManager::destroyComponentPrimitives(
@@ -371,6 +426,7 @@ void FRenderableManager::prepare(
     UniformBuffer           const * const UTILS_RESTRICT uniforms = manager.raw_array<UNIFORMS>();
     Handle<HwUniformBuffer> const * const UTILS_RESTRICT ubhs     = manager.raw_array<UNIFORMS_HANDLE>();
     std::unique_ptr<Bones>  const * const UTILS_RESTRICT bones    = manager.raw_array<BONES>();
+    std::unique_ptr<Instances> const * const UTILS_RESTRICT instanceTransforms = manager.raw_array<INSTANCES>();
     for (uint32_t index : list) {
         size_t i = instances[index].asValue();
         assert(i);  // we should never get the null instance here
@@ -385,6 +441,13 @@ void FRenderableManager::prepare(
                 bones[i]->bones.clean();
             }
         }
+        if (UTILS_UNLIKELY(instanceTransforms[i])) {
+            if (instanceTransforms[i]->transforms.isDirty()) {
+                driver.updateUniformBuffer(instanceTransforms[i]->handle,
+                        UniformBuffer(instanceTransforms[i]->transforms));
+                instanceTransforms[i]->transforms.clean();
+            }
+        }
     }
 }
 
@@ -514,6 +577,21 @@ void FRenderableManager::setBones(Instance ci,
     }
 }
 
+void FRenderableManager::setInstanceTransforms(Instance ci,
+        math::mat4f const* UTILS_RESTRICT transforms, size_t count, size_t offset) noexcept {
+    if (ci) {
+        std::unique_ptr<Instances> const& instances = mManager[ci].instances;
+        if (instances) {
+            assert(offset + count <= instances->count);
+            count = std::min(count, instances->count - offset);
+            mat4f* UTILS_RESTRICT out = (mat4f*)instances->transforms.invalidateUniforms(
+                    offset * sizeof(mat4f),
+                    count * sizeof(mat4f));
+            std::copy_n(transforms, count, out);
+        }
+    }
+}
+
 } // namespace details
 
 
@@ -556,6 +634,10 @@ void RenderableManager::setReceiveShadows(Instance instance, bool enable) noexce
     upcast(this)->setReceiveShadows(instance, enable);
 }
 
+void RenderableManager::setStaticShadowCaster(Instance instance, bool enable) noexcept {
+    upcast(this)->setStaticShadowCaster(instance, enable);
+}
+
 bool RenderableManager::isShadowCaster(Instance instance) const noexcept {
     return upcast(this)->isShadowCaster(instance);
 }
@@ -564,6 +646,10 @@ bool RenderableManager::isShadowReceiver(Instance instance) const noexcept {
     return upcast(this)->isShadowReceiver(instance);
 }
 
+bool RenderableManager::isStaticShadowCaster(Instance instance) const noexcept {
+    return upcast(this)->isStaticShadowCaster(instance);
+}
+
 const Box& RenderableManager::getAxisAlignedBoundingBox(Instance instance) const noexcept {
     return upcast(this)->getAxisAlignedBoundingBox(instance);
 }
@@ -612,4 +698,13 @@ void RenderableManager::setBones(Instance instance,
     upcast(this)->setBones(instance, transforms, boneCount, offset);
 }
 
+void RenderableManager::setInstanceTransforms(Instance instance,
+        mat4f const* transforms, size_t count, size_t offset) noexcept {
+    upcast(this)->setInstanceTransforms(instance, transforms, count, offset);
+}
+
+size_t RenderableManager::getInstanceCount(Instance instance) const noexcept {
+    return upcast(this)->getInstanceCount(instance);
+}
+
 } // namespace filament
@@ -47,6 +47,8 @@ public:
         bool receiveShadows : 1;
         bool culling        : 1;
         bool skinning       : 1;
+        bool instancing     : 1;
+        bool staticShadowCaster : 1;
     };
 
     FRenderableManager(FEngine& engine) noexcept;
@@ -78,7 +80,34 @@ public:
             utils::Range<uint32_t> list) const noexcept;
 
     void gc(utils::EntityManager& em) noexcept {
+        const size_t count = mManager.getComponentCount();
         mManager.gc(em);
+        if (mManager.getComponentCount() != count) {
+            mComponentGeneration++;
+        }
+    }
+
+    utils::Entity getEntity(Instance instance) const noexcept {
+        return mManager.getEntity(instance);
+    }
+
+    /*
+     * Change tracking. The generation is incremented each time an instance's bounding box,
+     * layers or visibility is modified, and each modified instance records the generation it
+     * was last modified in. The component generation is incremented each time instances are
+     * created or destroyed, i.e. when previously returned instances may have become invalid.
+     */
+
+    uint32_t getGeneration() const noexcept {
+        return mGeneration;
+    }
+
+    uint32_t getGeneration(Instance instance) const noexcept {
+        return mManager[instance].generation;
+    }
+
+    uint32_t getComponentGeneration() const noexcept {
+        return mComponentGeneration;
     }
 
     utils::Slice<const UniformBuffer> getUniformBuffers() const noexcept {
@@ -101,14 +130,17 @@ public:
 
     inline void setLayerMask(Instance instance, uint8_t enable) noexcept;
     inline void setReceiveShadows(Instance instance, bool enable) noexcept;
+    inline void setStaticShadowCaster(Instance instance, bool enable) noexcept;
     inline void setCulling(Instance instance, bool enable) noexcept;
     inline void setUniformHandle(Instance instance, Handle<HwUniformBuffer> const& handle) noexcept;
     inline void setPrimitives(Instance instance, utils::Slice<FRenderPrimitive> const& primitives) noexcept;
     inline void setBones(Instance instance, Bone const* transforms, size_t boneCount, size_t offset = 0) noexcept;
     inline void setBones(Instance instance, math::mat4f const* transforms, size_t boneCount, size_t offset = 0) noexcept;
+    inline void setInstanceTransforms(Instance instance, math::mat4f const* transforms, size_t count, size_t offset = 0) noexcept;
 
 
     inline bool isShadowCaster(Instance instance) const noexcept;
+    inline bool isStaticShadowCaster(Instance instance) const noexcept;
     inline bool isShadowReceiver(Instance instance) const noexcept;
     inline bool isCullingEnabled(Instance instance) const noexcept;
 
@@ -123,6 +155,8 @@ public:
 
     inline Handle<HwUniformBuffer> getUbh(Instance instance) const noexcept;
     inline Handle<HwUniformBuffer> getBonesUbh(Instance instance) const noexcept;
+    inline Handle<HwUniformBuffer> getInstancesUbh(Instance instance) const noexcept;
+    inline uint16_t getInstanceCount(Instance instance) const noexcept;
 
 
     inline size_t getLevelCount(Instance instance) const noexcept { return 1; }
@@ -142,6 +176,7 @@ public:
 
 
 private:
+    inline void markModified(Instance instance) noexcept;
     void destroyComponent(Instance ci) noexcept;
     static void destroyComponentPrimitives(FEngine& engine,
             utils::Slice<FRenderPrimitive>& primitives) noexcept;
@@ -152,6 +187,12 @@ private:
         uint8_t count;
     };
 
+    struct Instances {
+        filament::Handle<HwUniformBuffer> handle;
+        UniformBuffer transforms;
+        uint16_t count;
+    };
+
     enum {
         AABB,               // user data
         LAYERS,             // user data
@@ -160,6 +201,8 @@ private:
         UNIFORMS,           // filament data, UBO data where world-transform is stored
         UNIFORMS_HANDLE,    // filament data, handle to the driver's UBO
         BONES,              // filament data, UBO storing a pointer to the bones information
+        INSTANCES,          // filament data, UBO storing the instances transforms
+        GENERATION,         // filament data, generation of the last change to the user data
     };
 
     using Base = utils::SingleInstanceComponentManager<
@@ -169,7 +212,9 @@ private:
             utils::Slice<FRenderPrimitive>,
             UniformBuffer,
             filament::Handle<HwUniformBuffer>,
-            std::unique_ptr<Bones>
+            std::unique_ptr<Bones>,
+            std::unique_ptr<Instances>,
+            uint32_t
     >;
 
     struct Sim : public Base {
@@ -191,6 +236,8 @@ private:
                 Field<UNIFORMS>         uniforms;
                 Field<UNIFORMS_HANDLE>  uniformsHandle;
                 Field<BONES>            bones;
+                Field<INSTANCES>        instances;
+                Field<GENERATION>       generation;
             };
         };
 
@@ -204,13 +251,20 @@ private:
 
     Sim mManager;
     FEngine& mEngine;
+    uint32_t mGeneration = 0;
+    uint32_t mComponentGeneration = 0;
 };
 
 FILAMENT_UPCAST(RenderableManager)
 
+void FRenderableManager::markModified(Instance instance) noexcept {
+    mManager[instance].generation = ++mGeneration;
+}
+
 void FRenderableManager::setAxisAlignedBoundingBox(Instance instance, const Box& aabb) noexcept {
     if (instance) {
         mManager[instance].aabb = aabb;
+        markModified(instance);
     }
 }
 
@@ -219,12 +273,14 @@ void FRenderableManager::setLayerMask(Instance instance,
     if (instance) {
         uint8_t& layers = mManager[instance].layers;
         layers = (layers & ~select) | (values & select);
+        markModified(instance);
     }
 }
 
 void FRenderableManager::setLayerMask(Instance instance, uint8_t layerMask) noexcept {
     if (instance) {
         mManager[instance].layers = layerMask;
+        markModified(instance);
     }
 }
 
@@ -232,6 +288,7 @@ void FRenderableManager::setPriority(Instance instance, uint8_t priority) noexce
     if (instance) {
         Visibility& visibility = mManager[instance].visibility;
         visibility.priority = priority;
+        markModified(instance);
     }
 }
 
@@ -239,6 +296,7 @@ void FRenderableManager::setCastShadows(Instance instance, bool enable) noexcept
     if (instance) {
         Visibility& visibility = mManager[instance].visibility;
         visibility.castShadows = enable;
+        markModified(instance);
     }
 }
 
@@ -246,6 +304,15 @@ void FRenderableManager::setReceiveShadows(Instance instance, bool enable) noexc
     if (instance) {
         Visibility& visibility = mManager[instance].visibility;
         visibility.receiveShadows = enable;
+        markModified(instance);
+    }
+}
+
+void FRenderableManager::setStaticShadowCaster(Instance instance, bool enable) noexcept {
+    if (instance) {
+        Visibility& visibility = mManager[instance].visibility;
+        visibility.staticShadowCaster = enable;
+        markModified(instance);
     }
 }
 
@@ -253,6 +320,7 @@ void FRenderableManager::setCulling(Instance instance, bool enable) noexcept {
     if (instance) {
         Visibility& visibility = mManager[instance].visibility;
         visibility.culling = enable;
+        markModified(instance);
     }
 }
 
@@ -260,6 +328,7 @@ void FRenderableManager::setUniformHandle(Instance instance,
         Handle<HwUniformBuffer> const& handle) noexcept {
     if (instance) {
         mManager[instance].uniformsHandle = handle;
+        markModified(instance);
     }
 }
 
@@ -283,6 +352,10 @@ bool FRenderableManager::isShadowReceiver(Instance instance) const noexcept {
     return getVisibility(instance).receiveShadows;
 }
 
+bool FRenderableManager::isStaticShadowCaster(Instance instance) const noexcept {
+    return getVisibility(instance).staticShadowCaster;
+}
+
 bool FRenderableManager::isCullingEnabled(Instance instance) const noexcept {
     return getVisibility(instance).culling;
 }
@@ -316,6 +389,16 @@ Handle<HwUniformBuffer> FRenderableManager::getBonesUbh(Instance instance) const
     return bones ? bones->handle : Handle<HwUniformBuffer>{};
 }
 
+Handle<HwUniformBuffer> FRenderableManager::getInstancesUbh(Instance instance) const noexcept {
+    std::unique_ptr<Instances> const& instances = mManager[instance].instances;
+    return instances ? instances->handle : Handle<HwUniformBuffer>{};
+}
+
+uint16_t FRenderableManager::getInstanceCount(Instance instance) const noexcept {
+    std::unique_ptr<Instances> const& instances = mManager[instance].instances;
+    return instances ? instances->count : uint16_t(1);
+}
+
 utils::Slice<FRenderPrimitive> const& FRenderableManager::getRenderPrimitives(
         Instance instance, uint8_t level) const noexcept {
     return mManager[instance].primitives;
@@ -16,13 +16,35 @@
 
 #include "components/TransformManager.h"
 
+#include <utils/JobSystem.h>
+
+#include <math/affine.h>
+
 using namespace utils;
 using namespace math;
 
 namespace filament {
 namespace details {
 
-FTransformManager::FTransformManager() noexcept = default;
+// minimum number of nodes in a level of the hierarchy to transform it in parallel
+static constexpr size_t PARALLEL_TRANSFORM_MIN_COUNT = 1024;
+
+// a * b, written with columns so that it's always vectorized
+static inline mat4f multiply(mat4f const& a, mat4f const& b) noexcept {
+    mat4f r;
+    for (size_t i = 0; i < 4; i++) {
+        r[i] = a[0] * b[i].x + a[1] * b[i].y + a[2] * b[i].z + a[3] * b[i].w;
+    }
+    return r;
+}
+
+// parent * local, local transforms are almost always affine
+static inline mat4f concat(mat4f const& parent, mat4f const& local) noexcept {
+    return UTILS_LIKELY(isAffine(local)) ? multiplyAffine(parent, local) : multiply(parent, local);
+}
+
+FTransformManager::FTransformManager(JobSystem* js) noexcept : mJobSystem(js) {
+}
 
 FTransformManager::~FTransformManager() noexcept = default;
 
@@ -44,6 +66,8 @@ void FTransformManager::create(Entity entity, Instance parent, const mat4f& loca
     Instance i = manager.addComponent(entity);
     assert(i);
     assert(i != parent);
+    mComponentGeneration++;
+    mLevelOrderDirty = true;
 
     if (i && i != parent) {
         manager[i].parent = 0;
@@ -64,6 +88,8 @@ void FTransformManager::setParent(Instance i, Instance parent) noexcept {
             // TODO: on debug builds, ensure that the new parent isn't one of our descendant
             removeNode(i);
             insertNode(i, parent);
+            mLevelOrderDirty = true;
+            mGeneration++;
             updateNodeTransform(i);
         }
     }
@@ -87,6 +113,8 @@ void FTransformManager::destroy(Entity e) noexcept {
 
         // 2) remove the component
         Instance moved = manager.removeComponent(e);
+        mComponentGeneration++;
+        mLevelOrderDirty = true;
 
         // 3) update the references to the entry now with Instance i
         if (moved != i) {
@@ -101,10 +129,35 @@ void FTransformManager::setTransform(Instance ci, const mat4f& model) noexcept {
         auto& manager = mManager;
         // store our local transform
         manager[ci].local = model;
+        mGeneration++;
         updateNodeTransform(ci);
     }
 }
 
+void FTransformManager::setTransforms(Instance const* instances, mat4f const* models,
+        size_t count) noexcept {
+    auto& manager = mManager;
+    auto& soa = manager.getSoA();
+    mat4f* const UTILS_RESTRICT local = soa.data<LOCAL>();
+    uint32_t* const UTILS_RESTRICT generations = soa.data<GENERATION>();
+
+    // store the local transforms and tag them with the new generation, which is how
+    // updateWorldTransforms() finds the subtrees to update
+    const uint32_t generation = ++mGeneration;
+    for (size_t j = 0; j < count; j++) {
+        const Instance ci = instances[j];
+        validateNode(ci);
+        if (ci) {
+            local[ci] = models[j];
+            generations[ci] = generation;
+        }
+    }
+
+    if (!mLocalTransformTransactionOpen) {
+        updateWorldTransforms(generation, false);
+    }
+}
+
 void FTransformManager::updateNodeTransform(Instance i) noexcept {
     validateNode(i);
     auto& manager = mManager;
@@ -129,12 +182,13 @@ void FTransformManager::updateNodeTransform(Instance i) noexcept {
     mat4f const& pt = manager.raw_array<WORLD>()[parent];
 
     // compute our world transform
-    manager[i].world = pt * static_cast<mat4f const&>(manager[i].local);
+    manager[i].world = concat(pt, manager[i].local);
+    manager[i].generation = mGeneration;
 
     // update our children's world transforms
     Instance child = manager[i].firstChild;
     if (UTILS_UNLIKELY(child)) { // assume we don't have a hierarchy in the common case
-        transformChildren(manager, child);
+        transformChildren(manager, child, mGeneration);
     }
 }
 
@@ -145,23 +199,86 @@ void FTransformManager::openLocalTransformTransaction() noexcept {
 void FTransformManager::commitLocalTransformTransaction() noexcept {
     if (mLocalTransformTransactionOpen) {
         mLocalTransformTransactionOpen = false;
-        auto& manager = mManager;
+        updateWorldTransforms(++mGeneration, true);
+    }
+}
+
+void FTransformManager::updateWorldTransforms(uint32_t generation, bool all) noexcept {
+    if (UTILS_UNLIKELY(mLevelOrderDirty)) {
+        updateLevelOrder();
+    }
+
+    // note: the world transform of instance 0 (i.e. no parent) is the identity
+    auto& soa = mManager.getSoA();
+    mat4f* const UTILS_RESTRICT world = soa.data<WORLD>();
+    mat4f const* const UTILS_RESTRICT local = soa.data<LOCAL>();
+    Instance const* const UTILS_RESTRICT parents = soa.data<PARENT>();
+    uint32_t* const UTILS_RESTRICT generations = soa.data<GENERATION>();
+    Instance const* const UTILS_RESTRICT order = mLevelOrder.data();
+
+    // unless all nodes are updated, a node is updated if it's tagged with the current
+    // generation or if its parent was updated (i.e. is tagged) in the previous level.
+    auto work = [world, local, parents, generations, order, generation, all]
+            (uint32_t start, uint32_t count) {
+        for (size_t j = start, e = start + count; j < e; j++) {
+            const Instance i = order[j];
+            const Instance parent = parents[i];
+            if (all || generations[i] == generation || generations[parent] == generation) {
+                world[i] = concat(world[parent], local[i]);
+                generations[i] = generation;
+            }
+        }
+    };
+
+    // the parents of a level are all in the previous level, so each level can be
+    // transformed in parallel once the previous one is done.
+    for (size_t level = 0, c = mLevelOffsets.size() - 1; level < c; level++) {
+        const uint32_t start = mLevelOffsets[level];
+        const uint32_t count = mLevelOffsets[level + 1] - start;
+        if (mJobSystem && count >= PARALLEL_TRANSFORM_MIN_COUNT) {
+            JobSystem& js = *mJobSystem;
+            auto job = jobs::parallel_for(js, nullptr, start, count, std::cref(work),
+                    jobs::CountSplitter<PARALLEL_TRANSFORM_MIN_COUNT / 2, 8>());
+            js.runAndWait(job);
+        } else {
+            work(start, count);
+        }
+    }
+}
 
-        // swapNode() below needs some temporary storage which we provide here
-        auto& soa = manager.getSoA();
-        soa.ensureCapacity(soa.size() + 1);
+void FTransformManager::updateLevelOrder() noexcept {
+    auto& manager = mManager;
+    std::vector<Instance>& order = mLevelOrder;
+    std::vector<uint32_t>& offsets = mLevelOffsets;
+    order.clear();
+    offsets.clear();
+    order.reserve(manager.getComponentCount());
+
+    // the first level is made of the nodes without parent
+    for (Instance i = manager.begin(), e = manager.end(); i != e; ++i) {
+        Instance parent = manager[i].parent;
+        if (!parent) {
+            order.push_back(i);
+        }
+    }
 
-        mat4f const* const UTILS_RESTRICT world = manager.raw_array<WORLD>();
-        for (Instance i = manager.begin(), e = manager.end(); i != e; ++i) {
-            // Ensure that children are always sorted after their parent.
-            if (UTILS_UNLIKELY(Instance(manager[i].parent) > i)) {
-                swapNode(i, manager[i].parent);
+    // each following level is made of the children of the previous one
+    size_t start = 0;
+    while (start != order.size()) {
+        offsets.push_back(uint32_t(start));
+        const size_t end = order.size();
+        for (size_t j = start; j < end; j++) {
+            for (Instance child = manager[order[j]].firstChild; child;
+                    child = manager[child].next) {
+                order.push_back(child);
             }
-            Instance parent = manager[i].parent;
-            assert(parent < i);
-            manager[i].world = world[parent] * static_cast<mat4f const&>(manager[i].local);
         }
+        start = end;
     }
+    offsets.push_back(uint32_t(order.size()));
+    assert(order.size() == manager.getComponentCount());
+
+    mLevelOrderDirty = false;
 }
 
 // Inserts a parentless node in the hierarchy
@@ -188,44 +305,6 @@ void FTransformManager::insertNode(Instance i, Instance parent) noexcept {
     validateNode(parent);
 }
 
-void FTransformManager::swapNode(Instance i, Instance j) noexcept {
-    validateNode(i);
-    validateNode(j);
-
-    auto& manager = mManager;
-
-    // swap the content of the nodes directly
-    std::swap(manager.elementAt<LOCAL>(i), manager.elementAt<LOCAL>(j));
-    std::swap(manager.elementAt<WORLD>(i), manager.elementAt<WORLD>(j));
-    manager.swap(i, j); // this swaps the data relative to SingleInstanceComponentManager
-
-    // now swap the linked-list references, to do that correctly we must use a temporary
-    // node to fix-up the linked-list pointers
-    // Here we are guaranteed to have enough capacity for our temporary storage, so we
-    // can safely use the item just past the end of the array.
-    assert(manager.getSoA().capacity() >= manager.getSoA().size() + 1);
-
-    const Instance t = manager.end();
-
-    manager[t].parent       = manager[i].parent;
-    manager[t].firstChild   = manager[i].firstChild;
-    manager[t].next         = manager[i].next;
-    manager[t].prev         = manager[i].prev;
-    updateNode(t);
-
-    manager[i].parent       = manager[j].parent;
-    manager[i].firstChild   = manager[j].firstChild;
-    manager[i].next         = manager[j].next;
-    manager[i].prev         = manager[j].prev;
-    updateNode(i);
-
-    manager[j].parent       = manager[t].parent;
-    manager[j].firstChild   = manager[t].firstChild;
-    manager[j].next         = manager[t].next;
-    manager[j].prev         = manager[t].prev;
-    updateNode(j);
-}
-
 // removes an node from the graph, but doesn't removes it or its children from the array
 // (making everybody orphaned).
 void FTransformManager::removeNode(Instance i) noexcept {
@@ -283,18 +362,20 @@ void FTransformManager::updateNode(Instance i) noexcept {
     validateNode(next);
 }
 
-void FTransformManager::transformChildren(Sim& manager, Instance ci) noexcept {
+void FTransformManager::transformChildren(Sim& manager, Instance ci,
+        uint32_t generation) noexcept {
     while (ci) {
         // update child's world transform
         Instance parent = manager[ci].parent;
         mat4f const& pt = manager[parent].world;
         mat4f const& local = manager[ci].local;
-        manager[ci].world = pt * local;
+        manager[ci].world = concat(pt, local);
+        manager[ci].generation = generation;
 
         // assume we don't have a deep hierarchy
         Instance child = manager[ci].firstChild;
         if (UTILS_UNLIKELY(child)) {
-            transformChildren(manager, child);
+            transformChildren(manager, child, generation);
         }
 
         // process our next child
@@ -380,6 +461,11 @@ void TransformManager::setTransform(Instance ci, const mat4f& model) noexcept {
     upcast(this)->setTransform(ci, model);
 }
 
+void TransformManager::setTransforms(Instance const* instances, const mat4f* models,
+        size_t count) noexcept {
+    upcast(this)->setTransforms(instances, models, count);
+}
+
 const mat4f& TransformManager::getTransform(Instance ci) const noexcept {
     return upcast(this)->getTransform(ci);
 }
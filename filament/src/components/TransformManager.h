@@ -28,6 +28,12 @@
 
 #include <math/mat4.h>
 
+#include <vector>
+
+namespace utils {
+class JobSystem;
+} // namespace utils
+
 namespace filament {
 namespace details {
 
@@ -35,7 +41,8 @@ class UTILS_PRIVATE FTransformManager : public TransformManager {
 public:
     using Instance = TransformManager::Instance;
 
-    FTransformManager() noexcept;
+    // the job system is used to update large hierarchies in parallel, it can be null
+    explicit FTransformManager(utils::JobSystem* js = nullptr) noexcept;
     ~FTransformManager() noexcept;
 
     // free-up all resources
@@ -74,6 +81,9 @@ public:
 
     void setTransform(Instance ci, const math::mat4f& model) noexcept;
 
+    void setTransforms(Instance const* instances, const math::mat4f* models,
+            size_t count) noexcept;
+
     const math::mat4f& getTransform(Instance ci) const noexcept {
         return mManager[ci].local;
     }
@@ -82,6 +92,25 @@ public:
         return mManager[ci].world;
     }
 
+    /*
+     * Change tracking. The generation is incremented each time world transforms are
+     * modified, and each modified instance records the generation it was last modified in.
+     * The component generation is incremented each time instances are created, destroyed or
+     * moved, i.e. when previously returned instances may have become invalid.
+     */
+
+    uint32_t getGeneration() const noexcept {
+        return mGeneration;
+    }
+
+    uint32_t getGeneration(Instance ci) const noexcept {
+        return mManager[ci].generation;
+    }
+
+    uint32_t getComponentGeneration() const noexcept {
+        return mComponentGeneration;
+    }
+
 private:
     struct Sim;
 
@@ -90,8 +119,10 @@ private:
     void updateNode(Instance i) noexcept;
     void updateNodeTransform(Instance i) noexcept;
     void insertNode(Instance i, Instance p) noexcept;
-    void swapNode(Instance i, Instance j) noexcept;
-    static void transformChildren(Sim& manager, Instance firstChild) noexcept;
+    void updateLevelOrder() noexcept;
+    void updateWorldTransforms(uint32_t generation, bool all) noexcept;
+    static void transformChildren(Sim& manager, Instance firstChild,
+            uint32_t generation) noexcept;
 
 
     enum {
@@ -101,6 +132,7 @@ private:
         FIRST_CHILD,    // instance to our first child
         NEXT,           // instance to our next sibling
         PREV,           // instance to our previous sibling
+        GENERATION,     // generation of the last change to the world transform
     };
 
     using Base = utils::SingleInstanceComponentManager<
@@ -109,7 +141,8 @@ private:
             Instance,
             Instance,
             Instance,
-            Instance
+            Instance,
+            uint32_t
     >;
 
     struct Sim : public Base {
@@ -132,6 +165,7 @@ private:
                 Field<FIRST_CHILD>  firstChild;
                 Field<NEXT>         next;
                 Field<PREV>         prev;
+                Field<GENERATION>   generation;
             };
         };
 
@@ -144,6 +178,17 @@ private:
     };
 
     Sim mManager;
+
+    // All the instances sorted by depth in the hierarchy, mLevelOffsets[d] is the index of the
+    // first instance of depth d, the last entry is the instance count. This is rebuilt when
+    // the hierarchy changes, and allows each level to be transformed in parallel.
+    std::vector<Instance> mLevelOrder;
+    std::vector<uint32_t> mLevelOffsets;
+    bool mLevelOrderDirty = true;
+
+    utils::JobSystem* const mJobSystem;
+    uint32_t mGeneration = 0;
+    uint32_t mComponentGeneration = 0;
     bool mLocalTransformTransactionOpen = false;
 };
 
@@ -32,6 +32,8 @@ static constexpr size_t CONFIG_PER_FRAME_COMMANDS_SIZE = 1 * 1024 * 1024;
 // size of a command-stream buffer (comes from mmap -- not the per-engine arena)
 static constexpr size_t CONFIG_MIN_COMMAND_BUFFERS_SIZE = 1 * 1024 * 1024;
 static constexpr size_t CONFIG_COMMAND_BUFFERS_SIZE     = 3 * CONFIG_MIN_COMMAND_BUFFERS_SIZE;
+// the command-stream buffer grows up to this size when a frame needs more than the minimum
+static constexpr size_t CONFIG_MAX_COMMAND_BUFFERS_SIZE = 8 * CONFIG_COMMAND_BUFFERS_SIZE;
 
 #ifndef NDEBUG
 
@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef TNT_FILAMENT_DETAILS_BVH_H
+#define TNT_FILAMENT_DETAILS_BVH_H
+
+#include "details/Culler.h"
+
+#include <filament/Frustum.h>
+#include <filament/RenderableManager.h>
+
+#include <utils/compiler.h>
+
+#include <math/vec3.h>
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+namespace utils {
+class JobSystem;
+} // namespace utils
+
+namespace filament {
+namespace details {
+
+/*
+ * A bounding volume hierarchy of the renderables' world-space AABBs, used to reject whole
+ * groups of renderables during culling.
+ *
+ * The AABBs are stored in arrays owned by the caller (i.e. the scene's SoA), which can
+ * be reordered between frames. For this reason the hierarchy refers to renderables by their
+ * Instance, and setIndex() must be called with their current position in the arrays.
+ *
+ * The hierarchy is built once and refitted when renderables move, refitting doesn't change
+ * its topology, so its quality degrades over time, see needsRebuild().
+ */
+class UTILS_PRIVATE Bvh {
+public:
+    using Instance = RenderableManager::Instance;
+
+    // maximum number of renderables per leaf, must be a multiple of Culler::MODULO
+    static constexpr size_t LEAF_SIZE = 32;
+
+    Bvh() noexcept;
+    ~Bvh() noexcept;
+
+    bool empty() const noexcept { return mNodes.empty(); }
+
+    void clear() noexcept;
+
+    // builds the hierarchy of the 'count' AABBs, instances[i] is the renderable at index i
+    void build(Instance const* instances,
+            math::float3 const* centers, math::float3 const* extents, size_t count);
+
+    // records that the renderable is now at the given index. This is thread-safe as long as
+    // each renderable is only updated by a single thread.
+    void setIndex(Instance instance, uint32_t index) noexcept {
+        mIndices[instance] = index;
+    }
+
+    // marks the renderable's AABB as modified. This is thread-safe.
+    void invalidate(Instance instance) noexcept {
+        mDirty[mLeaves[instance]].store(true, std::memory_order_relaxed);
+    }
+
+    // updates the bounds of the modified leaves and of all the nodes above them
+    void refit(math::float3 const* centers, math::float3 const* extents) noexcept;
+
+    // whether the renderables moved enough since build() to warrant a new build()
+    bool needsRebuild() const noexcept { return mRefitLeafCount > mLeafCount; }
+
+    // Same as Culler::intersects(), but whole subtrees outside (or inside) the frustum are
+    // rejected (or accepted) without testing each of their AABBs.
+    void cull(utils::JobSystem& js, Culler::result_type* results, Frustum const& frustum,
+            math::float3 const* centers, math::float3 const* extents, size_t bit) const noexcept;
+
+private:
+    struct Node {
+        math::float3 min;
+        uint32_t first;         // first item of this subtree
+        math::float3 max;
+        uint32_t count;         // number of items in this subtree
+        uint32_t right;         // right child (left child is the next node), 0 for leaves
+    };
+
+    enum class Classification : uint8_t { OUTSIDE, INTERSECTS, INSIDE };
+
+    uint32_t buildNode(uint32_t* order, math::float3 const* centers,
+            math::float3 const* extents, uint32_t first, uint32_t count);
+    void computeLeafBounds(Node& node,
+            math::float3 const* centers, math::float3 const* extents) const noexcept;
+    static Classification classify(Node const& node, math::float4 const* planes) noexcept;
+    void cullLeaf(uint32_t node, Culler::result_type* results, Frustum const& frustum,
+            math::float3 const* centers, math::float3 const* extents, size_t bit) const noexcept;
+    void accept(Node const& node, Culler::result_type* results, size_t bit) const noexcept;
+
+    std::vector<Node> mNodes;                   // depth-first, children after their parent
+    std::vector<Instance> mItems;               // renderables, ordered by leaves
+    std::vector<uint32_t> mIndices;             // renderable to its index in the AABB arrays
+    std::vector<uint32_t> mLeaves;              // renderable to the node of its leaf
+    std::unique_ptr<std::atomic<bool>[]> mDirty;  // node to whether it must be refitted
+    size_t mLeafCount = 0;
+    size_t mRefitLeafCount = 0;
+};
+
+} // namespace details
+} // namespace filament
+
+#endif // TNT_FILAMENT_DETAILS_BVH_H
@@ -82,16 +82,29 @@ public:
 
 
     struct UTILS_PUBLIC Test {
+        // implementations of the culling loops, DEFAULT is the best one supported
+        enum class Kernel : uint8_t {
+            DEFAULT,
+            GENERIC,    // relies on the compiler's auto-vectorization
+            SSE41,
+            AVX2,
+            NEON
+        };
+
+        static bool isSupported(Kernel kernel) noexcept;
+
         static void intersects(result_type* results,
                 Frustum const& frustum,
                 math::float3 const* c,
                 math::float3 const* e,
-                size_t count) noexcept;
+                size_t count,
+                Kernel kernel = Kernel::DEFAULT) noexcept;
 
         static void intersects(result_type* results,
                 Frustum const& frustum,
                 math::float4 const* b,
-                size_t count) noexcept;
+                size_t count,
+                Kernel kernel = Kernel::DEFAULT) noexcept;
     };
 };
 
@@ -18,6 +18,7 @@
 #define TNT_FILAMENT_DETAILS_ENGINE_H
 
 #include "upcast.h"
+#include "MaterialCompiler.h"
 #include "PostProcessManager.h"
 #include "RenderTargetPool.h"
 
@@ -37,6 +38,7 @@
 #include "driver/DriverApi.h"
 
 #include <filament/Engine.h>
+#include <filament/EngineEnums.h>
 #include <filament/VertexBuffer.h>
 #include <filament/IndirectLight.h>
 #include <filament/Material.h>
@@ -102,11 +104,13 @@ public:
     static constexpr float  CONFIG_Z_LIGHT_FAR             = 100;
     static constexpr size_t CONFIG_FROXEL_SLICE_COUNT      = 16;
     static constexpr bool   CONFIG_IBL_USE_IRRADIANCE_MAP  = false;
+    static constexpr size_t CONFIG_MATERIAL_COMPILER_THREAD_COUNT = 2;
 
     static constexpr size_t CONFIG_PER_RENDER_PASS_ARENA_SIZE   = details::CONFIG_PER_RENDER_PASS_ARENA_SIZE;
     static constexpr size_t CONFIG_PER_FRAME_COMMANDS_SIZE      = details::CONFIG_PER_FRAME_COMMANDS_SIZE;
     static constexpr size_t CONFIG_MIN_COMMAND_BUFFERS_SIZE     = details::CONFIG_MIN_COMMAND_BUFFERS_SIZE;
     static constexpr size_t CONFIG_COMMAND_BUFFERS_SIZE         = details::CONFIG_COMMAND_BUFFERS_SIZE;
+    static constexpr size_t CONFIG_MAX_COMMAND_BUFFERS_SIZE     = details::CONFIG_MAX_COMMAND_BUFFERS_SIZE;
 
     struct PerViewUib {
         static UniformInterfaceBlock getUib() noexcept;
@@ -117,7 +121,8 @@ public:
         math::mat4f clipFromViewMatrix;
         math::mat4f viewFromClipMatrix;
         math::mat4f clipFromWorldMatrix;
-        math::mat4f lightFromWorldMatrix;
+        math::mat4f lightFromWorldMatrix[CONFIG_MAX_SHADOW_CASCADES];
+        math::mat4f atlasFromWorldMatrix[CONFIG_MAX_SHADOW_ATLAS_TILES]; // spot and point lights
 
         math::float4 resolution; // width, height, 1/width, 1/height
 
@@ -131,9 +136,13 @@ public:
         math::float3 lightDirection;
         float padding1;
 
-        math::float3 shadowBias; // constant bias, normal bias, unused
+        math::float3 padding2;
         float oneOverFroxelDimensionY;
 
+        math::float4 cascadeSplits;         // view space depth of the far end of each cascade
+        math::float4 cascadeConstantBias;   // constant bias of each cascade, in light space
+        math::float4 cascadeNormalBias;     // normal bias of each cascade, in world space
+
         math::float4 zParams; // froxel Z parameters
 
         math::uint2 fParams; // froxelCountX, froxelCountX * froxelCountY
@@ -165,11 +174,12 @@ public:
         static SamplerInterfaceBlock getSib() noexcept;
         // indices of each samplers in this SamplerInterfaceBlock (see: getSib())
         static constexpr size_t SHADOW_MAP     = 0;
-        static constexpr size_t RECORDS        = 1;
-        static constexpr size_t FROXELS        = 2;
-        static constexpr size_t IBL_DFG_LUT    = 3;
-        static constexpr size_t IBL_SPECULAR   = 4;
-        static constexpr size_t IBL_IRRADIANCE = 5;
+        static constexpr size_t SHADOW_ATLAS   = 1;
+        static constexpr size_t RECORDS        = 2;
+        static constexpr size_t FROXELS        = 3;
+        static constexpr size_t IBL_DFG_LUT    = 4;
+        static constexpr size_t IBL_SPECULAR   = 5;
+        static constexpr size_t IBL_IRRADIANCE = 6;
     };
 
     struct PostProcessSib {
@@ -180,7 +190,8 @@ public:
 
 public:
     static FEngine* create(Backend backend = Backend::DEFAULT,
-            ExternalContext* externalContext = nullptr, void* sharedGLContext = nullptr);
+            ExternalContext* externalContext = nullptr, void* sharedGLContext = nullptr,
+            BlobCache* blobCache = nullptr);
 
     ~FEngine() noexcept;
 
@@ -281,10 +292,18 @@ public:
 
     void* streamAlloc(size_t size, size_t alignment) noexcept;
 
+    CommandBufferStats getCommandBufferStats() const noexcept;
+    DriverObjectStats getDriverObjectStats() const noexcept;
+
     utils::JobSystem& getJobSystem() noexcept { return mJobSystem; }
 
+    MaterialCompiler& getMaterialCompiler() noexcept { return mMaterialCompiler; }
+
     Epoch getEpoch() const { return mEpoch; }
 
+    // incremented by prepare(), i.e. once per Renderer frame
+    uint32_t getFrameId() const noexcept { return mFrameId; }
+
     void shutdown();
 
     template <typename T>
@@ -344,7 +363,8 @@ public:
     }
 
 private:
-    FEngine(Backend backend, ExternalContext* externalContext, void* sharedGLContext);
+    FEngine(Backend backend, ExternalContext* externalContext, void* sharedGLContext,
+            BlobCache* blobCache);
     void init();
 
     int loop();
@@ -364,6 +384,7 @@ private:
     Backend mBackend;
     ExternalContext* mExternalContext = nullptr;
     void* mSharedGLContext = nullptr;
+    BlobCache* mBlobCache = nullptr;
     bool mTerminated = false;
     Handle<HwRenderPrimitive> mFullScreenTriangleRph;
     FVertexBuffer* mFullScreenTriangleVb = nullptr;
@@ -393,6 +414,8 @@ private:
 
     mutable uint32_t mMaterialId = 0;
 
+    uint32_t mFrameId = 0;
+
     // FMaterialInstance are handled directly by FMaterial
     std::unordered_map<const FMaterial*, ResourceList<FMaterialInstance>> mMaterialInstances;
 
@@ -419,6 +442,7 @@ private:
     HeapAllocatorArena mHeapAllocator;
 
     utils::JobSystem mJobSystem;
+    MaterialCompiler mMaterialCompiler{ CONFIG_MATERIAL_COMPILER_THREAD_COUNT };
 
     Epoch mEpoch;
 
@@ -23,8 +23,10 @@
 
 #include "driver/Handle.h"
 #include "driver/GPUBuffer.h"
+#include "driver/SamplerBuffer.h"
 #include "driver/UniformBuffer.h"
 
+#include <filament/View.h>
 #include <filament/Viewport.h>
 
 #include <utils/compiler.h>
@@ -88,6 +90,12 @@ public:
 
     void setOptions(float zLightNear, float zLightFar) noexcept;
 
+    // sets the budget of froxels, records and lights, see View::DynamicLightingBudget
+    void setBudget(View::DynamicLightingBudget const& budget) noexcept;
+
+    // maximum number of point and spot lights that can be froxelized
+    size_t getLightCountMax() const noexcept { return mLightCountMax; }
+
     /*
      * Allocate per-frame data structures for froxelization.
      *
@@ -97,11 +105,13 @@ public:
      * projection        camera projection matrix
      * projectionNear    near plane
      * projectionFar     far plane
+     * lightCount        number of point and spot lights, at most getLightCountMax()
      *
-     * return true if updateUniforms() needs to be called
+     * return true if updateUniforms() and updateSamplers() need to be called
      */
     bool prepare(driver::DriverApi& driverApi, ArenaScope& arena, Viewport const& viewport,
-            const math::mat4f& projection, float projectionNear, float projectionFar) noexcept;
+            const math::mat4f& projection, float projectionNear, float projectionFar,
+            size_t lightCount) noexcept;
 
     Froxel getFroxelAt(size_t x, size_t y, size_t z) const noexcept;
     size_t getFroxelCountX() const noexcept { return mFroxelCountX; }
@@ -119,6 +129,12 @@ public:
         u.setUniform(offsetof(FEngine::PerViewUib, oneOverFroxelDimensionY), mOneOverDimension.y);
     }
 
+    void updateSamplers(SamplerBuffer& sb) const noexcept {
+        // our buffers are re-created when the budget changes
+        sb.setBuffer(FEngine::PerViewSib::RECORDS, mRecordsBuffer);
+        sb.setBuffer(FEngine::PerViewSib::FROXELS, mFroxelBuffer);
+    }
+
     // send froxel data to GPU
     void commit(driver::DriverApi& driverApi);
 
@@ -169,7 +185,8 @@ private:
 
     void setViewport(Viewport const& viewport) noexcept;
     void setProjection(const math::mat4f& projection, float near, float far) noexcept;
-    bool update() noexcept;
+    bool update(driver::DriverApi& driverApi) noexcept;
+    void createBuffers(driver::DriverApi& driverApi) noexcept;
 
     void froxelizeLoop(FEngine& engine, utils::Slice<uint16_t>& froxelsList,
             utils::Slice<FroxelRunEntry> froxelsListIndices, const math::mat4f& viewMatrix,
@@ -179,7 +196,7 @@ private:
             utils::GrowingSlice<uint16_t>& froxels,
             math::mat4f const& projection, const LightParams& light) const noexcept;
 
-    void froxelizeAssignRecordsCompress(
+    void froxelizeAssignRecordsCompress(utils::JobSystem& js,
             const utils::Slice<uint16_t>& froxelsList,
             const utils::Slice<FroxelRunEntry>& froxelsListIndices) noexcept;
 
@@ -193,7 +210,7 @@ private:
 
     static void computeFroxelLayout(
             math::uint2* dim, uint16_t* countX, uint16_t* countY, uint16_t* countZ,
-            Viewport const& viewport) noexcept;
+            Viewport const& viewport, size_t froxelCount, size_t froxelSliceCount) noexcept;
 
     // internal state dependant on the viewport and needed for froxelizing
     LinearAllocatorArena mArena;                    // ~256 KiB
@@ -211,6 +228,12 @@ private:
     utils::Slice<RecordBufferType> mRecordBufferUser;   // max 64 KiB
     utils::Slice<LightRecord> mLightRecords;            // 256 KiB
 
+    // budget
+    uint32_t mFroxelCountMax;
+    uint32_t mRecordCountMax;
+    uint16_t mFroxelSliceCount;
+    uint16_t mLightCountMax;
+
     uint16_t mFroxelCountX = 0;
     uint16_t mFroxelCountY = 0;
     uint16_t mFroxelCountZ = 0;
@@ -237,7 +260,8 @@ private:
     uint8_t mDirtyFlags = 0;
     enum {
         VIEWPORT_CHANGED = 0x01,
-        PROJECTION_CHANGED = 0x02
+        PROJECTION_CHANGED = 0x02,
+        BUFFERS_CHANGED = 0x04
     };
 };
 
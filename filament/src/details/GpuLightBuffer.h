@@ -35,7 +35,7 @@ public:
         math::float4 positionFalloff;   // { float3(pos), 1/falloff^2 }
         math::float4 colorIntensity;    // { float3(col), intensity }
         math::float4 directionIES;      // { float3(dir), IES index }
-        math::float4 spotScaleOffset;   // { scale, offset, unused, unused }
+        math::float4 spotScaleOffset;   // { scale, offset, shadow atlas tile, normal bias }
     };
 
     explicit GpuLightBuffer(FEngine& engine) noexcept;
@@ -28,6 +28,10 @@
 #include <filaflat/ShaderBuilder.h>
 
 #include <utils/compiler.h>
+#include <utils/Mutex.h>
+
+#include <memory>
+#include <vector>
 
 
 namespace filaflat {
@@ -38,6 +42,7 @@ namespace filament {
 namespace details {
 
 class  FEngine;
+class  FVertexBuffer;
 struct ShaderGenerator;
 
 class FMaterial : public Material {
@@ -73,6 +78,19 @@ public:
 
     FEngine& getEngine() const noexcept  { return mEngine; }
 
+    void compile(uint8_t variantMask, CompilationCallback callback, void* user) noexcept;
+
+    void precompile(uint8_t variantMask, FVertexBuffer const* vertexBuffer,
+            PrimitiveType type) const noexcept;
+
+    // hands the variants prepared in the background by compile() to the driver, called once
+    // per frame
+    void commitCompilations() noexcept {
+        if (UTILS_UNLIKELY(!mCompilations.empty())) {
+            commitCompilationsSlow();
+        }
+    }
+
     Handle<HwProgram> getProgramSlow(uint8_t variantKey) const noexcept;
     Handle<HwProgram> getProgram(uint8_t variantKey) const noexcept {
 
@@ -83,6 +101,11 @@ public:
         return UTILS_LIKELY(entry) ? entry : getProgramSlow(variantKey);
     }
 
+    // whether getProgram() can be called without creating the program
+    bool hasProgram(uint8_t variantKey) const noexcept {
+        return UTILS_LIKELY(mCachedPrograms[variantKey]) || getFallbackProgram(variantKey);
+    }
+
     bool isVariantLit() const noexcept { return mIsVariantLit; }
 
     const utils::CString& getName() const noexcept { return mName; }
@@ -114,6 +137,17 @@ public:
     uint32_t generateMaterialInstanceId() const noexcept { return mMaterialInstanceId++; }
 
 private:
+    struct Compilation;
+
+    bool getShaders(uint8_t variantKey,
+            filaflat::ShaderBuilder& vsBuilder, filaflat::ShaderBuilder& fsBuilder) const noexcept;
+    Handle<HwProgram> createProgram(uint8_t variantKey,
+            utils::CString const& vs, utils::CString const& fs) const noexcept;
+    Handle<HwProgram> getFallbackProgram(uint8_t variantKey) const noexcept;
+    void prepareVariant(Compilation& compilation, uint8_t variantKey) const noexcept;
+    void commitCompilationsSlow() noexcept;
+    void cancelCompilations() noexcept;
+
     // try to order by frequency of use
     mutable std::array<Handle<HwProgram>, VARIANT_COUNT> mCachedPrograms;
     Driver::RasterState mRasterState;
@@ -141,6 +175,13 @@ private:
     const uint32_t mMaterialId;
     mutable uint32_t mMaterialInstanceId = 0;
     filaflat::MaterialParser* mMaterialParser = nullptr;
+
+    // the parser is used by the jobs of compile() and by getProgramSlow()
+    mutable utils::Mutex mParserLock;
+
+    // variants being prepared by compile(), one bit per variant key
+    uint64_t mPendingVariants = 0;
+    std::vector<std::unique_ptr<Compilation>> mCompilations;
 };
 
 
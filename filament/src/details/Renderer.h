@@ -45,6 +45,7 @@ namespace details {
 
 class FEngine;
 class FView;
+class ShadowAtlas;
 class ShadowMap;
 
 /*
@@ -95,16 +96,45 @@ private:
 
     // this class is defined in RenderPass.cpp
     class ShadowPass final : public RenderPass {
+    public:
+        // which shadow casters of the cascade are drawn, and where
+        enum class Casters : uint8_t {
+            ALL,        // all of them, in the shadow map
+            STATIC,     // the static ones, in the cascade's cache
+            DYNAMIC     // the other ones, in the shadow map (on top of the cache)
+        };
+    private:
         using DriverApi = driver::DriverApi;
-        ShadowMap const& shadowMap;
+        ShadowMap& shadowMap;
+        const size_t cascade;
+        const Casters casters;
+        const bool clear;
         virtual void beginRenderPass(driver::DriverApi& driver, Viewport const& viewport, const CameraInfo& camera) noexcept override;
         virtual void endRenderPass(DriverApi& driver, Viewport const& viewport) noexcept override;
+        static uint8_t getVisibilityMask(size_t cascade, Casters casters) noexcept;
+        static uint8_t getVisibilityBits(size_t cascade, Casters casters) noexcept;
     public:
-        ShadowPass(const char* name, ShadowMap const& shadowMap) noexcept;
+        ShadowPass(const char* name, ShadowMap& shadowMap, size_t cascade, Casters casters,
+                bool clear) noexcept;
         static void renderShadowMap(FEngine& engine, utils::JobSystem& js,
                 FView* view, utils::GrowingSlice<Command>& commands) noexcept;
     };
 
+    // this class is defined in RenderPass.cpp
+    class ShadowAtlasPass final : public RenderPass {
+        using DriverApi = driver::DriverApi;
+        ShadowAtlas const& shadowAtlas;
+        const size_t tile;
+        const bool clear;
+        virtual void beginRenderPass(driver::DriverApi& driver, Viewport const& viewport, const CameraInfo& camera) noexcept override;
+        virtual void endRenderPass(DriverApi& driver, Viewport const& viewport) noexcept override;
+    public:
+        ShadowAtlasPass(const char* name, ShadowAtlas const& shadowAtlas, size_t tile,
+                bool clear) noexcept;
+        static void renderShadowAtlas(FEngine& engine, utils::JobSystem& js,
+                FView* view, utils::GrowingSlice<Command>& commands) noexcept;
+    };
+
     Handle<HwRenderTarget> getRenderTarget() const noexcept { return mRenderTarget; }
 
     void recordHighWatermark(utils::Slice<Command> const& commands) noexcept {
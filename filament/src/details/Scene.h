@@ -22,6 +22,8 @@
 #include "components/RenderableManager.h"
 #include "components/TransformManager.h"
 
+#include "details/Allocators.h"
+#include "details/Bvh.h"
 #include "details/Culler.h"
 #include "details/GpuLightBuffer.h"
 
@@ -35,6 +37,7 @@
 #include <utils/Range.h>
 
 #include <cstddef>
+#include <vector>
 #include <tsl/robin_set.h>
 
 namespace filament {
@@ -81,9 +84,19 @@ public:
     void terminate(FEngine& engine);
 
     void prepare(const math::mat4f& worldOriginTansform);
-    void prepareLights(const CameraInfo& camera) noexcept;
+    // keeps at most maxLightCount point and spot lights, the closest to the camera
+    void prepareLights(const CameraInfo& camera, ArenaScope& arena,
+            size_t maxLightCount) noexcept;
     void computeBounds(Aabb& castersBox, Aabb& receiversBox, uint32_t visibleLayers) const noexcept;
 
+    // Computes the bounds of the shadow casters and receivers in the space of 'lightView', which
+    // must be a rigid transform. Unlike computeBounds(), each renderable's box is transformed
+    // on its own, which gives much tighter bounds. Only the receivers with one of the
+    // 'receiversVisibleMask' bits set in their VISIBLE_MASK (or which aren't culled) count.
+    void computeLightSpaceBounds(Aabb& castersBox, Aabb& receiversBox,
+            math::mat4f const& lightView, uint8_t visibleLayers,
+            uint8_t receiversVisibleMask) const noexcept;
+
     /*
      * Storage for per-frame renderable data
      */
@@ -94,12 +107,16 @@ public:
         VISIBILITY_STATE,       //  1 visibility data of the component
         UBH,                    //  4 uniform buffer handle
         BONES_UBH,              //  4 bones uniform buffer handle
+        INSTANCES_UBH,          //  4 instances uniform buffer handle
+        INSTANCE_COUNT,         //  2 number of instances to draw
         WORLD_AABB_CENTER,      // 12 world-space bounding box center of the renderable
         VISIBLE_MASK,           //  1 each bit represents a visibility in a pass
+        SHADOW_ATLAS_MASK,      //  4 each bit represents a visibility in a tile of the shadow atlas
 
         // These are not needed anymore after culling
         LAYERS,                 //  1 layers
         WORLD_AABB_EXTENT,      // 12 world-space bounding box half-extent of the renderable
+        TRANSFORM_INSTANCE,     //  4 instance of the Transform component
 
         // These are temporaries and should be stored out of line
         PRIMITIVES,             //  8 level-of-detail'ed primitives
@@ -112,10 +129,14 @@ public:
             FRenderableManager::Visibility,
             Handle<HwUniformBuffer>,
             Handle<HwUniformBuffer>,
+            Handle<HwUniformBuffer>,
+            uint16_t,
             math::float3,
             Culler::result_type,
+            uint32_t,
             uint8_t,
             math::float3,
+            utils::EntityInstance<TransformManager>,
             utils::Slice<FRenderPrimitive>,
             uint32_t
     >;
@@ -143,14 +164,16 @@ public:
         POSITION_RADIUS,
         DIRECTION,
         LIGHT_INSTANCE,
-        VISIBILITY
+        VISIBILITY,
+        SHADOW_INFO         // { first tile in the shadow atlas or -1, normal bias }
     };
 
     using LightSoa = utils::StructureOfArrays<
             math::float4,
             math::float3,
             FLightManager::Instance,
-            Culler::result_type
+            Culler::result_type,
+            math::float2
     >;
 
     LightSoa const& getLightData() const noexcept { return mLightData; }
@@ -158,7 +181,29 @@ public:
 
     void updateUBOs(utils::Range<uint32_t> visibleRenderables) const noexcept;
 
+    // Hierarchy of the renderables' AABBs, or null if there are too few renderables for it to
+    // be useful. It refers to the current order of the renderables, which is only valid from
+    // prepare() until the renderables are reordered.
+    Bvh const* getBvh() const noexcept { return mBvh.empty() ? nullptr : &mBvh; }
+
 private:
+    // prepare() processes the entities in at most this many chunks, of at least
+    // PREPARE_MIN_CHUNK_SIZE entities each.
+    static constexpr size_t PREPARE_MAX_CHUNK_COUNT = 32;
+    static constexpr size_t PREPARE_MIN_CHUNK_SIZE = 1024;
+
+    // minimum number of renderables for culling to use a hierarchy
+    static constexpr size_t BVH_MIN_RENDERABLE_COUNT = 4096;
+
+    template<typename WORK>
+    uint32_t forEachChunk(size_t count, WORK const& work) const;
+    void prepareAll(const math::mat4f& worldOriginTansform);
+    bool updateRenderables(const math::mat4f& worldOriginTansform);
+    void prepareLightData(const math::mat4f& worldOriginTansform);
+    void buildBvh();
+    inline void setRenderableData(size_t index, FRenderableManager::Instance ri,
+            FTransformManager::Instance ti, const math::mat4f& worldTransform) noexcept;
+
     FEngine& mEngine;
     FSkybox const* mSkybox = nullptr;
     FIndirectLight const* mIndirectLight = nullptr;
@@ -168,8 +213,26 @@ private:
     // (a vector<> could work, but removes would be O(n)). robin_set<> iterates almost as
     // nicely as vector<>, which is a good compromise.
     tsl::robin_set<utils::Entity> mEntities;
+    // mEntities as an array, so prepare() can process it in parallel. Rebuilt when the set changes.
+    std::vector<utils::Entity> mEntityList;
+    bool mEntityListDirty = true;
     RenderableSoa mRenderableData;
     LightSoa mLightData;
+
+    // Entities with a Light component, as of the last time mRenderableData was rebuilt.
+    // mLightData is rebuilt from this list each frame because the views cull it.
+    std::vector<utils::Entity> mLightEntities;
+
+    Bvh mBvh;
+
+    // State of the managers when prepare() was last called, mRenderableData is rebuilt when
+    // components are added or removed, otherwise only entries modified since are updated.
+    math::mat4f mWorldOrigin;
+    uint32_t mTransformGeneration = 0;
+    uint32_t mRenderableGeneration = 0;
+    uint32_t mTransformComponentGeneration = 0;
+    uint32_t mRenderableComponentGeneration = 0;
+    uint32_t mLightComponentGeneration = 0;
 };
 
 FILAMENT_UPCAST(Scene)
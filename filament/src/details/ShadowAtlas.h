@@ -0,0 +1,129 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef TNT_FILAMENT_DETAILS_SHADOWATLAS_H
+#define TNT_FILAMENT_DETAILS_SHADOWATLAS_H
+
+#include "details/Camera.h"
+#include "details/Scene.h"
+
+#include "driver/DriverApiForward.h"
+#include "driver/SamplerBuffer.h"
+
+#include <filament/EngineEnums.h>
+#include <filament/Frustum.h>
+#include <filament/Viewport.h>
+
+#include <math/mat4.h>
+
+#include <array>
+#include <vector>
+
+namespace filament {
+namespace details {
+
+/*
+ * The shadow maps of the spot and point lights, packed in the tiles of a single texture.
+ *
+ * The tiles are allocated again each frame. The shadow casting lights are sorted by their size
+ * on screen, which also decides the size of their tiles: the most important lights get the
+ * largest tiles, and the least important ones don't cast shadows when the atlas is full. A spot
+ * light uses a single tile, a point light uses six, one per face of a cube.
+ *
+ * Tiles have power-of-two dimensions and are allocated by decreasing dimension along a Z-order
+ * curve, which packs them without leaving any hole.
+ */
+class ShadowAtlas {
+public:
+    // dimension of the atlas texture, and of its largest and smallest tiles
+    static constexpr uint32_t ATLAS_DIMENSION = 2048;
+    static constexpr uint32_t MAX_TILE_DIMENSION = ATLAS_DIMENSION / 2;
+    static constexpr uint32_t MIN_TILE_DIMENSION = ATLAS_DIMENSION / 16;
+
+    explicit ShadowAtlas(FEngine& engine) noexcept;
+    ~ShadowAtlas();
+
+    void terminate(driver::DriverApi& driverApi) noexcept;
+
+    // Allocates the tiles of the shadow casting spot and point lights which are visible from the
+    // camera, and sets their FScene::SHADOW_INFO. Call once per frame, after FScene::prepare().
+    void update(FScene::LightSoa& lightData,
+            CameraInfo const& camera, Frustum const& cullingFrustum) noexcept;
+
+    // Do we have visible shadows in any tile. Valid after calling update().
+    bool hasVisibleShadows() const noexcept { return mTileCount > 0; }
+
+    // Number of tiles allocated this frame. Valid after calling update().
+    size_t getTileCount() const noexcept { return mTileCount; }
+
+    // The camera the tile is rendered with. Valid after calling update().
+    CameraInfo const& getCameraInfo(size_t tile) const noexcept { return mTiles[tile].camera; }
+
+    // The light frustum of the tile, used to cull its shadow casters. Valid after calling update().
+    Frustum const& getFrustum(size_t tile) const noexcept { return mTiles[tile].frustum; }
+
+    // The tile's viewport in the atlas texture. Valid after calling update().
+    Viewport const& getViewport(size_t tile) const noexcept { return mTiles[tile].viewport; }
+
+    // Computes the transform to use in the shader to access the tile.
+    // Valid after calling update().
+    math::mat4f const& getLightSpaceMatrix(size_t tile) const noexcept {
+        return mTiles[tile].lightSpace;
+    }
+
+    // Allocates the atlas texture (the first time) and binds it. When the directional light
+    // doesn't cast shadows, 'bindShadowMap' binds the atlas in place of its shadow map as well,
+    // because the shadow receivers sample it regardless.
+    void prepare(driver::DriverApi& driver, SamplerBuffer& buffer, bool bindShadowMap) noexcept;
+
+    // Set-up the render target, call before rendering a tile. The whole texture is cleared if
+    // 'clear' is set, which must be the case of the first tile rendered.
+    void beginRenderPass(driver::DriverApi& driverApi, size_t tile, bool clear) const noexcept;
+
+private:
+    struct Tile {
+        CameraInfo camera;
+        Frustum frustum;
+        math::mat4f lightSpace;
+        Viewport viewport;
+    };
+
+    struct Candidate {
+        float importance;
+        uint32_t index;         // index of the light in the FScene::LightSoa
+    };
+
+    void setTile(Tile& tile, math::float3 const& position, math::float3 const& direction,
+            math::float3 const& up, float fov, float radius,
+            uint32_t offset, uint32_t dimension) noexcept;
+
+    std::array<Tile, CONFIG_MAX_SHADOW_ATLAS_TILES> mTiles;
+    size_t mTileCount = 0;
+
+    // scratch buffer, kept here to avoid reallocating it each frame
+    std::vector<Candidate> mCandidates;
+
+    Handle<HwTexture> mTexture;
+    Handle<HwRenderTarget> mRenderTarget;
+
+    FEngine& mEngine;
+    const bool mClipSpaceFlipped;
+};
+
+} // namespace details
+} // namespace filament
+
+#endif // TNT_FILAMENT_DETAILS_SHADOWATLAS_H
@@ -25,11 +25,14 @@
 #include "driver/DriverApiForward.h"
 #include "driver/SamplerBuffer.h"
 
+#include <filament/EngineEnums.h>
 #include <filament/Viewport.h>
 
 #include <math/mat4.h>
 #include <math/vec4.h>
 
+#include <array>
+
 namespace filament {
 namespace details {
 
@@ -46,34 +49,91 @@ public:
             const FScene::LightSoa& lightData, size_t index, FScene const* scene,
             details::CameraInfo const& camera, uint8_t visibleLayers) noexcept;
 
-    // Do we have visible shadows. Valid after calling update().
+    // Do we have visible shadows in any cascade. Valid after calling update().
     bool hasVisibleShadows() const noexcept { return mHasVisibleShadows; }
 
+    // Number of cascades, each has its own camera and viewport in the shadow map texture.
+    // Valid after calling update().
+    size_t getCascadeCount() const noexcept { return mCascadeCount; }
+
+    // The view-space distance to the far end of each cascade, unused cascades are set to the
+    // far end of the last one. Valid after calling update().
+    math::float4 const& getCascadeSplits() const noexcept { return mCascadeSplits; }
+
+    // Do we have visible shadows in this cascade. Valid after calling update().
+    bool hasVisibleShadows(size_t cascade) const noexcept {
+        return mCascades[cascade].hasVisibleShadows;
+    }
+
     // Allocates shadow texture based on user parameters (e.g. dimensions)
     void prepare(driver::DriverApi& driver, SamplerBuffer& buffer) noexcept;
 
-    // Returns the shadow map's viewport. Valid after prepare().
-    Viewport const& getViewport() const noexcept { return mViewport; }
+    // Returns the cascade's viewport in the shadow map texture. Valid after calling update().
+    Viewport const& getViewport(size_t cascade) const noexcept {
+        return mCascades[cascade].viewport;
+    }
 
     // Computes the transform to use in the shader to access the shadow map.
     // Valid after calling update().
-    math::mat4f const& getLightSpaceMatrix() const noexcept { return mLightSpace; }
+    math::mat4f const& getLightSpaceMatrix(size_t cascade) const noexcept {
+        return mCascades[cascade].lightSpace;
+    }
 
     // return the size of a texel in world space (pre-warping)
-    float getTexelSizeWorldSpace() const noexcept { return mTexelSizeWs; }
+    float getTexelSizeWorldSpace(size_t cascade) const noexcept {
+        return mCascades[cascade].texelSizeWs;
+    }
 
     // Returns the shadow map's depth range. Valid after init().
-    float getSceneRange() const noexcept { return mSceneRange; }
+    float getSceneRange(size_t cascade) const noexcept { return mCascades[cascade].sceneRange; }
 
     // Returns the light's projection. Valid after calling update().
-    FCamera const& getCamera() const noexcept { return *mCamera; }
+    FCamera const& getCamera(size_t cascade) const noexcept { return *mCascades[cascade].camera; }
+
+    // Set-up the render target, call before rendering a cascade of the shadow map. The whole
+    // texture is cleared if 'clear' is set, which must be the case of the first cascade rendered.
+    void beginRenderPass(driver::DriverApi& driverApi, size_t cascade, bool clear) const noexcept;
+
+    // Clears the whole texture in its own render pass, for when the first cascade rendered
+    // starts from its cache of static casters.
+    void clear(driver::DriverApi& driverApi) const noexcept;
+
+    // The static shadow casters of a cascade (see RenderableManager::Builder::staticShadowCaster)
+    // are rendered in their own texture, which is copied into the shadow map before the other
+    // casters are drawn on top of it.
+    enum class StaticCasters : uint8_t {
+        NONE,       // no static casters (or no caching), all the casters are drawn
+        RENDER,     // the cache is out of date, the static casters must be drawn in it first
+        CACHED      // the cache is up to date, only the other casters are drawn
+    };
+
+    // Records the static casters visible from a cascade, 'signature' identifies them and is 0
+    // if there are none. This decides whether the cache can be used. Call after update().
+    void setStaticCasters(size_t cascade, uint64_t signature) noexcept;
+
+    StaticCasters getStaticCasters(size_t cascade) const noexcept {
+        return mCascades[cascade].staticCasters;
+    }
 
-    // Set-up the render target, call before rendering the shadow map.
-    void beginRenderPass(driver::DriverApi& driverApi) const noexcept;
+    // Set-up the render target of the cascade's static casters (allocating it as needed), call
+    // before rendering them.
+    void beginStaticRenderPass(driver::DriverApi& driverApi, size_t cascade) noexcept;
+
+    // Copies the cascade's static casters into the shadow map, call before rendering the other
+    // casters of this cascade, outside of a render pass.
+    void copyStaticCasters(driver::DriverApi& driverApi, size_t cascade) const noexcept;
 
     // use only for debugging
     FCamera const& getDebugCamera() const noexcept { return *mDebugCamera; }
 
+    // The sampler parameters of the shadow maps, which are sampled with depth comparison.
+    static driver::SamplerParams getSamplerParams() noexcept;
+
+    // Computes the transform from clip space to the texture coordinates of the viewport in the
+    // shadow map texture.
+    static math::mat4f getTextureCoordsMapping(Viewport const& viewport,
+            math::uint2 textureDimension, bool clipSpaceFlipped) noexcept;
+
 private:
     struct CameraInfo {
         math::mat4f projection;
@@ -101,12 +161,37 @@ private:
         uint8_t v0, v1, v2, v3;
     };
 
+    struct StaticCache {
+        Handle<HwTexture> texture;
+        Handle<HwRenderTarget> target;
+        uint32_t dimension = 0;         // the texture holds a single cascade
+        math::mat4f lightSpace;         // light space matrix the cache was rendered with
+        uint64_t signature = 0;         // static casters the cache was rendered with
+    };
+
+    struct Cascade {
+        FCamera* camera = nullptr;
+        math::mat4f lightSpace;
+        float sceneRange = 0.0f;
+        float texelSizeWs = 0.0f;
+        Viewport viewport;
+        bool hasVisibleShadows = false;
+        StaticCasters staticCasters = StaticCasters::NONE;
+        StaticCache cache;
+    };
+
     // 8 corners, 12 segments w/ 2 intersection max -- all of this twice (8 + 12 * 2) * 2 (768 bytes)
     using FrustumBoxIntersection = std::array<math::float3, 64>;
 
     void computeShadowCameraDirectional(
-            math::float3 const& direction, FScene const* scene, CameraInfo const& camera,
-            uint8_t visibleLayers) noexcept;
+            math::float3 const& direction, CameraInfo const& camera,
+            Aabb const& wsShadowCastersVolume, Aabb const& wsShadowReceiversVolume,
+            Aabb const& lsShadowCastersBounds, Aabb const& lsShadowReceiversBounds,
+            size_t cascade) noexcept;
+
+    static math::float4 computeCascadeSplits(float zn, float zf, size_t count) noexcept;
+
+    static math::mat4f setProjectionNearFar(math::mat4f projection, float n, float f) noexcept;
 
     static math::mat4f applyLISPSM(
             CameraInfo const& camera, float dzn, float dzf, const math::mat4f& LMpMv,
@@ -116,9 +201,18 @@ private:
     static inline void snapLightFrustum(math::float2& s, math::float2& o,
             uint32_t shadowMapDimension) noexcept;
 
+    // Rounds the light space bounds [min, max] of one axis outwards, to a step relative to their
+    // extent.
+    static void quantizeLightFrustum(float& min, float& max) noexcept;
+
     static inline void computeFrustumCorners(math::float3* out,
             const math::mat4f& projectionViewInverse) noexcept;
 
+    // Returns the light's view matrix, rotated around the light direction to align with the
+    // camera. If 'lightRotation' is set, the rotation is returned there and isn't applied.
+    static math::mat4f computeLightView(math::float3 const& direction,
+            math::float3 const& cameraForward, math::mat4f* lightRotation = nullptr) noexcept;
+
     static inline math::float2 computeNearFar(math::mat4f const& lightView,
             Aabb const& wsShadowCastersVolume) noexcept;
 
@@ -148,8 +242,6 @@ private:
 
     static math::mat4f warpFrustum(float n, float f) noexcept;
 
-    math::mat4f getTextureCoordsMapping() const noexcept;
-
     float texelSizeWorldSpace(const math::mat4f& lightSpaceMatrix) const noexcept;
     float texelSizeWorldSpace(const math::mat4f& lightSpaceMatrix, math::float3 const& str) const noexcept;
 
@@ -167,19 +259,19 @@ private:
             { 2, 6, 7, 3 },  // top
     };
 
-    FCamera* mCamera = nullptr;
+    std::array<Cascade, CONFIG_MAX_SHADOW_CASCADES> mCascades;
     FCamera* mDebugCamera = nullptr;
-    math::mat4f mLightSpace;
-    float mSceneRange = 0.0f;
-    float mTexelSizeWs = 0.0f;
 
     // set-up in prepare()
-    Viewport mViewport;
+    math::uint2 mAllocatedDimension = 0;
     Handle<HwTexture> mShadowMapHandle;
     Handle<HwRenderTarget> mShadowMapRenderTarget;
 
     // set-up in update()
-    uint32_t mShadowMapDimension = 0;
+    uint32_t mShadowMapDimension = 0;       // size of a cascade
+    math::uint2 mTextureDimension = 0;      // size of the texture holding all the cascades
+    size_t mCascadeCount = 0;
+    math::float4 mCascadeSplits = 0;
     bool mHasVisibleShadows = false;
 
     // use a member here (instead of stack) because we don't want to pay the
@@ -188,6 +280,8 @@ private:
 
     FEngine& mEngine;
     const bool mClipSpaceFlipped;
+    const bool mStaticCachingSupported;
+    const uint32_t mMaxTextureSize;
 };
 
 } // namespace details
@@ -21,9 +21,12 @@
 
 #include "upcast.h"
 
+#include "RenderPass.h"
+
 #include "details/Allocators.h"
 #include "details/Camera.h"
 #include "details/Froxelizer.h"
+#include "details/ShadowAtlas.h"
 #include "details/ShadowMap.h"
 #include "details/Scene.h"
 
@@ -37,6 +40,7 @@
 #include <utils/Slice.h>
 #include <utils/Range.h>
 
+#include <array>
 #include <deque>
 
 namespace utils {
@@ -56,6 +60,20 @@ class FView : public View {
 public:
     using Range = utils::Range<uint32_t>;
 
+    // bit of the 'VISIBLE_MASK' set for the renderables visible from the camera
+    static constexpr size_t VISIBLE_RENDERABLE_BIT = 0u;
+
+    // bit of the 'VISIBLE_MASK' set for the shadow casters of the first cascade, the following
+    // cascades use the next bits.
+    static constexpr size_t VISIBLE_SHADOW_CASCADE_BIT = 2u;
+
+    // bit of the 'VISIBLE_MASK' set for the visible static shadow casters
+    static constexpr size_t VISIBLE_STATIC_SHADOW_CASTER_BIT = 6u;
+
+    // bit of the 'VISIBLE_MASK' set for the shadow casters of any tile of the shadow atlas,
+    // the tiles themselves are in the 'SHADOW_ATLAS_MASK'.
+    static constexpr size_t VISIBLE_SHADOW_ATLAS_BIT = 7u;
+
     explicit FView(FEngine& engine);
     ~FView() noexcept;
 
@@ -115,7 +133,7 @@ public:
 
     void prepareCamera(const CameraInfo& camera, const Viewport& viewport) const noexcept;
     void prepareShadowing(FEngine& engine, driver::DriverApi& driver,
-            FScene::RenderableSoa& renderableData, FScene::LightSoa const& lightData) noexcept;
+            FScene::RenderableSoa& renderableData, FScene::LightSoa& lightData) noexcept;
     void prepareLighting(
             FEngine& engine, FEngine::DriverApi& driver, ArenaScope& arena, Viewport const& viewport) noexcept;
     void froxelize(FEngine& engine) const noexcept;
@@ -124,23 +142,34 @@ public:
 
     bool hasDirectionalLight() const noexcept { return mHasDirectionalLight; }
     bool hasDynamicLighting() const noexcept { return mHasDynamicLighting; }
-    bool hasShadowing() const noexcept { return mHasShadowing & mDirectionalShadowMap.hasVisibleShadows(); }
+    bool hasShadowing() const noexcept { return hasDirectionalShadows() | hasLocalShadows(); }
+    bool hasDirectionalShadows() const noexcept { return mHasShadowing & mDirectionalShadowMap.hasVisibleShadows(); }
+    bool hasShadowCascades() const noexcept { return hasDirectionalShadows() && mDirectionalShadowMap.getCascadeCount() > 1; }
+    bool hasLocalShadows() const noexcept { return mShadowingEnabled & mShadowAtlas.hasVisibleShadows(); }
 
     void prepareVisibleRenderables(utils::JobSystem& js, FScene::RenderableSoa& renderableData) const noexcept;
 
     void prepareVisibleShadowCasters(utils::JobSystem& js, FScene::RenderableSoa& renderableData,
-                                     Frustum const& lightFrustum) const noexcept;
+                                     Frustum const& lightFrustum, size_t cascade) const noexcept;
+
+    void prepareStaticShadowCasters(FScene::RenderableSoa const& renderableData) const noexcept;
+
+    void prepareShadowAtlasCasters(utils::JobSystem& js,
+            FScene::RenderableSoa& renderableData) const noexcept;
 
     void updatePrimitivesLod(
             FEngine& engine, const CameraInfo& camera,
             FScene::RenderableSoa& renderableData, Range visibles) noexcept;
 
     static void cullRenderables(utils::JobSystem& js, FScene::RenderableSoa& renderableData,
-                                Frustum const& frustum, size_t bit) noexcept;
+                                Bvh const* bvh, Frustum const& frustum, size_t bit) noexcept;
 
     void setShadowsEnabled(bool enabled) noexcept { mShadowingEnabled = enabled; }
 
     ShadowMap const& getShadowMap() const { return mDirectionalShadowMap; }
+    ShadowMap& getShadowMap() { return mDirectionalShadowMap; }
+
+    ShadowAtlas const& getShadowAtlas() const { return mShadowAtlas; }
 
     FCamera const* getDirectionalLightCamera() const noexcept {
         return &mDirectionalShadowMap.getDebugCamera();
@@ -182,6 +211,12 @@ public:
 
     void setDynamicLightingOptions(float zLightNear, float zLightFar) noexcept;
 
+    void setDynamicLightingBudget(DynamicLightingBudget const& budget) noexcept;
+
+    DynamicLightingBudget getDynamicLightingBudget() const noexcept {
+        return mDynamicLightingBudget;
+    }
+
     void setPostProcessingEnabled(bool enabled) noexcept {
         mHasPostProcessPass = enabled;
     }
@@ -194,6 +229,31 @@ public:
         return mDepthPrepass;
     }
 
+    RenderPass::CommandCache* getColorPassCommandCache() noexcept {
+        return &mColorPassCommandCache;
+    }
+
+    RenderPass::CommandCache* getShadowPassCommandCache(size_t cascade) noexcept {
+        return &mShadowPassCommandCaches[cascade];
+    }
+
+    void setAutomaticInstancingEnabled(bool enabled) noexcept {
+        mAutomaticInstancing = enabled;
+    }
+
+    bool isAutomaticInstancingEnabled() const noexcept {
+        return mAutomaticInstancing;
+    }
+
+    // these return nullptr when automatic instancing is disabled
+    RenderPass::InstanceBuffers* getColorPassInstanceBuffers() noexcept {
+        return mAutomaticInstancing ? &mColorPassInstanceBuffers : nullptr;
+    }
+
+    RenderPass::InstanceBuffers* getShadowPassInstanceBuffers(size_t cascade) noexcept {
+        return mAutomaticInstancing ? &mShadowPassInstanceBuffers[cascade] : nullptr;
+    }
+
     Range const& getVisibleRenderables() const noexcept {
         return mVisibleRenderables;
     }
@@ -257,9 +317,11 @@ private:
     bool mShadowingEnabled = true;
     bool mHasPostProcessPass = true;
     DepthPrepass mDepthPrepass = DepthPrepass::DEFAULT;
+    bool mAutomaticInstancing = false;
 
     using duration = std::chrono::duration<float, std::milli>;
     DynamicResolutionOptions mDynamicResolution;
+    DynamicLightingBudget mDynamicLightingBudget;
     std::deque<duration> mFrameTimeHistory;
 
     math::float2 mScale = 1.0f;
@@ -279,6 +341,16 @@ private:
     mutable bool mHasDynamicLighting = false;
     mutable bool mHasShadowing = false;
     mutable ShadowMap mDirectionalShadowMap;
+    ShadowAtlas mShadowAtlas;
+
+    // sort order of the commands of the previous frame, so that only the ones that changed are
+    // sorted again
+    RenderPass::CommandCache mColorPassCommandCache;
+    std::array<RenderPass::CommandCache, CONFIG_MAX_SHADOW_CASCADES> mShadowPassCommandCaches;
+
+    // uniform buffers of the merged commands, when automatic instancing is enabled
+    RenderPass::InstanceBuffers mColorPassInstanceBuffers;
+    std::array<RenderPass::InstanceBuffers, CONFIG_MAX_SHADOW_CASCADES> mShadowPassInstanceBuffers;
 };
 
 FILAMENT_UPCAST(View)
@@ -49,6 +49,10 @@ CircularBuffer::CircularBuffer(size_t size) {
     mHead = mData;
 }
 
+CircularBuffer::CircularBuffer(void* data, size_t size) noexcept
+        : mSize(size), mTail(data), mHead(data) {
+}
+
 CircularBuffer::~CircularBuffer() noexcept {
 #if HAS_MMAP
     if (mData) {
@@ -37,6 +37,11 @@ public:
     //      to set it to 3*requiredSize to avoid blocking the render thread (usually the UI thread).
     CircularBuffer(size_t bufferSize);
 
+    // Creates a buffer over 'size' bytes of memory owned by the caller, e.g. space reserved in
+    // another CircularBuffer. Such a buffer is only allocated from linearly, it must never be
+    // circularized.
+    CircularBuffer(void* data, size_t size) noexcept;
+
     // can't be moved or copy-constructed
     CircularBuffer(CircularBuffer const& rhs) = delete;
     CircularBuffer(CircularBuffer&& rhs) noexcept = delete;
@@ -69,7 +74,7 @@ public:
 private:
     void* alloc(size_t size) noexcept;
 
-    // pointer to the beginning of the circular buffer (constant)
+    // pointer to the beginning of the circular buffer (constant), null if we don't own it
     void* mData = nullptr;
     int mUsesAshmem = -1;
 
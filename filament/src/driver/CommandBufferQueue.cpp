@@ -18,6 +18,8 @@
 
 #include <assert.h>
 
+#include <algorithm>
+
 #include <utils/Log.h>
 #include <utils/Systrace.h>
 
@@ -27,27 +29,76 @@ using namespace utils;
 
 namespace filament {
 
-CommandBufferQueue::CommandBufferQueue(size_t requiredSize, size_t bufferSize)
-        : mRequiredSize((requiredSize + CircularBuffer::BLOCK_MASK) & ~CircularBuffer::BLOCK_MASK),
-          mCircularBuffer(bufferSize),
-          mFreeSpace(mCircularBuffer.size()) {
-    assert(mCircularBuffer.size() > requiredSize);
+static size_t roundUpToBlock(size_t size) noexcept {
+    return (size + CircularBuffer::BLOCK_MASK) & ~CircularBuffer::BLOCK_MASK;
+}
+
+CommandBufferQueue::Buffer::Buffer(size_t size)
+        : circularBuffer(size),
+          freeSpace(circularBuffer.size()) {
+}
+
+CommandBufferQueue::CommandBufferQueue(size_t requiredSize, size_t bufferSize,
+        size_t maxBufferSize)
+        : mRequiredSize(roundUpToBlock(requiredSize)),
+          mMaxBufferSize(std::max(bufferSize, maxBufferSize)),
+          mSizeRatio((bufferSize + mRequiredSize - 1) / mRequiredSize),
+          mBuffer(new Buffer(bufferSize)) {
+    assert(mBuffer->circularBuffer.size() > requiredSize);
 }
 
 CommandBufferQueue::~CommandBufferQueue() {
-    assert(!mCommandBuffersToExecute.size());
+    assert(mReadIndex.load() == mWriteIndex.load());
+}
+
+CommandBufferQueue::Stats CommandBufferQueue::getStats() const noexcept {
+    return { mBuffer->circularBuffer.size(), mRequiredSize, mHighWatermark, mGrowCount };
+}
+
+/*
+ * Both threads sleep on a utils::Condition (a futex on Linux), the waker only takes the lock
+ * if the other thread is (about to be) sleeping, which is rare.
+ *
+ * The waiting flags and the indices/free space are accessed with sequential consistency: either
+ * the waker sees the flag set, or the sleeper sees the new state when it checks its predicate
+ * after setting the flag. The waker notifies with the lock held, so that the notification can't
+ * happen between the sleeper's check and its actual wait.
+ */
+
+bool CommandBufferQueue::canWrite() const noexcept {
+    return mBuffer->freeSpace.load() >= mRequiredSize &&
+           mWriteIndex.load(std::memory_order_relaxed) - mReadIndex.load() < SLICE_COUNT;
+}
+
+bool CommandBufferQueue::canRead() const noexcept {
+    return mReadIndex.load(std::memory_order_relaxed) != mWriteIndex.load() ||
+           mExitRequested.load();
+}
+
+void CommandBufferQueue::wakeConsumer() noexcept {
+    if (UTILS_UNLIKELY(mConsumerWaiting.load())) {
+        std::lock_guard<utils::Mutex> lock(mLock);
+        mConsumerCondition.notify_one();
+    }
+}
+
+void CommandBufferQueue::wakeProducer() noexcept {
+    if (UTILS_UNLIKELY(mProducerWaiting.load())) {
+        std::lock_guard<utils::Mutex> lock(mLock);
+        mProducerCondition.notify_one();
+    }
 }
 
 void CommandBufferQueue::requestExit() {
-    std::unique_lock<utils::Mutex> lock(mLock);
-    mExitRequested = true;
-    mCondition.notify_one();
+    mExitRequested.store(true);
+    wakeConsumer();
 }
 
 void CommandBufferQueue::flush() noexcept {
     SYSTRACE_CALL();
 
-    CircularBuffer& circularBuffer = mCircularBuffer;
+    Buffer& buffer = *mBuffer;
+    CircularBuffer& circularBuffer = buffer.circularBuffer;
     if (circularBuffer.empty()) {
         return;
     }
@@ -67,53 +118,87 @@ void CommandBufferQueue::flush() noexcept {
 
     circularBuffer.circularize();
 
-    std::unique_lock<utils::Mutex> lock(mLock);
-    mCommandBuffersToExecute.push_back({ tail, head });
-
     // circular buffer is too small, we corrupted the stream
-    assert(used <= mFreeSpace);
+    assert(used <= buffer.freeSpace.load());
+    const size_t freeSpace = buffer.freeSpace.fetch_sub(used) - used;
 
-    // wait until there is enough space in the buffer
-    mFreeSpace -= used;
-    const size_t requiredSize = mRequiredSize;
+    // the previous flush() guaranteed that this slot is free
+    const uint32_t writeIndex = mWriteIndex.load(std::memory_order_relaxed);
+    mSlices[writeIndex % SLICE_COUNT] = { tail, head, &buffer };
+    mWriteIndex.store(writeIndex + 1);
+    wakeConsumer();
 
-#ifndef NDEBUG
-    size_t totalUsed = circularBuffer.size() - mFreeSpace;
-    mHighWatermark = std::max(mHighWatermark, totalUsed);
-    if (UTILS_UNLIKELY(totalUsed > requiredSize)) {
-        slog.d << "CommandStream used too much space: " << totalUsed
-            << ", out of " << requiredSize << " (will block)" << io::endl;
+    mHighWatermark = std::max(mHighWatermark, circularBuffer.size() - freeSpace);
+
+    freeRetiredBuffers();
+
+    if (UTILS_UNLIKELY(used > mRequiredSize)) {
+        // We don't want to wait for the driver thread each time this happens, make sure the
+        // following flushes have this much space available.
+        grow(used);
     }
-#endif
 
-    if (UTILS_LIKELY(mFreeSpace >= requiredSize)) {
-        // ideally (and usually) we don't have to wait, this is the common case, so special case
-        // the unlock-before-notify, optimization.
-        lock.unlock();
-        mCondition.notify_one();
-    } else {
+    if (UTILS_UNLIKELY(!canWrite())) {
         // unfortunately, there is not enough space left, we'll have to wait.
-        mCondition.notify_one(); // too bad there isn't a notify-and-wait
         SYSTRACE_NAME("waiting: CircularBuffer::flush()");
-        mCondition.wait(lock, [this, requiredSize]() -> bool {
-            return mFreeSpace >= requiredSize;
-        });
+        std::unique_lock<utils::Mutex> lock(mLock);
+        mProducerWaiting.store(true);
+        mProducerCondition.wait(lock, [this]() -> bool { return canWrite(); });
+        mProducerWaiting.store(false);
+    }
+}
+
+void CommandBufferQueue::grow(size_t requiredSize) noexcept {
+    requiredSize = roundUpToBlock(requiredSize);
+    const size_t bufferSize = requiredSize * mSizeRatio;
+    if (bufferSize > mMaxBufferSize) {
+#ifndef NDEBUG
+        slog.d << "CommandStream used too much space: " << requiredSize
+            << ", out of " << mRequiredSize << " (will block)" << io::endl;
+#endif
+        return;
     }
+
+    SYSTRACE_CALL();
+
+    // the current buffer is empty, it's only referenced by the slices not released yet
+    mRetiredBuffers.push_back(std::move(mBuffer));
+    mBuffer.reset(new Buffer(bufferSize));
+    mRequiredSize = requiredSize;
+    mGrowCount++;
 }
 
-std::vector<CommandBufferQueue::Slice> CommandBufferQueue::waitForCommands() const {
-    std::unique_lock<utils::Mutex> lock(mLock);
-    while (!mCommandBuffersToExecute.size() && !mExitRequested) {
-        mCondition.wait(lock);
+void CommandBufferQueue::freeRetiredBuffers() noexcept {
+    auto& buffers = mRetiredBuffers;
+    buffers.erase(std::remove_if(buffers.begin(), buffers.end(),
+            [](std::unique_ptr<Buffer> const& buffer) {
+                return buffer->freeSpace.load() == buffer->circularBuffer.size();
+            }), buffers.end());
+}
+
+bool CommandBufferQueue::waitForCommands(Slice& buffer) noexcept {
+    if (UTILS_UNLIKELY(!canRead())) {
+        std::unique_lock<utils::Mutex> lock(mLock);
+        mConsumerWaiting.store(true);
+        mConsumerCondition.wait(lock, [this]() -> bool { return canRead(); });
+        mConsumerWaiting.store(false);
     }
-    return std::move(mCommandBuffersToExecute);
+
+    const uint32_t readIndex = mReadIndex.load(std::memory_order_relaxed);
+    if (UTILS_UNLIKELY(readIndex == mWriteIndex.load())) {
+        // exit was requested and all the commands have been executed
+        return false;
+    }
+
+    buffer = mSlices[readIndex % SLICE_COUNT];
+    mReadIndex.store(readIndex + 1);
+    wakeProducer();
+    return true;
 }
 
-void CommandBufferQueue::releaseBuffer(CommandBufferQueue::Slice const& buffer) {
-    std::unique_lock<utils::Mutex> lock(mLock);
-    mFreeSpace += uintptr_t(buffer.end) - uintptr_t(buffer.begin);
-    lock.unlock();
-    mCondition.notify_one();
+void CommandBufferQueue::releaseBuffer(CommandBufferQueue::Slice const& buffer) noexcept {
+    buffer.buffer->freeSpace.fetch_add(uintptr_t(buffer.end) - uintptr_t(buffer.begin));
+    wakeProducer();
 }
 
 } // namespace filament
@@ -23,48 +23,61 @@
 #include <utils/Condition.h>
 #include <utils/Mutex.h>
 
+#include <array>
+#include <atomic>
+#include <memory>
 #include <vector>
 
 namespace filament {
 
 /*
- * A produdcer-consumer command queue that uses a CircularBuffer as main storage
+ * A producer-consumer command queue that uses a CircularBuffer as main storage.
+ *
+ * There is a single producer (the thread calling flush()) and a single consumer (the thread
+ * calling waitForCommands() and releaseBuffer()). The slices of the CircularBuffer to execute
+ * are handed over through a fixed-size ring, without locking and without allocating. Either
+ * thread only takes the lock when it needs to sleep, or to wake the other one up.
+ *
+ * When a flush() uses more than the space guaranteed available, the guarantee is raised to that
+ * size and the queue switches to a larger CircularBuffer (up to maxBufferSize), instead of
+ * blocking the producer on the following flushes. The previous buffer is freed once all its
+ * commands are released.
  */
 class CommandBufferQueue {
+    struct Buffer;
+
+public:
     struct Slice {
         void* begin;
         void* end;
+        Buffer* buffer;     // the buffer this slice belongs to
     };
 
-    const size_t mRequiredSize;
-
-    CircularBuffer mCircularBuffer;
-
-    // space available in the circular buffer
-
-    mutable utils::Mutex mLock;
-    mutable utils::Condition mCondition;
-    mutable std::vector<Slice> mCommandBuffersToExecute;
-    size_t mFreeSpace = 0;
-    size_t mHighWatermark = 0;
-    bool mExitRequested = false;
+    struct Stats {
+        size_t bufferSize;      // size of the current CircularBuffer
+        size_t requiredSize;    // space guaranteed available after flush()
+        size_t highWatermark;   // maximum space used by commands not yet released
+        uint32_t growCount;     // number of times the CircularBuffer was replaced by a larger one
+    };
 
-public:
     // requiredSize: guaranteed available space after flush()
-    CommandBufferQueue(size_t requiredSize, size_t bufferSize);
+    CommandBufferQueue(size_t requiredSize, size_t bufferSize, size_t maxBufferSize);
     ~CommandBufferQueue();
 
-    CircularBuffer& getCircularBuffer() { return mCircularBuffer; }
+    // The buffer to write the commands to. It can change after flush().
+    CircularBuffer& getCircularBuffer() { return mBuffer->circularBuffer; }
 
-    size_t getHigWatermark() noexcept { return mHighWatermark; }
+    // Must be called from the producer thread.
+    Stats getStats() const noexcept;
 
-    // wait for commands to be available and returns an array containing these commands
-    std::vector<Slice> waitForCommands() const;
+    // Waits for commands to be available and returns the oldest command buffer in 'buffer'.
+    // Returns false if there are no commands left after requestExit() was called.
+    bool waitForCommands(Slice& buffer) noexcept;
 
     // return the memory used by this command buffer to the circular buffer
     // WARNING: releaseBuffer() must be called in sequence of the Slices returned by
     // waitForCommands()
-    void releaseBuffer(Slice const& buffer);
+    void releaseBuffer(Slice const& buffer) noexcept;
 
     // all commands buffers (Slices) written to this point are returned by waitForCommand(). This
     // call blocks until the CircularBuffer has at least mRequiredSize bytes available.
@@ -72,6 +85,48 @@ public:
 
     // returns from waitForcommands() immediately.
     void requestExit();
+
+private:
+    // maximum number of flushed slices not yet returned by waitForCommands(). flush() blocks
+    // when the ring is full.
+    static constexpr uint32_t SLICE_COUNT = 64;
+
+    struct Buffer {
+        explicit Buffer(size_t size);
+        CircularBuffer circularBuffer;
+        // space available in the circular buffer
+        std::atomic<size_t> freeSpace;
+    };
+
+    bool canWrite() const noexcept;
+    bool canRead() const noexcept;
+    void wakeConsumer() noexcept;
+    void wakeProducer() noexcept;
+    void grow(size_t requiredSize) noexcept;
+    void freeRetiredBuffers() noexcept;
+
+    // these are only accessed by the producer
+    size_t mRequiredSize;
+    const size_t mMaxBufferSize;
+    const size_t mSizeRatio;
+    std::unique_ptr<Buffer> mBuffer;
+    std::vector<std::unique_ptr<Buffer>> mRetiredBuffers;
+    size_t mHighWatermark = 0;
+    uint32_t mGrowCount = 0;
+
+    // the ring of slices, indices only ever increase and wrap around on overflow
+    std::array<Slice, SLICE_COUNT> mSlices;
+    std::atomic<uint32_t> mWriteIndex = { 0 };  // only written by the producer
+    std::atomic<uint32_t> mReadIndex = { 0 };   // only written by the consumer
+
+    std::atomic<bool> mExitRequested = { false };
+
+    // only used to sleep, see wakeConsumer() and wakeProducer()
+    utils::Mutex mLock;
+    utils::Condition mConsumerCondition;
+    utils::Condition mProducerCondition;
+    std::atomic<bool> mConsumerWaiting = { false };
+    std::atomic<bool> mProducerWaiting = { false };
 };
 
 } // namespace filament
@@ -18,6 +18,7 @@
 
 #include <utils/CallStack.h>
 #include <utils/Log.h>
+#include <utils/Panic.h>
 #include <utils/Profiler.h>
 #include <utils/Systrace.h>
 
@@ -99,6 +100,29 @@ void CommandStream::queueCommand(std::function<void()> command) {
     new(allocateCommand(CustomCommand::align(sizeof(CustomCommand)))) CustomCommand(command);
 }
 
+// ------------------------------------------------------------------------------------------------
+
+SecondaryCommandStream::SecondaryCommandStream(CommandStream& primary, size_t size) noexcept
+        : mBegin(static_cast<char*>(primary.allocateCommand(getReservedSize(size)))),
+          mSize(getReservedSize(size)),
+          mBuffer(mBegin, mSize),
+          mStream(*primary.mDriver, mBuffer) {
+    // skip the whole space until the commands are recorded, the first one overwrites this
+    new(mBegin) NoopCommand(mBegin + mSize);
+}
+
+void SecondaryCommandStream::finish() noexcept {
+    // jump back to the primary stream, past the reserved space
+    void* const p = mStream.allocateCommand(CommandBase::align(sizeof(NoopCommand)));
+    // The commands are already written at this point, but an overflow has overwritten the
+    // primary stream's next commands: never let it go unnoticed, even in release builds.
+    char* const end = static_cast<char*>(p) + CommandBase::align(sizeof(NoopCommand));
+    ASSERT_POSTCONDITION(end <= mBegin + mSize,
+            "secondary command stream overflow: %zu bytes recorded in %zu bytes reserved",
+            size_t(end - mBegin), mSize);
+    new(p) NoopCommand(mBegin + mSize);
+}
+
 template<typename... ARGS>
 template<void (Driver::*METHOD)(ARGS...)>
 template<std::size_t... I>
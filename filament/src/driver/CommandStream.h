@@ -272,6 +272,12 @@ public:
 
     void execute(void* buffer);
 
+    // Sets the buffer the commands are written to, must be empty.
+    void setCircularBuffer(CircularBuffer& buffer) noexcept {
+        assert(buffer.empty());
+        mCurrentBuffer = &buffer;
+    }
+
     /*
      * queueCommand() allows to queue a lambda function as a command.
      * This is much less efficient than using the Driver* API.
@@ -293,7 +299,18 @@ public:
     inline PodType* allocatePod(
             size_t count = 1, size_t alignment = alignof(PodType)) noexcept;
 
+    /*
+     * Returns the space taken in the stream by a call to a Driver method, e.g.:
+     *      getCommandSize<decltype(&Driver::draw), &Driver::draw>()
+     */
+    template<typename M, M METHOD>
+    static constexpr size_t getCommandSize() noexcept {
+        return CommandBase::align(sizeof(typename CommandType<M>::template Command<METHOD>));
+    }
+
 private:
+    friend class SecondaryCommandStream;
+
     // Dispatcher could be a value (instead of pointer), which saves a load when writing commands
     // at the expense of a larger CommandStream object (about ~400 bytes)
     Dispatcher* mDispatcher = nullptr;
@@ -333,6 +350,46 @@ PodType* CommandStream::allocatePod(size_t count, size_t alignment) noexcept {
     return static_cast<PodType*>(allocate(count * sizeof(PodType), alignment));
 }
 
+// ------------------------------------------------------------------------------------------------
+
+/*
+ * A SecondaryCommandStream records commands from another thread than its primary
+ * CommandStream's, so that several threads can record commands at the same time.
+ *
+ * Its space is reserved in the primary stream when it's created, and its commands execute at
+ * that point of the primary stream, i.e. in the order the secondary streams were created,
+ * regardless of the order they're recorded in. The reserved space must be large enough for all
+ * the commands recorded, any space left is skipped.
+ *
+ * The commands must be terminated with finish() before the primary stream is flushed.
+ */
+class SecondaryCommandStream {
+public:
+    // must be called from the primary stream's thread
+    SecondaryCommandStream(CommandStream& primary, size_t size) noexcept;
+
+    SecondaryCommandStream(SecondaryCommandStream const& rhs) = delete;
+    SecondaryCommandStream& operator=(SecondaryCommandStream const& rhs) = delete;
+
+    // The stream to record the commands into, from a single thread, which must call
+    // CommandStream::debugThreading() first.
+    CommandStream& getStream() noexcept { return mStream; }
+
+    // Terminates the commands, the stream can't be used afterwards. Call from the thread
+    // recording the commands.
+    void finish() noexcept;
+
+private:
+    static size_t getReservedSize(size_t size) noexcept {
+        return CommandBase::align(size) + CommandBase::align(sizeof(NoopCommand));
+    }
+
+    char* const mBegin;
+    const size_t mSize;
+    CircularBuffer mBuffer;
+    CommandStream mStream;
+};
+
 } // namespace filament
 
 #endif // TNT_FILAMENT_DRIVER_COMMANDSTREAM_H
@@ -27,6 +27,11 @@
 #include <filament/driver/BufferDescriptor.h>
 #include <filament/driver/PixelBufferDescriptor.h>
 
+#include <utils/Log.h>
+
+#include <algorithm>
+#include <exception>
+
 using namespace utils;
 
 namespace filament {
@@ -43,6 +48,12 @@ DriverBase::~DriverBase() noexcept {
     delete mDispatcher;
 }
 
+Driver::HandleCount DriverBase::getHandleCount(HandleType type) const noexcept {
+    AtomicHandleCount const& count = mHandleCounts[size_t(type)];
+    return { count.live.load(std::memory_order_relaxed),
+             count.highWatermark.load(std::memory_order_relaxed) };
+}
+
 void DriverBase::purge() noexcept {
     std::vector<BufferDescriptor> buffersToPurge;
     std::unique_lock<std::mutex> lock(mPurgeLock);
@@ -55,6 +66,78 @@ void DriverBase::scheduleDestroySlow(BufferDescriptor&& buffer) noexcept {
     mBufferToPurge.push_back(std::move(buffer));
 }
 
+// ------------------------------------------------------------------------------------------------
+// HandleAllocator
+// ------------------------------------------------------------------------------------------------
+
+HandleAllocator::HandleAllocator(const char* name, size_t size) noexcept
+        : mArea(size),
+          mName(name),
+          mSlotCount(uint32_t(size >> MIN_ALIGNMENT_SHIFT)),
+          mGenerations(new std::atomic<uint8_t>[mSlotCount]()) {
+    // the generation must be able to tell apart any slot from the null handle
+    assert(mSlotCount <= INDEX_MASK);
+    for (auto& freeList : mFreeLists) {
+        freeList.store(EMPTY, std::memory_order_relaxed);
+    }
+}
+
+HandleAllocator::~HandleAllocator() noexcept {
+#ifndef NDEBUG
+    const size_t wm = std::min(mCursor.load(std::memory_order_relaxed), mSlotCount);
+    slog.d << mName << " handles: High watermark "
+           << (wm << MIN_ALIGNMENT_SHIFT) / 1024 << " KiB ("
+           << (wm * 100) / mSlotCount << "%)" << io::endl;
+#endif
+}
+
+HandleBase::HandleId HandleAllocator::allocate(size_t size) noexcept {
+    const size_t sizeClass = getSizeClass(size);
+    std::atomic<uint64_t>& freeList = mFreeLists[sizeClass];
+
+    uint32_t index;
+    uint64_t head = freeList.load(std::memory_order_acquire);
+    while ((index = uint32_t(head)) != EMPTY) {
+        // the slot may be allocated by another thread in the meantime, in which case this
+        // reads garbage and the exchange below fails
+        const uint32_t next = getSlot(index)->load(std::memory_order_relaxed);
+        const uint64_t newHead = ((head >> 32u) + 1u) << 32u | next;
+        if (freeList.compare_exchange_weak(head, newHead,
+                std::memory_order_acquire, std::memory_order_acquire)) {
+            return HandleBase::HandleId(index) |
+                   HandleBase::HandleId(mGenerations[index].load(std::memory_order_relaxed))
+                           << GENERATION_SHIFT;
+        }
+    }
+
+    // no free slot of this size, take new ones
+    const uint32_t count = uint32_t(1u << sizeClass);
+    index = mCursor.fetch_add(count, std::memory_order_relaxed);
+    if (UTILS_UNLIKELY(index + count > mSlotCount)) {
+        slog.e << mName << " handle arena is full" << io::endl;
+        std::terminate();
+    }
+    // slots never allocated are at generation 0
+    return HandleBase::HandleId(index);
+}
+
+void HandleAllocator::free(HandleBase::HandleId id, size_t size) noexcept {
+    const uint32_t index = getIndex(id);
+    assert(isValid(id));
+    // this invalidates all the existing handles to this slot
+    mGenerations[index].fetch_add(1, std::memory_order_relaxed);
+
+    std::atomic<uint32_t>* const slot = new(getSlot(index)) std::atomic<uint32_t>();
+    std::atomic<uint64_t>& freeList = mFreeLists[getSizeClass(size)];
+    uint64_t head = freeList.load(std::memory_order_relaxed);
+    uint64_t newHead;
+    do {
+        slot->store(uint32_t(head), std::memory_order_relaxed);
+        newHead = ((head >> 32u) + 1u) << 32u | index;
+    } while (!freeList.compare_exchange_weak(head, newHead,
+            std::memory_order_release, std::memory_order_relaxed));
+}
+
 // ------------------------------------------------------------------------------------------------
 // Texture format data...
 // ------------------------------------------------------------------------------------------------
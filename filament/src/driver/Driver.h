@@ -26,6 +26,7 @@
 #include <utils/compiler.h>
 #include <utils/Log.h>
 
+#include <filament/driver/BlobCache.h>
 #include <filament/driver/PixelBufferDescriptor.h>
 #include <filament/driver/BufferDescriptor.h>
 #include <filament/driver/ExternalContext.h>
@@ -102,6 +103,28 @@ public:
     using SwapChainHandle       = Handle<HwSwapChain>;
     using StreamHandle          = Handle<HwStream>;
 
+    // the types of the objects above, used to count them
+    enum class HandleType : uint8_t {
+        VERTEX_BUFFER,
+        INDEX_BUFFER,
+        RENDER_PRIMITIVE,
+        PROGRAM,
+        SAMPLER_BUFFER,
+        UNIFORM_BUFFER,
+        TEXTURE,
+        RENDER_TARGET,
+        FENCE,
+        SWAP_CHAIN,
+        STREAM,
+    };
+
+    static constexpr size_t HANDLE_TYPE_COUNT = size_t(HandleType::STREAM) + 1;
+
+    struct HandleCount {
+        uint32_t live = 0;              // objects of this type currently alive
+        uint32_t highWatermark = 0;     // maximum number of objects of this type alive at once
+    };
+
     struct Attribute {
         uint32_t offset = 0;
         uint8_t stride = 0;
@@ -230,6 +253,13 @@ public:
 
     virtual Dispatcher& getDispatcher() noexcept = 0;
 
+    // can be called from any thread
+    virtual HandleCount getHandleCount(HandleType type) const noexcept = 0;
+
+    // called once, before any command, with the storage the application provides for the
+    // results of expensive operations (e.g. program binaries). Can be nullptr.
+    virtual void setBlobCache(driver::BlobCache* blobCache) noexcept = 0;
+
 #ifndef NDEBUG
     virtual void debugCommand(const char* methodName) {}
 #endif
@@ -18,10 +18,13 @@
 #define TNT_FILAMENT_DRIVER_DRIVERBASE_H
 
 #include <array>
+#include <atomic>
+#include <memory>
 #include <mutex>
 #include <assert.h>
 #include <stdint.h>
 
+#include <utils/Allocator.h>
 #include <utils/compiler.h>
 #include <utils/CString.h>
 
@@ -46,6 +49,8 @@ struct HwBase {
 };
 
 struct HwVertexBuffer : public HwBase {
+    static constexpr Driver::HandleType HANDLE_TYPE = Driver::HandleType::VERTEX_BUFFER;
+
     static constexpr size_t MAX_ATTRIBUTE_BUFFER_COUNT = Driver::MAX_ATTRIBUTE_BUFFER_COUNT;
 
     Driver::AttributeArray attributes;    // 8*6
@@ -67,6 +72,8 @@ struct HwVertexBuffer : public HwBase {
 };
 
 struct HwIndexBuffer : public HwBase {
+    static constexpr Driver::HandleType HANDLE_TYPE = Driver::HandleType::INDEX_BUFFER;
+
     HwIndexBuffer(uint8_t elementSize, uint32_t indexCount) noexcept :
             count(indexCount), elementSize(elementSize) {
     }
@@ -75,6 +82,8 @@ struct HwIndexBuffer : public HwBase {
 };
 
 struct HwRenderPrimitive : public HwBase {
+    static constexpr Driver::HandleType HANDLE_TYPE = Driver::HandleType::RENDER_PRIMITIVE;
+
     HwRenderPrimitive() noexcept = default;
     uint32_t offset = 0;
     uint32_t minIndex = 0;
@@ -85,6 +94,8 @@ struct HwRenderPrimitive : public HwBase {
 };
 
 struct HwProgram : public HwBase {
+    static constexpr Driver::HandleType HANDLE_TYPE = Driver::HandleType::PROGRAM;
+
 #if defined(NDEBUG)
     HwProgram(const utils::CString& name) noexcept { }
 #else
@@ -94,17 +105,23 @@ struct HwProgram : public HwBase {
 };
 
 struct HwSamplerBuffer : public HwBase {
+    static constexpr Driver::HandleType HANDLE_TYPE = Driver::HandleType::SAMPLER_BUFFER;
+
     HwSamplerBuffer(size_t size) noexcept : sb(new SamplerBuffer(size)) { }
     // NOTE: we have to use out-of-line allocation here because the size of a Handle<> is limited
     std::unique_ptr<SamplerBuffer> sb;
 };
 
 struct HwUniformBuffer : public HwBase {
+    static constexpr Driver::HandleType HANDLE_TYPE = Driver::HandleType::UNIFORM_BUFFER;
+
     HwUniformBuffer(size_t size) noexcept : ub(size) { }
     UniformBuffer ub;
 };
 
 struct HwTexture : public HwBase {
+    static constexpr Driver::HandleType HANDLE_TYPE = Driver::HandleType::TEXTURE;
+
     HwTexture(driver::SamplerType target, uint8_t levels, uint8_t samples,
               uint32_t width, uint32_t height, uint32_t depth) noexcept
             : width(width), height(height), depth(depth),
@@ -119,6 +136,8 @@ struct HwTexture : public HwBase {
 };
 
 struct HwRenderTarget : public HwBase {
+    static constexpr Driver::HandleType HANDLE_TYPE = Driver::HandleType::RENDER_TARGET;
+
     HwRenderTarget() = default;
     HwRenderTarget(uint32_t w, uint32_t h) : width(w), height(h) {}
     uint32_t width;
@@ -126,14 +145,20 @@ struct HwRenderTarget : public HwBase {
 };
 
 struct HwFence : public HwBase {
+    static constexpr Driver::HandleType HANDLE_TYPE = Driver::HandleType::FENCE;
+
     driver::ExternalContext::Fence* fence;
 };
 
 struct HwSwapChain : public HwBase {
+    static constexpr Driver::HandleType HANDLE_TYPE = Driver::HandleType::SWAP_CHAIN;
+
     driver::ExternalContext::SwapChain* swapChain;
 };
 
 struct HwStream : public HwBase {
+    static constexpr Driver::HandleType HANDLE_TYPE = Driver::HandleType::STREAM;
+
     HwStream() = default;
     HwStream(driver::ExternalContext::Stream* stream) : stream(stream) { }
     driver::ExternalContext::Stream* stream = nullptr;
@@ -141,6 +166,85 @@ struct HwStream : public HwBase {
     uint32_t height = 0;
 };
 
+/*
+ * Allocates the memory of the hardware handles
+ *
+ * Handles are created on the engine thread (createXXXSynchronous) and destroyed on the driver
+ * thread, so the allocator is lock-free: each size class has its own free list, and slots never
+ * used before are taken from the end of the area.
+ *
+ * A HandleId is the index of the handle's slot (in units of 16 bytes from the beginning of the
+ * area) and, in its upper bits, the generation of that slot, which is incremented every time
+ * the slot is freed. isValid() tells apart a stale handle from a live one.
+ */
+
+class HandleAllocator {
+public:
+    static constexpr size_t MIN_ALIGNMENT_SHIFT = 4;
+    static constexpr size_t MIN_SIZE = 1u << MIN_ALIGNMENT_SHIFT;
+    static constexpr size_t MAX_SIZE = 1024;
+
+    HandleAllocator(const char* name, size_t size) noexcept;
+    ~HandleAllocator() noexcept;
+
+    HandleAllocator(HandleAllocator const& rhs) = delete;
+    HandleAllocator& operator=(HandleAllocator const& rhs) = delete;
+
+    // can be called from any thread, fails if the area is full
+    HandleBase::HandleId allocate(size_t size) noexcept;
+
+    // 'size' must be the size given to allocate()
+    void free(HandleBase::HandleId id, size_t size) noexcept;
+
+    // returns the address of a handle's object
+    void* handle_cast(HandleBase::HandleId id) const noexcept {
+        return static_cast<char*>(mArea.begin()) + (getIndex(id) << MIN_ALIGNMENT_SHIFT);
+    }
+
+    // returns whether the handle has not been freed
+    bool isValid(HandleBase::HandleId id) const noexcept {
+        const uint32_t index = getIndex(id);
+        return index < mSlotCount &&
+                mGenerations[index].load(std::memory_order_relaxed) == getGeneration(id);
+    }
+
+private:
+    static constexpr uint32_t GENERATION_SHIFT = 24;
+    static constexpr uint32_t INDEX_MASK = (1u << GENERATION_SHIFT) - 1u;
+    static constexpr size_t SIZE_CLASS_COUNT = 7;   // 16 to 1024 bytes
+    static constexpr uint32_t EMPTY = 0xFFFFFFFF;
+
+    static uint32_t getIndex(HandleBase::HandleId id) noexcept { return id & INDEX_MASK; }
+    static uint8_t getGeneration(HandleBase::HandleId id) noexcept {
+        return uint8_t(id >> GENERATION_SHIFT);
+    }
+
+    static size_t getSizeClass(size_t size) noexcept {
+        assert(size <= MAX_SIZE);
+        size_t c = 0;
+        while ((MIN_SIZE << c) < size) {
+            c++;
+        }
+        return c;
+    }
+
+    std::atomic<uint32_t>* getSlot(uint32_t index) const noexcept {
+        return static_cast<std::atomic<uint32_t>*>(handle_cast(index));
+    }
+
+    utils::HeapArea mArea;
+    const char* const mName;
+    const uint32_t mSlotCount;
+    std::unique_ptr<std::atomic<uint8_t>[]> mGenerations;
+
+    // index of the first slot never allocated
+    std::atomic<uint32_t> mCursor = { 0 };
+
+    // the index of the first free slot of each size class, each free slot holding the index
+    // of the next one. The upper 32 bits are incremented by each operation to avoid ABA issues.
+    std::atomic<uint64_t> mFreeLists[SIZE_CLASS_COUNT];
+};
+
 /*
  * Base class of all Driver implementations
  */
@@ -158,12 +262,17 @@ public:
 
     Dispatcher& getDispatcher() noexcept override final { return *mDispatcher; }
 
+    HandleCount getHandleCount(HandleType type) const noexcept override final;
+
+    void setBlobCache(driver::BlobCache* blobCache) noexcept override { mBlobCache = blobCache; }
+
     // --------------------------------------------------------------------------------------------
     // Privates
     // --------------------------------------------------------------------------------------------
 
 protected:
     Dispatcher* mDispatcher;
+    driver::BlobCache* mBlobCache = nullptr;
 
     inline void scheduleDestroy(BufferDescriptor&& buffer) noexcept {
         if (buffer.hasCallback()) {
@@ -173,7 +282,33 @@ protected:
 
     void scheduleDestroySlow(BufferDescriptor&& buffer) noexcept;
 
+    // must be called by the concrete drivers when the object of a Handle<B> is constructed and
+    // when it is destroyed, from any thread
+    template<typename B>
+    void onHandleConstructed() noexcept {
+        AtomicHandleCount& count = mHandleCounts[size_t(B::HANDLE_TYPE)];
+        const uint32_t live = count.live.fetch_add(1, std::memory_order_relaxed) + 1;
+        uint32_t highWatermark = count.highWatermark.load(std::memory_order_relaxed);
+        while (highWatermark < live && !count.highWatermark.compare_exchange_weak(
+                highWatermark, live, std::memory_order_relaxed)) {
+        }
+    }
+
+    template<typename B>
+    void onHandleDestroyed() noexcept {
+        AtomicHandleCount& count = mHandleCounts[size_t(B::HANDLE_TYPE)];
+        assert(count.live.load(std::memory_order_relaxed) > 0);
+        count.live.fetch_sub(1, std::memory_order_relaxed);
+    }
+
 private:
+    struct AtomicHandleCount {
+        std::atomic<uint32_t> live = { 0 };
+        std::atomic<uint32_t> highWatermark = { 0 };
+    };
+
+    AtomicHandleCount mHandleCounts[HANDLE_TYPE_COUNT];
+
     using TF = Driver::TextureFormat;
     using SF = Driver::SamplerFormat;
     using SP = Driver::SamplerPrecision;
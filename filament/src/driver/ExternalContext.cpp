@@ -14,6 +14,7 @@
  * limitations under the License.
  */
 
+#include <filament/driver/BlobCache.h>
 #include <filament/driver/ExternalContext.h>
 
 #if defined(ANDROID)
@@ -46,6 +47,8 @@ namespace driver {
 // this generates the vtable in this translation unit
 ExternalContext::~ExternalContext() noexcept = default;
 
+BlobCache::~BlobCache() noexcept = default;
+
 ContextManagerGL::~ContextManagerGL() noexcept = default;
 
 ContextManagerVk::~ContextManagerVk() noexcept = default;
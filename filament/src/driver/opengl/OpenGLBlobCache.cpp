@@ -0,0 +1,119 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "driver/opengl/OpenGLBlobCache.h"
+
+#include <utils/Log.h>
+
+#include <memory>
+
+#include <string.h>
+
+using namespace utils;
+
+namespace filament {
+
+// increment when the layout of the keys or blobs changes
+static constexpr uint64_t BLOB_CACHE_VERSION = 1;
+
+// 64-bits FNV-1a
+static uint64_t hash(uint64_t h, const void* data, size_t size) noexcept {
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < size; i++) {
+        h = (h ^ p[i]) * 0x100000001b3ull;
+    }
+    return h;
+}
+
+static uint64_t hash(uint64_t h, const char* string) noexcept {
+    return string ? hash(h, string, strlen(string)) : h;
+}
+
+static constexpr uint64_t HASH_SEED = 0xcbf29ce484222325ull;
+
+OpenGLBlobCache::OpenGLBlobCache() noexcept {
+    GLint formatCount = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formatCount);
+    mIsSupported = formatCount > 0;
+
+    uint64_t h = hash(HASH_SEED, &BLOB_CACHE_VERSION, sizeof(BLOB_CACHE_VERSION));
+    h = hash(h, (const char*) glGetString(GL_VENDOR));
+    h = hash(h, (const char*) glGetString(GL_RENDERER));
+    h = hash(h, (const char*) glGetString(GL_VERSION));
+    mDriverHash = h;
+}
+
+OpenGLBlobCache::Key OpenGLBlobCache::getKey(Program const& program) const noexcept {
+    Key key = {};
+    key.driverHash = mDriverHash;
+    auto const& sources = program.getShadersSource();
+    for (size_t i = 0; i < Program::NUM_SHADER_TYPES; i++) {
+        key.sourceHash[i] = hash(HASH_SEED, sources[i].c_str(), sources[i].size());
+        key.sourceSize[i] = uint32_t(sources[i].size());
+    }
+    return key;
+}
+
+GLuint OpenGLBlobCache::retrieve(driver::BlobCache& cache, Key const& key) const noexcept {
+    const size_t size = cache.retrieve(&key, sizeof(key), nullptr, 0);
+    if (size <= sizeof(Header)) {
+        return 0;
+    }
+
+    std::unique_ptr<uint8_t[]> blob(new uint8_t[size]);
+    if (cache.retrieve(&key, sizeof(key), blob.get(), size) != size) {
+        return 0;
+    }
+    Header header;
+    memcpy(&header, blob.get(), sizeof(header));
+    if (header.size != size - sizeof(Header)) {
+        return 0;
+    }
+
+    GLuint program = glCreateProgram();
+    glProgramBinary(program, header.format, blob.get() + sizeof(Header), GLsizei(header.size));
+
+    GLint status = GL_FALSE;
+    glGetProgramiv(program, GL_LINK_STATUS, &status);
+    if (UTILS_UNLIKELY(status != GL_TRUE)) {
+        // this is expected after the driver is updated without changing its version string
+        slog.w << "Cached program binary rejected by the driver" << io::endl;
+        glDeleteProgram(program);
+        return 0;
+    }
+    return program;
+}
+
+void OpenGLBlobCache::insert(driver::BlobCache& cache, Key const& key, GLuint program) const noexcept {
+    GLint length = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0) {
+        return;
+    }
+
+    std::unique_ptr<uint8_t[]> blob(new uint8_t[sizeof(Header) + length]);
+    Header header = {};
+    GLsizei written = 0;
+    glGetProgramBinary(program, length, &written, &header.format, blob.get() + sizeof(Header));
+    if (written <= 0) {
+        return;
+    }
+    header.size = uint32_t(written);
+    memcpy(blob.get(), &header, sizeof(header));
+    cache.insert(&key, sizeof(key), blob.get(), sizeof(Header) + written);
+}
+
+} // namespace filament
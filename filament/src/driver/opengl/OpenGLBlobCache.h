@@ -0,0 +1,75 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef TNT_FILAMENT_DRIVER_OPENGLBLOBCACHE_H
+#define TNT_FILAMENT_DRIVER_OPENGLBLOBCACHE_H
+
+#include <filament/driver/BlobCache.h>
+
+#include "driver/opengl/gl_headers.h"
+#include "driver/Program.h"
+
+#include <stdint.h>
+
+namespace filament {
+
+/*
+ * Keeps the binaries of the linked programs in the application's BlobCache, so that the next
+ * runs can skip compiling and linking them.
+ *
+ * A binary is only valid for the same driver, the key of a program includes a hash of the
+ * GL_VENDOR, GL_RENDERER and GL_VERSION strings in addition to a hash of its sources (which
+ * identify the material and variant). If the driver rejects a binary anyway, the program is
+ * compiled from its sources and its new binary replaces the old one.
+ */
+class OpenGLBlobCache {
+public:
+    struct Key {
+        uint64_t driverHash;
+        uint64_t sourceHash[Program::NUM_SHADER_TYPES];
+        uint32_t sourceSize[Program::NUM_SHADER_TYPES];
+    };
+
+    // queries the GL, the context must be current
+    OpenGLBlobCache() noexcept;
+
+    // whether the GL can save program binaries at all
+    bool isSupported() const noexcept { return mIsSupported; }
+
+    Key getKey(Program const& program) const noexcept;
+
+    // creates and links a program from its cached binary, returns 0 if there is none or if the
+    // driver rejects it
+    GLuint retrieve(driver::BlobCache& cache, Key const& key) const noexcept;
+
+    // stores the binary of a linked program, which must have been created with
+    // GL_PROGRAM_BINARY_RETRIEVABLE_HINT
+    void insert(driver::BlobCache& cache, Key const& key, GLuint program) const noexcept;
+
+private:
+    // stored before the binary in a blob
+    struct Header {
+        GLenum format;
+        uint32_t size;
+    };
+
+    uint64_t mDriverHash = 0;
+    bool mIsSupported = false;
+};
+
+} // namespace filament
+
+#endif // TNT_FILAMENT_DRIVER_OPENGLBLOBCACHE_H
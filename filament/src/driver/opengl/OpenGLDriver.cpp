@@ -96,7 +96,7 @@ std::unique_ptr<Driver> OpenGLDriver::create(
 
 OpenGLDriver::OpenGLDriver(ContextManagerGL* externalContext) noexcept
         : DriverBase(new ConcreteDispatcher<OpenGLDriver>(this)),
-          mHandleArena("Handles", 2U * 1024U * 1024U), // TODO: set the amount in configuration
+          mHandleAllocator("Handles", 2U * 1024U * 1024U), // TODO: set the amount in configuration
           mSamplerMap(32),
           mContextManager(*externalContext) {
     state.enables.caps.set(getIndexForCap(GL_DITHER));
@@ -126,6 +126,7 @@ OpenGLDriver::OpenGLDriver(ContextManagerGL* externalContext) noexcept
     glGetIntegerv(GL_MAJOR_VERSION, &major);
     glGetIntegerv(GL_MINOR_VERSION, &minor);
     glGetIntegerv(GL_MAX_RENDERBUFFER_SIZE, &mMaxRenderBufferSize);
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &mMaxTextureSize);
 
     if (strstr(renderer, "Adreno")) {
         bugs.clears_hurt_performance = true;
@@ -677,51 +678,8 @@ default_case:
 // -- less than 128 bytes
 
 
-OpenGLDriver::HandleAllocator::HandleAllocator(const utils::HeapArea& area)
-        : mPool0(area.begin(),
-                  pointermath::add(area.begin(), (1 * area.getSize()) / 16)),
-          mPool1( pointermath::add(area.begin(), (1 * area.getSize()) / 16),
-                  pointermath::add(area.begin(), (6 * area.getSize()) / 16)),
-          mPool2( pointermath::add(area.begin(), (6 * area.getSize()) / 16),
-                  area.end()) {
-
-#ifndef NDEBUG
-    slog.d << "HwFence: " << sizeof(HwFence) << io::endl;
-    slog.d << "GLIndexBuffer: " << sizeof(GLIndexBuffer) << io::endl;
-    slog.d << "GLSamplerBuffer: " << sizeof(GLSamplerBuffer) << io::endl;
-    slog.d << "GLRenderPrimitive: " << sizeof(GLRenderPrimitive) << io::endl;
-    slog.d << "GLTexture: " << sizeof(GLTexture) << io::endl;
-    slog.d << "OpenGLProgram: " << sizeof(OpenGLProgram) << io::endl;
-    slog.d << "GLRenderTarget: " << sizeof(GLRenderTarget) << io::endl;
-    slog.d << "GLVertexBuffer: " << sizeof(GLVertexBuffer) << io::endl;
-    slog.d << "GLUniformBuffer: " << sizeof(GLUniformBuffer) << io::endl;
-    slog.d << "GLStream: " << sizeof(GLStream) << io::endl;
-#endif
-}
-
-void* OpenGLDriver::HandleAllocator::alloc(size_t size, size_t alignment, size_t extra) noexcept {
-    assert(size <= mPool2.getSize());
-    if (size <= mPool0.getSize()) return mPool0.alloc(size, 16, extra);
-    if (size <= mPool1.getSize()) return mPool1.alloc(size, 32, extra);
-    if (size <= mPool2.getSize()) return mPool2.alloc(size, 32, extra);
-    return nullptr;
-}
-
-void OpenGLDriver::HandleAllocator::free(void* p, size_t size) noexcept {
-    if (size <= mPool0.getSize()) { mPool0.free(p); return; }
-    if (size <= mPool1.getSize()) { mPool1.free(p); return; }
-    if (size <= mPool2.getSize()) { mPool2.free(p); return; }
-}
-
-
-// This is "NOINLINE" because it ends-up generating more code than we'd like because of
-// the locking (unfortunately, mHandleArena is accessed from 2 threads)
-UTILS_NOINLINE
 HandleBase::HandleId OpenGLDriver::allocateHandle(size_t size) noexcept {
-    void* addr = mHandleArena.alloc(size);
-    char* const base = (char *)mHandleArena.getArea().begin();
-    size_t offset = (char*)addr - base;
-    return HandleBase::HandleId(offset >> HandleAllocator::MIN_ALIGNMENT_SHIFT);
+    return mHandleAllocator.allocate(size);
 }
 
 template<typename D, typename B, typename ... ARGS>
@@ -734,6 +692,7 @@ OpenGLDriver::construct(Handle<B> const& handle, ARGS&& ... args) noexcept {
 #if !defined(NDEBUG) && UTILS_HAS_RTTI
     addr->typeId = typeid(D).name();
 #endif
+    onHandleConstructed<B>();
     return addr;
 }
 
@@ -750,7 +709,8 @@ void OpenGLDriver::destruct(Handle<B>& handle, D const* p) noexcept {
         const_cast<D *>(p)->typeId = "(deleted)";
 #endif
         p->~D();
-        mHandleArena.free(const_cast<D*>(p), sizeof(D));
+        mHandleAllocator.free(handle.getId(), sizeof(D));
+        onHandleDestroyed<B>();
     }
 }
 
@@ -1444,6 +1404,10 @@ bool OpenGLDriver::isFrameTimeSupported() {
     return mContextManager.canCreateFence();
 }
 
+uint32_t OpenGLDriver::getMaxTextureSize() {
+    return uint32_t(mMaxTextureSize);
+}
+
 // ------------------------------------------------------------------------------------------------
 // Swap chains
 // ------------------------------------------------------------------------------------------------
@@ -1525,16 +1489,19 @@ void OpenGLDriver::beginRenderPass(Driver::RenderTargetHandle rth,
     const TargetBufferFlags clearFlags = (TargetBufferFlags) params.clear;
     const TargetBufferFlags discardFlags = (TargetBufferFlags) params.discardStart;
 
+    // Shadow map passes are flagged with the SHADOW bits minus DEPTH, so they can either clear
+    // or keep the depth buffer. This is set for each pass because consecutive passes can use
+    // the same framebuffer.
+    if (clearFlags & (TargetBufferFlags::SHADOW & ~TargetBufferFlags::DEPTH)) {
+        enable(GL_POLYGON_OFFSET_FILL);
+    } else {
+        disable(GL_POLYGON_OFFSET_FILL);
+    }
+
     GLRenderTarget* rt = handle_cast<GLRenderTarget*>(rth);
     if (UTILS_UNLIKELY(state.draw_fbo != rt->gl.fbo)) {
         bindFramebuffer(GL_FRAMEBUFFER, rt->gl.fbo);
 
-        if ((clearFlags & TargetBufferFlags::SHADOW) == TargetBufferFlags::SHADOW) {
-            enable(GL_POLYGON_OFFSET_FILL);
-        } else {
-            disable(GL_POLYGON_OFFSET_FILL);
-        }
-
         // glInvalidateFramebuffer appeared on GLES 3.0 and GL4.3, for simplicity we just
         // ignore it on GL (rather than having to do a runtime check).
         if (GLES31_HEADERS) {
@@ -2590,11 +2557,14 @@ void OpenGLDriver::blit(TargetBufferFlags buffers,
         GLRenderTarget const* d = handle_cast<GLRenderTarget const*>(dst);
         bindFramebuffer(GL_READ_FRAMEBUFFER, s->gl.fbo);
         bindFramebuffer(GL_DRAW_FRAMEBUFFER, d->gl.fbo);
+        // depth and stencil buffers can only be blitted with GL_NEAREST
+        const GLenum filter =
+                (mask & (GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT)) ? GL_NEAREST : GL_LINEAR;
         disable(GL_SCISSOR_TEST);
         glBlitFramebuffer(
                 srcLeft, srcBottom, srcLeft + srcWidth, srcBottom + srcHeight,
                 dstLeft, dstBottom, dstLeft + dstWidth, dstBottom + dstHeight,
-                mask, GL_LINEAR);
+                mask, filter);
         enable(GL_SCISSOR_TEST);
         CHECK_GL_ERROR(utils::slog.e)
     }
@@ -2620,6 +2590,37 @@ void OpenGLDriver::draw(
     CHECK_GL_ERROR(utils::slog.e)
 }
 
+void OpenGLDriver::drawInstanced(
+        Driver::ProgramHandle ph,
+        Driver::RasterState rs,
+        Driver::RenderPrimitiveHandle rph,
+        uint32_t instanceCount) {
+    DEBUG_MARKER()
+
+    OpenGLProgram* p = handle_cast<OpenGLProgram*>(ph);
+    useProgram(p);
+
+    const GLRenderPrimitive* rp = handle_cast<const GLRenderPrimitive *>(rph);
+    bindVertexArray(rp);
+
+    setRasterState(rs);
+
+    // there is no instanced version of glDrawRangeElements()
+    glDrawElementsInstanced(GLenum(rp->type), rp->count,
+            rp->gl.indicesType, reinterpret_cast<const void*>(rp->offset), GLsizei(instanceCount));
+
+    CHECK_GL_ERROR(utils::slog.e)
+}
+
+void OpenGLDriver::preparePipeline(
+        Driver::ProgramHandle ph,
+        Driver::RasterState rs,
+        Driver::VertexBufferHandle vbh,
+        uint32_t enabledAttributes,
+        Driver::PrimitiveType pt) {
+    // GL has no pipeline objects, the programs are linked by createProgram()
+}
+
 // explicit instantiation of the Dispatcher
 template class ConcreteDispatcher<OpenGLDriver>;
 
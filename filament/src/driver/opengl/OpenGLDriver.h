@@ -20,6 +20,7 @@
 #include "driver/Driver.h"
 #include "driver/DriverBase.h"
 #include "driver/opengl/GLUtils.h"
+#include "driver/opengl/OpenGLBlobCache.h"
 
 #include <utils/compiler.h>
 #include <utils/Allocator.h>
@@ -201,28 +202,7 @@ private:
 
     // Memory management...
 
-    class HandleAllocator {
-        utils::PoolAllocator< 16, 16>   mPool0;
-        utils::PoolAllocator< 64, 32>   mPool1;
-        utils::PoolAllocator<128, 32>   mPool2;
-    public:
-        static constexpr size_t MIN_ALIGNMENT_SHIFT = 4;
-        HandleAllocator(const utils::HeapArea& area);
-        void* alloc(size_t size, size_t alignment, size_t extra = 0) noexcept;
-        void free(void* p, size_t size) noexcept;
-    };
-
-    // the arenas for handle allocation needs to be thread-safe
-#ifndef NDEBUG
-    using HandleArena = utils::Arena<HandleAllocator,
-            utils::LockingPolicy::SpinLock,
-            utils::TrackingPolicy::HighWatermark>;
-#else
-    using HandleArena = utils::Arena<HandleAllocator,
-            utils::LockingPolicy::SpinLock>;
-#endif
-
-    HandleArena mHandleArena;
+    HandleAllocator mHandleAllocator;
 
     HandleBase::HandleId allocateHandle(size_t size) noexcept;
 
@@ -247,9 +227,9 @@ private:
             std::is_pointer<Dp>::value &&
             std::is_base_of<B, typename std::remove_pointer<Dp>::type>::value, Dp>::type
     handle_cast(Handle<B>& handle) noexcept {
-        char* const base = (char *)mHandleArena.getArea().begin();
-        size_t offset = handle.getId() << HandleAllocator::MIN_ALIGNMENT_SHIFT;
-        return static_cast<Dp>(static_cast<void *>(base + offset));
+        // catches the use of a destroyed object
+        assert(!handle || mHandleAllocator.isValid(handle.getId()));
+        return static_cast<Dp>(mHandleAllocator.handle_cast(handle.getId()));
     }
 
 private:
@@ -369,6 +349,7 @@ private:
 
     GLRenderPrimitive mDefaultVAO;
     GLint mMaxRenderBufferSize = 0;
+    GLint mMaxTextureSize = 0;
 
     template <typename T, typename F>
     inline void update_state(T& state, T const& expected, F functor, bool force = false) noexcept {
@@ -460,6 +441,9 @@ private:
     GLfloat mMaxAnisotropy = 0.0f;
     ShaderModel mShaderModel;
 
+    // saves and restores the program binaries, see OpenGLProgram
+    OpenGLBlobCache mGLBlobCache;
+
     // state required to represent the current render pass
     Driver::RenderTargetHandle mRenderPassTarget;
     Driver::RenderPassParams mRenderPassParams;
@@ -23,6 +23,7 @@
 #include <utils/compiler.h>
 #include <utils/Panic.h>
 
+#include "driver/opengl/OpenGLBlobCache.h"
 #include "driver/opengl/OpenGLDriver.h"
 
 namespace filament {
@@ -35,62 +36,83 @@ OpenGLProgram::OpenGLProgram(OpenGLDriver* gl, const Program& programBuilder) no
 
     using Shader = Program::Shader;
 
-    const auto& shadersSource = programBuilder.getShadersSource();
-
-    // build all shaders
-    #pragma nounroll
-    for (size_t i = 0; i < Program::NUM_SHADER_TYPES; i++) {
-        GLenum glShaderType;
-        Shader type = (Shader)i;
-        switch (type) {
-            case Shader::VERTEX:
-                glShaderType = GL_VERTEX_SHADER;
-                break;
-            case Shader::FRAGMENT:
-                glShaderType = GL_FRAGMENT_SHADER;
-                break;
-        }
+    // a program linked by a previous run can be loaded from the application's cache
+    OpenGLBlobCache const& glBlobCache = gl->mGLBlobCache;
+    driver::BlobCache* const blobCache = glBlobCache.isSupported() ? gl->mBlobCache : nullptr;
+    OpenGLBlobCache::Key key = {};
+    GLuint program = 0;
+    if (blobCache) {
+        key = glBlobCache.getKey(programBuilder);
+        program = glBlobCache.retrieve(*blobCache, key);
+    }
 
-        if (shadersSource[i].length()) {
-            GLint status;
-            char const* const source = shadersSource[i].c_str();
+    if (!program) {
+        const auto& shadersSource = programBuilder.getShadersSource();
 
-            GLuint shaderId = glCreateShader(glShaderType);
-            glShaderSource(shaderId, 1, &source, nullptr);
-            glCompileShader(shaderId);
+        // build all shaders
+        #pragma nounroll
+        for (size_t i = 0; i < Program::NUM_SHADER_TYPES; i++) {
+            GLenum glShaderType;
+            Shader type = (Shader)i;
+            switch (type) {
+                case Shader::VERTEX:
+                    glShaderType = GL_VERTEX_SHADER;
+                    break;
+                case Shader::FRAGMENT:
+                    glShaderType = GL_FRAGMENT_SHADER;
+                    break;
+            }
 
-            glGetShaderiv(shaderId, GL_COMPILE_STATUS, &status);
-            if (UTILS_UNLIKELY(status != GL_TRUE)) {
-                logCompilationError(slog.e, shaderId, source);
-                glDeleteShader(shaderId);
-                return;
+            if (shadersSource[i].length()) {
+                GLint status;
+                char const* const source = shadersSource[i].c_str();
+
+                GLuint shaderId = glCreateShader(glShaderType);
+                glShaderSource(shaderId, 1, &source, nullptr);
+                glCompileShader(shaderId);
+
+                glGetShaderiv(shaderId, GL_COMPILE_STATUS, &status);
+                if (UTILS_UNLIKELY(status != GL_TRUE)) {
+                    logCompilationError(slog.e, shaderId, source);
+                    glDeleteShader(shaderId);
+                    return;
+                }
+                this->gl.shaders[i] = shaderId;
+                mValidShaderSet |= 1U << i;
             }
-            this->gl.shaders[i] = shaderId;
-            mValidShaderSet |= 1U << i;
         }
     }
 
     // we need at least a vertex and fragment program
     const uint8_t validShaderSet = mValidShaderSet;
     const uint8_t mask = VERTEX_SHADER_BIT | FRAGMENT_SHADER_BIT;
-    if (UTILS_LIKELY((mValidShaderSet & mask) == mask)) {
-        GLint status;
-        GLuint program = glCreateProgram();
-        for (size_t i = 0; i < Program::NUM_SHADER_TYPES; i++) {
-            if (validShaderSet & (1U << i)) {
-                glAttachShader(program, this->gl.shaders[i]);
+    if (UTILS_LIKELY(program || (mValidShaderSet & mask) == mask)) {
+        if (!program) {
+            GLint status;
+            program = glCreateProgram();
+            for (size_t i = 0; i < Program::NUM_SHADER_TYPES; i++) {
+                if (validShaderSet & (1U << i)) {
+                    glAttachShader(program, this->gl.shaders[i]);
+                }
             }
-        }
-        glLinkProgram(program);
+            if (blobCache) {
+                glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+            }
+            glLinkProgram(program);
 
-        glGetProgramiv(program, GL_LINK_STATUS, &status);
-        if (UTILS_UNLIKELY(status != GL_TRUE)) {
-            char error[512];
-            glGetProgramInfoLog(program, sizeof(error), nullptr, error);
+            glGetProgramiv(program, GL_LINK_STATUS, &status);
+            if (UTILS_UNLIKELY(status != GL_TRUE)) {
+                char error[512];
+                glGetProgramInfoLog(program, sizeof(error), nullptr, error);
 
-            slog.e << "LINKING: " << error << io::endl;
-            glDeleteProgram(program);
-            return;
+                slog.e << "LINKING: " << error << io::endl;
+                glDeleteProgram(program);
+                return;
+            }
+
+            if (blobCache) {
+                glBlobCache.insert(*blobCache, key, program);
+            }
         }
         this->gl.program = program;
 
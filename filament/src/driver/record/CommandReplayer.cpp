@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "driver/record/CommandReplayer.h"
+
+#include <utils/Log.h>
+
+using namespace utils;
+
+namespace filament {
+
+CommandReplayer::CommandReplayer(Driver& driver, void* data, size_t size) noexcept
+        : mDriver(driver), mReader(data, size) {
+}
+
+CommandReplayer::~CommandReplayer() noexcept = default;
+
+size_t CommandReplayer::replay() {
+    size_t count = 0;
+    while (!mReader.empty()) {
+        const CommandId id = mReader.read<CommandId>();
+        if (UTILS_UNLIKELY(mReader.failed())) {
+            break;
+        }
+        if (UTILS_UNLIKELY(!execute(id))) {
+            slog.e << "invalid command in the driver commands recording" << io::endl;
+            break;
+        }
+        if (UTILS_UNLIKELY(mReader.failed())) {
+            break;
+        }
+        count++;
+    }
+    if (UTILS_UNLIKELY(mReader.failed())) {
+        // the last command wasn't executed
+        slog.e << "the driver commands recording is truncated" << io::endl;
+    }
+    return count;
+}
+
+bool CommandReplayer::execute(CommandId id) {
+    // these are part of the engine's lifecycle rather than of the recorded content and have
+    // nothing to replay, the caller terminates the driver
+    if (id == CommandId::terminate || id == CommandId::updateStreams) {
+        return true;
+    }
+
+    Dispatcher& dispatcher = mDriver.getDispatcher();
+    switch (id) {
+#define DECL_DRIVER_API(methodName, paramsDecl, params)                                         \
+        case CommandId::methodName:                                                             \
+            executeAsync<decltype(&Driver::methodName), &Driver::methodName>(                   \
+                    dispatcher.methodName##_, &Driver::methodName);                             \
+            return true;
+
+#define DECL_DRIVER_API_SYNCHRONOUS(RetType, methodName, paramsDecl, params)                    \
+        case CommandId::methodName:                                                             \
+            executeSynchronous(&Driver::methodName);                                            \
+            return true;
+
+#define DECL_DRIVER_API_RETURN(RetType, methodName, paramsDecl, params)                         \
+        case CommandId::methodName##Synchronous:                                                \
+            readResult(mDriver.methodName##Synchronous());                                      \
+            return true;                                                                        \
+        case CommandId::methodName:                                                             \
+            executeAsync<decltype(&Driver::methodName), &Driver::methodName>(                   \
+                    dispatcher.methodName##_, &Driver::methodName);                             \
+            return true;
+
+#include "driver/DriverAPI.inc"
+    }
+    return false;
+}
+
+} // namespace filament
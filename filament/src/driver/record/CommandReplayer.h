@@ -0,0 +1,113 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef TNT_FILAMENT_DRIVER_COMMANDREPLAYER_H
+#define TNT_FILAMENT_DRIVER_COMMANDREPLAYER_H
+
+#include "driver/Driver.h"
+#include "driver/CommandStream.h"
+#include "driver/record/CommandSerialization.h"
+
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+namespace filament {
+
+/*
+ * Executes the commands recorded by RecordingDriver on another Driver, in the calling thread.
+ *
+ * The recording must stay alive until the driver is terminated, buffers are passed to the
+ * driver without being copied. Native objects (windows, streams, external images) can't be
+ * recorded and are replayed as nullptr. The driver itself is not terminated by the replay.
+ */
+class CommandReplayer {
+public:
+    // 'data' must be aligned to CommandWriter::PAYLOAD_ALIGNMENT, see CommandReader::isValid()
+    CommandReplayer(Driver& driver, void* data, size_t size) noexcept;
+    ~CommandReplayer() noexcept;
+
+    CommandReplayer(CommandReplayer const& rhs) = delete;
+    CommandReplayer& operator=(CommandReplayer const& rhs) = delete;
+
+    // executes all the commands and returns how many were executed, this stops at the first
+    // invalid command or at the first command cut by the end of a truncated recording
+    size_t replay();
+
+private:
+    bool execute(CommandId id);
+
+    // reads the parameters of an asynchronous command and executes it
+    template<typename M, M METHOD, typename... ARGS>
+    void executeAsync(Dispatcher::Execute execute, void (Driver::*)(ARGS...)) {
+        std::tuple<typename std::decay<ARGS>::type...> args{
+                mReader.read<typename std::decay<ARGS>::type>()... };
+        if (UTILS_UNLIKELY(mReader.failed())) {
+            return;
+        }
+        executeAsync<M, METHOD>(execute, args, std::index_sequence_for<ARGS...>{});
+    }
+
+    template<typename M, M METHOD, typename T, size_t... I>
+    void executeAsync(Dispatcher::Execute execute, T& args, std::index_sequence<I...>) {
+        executeCommand<M, METHOD>(mDriver, execute, std::get<I>(args)...);
+    }
+
+    // reads the parameters of a synchronous call, calls it and reads its recorded result
+    template<typename R, typename... ARGS>
+    void executeSynchronous(R (Driver::*method)(ARGS...)) {
+        std::tuple<typename std::decay<ARGS>::type...> args{
+                mReader.read<typename std::decay<ARGS>::type>()... };
+        if (UTILS_UNLIKELY(mReader.failed())) {
+            return;
+        }
+        R result = call(method, args, std::index_sequence_for<ARGS...>{});
+        readResult(result);
+    }
+
+    template<typename... ARGS>
+    void executeSynchronous(void (Driver::*method)(ARGS...)) {
+        std::tuple<typename std::decay<ARGS>::type...> args{
+                mReader.read<typename std::decay<ARGS>::type>()... };
+        if (UTILS_UNLIKELY(mReader.failed())) {
+            return;
+        }
+        call(method, args, std::index_sequence_for<ARGS...>{});
+    }
+
+    template<typename R, typename... ARGS, typename T, size_t... I>
+    R call(R (Driver::*method)(ARGS...), T& args, std::index_sequence<I...>) {
+        return (mDriver.*method)(std::move(std::get<I>(args))...);
+    }
+
+    template<typename T>
+    void readResult(Handle<T> const& result) {
+        mReader.setHandle(mReader.read<HandleBase::HandleId>(), result.getId());
+    }
+
+    template<typename T>
+    void readResult(T const&) {
+        // the replayed result can legitimately differ (e.g. a fence's status)
+        mReader.read<T>();
+    }
+
+    Driver& mDriver;
+    CommandReader mReader;
+};
+
+} // namespace filament
+
+#endif // TNT_FILAMENT_DRIVER_COMMANDREPLAYER_H
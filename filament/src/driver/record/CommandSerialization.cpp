@@ -0,0 +1,381 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "driver/record/CommandSerialization.h"
+
+#include <utils/Log.h>
+
+#include <string>
+
+using namespace utils;
+
+namespace filament {
+
+using namespace driver;
+
+// ------------------------------------------------------------------------------------------------
+// CommandWriter
+// ------------------------------------------------------------------------------------------------
+
+CommandWriter::CommandWriter(FILE* file) noexcept : mFile(file) {
+    mBuffer.reserve(FLUSH_SIZE + FLUSH_SIZE / 4);
+    FileHeader header;
+    writeBytes(&header, sizeof(header));
+}
+
+CommandWriter::CommandWriter(std::vector<uint8_t>& recording) noexcept : mRecording(&recording) {
+    mBuffer.reserve(FLUSH_SIZE + FLUSH_SIZE / 4);
+    FileHeader header;
+    writeBytes(&header, sizeof(header));
+}
+
+CommandWriter::~CommandWriter() noexcept {
+    flush();
+    if (mFile) {
+        fclose(mFile);
+    }
+}
+
+void CommandWriter::flush() noexcept {
+    if (!mBuffer.empty()) {
+        if (mRecording) {
+            mRecording->insert(mRecording->end(), mBuffer.begin(), mBuffer.end());
+        } else if (fwrite(mBuffer.data(), 1, mBuffer.size(), mFile) != mBuffer.size()) {
+            slog.e << "error writing the driver commands recording" << io::endl;
+        }
+        mBuffer.clear();
+    }
+}
+
+void CommandWriter::writeBytes(void const* data, size_t size) noexcept {
+    uint8_t const* const p = static_cast<uint8_t const*>(data);
+    mBuffer.insert(mBuffer.end(), p, p + size);
+    mOffset += size;
+}
+
+void CommandWriter::writePayload(void const* data, size_t size) noexcept {
+    write(size);
+    if (size) {
+        // pad so that the replay can use the payload in place
+        const size_t padding = (PAYLOAD_ALIGNMENT - (mOffset % PAYLOAD_ALIGNMENT)) % PAYLOAD_ALIGNMENT;
+        mBuffer.insert(mBuffer.end(), padding, 0);
+        mOffset += padding;
+        writeBytes(data, size);
+    }
+}
+
+void CommandWriter::write(Driver::TargetBufferInfo const& info) noexcept {
+    write(info.handle);
+    write(info.level);
+    write(info.layer);
+}
+
+void CommandWriter::write(FaceOffsets const& offsets) noexcept {
+    writeBytes(offsets.offsets, sizeof(offsets.offsets));
+}
+
+void CommandWriter::write(BufferDescriptor const& buffer) noexcept {
+    writePayload(buffer.buffer, buffer.buffer ? buffer.size : 0);
+}
+
+void CommandWriter::write(PixelBufferDescriptor const& buffer) noexcept {
+    write(static_cast<BufferDescriptor const&>(buffer));
+    write(buffer.left);
+    write(buffer.top);
+    write(buffer.type);
+    write(buffer.alignment);
+    if (buffer.type == PixelDataType::COMPRESSED) {
+        write(buffer.imageSize);
+        write(buffer.compressedFormat);
+    } else {
+        write(buffer.stride);
+        write(buffer.format);
+    }
+}
+
+void CommandWriter::write(UniformBuffer const& buffer) noexcept {
+    writePayload(buffer.getBuffer(), buffer.getSize());
+}
+
+void CommandWriter::write(SamplerBuffer const& buffer) noexcept {
+    const size_t count = buffer.getSize();
+    write(count);
+    SamplerBuffer::Sampler const* const samplers = buffer.getBuffer();
+    for (size_t i = 0; i < count; i++) {
+        write(samplers[i].t);
+        write(samplers[i].s);
+    }
+}
+
+void CommandWriter::write(Program const& program) noexcept {
+    write(program.getName());
+    write(program.getVariant());
+    for (CString const& source : program.getShadersSource()) {
+        write(source);
+    }
+
+    for (UniformInterfaceBlock const* uib : program.getUniformInterfaceBlocks()) {
+        write(bool(uib != nullptr));
+        if (uib) {
+            write(uib->getName());
+            auto const& list = uib->getUniformInfoList();
+            write(list.size());
+            for (auto const& info : list) {
+                write(info.name);
+                write(info.size);
+                write(info.type);
+                write(info.precision);
+            }
+        }
+    }
+
+    for (SamplerInterfaceBlock const* sib : program.getSamplerInterfaceBlocks()) {
+        write(bool(sib != nullptr));
+        if (sib) {
+            write(sib->getName());
+            auto const& list = sib->getSamplerInfoList();
+            write(list.size());
+            for (auto const& info : list) {
+                write(info.name);
+                write(info.type);
+                write(info.format);
+                write(info.precision);
+                write(info.multisample);
+            }
+        }
+    }
+
+    SamplerBindingMap const* bindings = program.getSamplerBindings();
+    write(bool(bindings != nullptr));
+    if (bindings) {
+        auto const& list = bindings->getBindingList();
+        write(list.size());
+        for (SamplerBindingInfo const& info : list) {
+            write(info);
+        }
+    }
+}
+
+void CommandWriter::write(CString const& string) noexcept {
+    write(string.size());
+    writeBytes(string.c_str(), string.size());
+    write('\0');
+}
+
+void CommandWriter::write(const char* string) noexcept {
+    const size_t length = string ? strlen(string) : 0;
+    write(length);
+    writeBytes(string, length);
+    write('\0');
+}
+
+// ------------------------------------------------------------------------------------------------
+// CommandReader
+// ------------------------------------------------------------------------------------------------
+
+bool CommandReader::isValid(void const* data, size_t size) noexcept {
+    FileHeader header;
+    if (size < sizeof(header)) {
+        return false;
+    }
+    memcpy(&header, data, sizeof(header));
+    return header.magic == FileHeader::MAGIC &&
+           header.version == FileHeader::VERSION &&
+           header.pointerSize == sizeof(void*);
+}
+
+CommandReader::CommandReader(void* data, size_t size) noexcept
+        : mBegin(static_cast<char*>(data)),
+          mCurrent(mBegin + sizeof(FileHeader)),
+          mEnd(mBegin + size) {
+    assert(isValid(data, size));
+    assert((uintptr_t(data) % CommandWriter::PAYLOAD_ALIGNMENT) == 0);
+}
+
+CommandReader::~CommandReader() noexcept = default;
+
+bool CommandReader::canRead(size_t size) noexcept {
+    if (UTILS_UNLIKELY(mFailed || size > size_t(mEnd - mCurrent))) {
+        mFailed = true;
+        mCurrent = mEnd;
+        return false;
+    }
+    return true;
+}
+
+void CommandReader::readBytes(void* data, size_t size) noexcept {
+    if (UTILS_UNLIKELY(!canRead(size))) {
+        // this also ends the loops over a count read from the recording
+        memset(data, 0, size);
+        return;
+    }
+    memcpy(data, mCurrent, size);
+    mCurrent += size;
+}
+
+void* CommandReader::readPayload(size_t size) noexcept {
+    if (!size) {
+        return nullptr;
+    }
+    const size_t offset = size_t(mCurrent - mBegin);
+    const size_t padding = (CommandWriter::PAYLOAD_ALIGNMENT -
+            (offset % CommandWriter::PAYLOAD_ALIGNMENT)) % CommandWriter::PAYLOAD_ALIGNMENT;
+    if (UTILS_UNLIKELY(!canRead(padding))) {
+        return nullptr;
+    }
+    mCurrent += padding;
+    if (UTILS_UNLIKELY(!canRead(size))) {
+        return nullptr;
+    }
+    void* const payload = mCurrent;
+    mCurrent += size;
+    return payload;
+}
+
+const char* CommandReader::readString(size_t length) noexcept {
+    // the string is followed by its null terminator
+    if (UTILS_UNLIKELY(!canRead(length) || !canRead(length + 1))) {
+        return "";
+    }
+    const char* const string = mCurrent;
+    mCurrent += length + 1;
+    return string;
+}
+
+Driver::TargetBufferInfo CommandReader::read(Type<Driver::TargetBufferInfo>) noexcept {
+    Driver::TargetBufferInfo info;
+    info.handle = read<Driver::TextureHandle>();
+    info.level = read<uint8_t>();
+    info.layer = read<uint16_t>();
+    return info;
+}
+
+FaceOffsets CommandReader::read(Type<FaceOffsets>) noexcept {
+    FaceOffsets offsets;
+    readBytes(offsets.offsets, sizeof(offsets.offsets));
+    return offsets;
+}
+
+BufferDescriptor CommandReader::read(Type<BufferDescriptor>) noexcept {
+    const size_t size = read<size_t>();
+    // the recording owns the data, so there is no callback
+    return BufferDescriptor(readPayload(size), size);
+}
+
+PixelBufferDescriptor CommandReader::read(Type<PixelBufferDescriptor>) noexcept {
+    const size_t size = read<size_t>();
+    void* const data = readPayload(size);
+    const uint32_t left = read<uint32_t>();
+    const uint32_t top = read<uint32_t>();
+    const PixelDataType type = read<PixelDataType>();
+    const uint8_t alignment = read<uint8_t>();
+    if (type == PixelDataType::COMPRESSED) {
+        const uint32_t imageSize = read<uint32_t>();
+        const CompressedPixelDataType format = read<CompressedPixelDataType>();
+        return PixelBufferDescriptor(data, size, format, imageSize, nullptr);
+    }
+    const uint32_t stride = read<uint32_t>();
+    const PixelDataFormat format = read<PixelDataFormat>();
+    return PixelBufferDescriptor(data, size, format, type, alignment, left, top, stride);
+}
+
+UniformBuffer CommandReader::read(Type<UniformBuffer>) noexcept {
+    const size_t size = read<size_t>();
+    void const* const data = readPayload(size);
+    UniformBuffer buffer(size);
+    if (data) {
+        memcpy(buffer.invalidateUniforms(0, size), data, size);
+    }
+    return buffer;
+}
+
+SamplerBuffer CommandReader::read(Type<SamplerBuffer>) noexcept {
+    const size_t count = read<size_t>();
+    SamplerBuffer buffer(count);
+    for (size_t i = 0; i < count; i++) {
+        Driver::TextureHandle t = read<Driver::TextureHandle>();
+        SamplerParams s = read<SamplerParams>();
+        buffer.setSampler(i, { t, s });
+    }
+    return buffer;
+}
+
+Program CommandReader::read(Type<Program>) noexcept {
+    Program program;
+    CString name = read<CString>();
+    const uint8_t variant = read<uint8_t>();
+    program.diagnostics(name, variant);
+    for (size_t i = 0; i < Program::NUM_SHADER_TYPES; i++) {
+        program.shader(Program::Shader(i), read<CString>());
+    }
+
+    // the interface blocks are rebuilt in the order they were declared, which yields the
+    // same layout
+    for (size_t i = 0; i < Program::NUM_UNIFORM_BINDINGS; i++) {
+        if (read<bool>()) {
+            UniformInterfaceBlock::Builder builder;
+            builder.name(read<const char*>());
+            for (size_t j = 0, c = read<size_t>(); j < c; j++) {
+                std::string uniformName(read<const char*>());
+                const uint32_t size = read<uint32_t>();
+                const auto type = read<UniformInterfaceBlock::Type>();
+                const auto precision = read<UniformInterfaceBlock::Precision>();
+                builder.add(uniformName, size, type, precision);
+            }
+            mUniformBlocks.emplace_back(new UniformInterfaceBlock(builder.build()));
+            program.addUniformBlock(i, mUniformBlocks.back().get());
+        }
+    }
+
+    for (size_t i = 0; i < Program::NUM_SAMPLER_BINDINGS; i++) {
+        if (read<bool>()) {
+            SamplerInterfaceBlock::Builder builder;
+            builder.name(read<const char*>());
+            for (size_t j = 0, c = read<size_t>(); j < c; j++) {
+                std::string samplerName(read<const char*>());
+                const auto type = read<SamplerInterfaceBlock::Type>();
+                const auto format = read<SamplerInterfaceBlock::Format>();
+                const auto precision = read<SamplerInterfaceBlock::Precision>();
+                const bool multisample = read<bool>();
+                builder.add(samplerName, type, format, precision, multisample);
+            }
+            mSamplerBlocks.emplace_back(new SamplerInterfaceBlock(builder.build()));
+            program.addSamplerBlock(i, mSamplerBlocks.back().get());
+        }
+    }
+
+    if (read<bool>()) {
+        mSamplerBindings.emplace_back(new SamplerBindingMap());
+        SamplerBindingMap* bindings = mSamplerBindings.back().get();
+        for (size_t j = 0, c = read<size_t>(); j < c; j++) {
+            bindings->addSampler(read<SamplerBindingInfo>());
+        }
+        program.withSamplerBindings(bindings);
+    }
+    return program;
+}
+
+CString CommandReader::read(Type<CString>) noexcept {
+    const size_t length = read<size_t>();
+    const char* const string = readString(length);
+    return mFailed ? CString() : CString(string, length);
+}
+
+const char* CommandReader::read(Type<const char*>) noexcept {
+    return readString(read<size_t>());
+}
+
+} // namespace filament
@@ -0,0 +1,253 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef TNT_FILAMENT_DRIVER_COMMANDSERIALIZATION_H
+#define TNT_FILAMENT_DRIVER_COMMANDSERIALIZATION_H
+
+#include "driver/CommandStream.h"
+#include "driver/Driver.h"
+
+#include <filament/SamplerBindingMap.h>
+#include <filament/SamplerInterfaceBlock.h>
+#include <filament/UniformInterfaceBlock.h>
+
+#include <utils/compiler.h>
+#include <utils/CString.h>
+
+#include <memory>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * A recording of the driver commands is a header followed by the commands, in the order they
+ * were executed. Each command is its CommandId followed by its parameters, see CommandWriter.
+ *
+ * Handles are recorded with the id the recorded driver gave them. The creation of a handle is
+ * recorded as its own command (e.g. createTextureSynchronous), which lets the replay map them to
+ * the handles of the replaying driver.
+ *
+ * Recordings are only meant to be replayed on the same architecture, values are recorded with
+ * their in-memory representation.
+ */
+
+namespace filament {
+
+// identifies the commands in a recording, one per Driver API
+enum class CommandId : uint16_t {
+#define DECL_DRIVER_API(methodName, paramsDecl, params)                         methodName,
+#define DECL_DRIVER_API_SYNCHRONOUS(RetType, methodName, paramsDecl, params)    methodName,
+#define DECL_DRIVER_API_RETURN(RetType, methodName, paramsDecl, params)         \
+        methodName##Synchronous, methodName,
+#include "driver/DriverAPI.inc"
+};
+
+struct FileHeader {
+    static constexpr uint32_t MAGIC = 0x43524446;   // 'FDRC'
+    static constexpr uint32_t VERSION = 2;
+    uint32_t magic = MAGIC;
+    uint32_t version = VERSION;
+    uint32_t pointerSize = sizeof(void*);
+    uint32_t reserved = 0;
+};
+
+// Executes a single command on a driver, as if it came from a CommandStream. 'execute' must be
+// the entry of METHOD in the driver's Dispatcher.
+template<typename M, M METHOD, typename... ARGS>
+void executeCommand(Driver& driver, Dispatcher::Execute execute, ARGS&&... args) {
+    using Cmd = typename CommandType<M>::template Command<METHOD>;
+    typename std::aligned_storage<sizeof(Cmd), alignof(Cmd)>::type storage;
+    CommandBase* const command = new(&storage) Cmd(execute, std::forward<ARGS>(args)...);
+    // this also destroys the command
+    command->execute(driver);
+}
+
+// ------------------------------------------------------------------------------------------------
+
+/*
+ * Writes commands to a file, or to memory. It's not thread-safe.
+ *
+ * Trivially copyable parameters are written as-is. Buffers are written as their size followed
+ * by their content, aligned to PAYLOAD_ALIGNMENT from the beginning of the file. Pointers that
+ * are not strings can't be recorded, they're replayed as nullptr.
+ */
+class CommandWriter {
+public:
+    static constexpr size_t PAYLOAD_ALIGNMENT = 16;
+
+    // takes ownership of the file, the header is written immediately
+    explicit CommandWriter(FILE* file) noexcept;
+
+    // appends the recording to 'recording' instead, which must outlive the CommandWriter
+    explicit CommandWriter(std::vector<uint8_t>& recording) noexcept;
+    ~CommandWriter() noexcept;
+
+    CommandWriter(CommandWriter const& rhs) = delete;
+    CommandWriter& operator=(CommandWriter const& rhs) = delete;
+
+    template<typename... ARGS>
+    void writeCommand(CommandId id, std::tuple<ARGS...> const& args) noexcept {
+        write(id);
+        writeAll(args, std::index_sequence_for<ARGS...>{});
+        if (UTILS_UNLIKELY(mBuffer.size() >= FLUSH_SIZE)) {
+            flush();
+        }
+    }
+
+    // writes the buffered commands to the file, or appends them to the recording
+    void flush() noexcept;
+
+private:
+    static constexpr size_t FLUSH_SIZE = 1024 * 1024;
+
+    template<typename T, size_t... I>
+    void writeAll(T const& args, std::index_sequence<I...>) noexcept {
+        UTILS_UNUSED int dummy[] = { 0, (write(std::get<I>(args)), 0)... };
+    }
+
+    template<typename T, typename = typename std::enable_if<
+            std::is_trivially_copyable<T>::value && !std::is_pointer<T>::value>::type>
+    void write(T const& value) noexcept {
+        writeBytes(&value, sizeof(T));
+    }
+
+    template<typename T>
+    void write(Handle<T> const& handle) noexcept {
+        write(handle.getId());
+    }
+
+    void write(Driver::TargetBufferInfo const& info) noexcept;
+    void write(driver::FaceOffsets const& offsets) noexcept;
+    void write(driver::BufferDescriptor const& buffer) noexcept;
+    void write(driver::PixelBufferDescriptor const& buffer) noexcept;
+    void write(UniformBuffer const& buffer) noexcept;
+    void write(SamplerBuffer const& buffer) noexcept;
+    void write(Program const& program) noexcept;
+    void write(utils::CString const& string) noexcept;
+    void write(const char* string) noexcept;
+    void write(void const*) noexcept { }
+
+    void writePayload(void const* data, size_t size) noexcept;
+    void writeBytes(void const* data, size_t size) noexcept;
+
+    FILE* const mFile = nullptr;
+    std::vector<uint8_t>* const mRecording = nullptr;
+    std::vector<uint8_t> mBuffer;
+    size_t mOffset = 0;     // offset from the beginning of the file
+};
+
+// ------------------------------------------------------------------------------------------------
+
+/*
+ * Reads commands written by CommandWriter. The recording must stay alive while the commands are
+ * read and executed: buffers and strings point directly into it. Objects that only exist by
+ * pointer in the commands (e.g. a Program's interface blocks) are owned by the CommandReader.
+ *
+ * Reading past the end of the recording (e.g. if it was truncated) sets failed(), the values
+ * read from then on are zeros, null buffers and empty strings.
+ */
+class CommandReader {
+public:
+    // returns false if the data is not a recording this build can read
+    static bool isValid(void const* data, size_t size) noexcept;
+
+    // 'data' must be aligned to CommandWriter::PAYLOAD_ALIGNMENT
+    CommandReader(void* data, size_t size) noexcept;
+    ~CommandReader() noexcept;
+
+    CommandReader(CommandReader const& rhs) = delete;
+    CommandReader& operator=(CommandReader const& rhs) = delete;
+
+    bool empty() const noexcept { return mCurrent >= mEnd; }
+
+    // true if a read went past the end of the recording
+    bool failed() const noexcept { return mFailed; }
+
+    template<typename T>
+    T read() noexcept {
+        return read(Type<T>{});
+    }
+
+    // handles read after this call with the 'recorded' id are replaced by 'replayed'
+    void setHandle(HandleBase::HandleId recorded, HandleBase::HandleId replayed) {
+        mHandles[recorded] = replayed;
+    }
+
+private:
+    template<typename T>
+    struct Type { };
+
+    template<typename T>
+    typename std::enable_if<
+            std::is_trivially_copyable<T>::value && !std::is_pointer<T>::value, T>::type
+    read(Type<T>) noexcept {
+        T value;
+        readBytes(&value, sizeof(T));
+        return value;
+    }
+
+    template<typename T>
+    Handle<T> read(Type<Handle<T>>) noexcept {
+        const HandleBase::HandleId id = getHandle(read<HandleBase::HandleId>());
+        return id == HandleBase::nullid ? Handle<T>() : Handle<T>(id);
+    }
+
+    template<typename T>
+    T* read(Type<T*>) noexcept {
+        return nullptr;
+    }
+
+    Driver::TargetBufferInfo read(Type<Driver::TargetBufferInfo>) noexcept;
+    driver::FaceOffsets read(Type<driver::FaceOffsets>) noexcept;
+    driver::BufferDescriptor read(Type<driver::BufferDescriptor>) noexcept;
+    driver::PixelBufferDescriptor read(Type<driver::PixelBufferDescriptor>) noexcept;
+    UniformBuffer read(Type<UniformBuffer>) noexcept;
+    SamplerBuffer read(Type<SamplerBuffer>) noexcept;
+    Program read(Type<Program>) noexcept;
+    utils::CString read(Type<utils::CString>) noexcept;
+    const char* read(Type<const char*>) noexcept;
+
+    HandleBase::HandleId getHandle(HandleBase::HandleId recorded) const noexcept {
+        auto pos = mHandles.find(recorded);
+        return pos != mHandles.end() ? pos->second : recorded;
+    }
+
+    // returns false, and fails the reader, if there are less than 'size' bytes left
+    bool canRead(size_t size) noexcept;
+
+    void* readPayload(size_t size) noexcept;
+    void readBytes(void* data, size_t size) noexcept;
+    const char* readString(size_t length) noexcept;
+
+    char* const mBegin;
+    char* mCurrent;
+    char* const mEnd;
+    bool mFailed = false;
+    std::unordered_map<HandleBase::HandleId, HandleBase::HandleId> mHandles;
+    std::vector<std::unique_ptr<UniformInterfaceBlock>> mUniformBlocks;
+    std::vector<std::unique_ptr<SamplerInterfaceBlock>> mSamplerBlocks;
+    std::vector<std::unique_ptr<SamplerBindingMap>> mSamplerBindings;
+};
+
+} // namespace filament
+
+#endif // TNT_FILAMENT_DRIVER_COMMANDSERIALIZATION_H
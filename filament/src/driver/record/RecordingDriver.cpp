@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "driver/record/RecordingDriver.h"
+
+#include <utils/Log.h>
+
+using namespace utils;
+
+namespace filament {
+
+std::unique_ptr<Driver> RecordingDriver::create(std::unique_ptr<Driver> target, const char* path) {
+    FILE* file = fopen(path, "wb");
+    if (!file) {
+        slog.e << "could not create the driver commands recording " << path << io::endl;
+        return target;
+    }
+    slog.i << "recording the driver commands to " << path << io::endl;
+    return std::unique_ptr<Driver>(new RecordingDriver(std::move(target), file));
+}
+
+std::unique_ptr<Driver> RecordingDriver::create(std::unique_ptr<Driver> target,
+        std::vector<uint8_t>& recording) {
+    return std::unique_ptr<Driver>(new RecordingDriver(std::move(target), recording));
+}
+
+RecordingDriver::RecordingDriver(std::unique_ptr<Driver> target, FILE* file) noexcept
+        : mTarget(std::move(target)),
+          mDispatcher(new ConcreteDispatcher<RecordingDriver>(this)),
+          mWriter(file) {
+}
+
+RecordingDriver::RecordingDriver(std::unique_ptr<Driver> target,
+        std::vector<uint8_t>& recording) noexcept
+        : mTarget(std::move(target)),
+          mDispatcher(new ConcreteDispatcher<RecordingDriver>(this)),
+          mWriter(recording) {
+}
+
+RecordingDriver::~RecordingDriver() noexcept {
+    delete mDispatcher;
+}
+
+void RecordingDriver::purge() noexcept {
+    mTarget->purge();
+}
+
+Driver::ShaderModel RecordingDriver::getShaderModel() const noexcept {
+    return mTarget->getShaderModel();
+}
+
+Driver::HandleCount RecordingDriver::getHandleCount(HandleType type) const noexcept {
+    return mTarget->getHandleCount(type);
+}
+
+void RecordingDriver::setBlobCache(driver::BlobCache* blobCache) noexcept {
+    mTarget->setBlobCache(blobCache);
+}
+
+#ifndef NDEBUG
+void RecordingDriver::debugCommand(const char* methodName) {
+    mTarget->debugCommand(methodName);
+}
+#endif
+
+// explicit instantiation of the Dispatcher
+template class ConcreteDispatcher<RecordingDriver>;
+
+} // namespace filament
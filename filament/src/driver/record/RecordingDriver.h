@@ -0,0 +1,144 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef TNT_FILAMENT_DRIVER_RECORDINGDRIVER_H
+#define TNT_FILAMENT_DRIVER_RECORDINGDRIVER_H
+
+#include "driver/Driver.h"
+#include "driver/CommandStream.h"
+#include "driver/record/CommandSerialization.h"
+
+#include <utils/compiler.h>
+#include <utils/Mutex.h>
+
+#include <memory>
+#include <mutex>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace filament {
+
+/*
+ * A Driver that records all the commands it receives to a file, or to memory, before forwarding
+ * them to another Driver. The recording can be replayed with CommandReplayer, e.g. to benchmark a driver
+ * without running the engine.
+ *
+ * The synchronous calls are made from the engine's thread while the other commands are executed
+ * on the driver's thread, the file has them in the order they were executed by the driver.
+ */
+class RecordingDriver final : public Driver {
+    RecordingDriver(std::unique_ptr<Driver> target, FILE* file) noexcept;
+    RecordingDriver(std::unique_ptr<Driver> target, std::vector<uint8_t>& recording) noexcept;
+    virtual ~RecordingDriver() noexcept;
+
+public:
+    // returns 'target' itself if the recording can't be created
+    static std::unique_ptr<Driver> create(std::unique_ptr<Driver> target, const char* path);
+
+    // records to memory, 'recording' is complete once the driver is destroyed
+    static std::unique_ptr<Driver> create(std::unique_ptr<Driver> target,
+            std::vector<uint8_t>& recording);
+
+private:
+    void purge() noexcept override;
+
+    ShaderModel getShaderModel() const noexcept override;
+
+    Dispatcher& getDispatcher() noexcept override { return *mDispatcher; }
+
+    HandleCount getHandleCount(HandleType type) const noexcept override;
+
+    void setBlobCache(driver::BlobCache* blobCache) noexcept override;
+
+#ifndef NDEBUG
+    void debugCommand(const char* methodName) override;
+#endif
+
+    template<typename... ARGS>
+    void record(CommandId id, std::tuple<ARGS...> const& args) noexcept {
+        std::lock_guard<utils::Mutex> guard(mLock);
+        mWriter.writeCommand(id, args);
+    }
+
+    // the result of a synchronous call is recorded after its parameters
+    template<typename... ARGS, typename F>
+    auto recordSynchronous(CommandId id, std::tuple<ARGS...> const& args, F call)
+            -> typename std::enable_if<std::is_void<decltype(call())>::value>::type {
+        // the target is called first, without holding the lock, because it could be
+        // waiting for the driver thread (e.g. wait())
+        call();
+        record(id, args);
+    }
+
+    template<typename... ARGS, typename F>
+    auto recordSynchronous(CommandId id, std::tuple<ARGS...> const& args, F call)
+            -> typename std::enable_if<!std::is_void<decltype(call())>::value, decltype(call())>::type {
+        auto result = call();
+        record(id, std::tuple_cat(args, std::forward_as_tuple(result)));
+        return result;
+    }
+
+    // forwards an asynchronous command to the target
+    template<typename M, M METHOD, typename... ARGS>
+    void forwardCommand(Dispatcher::Execute execute, ARGS&&... args) {
+        executeCommand<M, METHOD>(*mTarget, execute, std::forward<ARGS>(args)...);
+    }
+
+    /*
+     * Driver interface
+     */
+
+    template<typename T>
+    friend class ConcreteDispatcher;
+
+#define DECL_DRIVER_API(methodName, paramsDecl, params)                                         \
+    void methodName(paramsDecl) {                                                               \
+        record(CommandId::methodName, std::forward_as_tuple(params));                           \
+        forwardCommand<decltype(&Driver::methodName), &Driver::methodName>(                     \
+                mTarget->getDispatcher().methodName##_, params);                                \
+    }
+
+#define DECL_DRIVER_API_SYNCHRONOUS(RetType, methodName, paramsDecl, params)                    \
+    RetType methodName(paramsDecl) override {                                                   \
+        return recordSynchronous(CommandId::methodName, std::forward_as_tuple(params),          \
+                [&]() { return mTarget->methodName(params); });                                 \
+    }
+
+#define DECL_DRIVER_API_RETURN(RetType, methodName, paramsDecl, params)                         \
+    RetType methodName##Synchronous() noexcept override {                                       \
+        RetType handle = mTarget->methodName##Synchronous();                                    \
+        record(CommandId::methodName##Synchronous, std::forward_as_tuple(handle));              \
+        return handle;                                                                          \
+    }                                                                                           \
+    void methodName(RetType handle, paramsDecl) {                                               \
+        record(CommandId::methodName, std::forward_as_tuple(handle, params));                   \
+        forwardCommand<decltype(&Driver::methodName), &Driver::methodName>(                     \
+                mTarget->getDispatcher().methodName##_, handle, params);                        \
+    }
+
+#include "driver/DriverAPI.inc"
+
+    std::unique_ptr<Driver> mTarget;
+    Dispatcher* const mDispatcher;
+    utils::Mutex mLock;
+    CommandWriter mWriter;
+};
+
+} // namespace filament
+
+#endif // TNT_FILAMENT_DRIVER_RECORDINGDRIVER_H
@@ -60,6 +60,49 @@ VulkanBinder::VulkanBinder() : mDefaultRasterState(createDefaultRasterState()) {
 
 VulkanBinder::~VulkanBinder() {
     destroyCache();
+    destroyPipelineCache();
+}
+
+void VulkanBinder::createPipelineCache(const void* data, size_t size) noexcept {
+    assert(mPipelines.empty());
+    destroyPipelineCache();
+    VkPipelineCacheCreateInfo createInfo = {};
+    createInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+    createInfo.initialDataSize = size;
+    createInfo.pInitialData = data;
+    VkResult err = vkCreatePipelineCache(mDevice, &createInfo, VKALLOC, &mPipelineCache);
+    if (err && size) {
+        // The data is ignored by the driver when it doesn't match the device, but it can still
+        // be rejected, in which case we start from an empty cache.
+        createInfo.initialDataSize = 0;
+        createInfo.pInitialData = nullptr;
+        err = vkCreatePipelineCache(mDevice, &createInfo, VKALLOC, &mPipelineCache);
+    }
+    if (err) {
+        utils::slog.e << "vkCreatePipelineCache error " << err << utils::io::endl;
+        mPipelineCache = VK_NULL_HANDLE;
+    }
+}
+
+std::vector<uint8_t> VulkanBinder::getPipelineCacheData() const noexcept {
+    std::vector<uint8_t> data;
+    size_t size = 0;
+    if (mPipelineCache &&
+            vkGetPipelineCacheData(mDevice, mPipelineCache, &size, nullptr) == VK_SUCCESS) {
+        data.resize(size);
+        if (vkGetPipelineCacheData(mDevice, mPipelineCache, &size, data.data()) != VK_SUCCESS) {
+            size = 0;
+        }
+        data.resize(size);
+    }
+    return data;
+}
+
+void VulkanBinder::destroyPipelineCache() noexcept {
+    if (mPipelineCache) {
+        vkDestroyPipelineCache(mDevice, mPipelineCache, VKALLOC);
+        mPipelineCache = VK_NULL_HANDLE;
+    }
 }
 
 bool VulkanBinder::getOrCreateDescriptor(VkDescriptorSet* descriptor,
@@ -202,18 +245,54 @@ bool VulkanBinder::getOrCreatePipeline(VkPipeline* pipeline) noexcept {
     }
 
     // If we reach this point, we need to create and stash a brand new pipeline object.
-    mShaderStages[0].module = mPipelineKey.shaders[0];
-    mShaderStages[1].module = mPipelineKey.shaders[1];
+    createPipeline(mPipelineKey, pipeline);
+
+    // Here we construct a PipelineVal in place, then stash its pointer to allow fast subsequent
+    // calls to getOrCreatePipeline when nothing has been dirtied. Note that the robin_map
+    // iterator type proffers a "value" method, which returns a stable reference.
+    mCurrentPipeline = &mPipelines.emplace(std::make_pair(mPipelineKey, PipelineVal {
+        *pipeline, mCurrentTime, true })).first.value();
+    mDirtyPipeline = false;
+    return true;
+}
+
+void VulkanBinder::preparePipeline(const ProgramBundle& bundle, const RasterState& rasterState,
+        VkRenderPass renderPass, VkPrimitiveTopology topology,
+        const VertexArray& varray) noexcept {
+    if (!mPipelineLayout) {
+        createLayoutsAndDescriptors();
+    }
+    PipelineKey key = {};
+    key.shaders[0] = bundle.vertex;
+    key.shaders[1] = bundle.fragment;
+    key.rasterState = rasterState;
+    key.renderPass = renderPass;
+    key.topology = topology;
+    for (uint32_t i = 0; i < MAX_VERTEX_ATTRIBUTES; i++) {
+        key.vertexAttributes[i] = varray.attributes[i];
+        key.vertexBuffers[i] = varray.buffers[i];
+    }
+    if (mPipelines.find(key) != mPipelines.end()) {
+        return;
+    }
+    VkPipeline pipeline;
+    createPipeline(key, &pipeline);
+    vkDestroyPipeline(mDevice, pipeline, VKALLOC);
+}
+
+void VulkanBinder::createPipeline(const PipelineKey& key, VkPipeline* pipeline) noexcept {
+    mShaderStages[0].module = key.shaders[0];
+    mShaderStages[1].module = key.shaders[1];
 
     // We don't store array sizes to save space, but it's quick to count all non-zero
     // entries because these arrays have a small fixed-size capacity.
     uint32_t numVertexAttribs = 0;
     uint32_t numVertexBuffers = 0;
     for (uint32_t i = 0; i < MAX_VERTEX_ATTRIBUTES; i++) {
-        if (mPipelineKey.vertexAttributes[i].format > 0) {
+        if (key.vertexAttributes[i].format > 0) {
             numVertexAttribs++;
         }
-        if (mPipelineKey.vertexBuffers[i].stride > 0) {
+        if (key.vertexBuffers[i].stride > 0) {
             numVertexBuffers++;
         }
     }
@@ -221,13 +300,13 @@ bool VulkanBinder::getOrCreatePipeline(VkPipeline* pipeline) noexcept {
     VkPipelineVertexInputStateCreateInfo vertexInputState = {};
     vertexInputState.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
     vertexInputState.vertexBindingDescriptionCount = numVertexBuffers;
-    vertexInputState.pVertexBindingDescriptions = mPipelineKey.vertexBuffers;
+    vertexInputState.pVertexBindingDescriptions = key.vertexBuffers;
     vertexInputState.vertexAttributeDescriptionCount = numVertexAttribs;
-    vertexInputState.pVertexAttributeDescriptions = mPipelineKey.vertexAttributes;
+    vertexInputState.pVertexAttributeDescriptions = key.vertexAttributes;
 
     VkPipelineInputAssemblyStateCreateInfo inputAssemblyState = {};
     inputAssemblyState.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
-    inputAssemblyState.topology = mPipelineKey.topology;
+    inputAssemblyState.topology = key.topology;
 
     VkPipelineViewportStateCreateInfo viewportState = {};
     viewportState.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
@@ -248,40 +327,33 @@ bool VulkanBinder::getOrCreatePipeline(VkPipeline* pipeline) noexcept {
     VkGraphicsPipelineCreateInfo pipelineCreateInfo = {};
     pipelineCreateInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
     pipelineCreateInfo.layout = mPipelineLayout;
-    pipelineCreateInfo.renderPass = mPipelineKey.renderPass;
+    pipelineCreateInfo.renderPass = key.renderPass;
     pipelineCreateInfo.stageCount = hasFragmentShader ? NUM_SHADER_MODULES : 1;
     pipelineCreateInfo.pStages = mShaderStages;
     pipelineCreateInfo.pVertexInputState = &vertexInputState;
     pipelineCreateInfo.pInputAssemblyState = &inputAssemblyState;
-    pipelineCreateInfo.pRasterizationState = &mPipelineKey.rasterState.rasterization;
+    pipelineCreateInfo.pRasterizationState = &key.rasterState.rasterization;
     pipelineCreateInfo.pColorBlendState = &mColorBlendState;
-    pipelineCreateInfo.pMultisampleState = &mPipelineKey.rasterState.multisampling;
+    pipelineCreateInfo.pMultisampleState = &key.rasterState.multisampling;
     pipelineCreateInfo.pViewportState = &viewportState;
-    pipelineCreateInfo.pDepthStencilState = &mPipelineKey.rasterState.depthStencil;
+    pipelineCreateInfo.pDepthStencilState = &key.rasterState.depthStencil;
     pipelineCreateInfo.pDynamicState = &dynamicState;
 
     // There are no color attachments if there is no bound fragment shader.  (e.g. shadow map gen)
     mColorBlendState.attachmentCount = hasFragmentShader ? 1 : 0;
+    mColorBlendState.pAttachments = &key.rasterState.blending;
 
     #if FILAMENT_VULKAN_VERBOSE
     utils::slog.d << "vkCreateGraphicsPipelines with shaders = ("
             << mShaderStages[0].module << ", " << mShaderStages[1].module << ")" << utils::io::endl;
     #endif
 
-    VkResult err = vkCreateGraphicsPipelines(mDevice, VK_NULL_HANDLE, 1, &pipelineCreateInfo,
+    VkResult err = vkCreateGraphicsPipelines(mDevice, mPipelineCache, 1, &pipelineCreateInfo,
             VKALLOC, pipeline);
     if (err) {
         utils::slog.e << "vkCreateGraphicsPipelines error " << err << utils::io::endl;
         utils::debug_trap();
     }
-
-    // Here we construct a PipelineVal in place, then stash its pointer to allow fast subsequent
-    // calls to getOrCreatePipeline when nothing has been dirtied. Note that the robin_map
-    // iterator type proffers a "value" method, which returns a stable reference.
-    mCurrentPipeline = &mPipelines.emplace(std::make_pair(mPipelineKey, PipelineVal {
-        *pipeline, mCurrentTime, true })).first.value();
-    mDirtyPipeline = false;
-    return true;
 }
 
 void VulkanBinder::bindProgramBundle(const ProgramBundle& bundle) noexcept {
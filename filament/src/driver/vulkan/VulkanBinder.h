@@ -114,6 +114,14 @@ public:
     ~VulkanBinder();
     void setDevice(VkDevice device) { mDevice = device; }
 
+    // The pipeline cache is given to the driver every time a pipeline is created, which makes the
+    // creation of a pipeline already seen, possibly in a previous run, much faster. It can be
+    // created with data returned by getPipelineCacheData(). This should be called after setDevice()
+    // and before any pipeline is created.
+    void createPipelineCache(const void* data = nullptr, size_t size = 0) noexcept;
+    std::vector<uint8_t> getPipelineCacheData() const noexcept;
+    void destroyPipelineCache() noexcept;
+
     // Clients should initialize their copy of the raster state using this method. They can then
     // mutate their copy and pass it back through bindRasterState().
     const RasterState& getDefaultRasterState() const { return mDefaultRasterState; }
@@ -126,6 +134,12 @@ public:
     // Returns true if any pipeline bindings have changed. (i.e., vkCmdBindPipeline is required)
     bool getOrCreatePipeline(VkPipeline* pipeline) noexcept;
 
+    // Creates the pipeline for the given states and destroys it right away, leaving its compiled
+    // form in the pipeline cache. This doesn't change the current bindings.
+    void preparePipeline(const ProgramBundle& bundle, const RasterState& rasterState,
+            VkRenderPass renderPass, VkPrimitiveTopology topology,
+            const VertexArray& varray) noexcept;
+
     // Each bind method is fast and does not make Vulkan calls.
     void bindProgramBundle(const ProgramBundle& bundle) noexcept;
     void bindRasterState(const RasterState& rasterState) noexcept;
@@ -232,6 +246,7 @@ private:
         DescriptorVal& operator=(DescriptorVal &&) = default;
     };
 
+    void createPipeline(const PipelineKey& key, VkPipeline* pipeline) noexcept;
     void createLayoutsAndDescriptors() noexcept;
     void destroyLayoutsAndDescriptors() noexcept;
     void evictDescriptors(std::function<bool(const DescriptorKey&)> filter) noexcept;
@@ -264,6 +279,7 @@ private:
     // Cached Vulkan objects. These objects are owned by the Binder.
     VkDescriptorSetLayout mDescriptorSetLayout = VK_NULL_HANDLE;
     VkPipelineLayout mPipelineLayout = VK_NULL_HANDLE;
+    VkPipelineCache mPipelineCache = VK_NULL_HANDLE;
     tsl::robin_map<PipelineKey, PipelineVal, PipelineHashFn, PipelineEqual> mPipelines;
     tsl::robin_map<DescriptorKey, DescriptorVal, DescHashFn, DescEqual> mDescriptorSets;
     VkDescriptorPool mDescriptorPool;
@@ -39,10 +39,34 @@ static constexpr bool SWAPCHAIN_HAS_DEPTH = true;
 namespace filament {
 namespace driver {
 
+static void setRasterState(VulkanBinder::RasterState& state,
+        const Driver::RasterState& rasterState) noexcept {
+    state.depthStencil = {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO,
+        .depthTestEnable = VK_TRUE,
+        .depthWriteEnable = (VkBool32) rasterState.depthWrite,
+        .depthCompareOp = getCompareOp(rasterState.depthFunc),
+        .depthBoundsTestEnable = VK_FALSE,
+        .stencilTestEnable = VK_FALSE,
+    };
+    state.blending = {
+        .blendEnable = rasterState.hasBlending(),
+        .srcColorBlendFactor = getBlendFactor(rasterState.blendFunctionSrcRGB),
+        .dstColorBlendFactor = getBlendFactor(rasterState.blendFunctionDstRGB),
+        .colorBlendOp = (VkBlendOp) rasterState.blendEquationRGB,
+        .srcAlphaBlendFactor = getBlendFactor(rasterState.blendFunctionSrcAlpha),
+        .dstAlphaBlendFactor = getBlendFactor(rasterState.blendFunctionDstAlpha),
+        .alphaBlendOp =  (VkBlendOp) rasterState.blendEquationAlpha,
+        .colorWriteMask = (VkColorComponentFlags) (rasterState.colorWrite ? 0xf : 0x0),
+    };
+}
+
 VulkanDriver::VulkanDriver(ContextManagerVk* externalContext,
         const char* const* ppEnabledExtensions, uint32_t enabledExtensionCount) noexcept :
         DriverBase(new ConcreteDispatcher<VulkanDriver>(this)),
-        mContextManager(*externalContext), mStagePool(mContext), mFramebufferCache(mContext),
+        mContextManager(*externalContext),
+        mHandleAllocator("Handles", 2U * 1024U * 1024U), // TODO: set the amount in configuration
+        mStagePool(mContext), mFramebufferCache(mContext),
         mSamplerCache(mContext) {
     mContext.rasterState = mBinder.getDefaultRasterState();
 
@@ -148,6 +172,7 @@ VulkanDriver::VulkanDriver(ContextManagerVk* externalContext,
     // Initialize device and graphicsQueue.
     createVirtualDevice(mContext);
     mBinder.setDevice(mContext.device);
+    mBinder.createPipelineCache();
 
     // Choose a depth format that meets our requirements. Take care not to include stencil formats
     // just yet, since that would require a corollary change to the "aspect" flags for the VkImage.
@@ -174,12 +199,46 @@ ShaderModel VulkanDriver::getShaderModel() const noexcept {
 #endif
 }
 
+void VulkanDriver::setBlobCache(BlobCache* blobCache) noexcept {
+    DriverBase::setBlobCache(blobCache);
+    if (!blobCache) {
+        return;
+    }
+    const PipelineCacheKey key = getPipelineCacheKey();
+    std::vector<uint8_t> data(blobCache->retrieve(&key, sizeof(key), nullptr, 0));
+    if (!data.empty() &&
+            blobCache->retrieve(&key, sizeof(key), data.data(), data.size()) == data.size()) {
+        mBinder.createPipelineCache(data.data(), data.size());
+    }
+}
+
+VulkanDriver::PipelineCacheKey VulkanDriver::getPipelineCacheKey() const noexcept {
+    // the pipeline cache data starts with a header identifying the device and its driver, which
+    // vkCreatePipelineCache checks, but we keep one blob per device anyway so that several
+    // devices don't overwrite each other's
+    const VkPhysicalDeviceProperties& properties = mContext.physicalDeviceProperties;
+    PipelineCacheKey key = {};
+    key.vendorID = properties.vendorID;
+    key.deviceID = properties.deviceID;
+    key.driverVersion = properties.driverVersion;
+    memcpy(key.pipelineCacheUUID, properties.pipelineCacheUUID, sizeof(key.pipelineCacheUUID));
+    return key;
+}
+
 void VulkanDriver::terminate() {
     if (!mContext.instance) {
         return;
     }
     waitForIdle(mContext);
     mBinder.destroyCache();
+    if (mBlobCache) {
+        const PipelineCacheKey key = getPipelineCacheKey();
+        const std::vector<uint8_t> data = mBinder.getPipelineCacheData();
+        if (!data.empty()) {
+            mBlobCache->insert(&key, sizeof(key), data.data(), data.size());
+        }
+    }
+    mBinder.destroyPipelineCache();
     mStagePool.reset();
     mFramebufferCache.reset();
     mSamplerCache.reset();
@@ -238,52 +297,52 @@ void VulkanDriver::flush(int) {
 
 void VulkanDriver::createVertexBuffer(Driver::VertexBufferHandle vbh, uint8_t bufferCount,
         uint8_t attributeCount, uint32_t elementCount, Driver::AttributeArray attributes) {
-    construct_handle<VulkanVertexBuffer>(mHandleMap, vbh, mContext, mStagePool, bufferCount,
+    construct_handle<VulkanVertexBuffer>(vbh, mContext, mStagePool, bufferCount,
             attributeCount, elementCount, attributes);
 }
 
 void VulkanDriver::createIndexBuffer(Driver::IndexBufferHandle ibh, Driver::ElementType elementType,
         uint32_t indexCount) {
     auto elementSize = (uint8_t) getElementTypeSize(elementType);
-    construct_handle<VulkanIndexBuffer>(mHandleMap, ibh, mContext, mStagePool, elementSize,
+    construct_handle<VulkanIndexBuffer>(ibh, mContext, mStagePool, elementSize,
             indexCount);
 }
 
 void VulkanDriver::createTexture(Driver::TextureHandle th, SamplerType target, uint8_t levels,
         TextureFormat format, uint8_t samples, uint32_t w, uint32_t h, uint32_t depth,
         TextureUsage usage) {
-    construct_handle<VulkanTexture>(mHandleMap, th, mContext, target, levels, format, samples,
+    construct_handle<VulkanTexture>(th, mContext, target, levels, format, samples,
             w, h, depth, usage, mStagePool);
 }
 
 void VulkanDriver::createSamplerBuffer(Driver::SamplerBufferHandle sbh, size_t count) {
-    construct_handle<VulkanSamplerBuffer>(mHandleMap, sbh, mContext, count);
+    construct_handle<VulkanSamplerBuffer>(sbh, mContext, count);
 }
 
 void VulkanDriver::createUniformBuffer(Driver::UniformBufferHandle ubh, size_t size) {
-    construct_handle<VulkanUniformBuffer>(mHandleMap, ubh, mContext, mStagePool, size);
+    construct_handle<VulkanUniformBuffer>(ubh, mContext, mStagePool, size);
 }
 
 void VulkanDriver::createRenderPrimitive(Driver::RenderPrimitiveHandle rph, int) {
-    construct_handle<VulkanRenderPrimitive>(mHandleMap, rph, mContext);
+    construct_handle<VulkanRenderPrimitive>(rph, mContext);
 }
 
 void VulkanDriver::createProgram(Driver::ProgramHandle ph, Program&& program) {
-    construct_handle<VulkanProgram>(mHandleMap, ph, mContext, program);
+    construct_handle<VulkanProgram>(ph, mContext, program);
 }
 
 void VulkanDriver::createDefaultRenderTarget(Driver::RenderTargetHandle rth, int) {
-    construct_handle<VulkanRenderTarget>(mHandleMap, rth, mContext);
+    construct_handle<VulkanRenderTarget>(rth, mContext);
 }
 
 void VulkanDriver::createRenderTarget(Driver::RenderTargetHandle rth,
         Driver::TargetBufferFlags targets, uint32_t width, uint32_t height, uint8_t samples,
         TextureFormat format, Driver::TargetBufferInfo color, Driver::TargetBufferInfo depth,
         Driver::TargetBufferInfo stencil) {
-    auto& renderTarget = *construct_handle<VulkanRenderTarget>(mHandleMap, rth, mContext,
+    auto& renderTarget = *construct_handle<VulkanRenderTarget>(rth, mContext,
             width, height);
     if (color.handle) {
-        auto colorTexture = handle_cast<VulkanTexture>(mHandleMap, color.handle);
+        auto colorTexture = handle_cast<VulkanTexture>(color.handle);
         renderTarget.setColorImage({
             .view = colorTexture->imageView,
             .format = colorTexture->format
@@ -292,7 +351,7 @@ void VulkanDriver::createRenderTarget(Driver::RenderTargetHandle rth,
         renderTarget.createColorImage(getVkFormat(format));
     }
     if (depth.handle) {
-        auto depthTexture = handle_cast<VulkanTexture>(mHandleMap, depth.handle);
+        auto depthTexture = handle_cast<VulkanTexture>(depth.handle);
         renderTarget.setDepthImage({
             .view = depthTexture->imageView,
             .format = depthTexture->format
@@ -307,7 +366,7 @@ void VulkanDriver::createFence(Driver::FenceHandle fh, int) {
 
 void VulkanDriver::createSwapChain(Driver::SwapChainHandle sch, void* nativeWindow,
         uint64_t flags) {
-    auto* swapChain = construct_handle<VulkanSwapChain>(mHandleMap, sch);
+    auto* swapChain = construct_handle<VulkanSwapChain>(sch);
     VulkanSurfaceContext& sc = swapChain->surfaceContext;
     sc.surface = (VkSurfaceKHR) mContextManager.createVkSurfaceKHR(nativeWindow,
             mContext.instance, &sc.clientSize.width, &sc.clientSize.height);
@@ -379,28 +438,28 @@ Handle<HwStream> VulkanDriver::createStreamFromTextureIdSynchronous() noexcept {
 void VulkanDriver::destroyVertexBuffer(Driver::VertexBufferHandle vbh) {
     if (vbh) {
         waitForIdle(mContext);
-        destruct_handle<VulkanVertexBuffer>(mHandleMap, vbh);
+        destruct_handle<VulkanVertexBuffer>(vbh);
     }
 }
 
 void VulkanDriver::destroyIndexBuffer(Driver::IndexBufferHandle ibh) {
     if (ibh) {
         waitForIdle(mContext);
-        destruct_handle<VulkanIndexBuffer>(mHandleMap, ibh);
+        destruct_handle<VulkanIndexBuffer>(ibh);
     }
 }
 
 void VulkanDriver::destroyRenderPrimitive(Driver::RenderPrimitiveHandle rph) {
     if (rph) {
         waitForIdle(mContext);
-        destruct_handle<VulkanRenderPrimitive>(mHandleMap, rph);
+        destruct_handle<VulkanRenderPrimitive>(rph);
     }
 }
 
 void VulkanDriver::destroyProgram(Driver::ProgramHandle ph) {
     if (ph) {
         waitForIdle(mContext);
-        destruct_handle<VulkanProgram>(mHandleMap, ph);
+        destruct_handle<VulkanProgram>(ph);
     }
 }
 
@@ -410,47 +469,47 @@ void VulkanDriver::destroySamplerBuffer(Driver::SamplerBufferHandle sbh) {
         // not map to any Vulkan objects. To handle destruction, the only thing we need to do is
         // ensure that the next draw call doesn't try to access a zombie sampler buffer. Therefore,
         // simply replace all weak references with null.
-        auto* hwsb = handle_cast<VulkanSamplerBuffer>(mHandleMap, sbh);
+        auto* hwsb = handle_cast<VulkanSamplerBuffer>(sbh);
         for (auto& binding : mSamplerBindings) {
             if (binding == hwsb) {
                 binding = nullptr;
             }
         }
-        destruct_handle<VulkanSamplerBuffer>(mHandleMap, sbh);
+        destruct_handle<VulkanSamplerBuffer>(sbh);
     }
 }
 
 void VulkanDriver::destroyUniformBuffer(Driver::UniformBufferHandle ubh) {
     if (ubh) {
-        auto* buffer = handle_cast<VulkanUniformBuffer>(mHandleMap, ubh);
+        auto* buffer = handle_cast<VulkanUniformBuffer>(ubh);
         mBinder.unbindUniformBuffer(buffer->getGpuBuffer());
         waitForIdle(mContext);
-        destruct_handle<VulkanUniformBuffer>(mHandleMap, ubh);
+        destruct_handle<VulkanUniformBuffer>(ubh);
     }
 }
 
 void VulkanDriver::destroyTexture(Driver::TextureHandle th) {
     if (th) {
-        auto* tex = handle_cast<VulkanTexture>(mHandleMap, th);
+        auto* tex = handle_cast<VulkanTexture>(th);
         mBinder.unbindImageView(tex->imageView);
         waitForIdle(mContext);
-        destruct_handle<VulkanTexture>(mHandleMap, th);
+        destruct_handle<VulkanTexture>(th);
     }
 }
 
 void VulkanDriver::destroyRenderTarget(Driver::RenderTargetHandle rth) {
     if (rth) {
         waitForIdle(mContext);
-        destruct_handle<VulkanRenderTarget>(mHandleMap, rth);
+        destruct_handle<VulkanRenderTarget>(rth);
     }
 }
 
 void VulkanDriver::destroySwapChain(Driver::SwapChainHandle sch) {
     if (sch) {
         waitForIdle(mContext);
-        VulkanSurfaceContext& sc = handle_cast<VulkanSwapChain>(mHandleMap, sch)->surfaceContext;
+        VulkanSurfaceContext& sc = handle_cast<VulkanSwapChain>(sch)->surfaceContext;
         destroySurfaceContext(mContext, sc);
-        destruct_handle<VulkanSwapChain>(mHandleMap, sch);
+        destruct_handle<VulkanSwapChain>(sch);
     }
 }
 
@@ -502,16 +561,20 @@ bool VulkanDriver::isFrameTimeSupported() {
     return false;
 }
 
+uint32_t VulkanDriver::getMaxTextureSize() {
+    return mContext.physicalDeviceProperties.limits.maxImageDimension2D;
+}
+
 void VulkanDriver::loadVertexBuffer(Driver::VertexBufferHandle vbh, size_t index,
         BufferDescriptor&& p, uint32_t byteOffset, uint32_t byteSize) {
-    auto& vb = *handle_cast<VulkanVertexBuffer>(mHandleMap, vbh);
+    auto& vb = *handle_cast<VulkanVertexBuffer>(vbh);
     vb.buffers[index]->loadFromCpu(p.buffer, byteOffset, byteSize);
     scheduleDestroy(std::move(p));
 }
 
 void VulkanDriver::loadIndexBuffer(Driver::IndexBufferHandle ibh, BufferDescriptor&& p,
         uint32_t byteOffset, uint32_t byteSize) {
-    auto& ib = *handle_cast<VulkanIndexBuffer>(mHandleMap, ibh);
+    auto& ib = *handle_cast<VulkanIndexBuffer>(ibh);
     ib.buffer->loadFromCpu(p.buffer, byteOffset, byteSize);
     scheduleDestroy(std::move(p));
 }
@@ -521,14 +584,14 @@ void VulkanDriver::load2DImage(Driver::TextureHandle th,
         PixelBufferDescriptor&& data) {
     assert(data.type != driver::PixelDataType::COMPRESSED && "Compression not yet supported.");
     assert(xoffset == 0 && yoffset == 0 && "Offsets not yet supported.");
-    handle_cast<VulkanTexture>(mHandleMap, th)->load2DImage(std::move(data), width, height, level);
+    handle_cast<VulkanTexture>(th)->load2DImage(std::move(data), width, height, level);
     scheduleDestroy(std::move(data));
 }
 
 void VulkanDriver::loadCubeImage(Driver::TextureHandle th, uint32_t level,
         PixelBufferDescriptor&& data, FaceOffsets faceOffsets) {
     assert(data.type != driver::PixelDataType::COMPRESSED && "Compression not yet supported.");
-    handle_cast<VulkanTexture>(mHandleMap, th)->loadCubeImage(std::move(data), faceOffsets, level);
+    handle_cast<VulkanTexture>(th)->loadCubeImage(std::move(data), faceOffsets, level);
     scheduleDestroy(std::move(data));
 }
 
@@ -543,7 +606,7 @@ void VulkanDriver::generateMipmaps(Driver::TextureHandle th) {
 
 void VulkanDriver::updateUniformBuffer(Driver::UniformBufferHandle ubh,
         UniformBuffer&& uniformBuffer) {
-    auto* buffer = handle_cast<VulkanUniformBuffer>(mHandleMap, ubh);
+    auto* buffer = handle_cast<VulkanUniformBuffer>(ubh);
     if (uniformBuffer.isDirty()) {
         buffer->loadFromCpu(uniformBuffer.getBuffer(), (uint32_t) uniformBuffer.getSize());
     }
@@ -552,7 +615,7 @@ void VulkanDriver::updateUniformBuffer(Driver::UniformBufferHandle ubh,
 
 void VulkanDriver::updateSamplerBuffer(Driver::SamplerBufferHandle sbh,
         SamplerBuffer&& samplerBuffer) {
-    auto* sb = handle_cast<VulkanSamplerBuffer>(mHandleMap, sbh);
+    auto* sb = handle_cast<VulkanSamplerBuffer>(sbh);
     *sb->sb = samplerBuffer;
 }
 
@@ -563,7 +626,7 @@ void VulkanDriver::beginRenderPass(Driver::RenderTargetHandle rth,
     assert(mContext.currentSurface);
     VulkanSurfaceContext& surface = *mContext.currentSurface;
     const SwapContext& swapContext = surface.swapContexts[surface.currentSwapIndex];
-    mCurrentRenderTarget = handle_cast<VulkanRenderTarget>(mHandleMap, rth);
+    mCurrentRenderTarget = handle_cast<VulkanRenderTarget>(rth);
     VulkanRenderTarget* rt = mCurrentRenderTarget;
     const VkExtent2D extent = rt->getExtent();
     assert(extent.width > 0 && extent.height > 0);
@@ -655,15 +718,15 @@ void VulkanDriver::resizeRenderTarget(Driver::RenderTargetHandle rth,
 void VulkanDriver::setRenderPrimitiveBuffer(Driver::RenderPrimitiveHandle rph,
         Driver::VertexBufferHandle vbh, Driver::IndexBufferHandle ibh,
         uint32_t enabledAttributes) {
-    auto primitive = handle_cast<VulkanRenderPrimitive>(mHandleMap, rph);
-    primitive->setBuffers(handle_cast<VulkanVertexBuffer>(mHandleMap, vbh),
-            handle_cast<VulkanIndexBuffer>(mHandleMap, ibh), enabledAttributes);
+    auto primitive = handle_cast<VulkanRenderPrimitive>(rph);
+    primitive->setBuffers(handle_cast<VulkanVertexBuffer>(vbh),
+            handle_cast<VulkanIndexBuffer>(ibh), enabledAttributes);
 }
 
 void VulkanDriver::setRenderPrimitiveRange(Driver::RenderPrimitiveHandle rph,
         Driver::PrimitiveType pt, uint32_t offset,
         uint32_t minIndex, uint32_t maxIndex, uint32_t count) {
-    auto& primitive = *handle_cast<VulkanRenderPrimitive>(mHandleMap, rph);
+    auto& primitive = *handle_cast<VulkanRenderPrimitive>(rph);
     primitive.setPrimitiveType(pt);
     primitive.offset = offset * primitive.indexBuffer->elementSize;
     primitive.count = count;
@@ -691,7 +754,7 @@ void VulkanDriver::setViewportScissor(
 }
 
 void VulkanDriver::makeCurrent(Driver::SwapChainHandle sch) {
-    VulkanSurfaceContext& sContext = handle_cast<VulkanSwapChain>(mHandleMap, sch)->surfaceContext;
+    VulkanSurfaceContext& sContext = handle_cast<VulkanSwapChain>(sch)->surfaceContext;
     mContext.currentSurface = &sContext;
 }
 
@@ -702,7 +765,7 @@ void VulkanDriver::commit(Driver::SwapChainHandle sch) {
     releaseCommandBuffer(mContext);
 
     // Present the backbuffer.
-    VulkanSurfaceContext& surface = handle_cast<VulkanSwapChain>(mHandleMap, sch)->surfaceContext;
+    VulkanSurfaceContext& surface = handle_cast<VulkanSwapChain>(sch)->surfaceContext;
     VkPresentInfoKHR presentInfo {
         .sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR,
         .waitSemaphoreCount = 1,
@@ -740,12 +803,12 @@ void VulkanDriver::viewport(ssize_t left, ssize_t bottom, size_t width, size_t h
 }
 
 void VulkanDriver::bindUniforms(size_t index, Driver::UniformBufferHandle ubh) {
-    auto* buffer = handle_cast<VulkanUniformBuffer>(mHandleMap, ubh);
+    auto* buffer = handle_cast<VulkanUniformBuffer>(ubh);
     mBinder.bindUniformBuffer((uint32_t) index, buffer->getGpuBuffer());
 }
 
 void VulkanDriver::bindSamplers(size_t index, Driver::SamplerBufferHandle sbh) {
-    auto* hwsb = handle_cast<VulkanSamplerBuffer>(mHandleMap, sbh);
+    auto* hwsb = handle_cast<VulkanSamplerBuffer>(sbh);
     mSamplerBindings[index] = hwsb;
 }
 
@@ -794,12 +857,17 @@ void VulkanDriver::blit(TargetBufferFlags buffers,
 
 void VulkanDriver::draw(Driver::ProgramHandle ph, Driver::RasterState rasterState,
         Driver::RenderPrimitiveHandle rph) {
+    drawInstanced(ph, rasterState, rph, 1);
+}
+
+void VulkanDriver::drawInstanced(Driver::ProgramHandle ph, Driver::RasterState rasterState,
+        Driver::RenderPrimitiveHandle rph, uint32_t instanceCount) {
     VkCommandBuffer cmdbuffer = mContext.cmdbuffer;
     ASSERT_POSTCONDITION(cmdbuffer, "Draw calls can occur only within a beginFrame / endFrame.");
-    const VulkanRenderPrimitive& prim = *handle_cast<VulkanRenderPrimitive>(mHandleMap, rph);
+    const VulkanRenderPrimitive& prim = *handle_cast<VulkanRenderPrimitive>(rph);
 
     // If this is a debug build, validate the current shader.
-    auto* program = handle_cast<VulkanProgram>(mHandleMap, ph);
+    auto* program = handle_cast<VulkanProgram>(ph);
 #if !defined(NDEBUG)
     if (program->bundle.vertex == VK_NULL_HANDLE || program->bundle.fragment == VK_NULL_HANDLE) {
         utils::slog.e << "Binding missing shader: " << program->name.c_str() << utils::io::endl;
@@ -807,24 +875,7 @@ void VulkanDriver::draw(Driver::ProgramHandle ph, Driver::RasterState rasterStat
 #endif
 
     // Update the VK raster state.
-    mContext.rasterState.depthStencil = {
-        .sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO,
-        .depthTestEnable = VK_TRUE,
-        .depthWriteEnable = (VkBool32) rasterState.depthWrite,
-        .depthCompareOp = getCompareOp(rasterState.depthFunc),
-        .depthBoundsTestEnable = VK_FALSE,
-        .stencilTestEnable = VK_FALSE,
-    };
-    mContext.rasterState.blending = {
-        .blendEnable = rasterState.hasBlending(),
-        .srcColorBlendFactor = getBlendFactor(rasterState.blendFunctionSrcRGB),
-        .dstColorBlendFactor = getBlendFactor(rasterState.blendFunctionDstRGB),
-        .colorBlendOp = (VkBlendOp) rasterState.blendEquationRGB,
-        .srcAlphaBlendFactor = getBlendFactor(rasterState.blendFunctionSrcAlpha),
-        .dstAlphaBlendFactor = getBlendFactor(rasterState.blendFunctionDstAlpha),
-        .alphaBlendOp =  (VkBlendOp) rasterState.blendEquationAlpha,
-        .colorWriteMask = (VkColorComponentFlags) (rasterState.colorWrite ? 0xf : 0x0),
-    };
+    setRasterState(mContext.rasterState, rasterState);
 
     // Remove the fragment shader from depth-only passes to avoid a validation warning.
     VulkanBinder::ProgramBundle shaderHandles = program->bundle;
@@ -863,7 +914,7 @@ void VulkanDriver::draw(Driver::ProgramHandle ph, Driver::RasterState rasterStat
                     &group)) {
                 const SamplerParams& samplerParams = sampler->s;
                 VkSampler vksampler = mSamplerCache.getSampler(samplerParams);
-                const auto* tex = handle_const_cast<VulkanTexture>(mHandleMap, sampler->t);
+                const auto* tex = handle_const_cast<VulkanTexture>(sampler->t);
                 mBinder.bindSampler(binding, {
                     .sampler = vksampler,
                     .imageView = tex->imageView,
@@ -884,7 +935,7 @@ void VulkanDriver::draw(Driver::ProgramHandle ph, Driver::RasterState rasterStat
     }
 
     // Bind the pipeline if it changed. This can happen, for example, if the raster state changed.
-    // Creating a new pipeline is slow, so we should consider using pipeline cache objects.
+    // Creating a new pipeline is slow, which preparePipeline() and the pipeline cache mitigate.
     VkPipeline pipeline;
     if (mBinder.getOrCreatePipeline(&pipeline)) {
         vkCmdBindPipeline(cmdbuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
@@ -899,14 +950,56 @@ void VulkanDriver::draw(Driver::ProgramHandle ph, Driver::RasterState rasterStat
             prim.indexBuffer->indexType);
 
     // Finally, make the actual draw call. TODO: support subranges
+    // gl_InstanceIndex includes firstInstId, it must be 0 for the instances transforms lookup
     const uint32_t indexCount = prim.count;
-    const uint32_t instanceCount = 1;
     const uint32_t firstIndex = prim.offset / prim.indexBuffer->elementSize;
     const int32_t vertexOffset = 0;
-    const uint32_t firstInstId = 1;
+    const uint32_t firstInstId = 0;
     vkCmdDrawIndexed(cmdbuffer, indexCount, instanceCount, firstIndex, vertexOffset, firstInstId);
 }
 
+void VulkanDriver::preparePipeline(Driver::ProgramHandle ph, Driver::RasterState rasterState,
+        Driver::VertexBufferHandle vbh, uint32_t enabledAttributes, Driver::PrimitiveType pt) {
+    // A pipeline is specific to a render pass, but any compatible render pass (same attachment
+    // formats) hits the same entry of the pipeline cache, so we use one that matches the swap
+    // chain. Nothing can be prepared before the first frame makes a swap chain current: until
+    // then, this is a no-op.
+    if (!mContext.currentSurface) {
+        return;
+    }
+    const VulkanSurfaceContext& surface = *mContext.currentSurface;
+    VkRenderPass renderPass = mFramebufferCache.getRenderPass({
+        .finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
+        .colorFormat = surface.surfaceFormat.format,
+        .depthFormat = surface.depth.format,
+    });
+
+    const auto* program = handle_cast<VulkanProgram>(ph);
+    VulkanBinder::RasterState vkRasterState = mContext.rasterState;
+    setRasterState(vkRasterState, rasterState);
+
+    VulkanRenderPrimitive prim(mContext);
+    prim.setPrimitiveType(pt);
+    prim.setBuffers(handle_cast<VulkanVertexBuffer>(vbh), nullptr, enabledAttributes);
+
+    mBinder.preparePipeline(program->bundle, vkRasterState, renderPass, prim.primitiveTopology,
+            prim.varray);
+
+    // Without color writes, this is a depth variant, which is also drawn into the depth-only
+    // shadow maps. There, draw() removes the fragment shader, so the pipeline differs too.
+    if (!rasterState.colorWrite) {
+        VkRenderPass depthOnlyRenderPass = mFramebufferCache.getRenderPass({
+            .finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL,
+            .colorFormat = VK_FORMAT_UNDEFINED,
+            .depthFormat = getVkFormat(TextureFormat::DEPTH16),
+        });
+        VulkanBinder::ProgramBundle depthOnlyBundle = program->bundle;
+        depthOnlyBundle.fragment = VK_NULL_HANDLE;
+        mBinder.preparePipeline(depthOnlyBundle, vkRasterState, depthOnlyRenderPass,
+                prim.primitiveTopology, prim.varray);
+    }
+}
+
 #ifndef NDEBUG
 void VulkanDriver::debugCommand(const char* methodName) {
     static const std::set<utils::StaticString> OUTSIDE_COMMANDS = {
@@ -29,7 +29,6 @@
 #include <utils/compiler.h>
 #include <utils/Allocator.h>
 
-#include <unordered_map>
 #include <vector>
 
 namespace filament {
@@ -56,6 +55,9 @@ private:
 
     virtual ShaderModel getShaderModel() const noexcept override final;
 
+    // loads the pipeline cache saved by the previous run, terminate() saves it
+    void setBlobCache(BlobCache* blobCache) noexcept override;
+
     template<typename T>
     friend class ::filament::ConcreteDispatcher;
 
@@ -77,55 +79,51 @@ private:
 
     driver::ContextManagerVk& mContextManager;
 
-    // For now we're not bothering to store handles in pools, just simple on-demand allocation.
-    // We have a little map from integer handles to "blobs" which get replaced with the Hw objects.
-    using Blob = std::vector<uint8_t>;
-    using HandleMap = std::unordered_map<HandleBase::HandleId, Blob>;
-    HandleMap mHandleMap;
-    HandleBase::HandleId mNextId = 1;
+    struct PipelineCacheKey {
+        char tag[4] = { 'V', 'K', 'P', 'C' };
+        uint32_t vendorID;
+        uint32_t deviceID;
+        uint32_t driverVersion;
+        uint8_t pipelineCacheUUID[VK_UUID_SIZE];
+    };
+
+    PipelineCacheKey getPipelineCacheKey() const noexcept;
+
+    HandleAllocator mHandleAllocator;
 
     template<typename Dp, typename B>
     Handle<B> alloc_handle() {
-        mHandleMap[mNextId] = Blob(sizeof(Dp));
-        return Handle<B>(mNextId++);
+        static_assert(sizeof(Dp) <= HandleAllocator::MAX_SIZE, "Handle<> too large");
+        return Handle<B>(mHandleAllocator.allocate(sizeof(Dp)));
     }
 
     template<typename Dp, typename B>
-    Dp* handle_cast(HandleMap& handleMap, Handle<B>& handle) noexcept {
+    Dp* handle_cast(Handle<B>& handle) noexcept {
         assert(handle);
-        auto iter = handleMap.find(handle.getId());
-        assert(iter != handleMap.end());
-        Blob& blob = iter->second;
-        assert(blob.size() == sizeof(Dp));
-        return reinterpret_cast<Dp*>(blob.data());
+        assert(mHandleAllocator.isValid(handle.getId()));
+        return static_cast<Dp*>(mHandleAllocator.handle_cast(handle.getId()));
     }
 
     template<typename Dp, typename B>
-    const Dp* handle_const_cast(HandleMap& handleMap, const Handle<B>& handle) noexcept {
+    const Dp* handle_const_cast(const Handle<B>& handle) noexcept {
         assert(handle);
-        auto iter = handleMap.find(handle.getId());
-        assert(iter != handleMap.end());
-        Blob& blob = iter->second;
-        assert(blob.size() == sizeof(Dp));
-        return reinterpret_cast<const Dp*>(blob.data());
+        assert(mHandleAllocator.isValid(handle.getId()));
+        return static_cast<const Dp*>(mHandleAllocator.handle_cast(handle.getId()));
     }
 
     template<typename Dp, typename B, typename ... ARGS>
-    Dp* construct_handle(HandleMap& handleMap, Handle<B>& handle, ARGS&& ... args) noexcept {
-        auto iter = handleMap.find(handle.getId());
-        assert(iter != handleMap.end());
-        Blob& blob = iter->second;
-        assert(blob.size() == sizeof(Dp));
-        Dp* addr = reinterpret_cast<Dp*>(blob.data());
+    Dp* construct_handle(Handle<B>& handle, ARGS&& ... args) noexcept {
+        Dp* addr = handle_cast<Dp>(handle);
         new(addr) Dp(std::forward<ARGS>(args)...);
+        onHandleConstructed<B>();
         return addr;
     }
 
     template<typename Dp, typename B>
-    void destruct_handle(HandleMap& handleMap, Handle<B>& handle) noexcept {
-        // Call the destructor, remove the blob, don't bother reclaiming the integer id.
-        handle_cast<Dp>(handleMap, handle)->~Dp();
-        handleMap.erase(handle.getId());
+    void destruct_handle(Handle<B>& handle) noexcept {
+        handle_cast<Dp>(handle)->~Dp();
+        mHandleAllocator.free(handle.getId(), sizeof(Dp));
+        onHandleDestroyed<B>();
     }
 
     VulkanContext mContext = {};
@@ -17,12 +17,15 @@
 #include <filament/Box.h>
 #include <filament/Frustum.h>
 #include "details/Culler.h"
+#include "RenderPass.h"
 
+#include <utils/JobSystem.h>
 #include <utils/Profiler.h>
 #include <utils/compiler.h>
 #include <math/fast.h>
 #include <math/scalar.h>
 
+#include <algorithm>
 #include <iostream>
 #include <vector>
 #include <random>
@@ -103,30 +106,86 @@ int main(void) {
             Profiler::EV_BPU_MISSES
     );
 
-    benchmark(p, "Box Culling Direct", [&]() {
-        Culler::Test::intersects(visibles, frustum, boxesCenter.data(), boxesExtent.data(), batch);
-    });
+    using Kernel = Culler::Test::Kernel;
+    struct {
+        Kernel kernel;
+        const char* box;
+        const char* sphere;
+    } const kernels[] = {
+            { Kernel::GENERIC, "Box Culling (generic)", "Sphere Culling (generic)" },
+            { Kernel::SSE41,   "Box Culling (SSE4.1)",  "Sphere Culling (SSE4.1)"  },
+            { Kernel::AVX2,    "Box Culling (AVX2)",    "Sphere Culling (AVX2)"    },
+            { Kernel::NEON,    "Box Culling (NEON)",    "Sphere Culling (NEON)"    },
+    };
+
+    for (auto const& k : kernels) {
+        if (!Culler::Test::isSupported(k.kernel)) {
+            continue;
+        }
+
+        std::fill(visibles, visibles + batch, 0);
+        benchmark(p, k.box, [&]() {
+            Culler::Test::intersects(visibles, frustum,
+                    boxesCenter.data(), boxesExtent.data(), batch, k.kernel);
+        });
+
+        size_t vb = 0;
+        for (size_t i = 0; i < batch; i++) {
+            vb = vb + (visibles[i] ? 1 : 0);
+        }
+
+        benchmark(p, k.sphere, [&]() {
+            Culler::Test::intersects(visibles, frustum, spheres.data(), batch, k.kernel);
+        });
+
+        size_t vs = 0;
+        for (size_t i = 0; i < batch; i++) {
+            vs = vs + (visibles[i] ? 1 : 0);
+        }
 
-    size_t vb = 0;
-    for (size_t i = 0; i < batch; i++) {
-        vb = vb + (visibles[i] ? 1 : 0);
+        std::cout << "visible boxes: " << vb << std::endl;
+        std::cout << "visible spheres: " << vs << std::endl;
+        std::cout << std::endl;
     }
 
-    benchmark(p, "Sphere Culling Direct", [&]() {
-        Culler::Test::intersects(visibles, frustum, spheres.data(), batch);
-    });
+    free(visibles);
 
-    size_t vs = 0;
-    for (size_t i = 0; i < batch; i++) {
-        vs = vs + (visibles[i] ? 1 : 0);
+
+    // sort a command buffer typical of a color pass, all the commands are in the same pass
+    // and only the material and Z-bucket bits vary.
+    using Command = RenderPass::Command;
+    const size_t commandCount = 32768;
+    std::uniform_int_distribution<uint32_t> randBits;
+    std::vector<Command> unsortedCommands(commandCount);
+    for (Command& command : unsortedCommands) {
+        command.key  = uint64_t(RenderPass::Pass::COLOR);
+        command.key |= RenderPass::makeFieldTruncate(randBits(gen),
+                RenderPass::Z_BUCKET_MASK, RenderPass::Z_BUCKET_SHIFT);
+        command.key |= RenderPass::makeFieldTruncate(randBits(gen),
+                RenderPass::MATERIAL_MASK, RenderPass::MATERIAL_SHIFT);
     }
+    unsortedCommands.back().key = uint64_t(RenderPass::Pass::SENTINEL);
+    std::vector<Command> commands(commandCount);
+    std::vector<Command> scratch(commandCount);
 
-    std::cout << "visible boxes: " << vb << std::endl;
-    std::cout << "visible spheres: " << vs << std::endl;
-    std::cout << std::endl;
+    JobSystem js;
+    js.adopt();
 
-    free(visibles);
+    benchmark(p, "Commands std::sort", [&]() {
+        std::copy(unsortedCommands.begin(), unsortedCommands.end(), commands.begin());
+        std::sort(commands.begin(), commands.end());
+    });
+
+    benchmark(p, "Commands radix sort", [&]() {
+        std::copy(unsortedCommands.begin(), unsortedCommands.end(), commands.begin());
+        RenderPass::sortCommands(js,
+                commands.data(), commands.data() + commands.size(), scratch.data());
+    });
+
+    std::cout << "radix sorted commands: " << std::is_sorted(commands.begin(), commands.end())
+              << std::endl << std::endl;
 
+    js.emancipate();
 
     benchmark(p, "cos", [&]() {
         for (size_t i = 0; i < batch; i++) {
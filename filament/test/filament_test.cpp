@@ -28,16 +28,38 @@
 #include <filament/Material.h>
 #include <filament/Engine.h>
 
+#include <filamat/MaterialBuilder.h>
+
+#include "driver/CircularBuffer.h"
+#include "driver/CommandStream.h"
+#include "driver/DriverBase.h"
 #include "driver/UniformBuffer.h"
+#if defined(FILAMENT_DRIVER_SUPPORTS_RECORDING)
+#include "driver/noop/NoopDriver.h"
+#include "driver/record/CommandReplayer.h"
+#include "driver/record/CommandSerialization.h"
+#include "driver/record/RecordingDriver.h"
+#endif
 #include <filament/UniformInterfaceBlock.h>
+#include <private/filament/Variant.h>
 
 #include "details/Allocators.h"
+#include "details/Bvh.h"
 #include "details/Material.h"
 #include "details/Camera.h"
 #include "details/Froxelizer.h"
 #include "details/Engine.h"
+#include "details/Scene.h"
 #include "components/TransformManager.h"
+#include "RenderPass.h"
+#include "utils/JobSystem.h"
 #include "utils/RangeSet.h"
+#include <utils/memalign.h>
+
+#include <chrono>
+#include <random>
+#include <thread>
+#include <vector>
 
 using namespace filament;
 using namespace math;
@@ -124,24 +146,110 @@ TEST(FilamentTest, TransformManager) {
     // make sure child/parent are out of order
     ASSERT_LT(child, newParent);
 
-    // local transaction reprders parent/child
+    // local transaction handles out-of-order parent/child
     tcm.openLocalTransformTransaction();
     tcm.setTransform(newParent, mat4f{ float4{ 8 }});
     tcm.commitLocalTransformTransaction();
 
-    // local transaction invalidates Instances
-    parent = tcm.getInstance(entities[0]);
-    child = tcm.getInstance(entities[1]);
-    newParent = tcm.getInstance(entities[2]);
-
-    // check parent / child order is correct
-    EXPECT_GT(child, newParent);
+    // local transaction doesn't invalidate Instances
+    EXPECT_EQ(parent, tcm.getInstance(entities[0]));
+    EXPECT_EQ(child, tcm.getInstance(entities[1]));
+    EXPECT_EQ(newParent, tcm.getInstance(entities[2]));
 
     // check transform propagation
     EXPECT_EQ(tcm.getTransform(newParent), mat4f{ float4{ 8 }});
     EXPECT_EQ(tcm.getWorldTransform(newParent), mat4f{ float4{ 8 }});
     EXPECT_EQ(tcm.getTransform(child), mat4f{ float4{ 1 }});
     EXPECT_EQ(tcm.getWorldTransform(child), mat4f{ float4{ 8 }});
+
+    // test setting several (affine) transforms at once, the child is set before its parent
+    const TransformManager::Instance instances[] = { child, newParent };
+    const mat4f transforms[] = {
+            mat4f::translate(float4{ 1, 2, 3, 1 }), mat4f::scale(float4{ 2, 2, 2, 1 }) };
+    tcm.setTransforms(instances, transforms, 2);
+    EXPECT_EQ(tcm.getTransform(child), transforms[0]);
+    EXPECT_EQ(tcm.getWorldTransform(newParent), transforms[1]);
+    EXPECT_EQ(tcm.getWorldTransform(child), transforms[1] * transforms[0]);
+    EXPECT_EQ(tcm.getWorldTransform(parent), mat4f{ float4{ 4 }});
+}
+
+TEST(FilamentTest, TransformManagerParallel) {
+    // levels larger than 1024 nodes are transformed in parallel, the results must be the same
+    // as when they're transformed serially
+    utils::JobSystem js;
+    js.adopt();
+
+    filament::details::FTransformManager serial;
+    filament::details::FTransformManager parallel(&js);
+    EntityManager& em = EntityManager::get();
+
+    // 4 roots, then levels of 1200, 2400 and 1200 nodes
+    const size_t levelSizes[] = { 4, 1200, 2400, 1200 };
+    std::vector<Entity> entities;
+    std::default_random_engine generator(42);
+    std::uniform_real_distribution<float> value(-2.0f, 2.0f);
+    auto randomTransform = [&]() {
+        const float s = 1.0f + 0.1f * value(generator);
+        return mat4f::translate(float4{ value(generator), value(generator), value(generator), 1 }) *
+               mat4f::rotate(value(generator), normalize(float3{ 1, value(generator), 1 })) *
+               mat4f::scale(float4{ s, s, s, 1 });
+    };
+
+    size_t levelStart = 0;
+    for (size_t level = 0; level < 4; level++) {
+        const size_t levelEnd = entities.size() + levelSizes[level];
+        const size_t parentCount = entities.size() - levelStart;
+        const size_t parentStart = levelStart;
+        levelStart = entities.size();
+        while (entities.size() != levelEnd) {
+            Entity e = em.create();
+            const mat4f local = randomTransform();
+            if (level == 0) {
+                serial.create(e, {}, local);
+                parallel.create(e, {}, local);
+            } else {
+                Entity p = entities[parentStart + entities.size() % parentCount];
+                serial.create(e, serial.getInstance(p), local);
+                parallel.create(e, parallel.getInstance(p), local);
+            }
+            entities.push_back(e);
+        }
+    }
+
+    auto expectSameWorldTransforms = [&]() {
+        for (Entity e : entities) {
+            ASSERT_EQ(serial.getWorldTransform(serial.getInstance(e)),
+                      parallel.getWorldTransform(parallel.getInstance(e)));
+        }
+    };
+
+    // update all the nodes
+    serial.openLocalTransformTransaction();
+    parallel.openLocalTransformTransaction();
+    for (size_t i = 0; i < levelSizes[0]; i++) {
+        const mat4f local = randomTransform();
+        serial.setTransform(serial.getInstance(entities[i]), local);
+        parallel.setTransform(parallel.getInstance(entities[i]), local);
+    }
+    serial.commitLocalTransformTransaction();
+    parallel.commitLocalTransformTransaction();
+    expectSameWorldTransforms();
+
+    // update only the subtrees of some nodes of the first two levels
+    std::vector<TransformManager::Instance> serialInstances;
+    std::vector<TransformManager::Instance> parallelInstances;
+    std::vector<mat4f> transforms;
+    for (size_t i = 0; i < levelSizes[0] + levelSizes[1]; i += 3) {
+        serialInstances.push_back(serial.getInstance(entities[i]));
+        parallelInstances.push_back(parallel.getInstance(entities[i]));
+        transforms.push_back(randomTransform());
+    }
+    serial.setTransforms(serialInstances.data(), transforms.data(), transforms.size());
+    parallel.setTransforms(parallelInstances.data(), transforms.data(), transforms.size());
+    expectSameWorldTransforms();
+
+    em.destroy(entities.size(), entities.data());
+    js.emancipate();
 }
 
 TEST(FilamentTest, UniformInterfaceBlock) {
@@ -408,6 +516,105 @@ TEST(FilamentTest, SphereCulling) {
     EXPECT_TRUE(frustum.intersects({ 0, 200 }));
 }
 
+TEST(FilamentTest, CullerKernels) {
+    using namespace filament::details;
+    using Kernel = Culler::Test::Kernel;
+
+    Frustum frustum(mat4f::frustum(-1, 1, -1, 1, 1, 100));
+
+    // random boxes and spheres, some visible, some not
+    const size_t count = 1000;
+    const size_t capacity = Culler::round(count);
+    std::default_random_engine gen;
+    std::uniform_real_distribution<float> position(-150.0f, 150.0f);
+    std::uniform_real_distribution<float> size(0.1f, 4.0f);
+    std::vector<float3> centers(capacity);
+    std::vector<float3> extents(capacity);
+    std::vector<float4> spheres(capacity);
+    for (size_t i = 0; i < count; i++) {
+        centers[i] = { position(gen), position(gen), position(gen) };
+        extents[i] = { size(gen), size(gen), size(gen) };
+        spheres[i] = { centers[i], size(gen) };
+    }
+
+    std::vector<Culler::result_type> boxes(capacity);
+    std::vector<Culler::result_type> balls(capacity);
+    Culler::Test::intersects(boxes.data(), frustum,
+            centers.data(), extents.data(), capacity, Kernel::GENERIC);
+    Culler::Test::intersects(balls.data(), frustum, spheres.data(), capacity, Kernel::GENERIC);
+
+    for (Kernel kernel : { Kernel::DEFAULT, Kernel::SSE41, Kernel::AVX2, Kernel::NEON }) {
+        if (!Culler::Test::isSupported(kernel)) {
+            continue;
+        }
+        std::vector<Culler::result_type> results(capacity);
+        Culler::Test::intersects(results.data(), frustum,
+                centers.data(), extents.data(), capacity, kernel);
+        EXPECT_EQ(boxes, results);
+        Culler::Test::intersects(results.data(), frustum, spheres.data(), capacity, kernel);
+        EXPECT_EQ(balls, results);
+    }
+}
+
+TEST(FilamentTest, BvhCulling) {
+    using namespace filament::details;
+
+    utils::JobSystem js;
+    js.adopt();
+
+    Frustum frustum(mat4f::frustum(-1, 1, -1, 1, 1, 100));
+
+    // random boxes, some visible, some not
+    const size_t count = 5000;
+    const size_t capacity = Culler::round(count);
+    std::default_random_engine gen;
+    std::uniform_real_distribution<float> position(-150.0f, 150.0f);
+    std::uniform_real_distribution<float> size(0.1f, 4.0f);
+    std::vector<Bvh::Instance> instances(capacity);
+    std::vector<float3> centers(capacity);
+    std::vector<float3> extents(capacity);
+    for (size_t i = 0; i < count; i++) {
+        instances[i] = Bvh::Instance(uint32_t(i + 1));
+        centers[i] = { position(gen), position(gen), position(gen) };
+        extents[i] = { size(gen), size(gen), size(gen) };
+    }
+
+    auto check = [&](Bvh const& bvh) {
+        std::vector<Culler::result_type> expected(capacity);
+        std::vector<Culler::result_type> results(capacity);
+        Culler::Test::intersects(expected.data(), frustum,
+                centers.data(), extents.data(), capacity);
+        bvh.cull(js, results.data(), frustum, centers.data(), extents.data(), 0);
+        for (size_t i = 0; i < count; i++) {
+            EXPECT_EQ(expected[i], results[i]);
+        }
+    };
+
+    Bvh bvh;
+    bvh.build(instances.data(), centers.data(), extents.data(), count);
+    EXPECT_FALSE(bvh.empty());
+    check(bvh);
+
+    // move some boxes into the frustum
+    for (size_t i = 0; i < count; i += 7) {
+        centers[i] = { position(gen) * 0.01f, position(gen) * 0.01f, -50.0f };
+        bvh.invalidate(instances[i]);
+    }
+    bvh.refit(centers.data(), extents.data());
+    check(bvh);
+
+    // reorder the boxes
+    std::reverse(instances.begin(), instances.begin() + count);
+    std::reverse(centers.begin(), centers.begin() + count);
+    std::reverse(extents.begin(), extents.begin() + count);
+    for (size_t i = 0; i < count; i++) {
+        bvh.setIndex(instances[i], uint32_t(i));
+    }
+    check(bvh);
+
+    js.emancipate();
+}
+
 TEST(FilamentTest, ColorConversion) {
     // Linear to Gamma
     // 0.0 stays 0.0
@@ -470,7 +677,7 @@ TEST(FilamentTest, FroxelData) {
 
     Froxelizer froxelData(*engine);
     froxelData.setOptions(5, 100);
-    froxelData.prepare(engine->getDriverApi(), scope, vp, p, 0.1, 100);
+    froxelData.prepare(engine->getDriverApi(), scope, vp, p, 0.1, 100, 1);
 
     Froxel f = froxelData.getFroxelAt(0,0,0);
 
@@ -553,11 +760,320 @@ TEST(FilamentTest, FroxelData) {
         EXPECT_GT(pointCount, 0);
     }
 
+    {
+        // a smaller budget uses fewer froxels and slices
+        View::DynamicLightingBudget budget;
+        budget.froxelCount = 4096;
+        froxelData.setBudget(budget);
+        froxelData.prepare(engine->getDriverApi(), scope, vp, p, 0.1, 100, 1);
+        EXPECT_EQ(8, froxelData.getFroxelCountZ());
+        EXPECT_LE(froxelData.getFroxelCountX() * froxelData.getFroxelCountY() *
+                  froxelData.getFroxelCountZ(), 4096);
+        EXPECT_EQ(CONFIG_MAX_LIGHT_COUNT, froxelData.getLightCountMax());
+
+        froxelData.froxelizeLights(*engine, {}, lights);
+        auto const& froxelBuffer = froxelData.getFroxelBufferUser();
+        size_t pointCount = 0;
+        for (const auto& entry : froxelBuffer) {
+            EXPECT_LE(entry.pointLightCount, 1);
+            pointCount += entry.pointLightCount;
+        }
+        EXPECT_GT(pointCount, 0);
+    }
+
     froxelData.terminate(engine->getDriverApi());
     engine->shutdown();
     delete engine;
 }
 
+TEST(FilamentTest, RenderPassInstancing) {
+    using namespace filament::details;
+    using Command = RenderPass::Command;
+    using Pass = RenderPass::Pass;
+
+    FEngine* engine = FEngine::create();
+    JobSystem& js = engine->getJobSystem();
+
+    constexpr size_t RENDERABLE_COUNT = 6;
+    FScene::RenderableSoa soa;
+    soa.resize(RENDERABLE_COUNT);   // identity world transforms
+
+    // 4 identical commands that can be merged, 2 skinned ones that can't, and cancelled commands
+    // whose primitive is garbage, like generateCommands() leaves them
+    auto makeCommands = [&js]() {
+        std::vector<Command> commands;
+        for (uint32_t i = 0; i < RENDERABLE_COUNT; i++) {
+            Command c;
+            c.key = uint64_t(Pass::COLOR) | (i < 4 ? 0 : 1);
+            c.primitive.primitiveHandle = Handle<HwRenderPrimitive>(0);
+            c.primitive.index = i;
+            if (i >= 4) {
+                c.primitive.perRenderableBones = Handle<HwUniformBuffer>(0);
+            }
+            commands.push_back(c);
+
+            Command cancelled;
+            cancelled.key = uint64_t(Pass::SENTINEL);
+            cancelled.primitive.index = 0xFFFFFFFF;
+            cancelled.primitive.instanceCount = 0xFFFF;
+            commands.push_back(cancelled);
+        }
+        Command sentinel;
+        sentinel.key = uint64_t(Pass::SENTINEL);
+        commands.push_back(sentinel);
+        RenderPass::sortCommands(js, commands.data(), commands.data() + commands.size(), nullptr);
+        return commands;
+    };
+
+    {
+        std::vector<Command> commands = makeCommands();
+        Command* const begin = commands.data();
+        Command* const last = RenderPass::getDrawCommandsEnd(*engine, nullptr, soa,
+                begin, begin + commands.size());
+        ASSERT_EQ(RENDERABLE_COUNT, last - begin);
+        for (Command const* c = begin; c != last; ++c) {
+            EXPECT_NE(uint64_t(Pass::SENTINEL), c->key);
+        }
+    }
+
+    RenderPass::InstanceBuffers instanceBuffers;
+    HandleBase::HandleId firstBuffer;
+    {
+        std::vector<Command> commands = makeCommands();
+        Command* const begin = commands.data();
+        Command* const last = RenderPass::getDrawCommandsEnd(*engine, &instanceBuffers, soa,
+                begin, begin + commands.size());
+        ASSERT_EQ(3, last - begin);
+        size_t drawnCount = 0;
+        for (Command const* c = begin; c != last; ++c) {
+            EXPECT_NE(uint64_t(Pass::SENTINEL), c->key);
+            EXPECT_LT(c->primitive.index, RENDERABLE_COUNT);
+            drawnCount += c->primitive.instanceCount;
+        }
+        EXPECT_EQ(4, begin[0].primitive.instanceCount);
+        EXPECT_EQ(RENDERABLE_COUNT, drawnCount);
+        firstBuffer = begin[0].primitive.perRenderableInstances.getId();
+    }
+
+    // an instance buffer is never updated again in the same frame, nor in the next one
+    auto getInstanceBuffer = [&]() {
+        std::vector<Command> commands = makeCommands();
+        Command* const begin = commands.data();
+        RenderPass::getDrawCommandsEnd(*engine, &instanceBuffers, soa,
+                begin, begin + commands.size());
+        return begin[0].primitive.perRenderableInstances.getId();
+    };
+    const HandleBase::HandleId secondPassBuffer = getInstanceBuffer();
+    EXPECT_NE(firstBuffer, secondPassBuffer);
+    engine->prepare();
+    const HandleBase::HandleId nextFrameBuffer = getInstanceBuffer();
+    EXPECT_NE(firstBuffer, nextFrameBuffer);
+    EXPECT_NE(secondPassBuffer, nextFrameBuffer);
+    engine->prepare();
+    EXPECT_EQ(firstBuffer, getInstanceBuffer());
+
+    instanceBuffers.terminate(engine->getDriverApi());
+    engine->shutdown();
+    delete engine;
+}
+
+TEST(FilamentTest, InstancingVariant) {
+    // instancing only changes the vertex shader, lit or not, including in the depth pass
+    for (uint8_t key = 0; key < VARIANT_COUNT; key++) {
+        if (Variant::isReserved(key)) {
+            continue;
+        }
+        Variant variant(key);
+        variant.setInstancing(true);
+        EXPECT_TRUE(variant.hasInstancing());
+        EXPECT_EQ(Variant::isReserved(key), Variant::isReserved(variant.key));
+        EXPECT_EQ(Variant(key).isDepthPass(), variant.isDepthPass());
+        EXPECT_TRUE(Variant::filterVariantVertex(variant.key) & Variant::INSTANCING);
+        EXPECT_EQ(Variant::filterVariantFragment(key),
+                Variant::filterVariantFragment(variant.key));
+        EXPECT_TRUE(Variant::filterVariant(variant.key, true) & Variant::INSTANCING);
+        EXPECT_TRUE(Variant::filterVariant(variant.key, false) & Variant::INSTANCING);
+        variant.setInstancing(false);
+        EXPECT_EQ(uint8_t(key & ~Variant::INSTANCING), variant.key);
+    }
+}
+
+TEST(FilamentTest, MaterialCompile) {
+    using namespace filament::details;
+
+    FEngine* engine = FEngine::create();
+
+    filamat::Package package = filamat::MaterialBuilder()
+            .name("Compile")
+            .shading(Shading::LIT)
+            .material("void material(inout MaterialInputs material) { prepareMaterial(material); }")
+            .build();
+    auto createMaterial = [&]() {
+        return upcast(Material::Builder()
+                .package(package.getData(), package.getSize())
+                .build(*engine));
+    };
+    auto countCallbacks = [](Material*, void* user) { (*static_cast<int*>(user))++; };
+
+    FMaterial* material = createMaterial();
+    ASSERT_NE(nullptr, material);
+
+    // while a variant is being prepared, it falls back to one without its lighting bits
+    const uint8_t variant = Variant::DIRECTIONAL_LIGHTING;
+    Handle<HwProgram> const fallback = material->getProgram(0);
+    int callbackCount = 0;
+    material->compile(variant, countCallbacks, &callbackCount);
+    EXPECT_TRUE(material->hasProgram(variant));
+    EXPECT_EQ(fallback.getId(), material->getProgram(variant).getId());
+
+    // the variant is created, and the callback called, by the first frame after it's prepared,
+    // whatever the number of frames in between
+    for (size_t i = 0; i < 10000 && !callbackCount; i++) {
+        engine->prepare();
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    EXPECT_EQ(1, callbackCount);
+    EXPECT_NE(fallback.getId(), material->getProgram(variant).getId());
+    engine->prepare();
+    EXPECT_EQ(1, callbackCount);
+
+    // destroying a material while its variants are being prepared waits for them, and the
+    // callback is never called
+    FMaterial* other = createMaterial();
+    ASSERT_NE(nullptr, other);
+    int otherCallbackCount = 0;
+    other->compile(Material::Variants::ALL, countCallbacks, &otherCallbackCount);
+    engine->destroy(other);
+    engine->prepare();
+    EXPECT_EQ(0, otherCallbackCount);
+
+    engine->destroy(material);
+    engine->shutdown();
+    delete engine;
+}
+
+#if defined(FILAMENT_DRIVER_SUPPORTS_RECORDING)
+
+// the replay needs the recording in memory aligned to CommandWriter::PAYLOAD_ALIGNMENT
+static std::unique_ptr<void, void(*)(void*)> alignRecording(std::vector<uint8_t> const& recording) {
+    std::unique_ptr<void, void(*)(void*)> data(
+            utils::aligned_alloc(recording.size(), CommandWriter::PAYLOAD_ALIGNMENT),
+            utils::aligned_free);
+    memcpy(data.get(), recording.data(), recording.size());
+    return data;
+}
+
+TEST(FilamentTest, DriverCommandsRecording) {
+    uint8_t pixels[4 * 4 * 4];
+    for (size_t i = 0; i < sizeof(pixels); i++) {
+        pixels[i] = uint8_t(i);
+    }
+    const uint16_t indices[] = { 0, 1, 2 };
+
+    UniformInterfaceBlock uib(UniformInterfaceBlock::Builder()
+            .name("Uniforms")
+            .add("color", 1, UniformInterfaceBlock::Type::FLOAT4)
+            .add("weights", 3, UniformInterfaceBlock::Type::FLOAT)
+            .build());
+    SamplerInterfaceBlock sib(SamplerInterfaceBlock::Builder()
+            .name("Samplers")
+            .add("albedo", SamplerInterfaceBlock::Type::SAMPLER_2D,
+                    SamplerInterfaceBlock::Format::FLOAT, SamplerInterfaceBlock::Precision::HIGH)
+            .build());
+
+    // records a few commands of each kind, sent through a CommandStream like the engine does
+    std::vector<uint8_t> recording;
+    {
+        std::unique_ptr<Driver> driver = RecordingDriver::create(NoopDriver::create(), recording);
+        std::vector<uint64_t> storage(8192);
+        CircularBuffer buffer(storage.data(), storage.size() * sizeof(uint64_t));
+        CommandStream stream(*driver, buffer);
+        stream.debugThreading();
+
+        Driver::TextureHandle th = stream.createTexture(Driver::SamplerType::SAMPLER_2D, 1,
+                Driver::TextureFormat::RGBA8, 1, 4, 4, 1, Driver::TextureUsage::DEFAULT);
+        stream.load2DImage(th, 0, 0, 0, 4, 4, Driver::PixelBufferDescriptor(
+                pixels, sizeof(pixels), Driver::PixelDataFormat::RGBA, Driver::PixelDataType::UBYTE));
+
+        Driver::IndexBufferHandle ibh = stream.createIndexBuffer(Driver::ElementType::USHORT, 3);
+        stream.loadIndexBuffer(ibh, Driver::BufferDescriptor(indices, sizeof(indices)),
+                0, sizeof(indices));
+
+        Program program;
+        program.diagnostics(CString("Recording"), 1)
+                .withVertexShader(CString("void main() { gl_Position = vec4(0.0); }"))
+                .withFragmentShader(CString("void main() { }"))
+                .addUniformBlock(0, &uib)
+                .addSamplerBlock(0, &sib);
+        Driver::ProgramHandle ph = stream.createProgram(std::move(program));
+
+        Driver::SamplerBufferHandle sbh = stream.createSamplerBuffer(1);
+        SamplerBuffer samplers(1);
+        SamplerInterfaceBlock::SamplerParams params;
+        params.filterMag = Driver::SamplerMagFilter::LINEAR;
+        samplers.setSampler(0, th, params);
+        stream.updateSamplerBuffer(sbh, std::move(samplers));
+
+        stream.getMaxTextureSize();
+
+        stream.destroySamplerBuffer(sbh);
+        stream.destroyProgram(ph);
+        stream.destroyIndexBuffer(ibh);
+        stream.destroyTexture(th);
+
+        new(buffer.allocate(CommandBase::align(sizeof(NoopCommand)))) NoopCommand(nullptr);
+        stream.execute(buffer.getTail());
+        // the recording is complete once the driver is destroyed
+    }
+    // 4 handles created (twice each), 3 buffers loaded, 1 synchronous call and 4 destructions
+    const size_t commandCount = 16;
+
+    ASSERT_TRUE(CommandReader::isValid(recording.data(), recording.size()));
+    std::unique_ptr<void, void(*)(void*)> data = alignRecording(recording);
+    std::unique_ptr<Driver> noop = NoopDriver::create();
+    EXPECT_EQ(commandCount, CommandReplayer(*noop, data.get(), recording.size()).replay());
+
+    // the replay records the same commands again: the buffers, the Program and the SamplerBuffer
+    // are read back exactly as they were written
+    std::vector<uint8_t> replayed;
+    {
+        std::unique_ptr<Driver> driver = RecordingDriver::create(NoopDriver::create(), replayed);
+        EXPECT_EQ(commandCount, CommandReplayer(*driver, data.get(), recording.size()).replay());
+    }
+    EXPECT_EQ(recording, replayed);
+
+    // a truncated recording is replayed up to its last complete command, wherever it's cut
+    size_t previousCount = 0;
+    for (size_t size = sizeof(FileHeader); size < recording.size(); size++) {
+        const size_t count = CommandReplayer(*noop, data.get(), size).replay();
+        EXPECT_LE(previousCount, count);
+        EXPECT_GT(commandCount, count);
+        previousCount = count;
+    }
+    EXPECT_EQ(commandCount - 1, previousCount);
+
+    // the recorded handles are replaced by the ones the replaying driver created
+    std::vector<uint8_t> handles;
+    {
+        CommandWriter writer(handles);
+        writer.writeCommand(CommandId::destroyTexture, std::make_tuple(Driver::TextureHandle(7)));
+        writer.writeCommand(CommandId::destroyTexture, std::make_tuple(Driver::TextureHandle()));
+    }
+    std::unique_ptr<void, void(*)(void*)> handlesData = alignRecording(handles);
+    CommandReader reader(handlesData.get(), handles.size());
+    reader.setHandle(7, 42);
+    EXPECT_EQ(CommandId::destroyTexture, reader.read<CommandId>());
+    EXPECT_EQ(42u, reader.read<Driver::TextureHandle>().getId());
+    EXPECT_EQ(CommandId::destroyTexture, reader.read<CommandId>());
+    EXPECT_FALSE(reader.read<Driver::TextureHandle>());
+    EXPECT_TRUE(reader.empty());
+    EXPECT_FALSE(reader.failed());
+
+    noop->terminate();
+}
+
+#endif
+
 TEST(FilamentTest, RangeSet) {
 
     utils::RangeSet<4> rs;
@@ -806,6 +1322,61 @@ TEST(FilamentTest, RangeSet) {
     EXPECT_EQ(250, b[2].end);
 }
 
+TEST(FilamentTest, HandleAllocator) {
+    HandleAllocator allocator("test", 64 * 1024);
+
+    HandleBase::HandleId a = allocator.allocate(16);
+    HandleBase::HandleId b = allocator.allocate(100);
+    HandleBase::HandleId c = allocator.allocate(16);
+    EXPECT_TRUE(allocator.isValid(a));
+    EXPECT_TRUE(allocator.isValid(b));
+    EXPECT_TRUE(allocator.isValid(c));
+
+    // the objects don't overlap
+    char* pa = static_cast<char*>(allocator.handle_cast(a));
+    char* pb = static_cast<char*>(allocator.handle_cast(b));
+    char* pc = static_cast<char*>(allocator.handle_cast(c));
+    EXPECT_TRUE(pb >= pa + 16 || pa >= pb + 100);
+    EXPECT_TRUE(pc >= pb + 100 || pb >= pc + 16);
+
+    // a freed slot is reused by the same size class, with a new id
+    allocator.free(a, 16);
+    EXPECT_FALSE(allocator.isValid(a));
+    HandleBase::HandleId d = allocator.allocate(12);
+    EXPECT_NE(a, d);
+    EXPECT_EQ(pa, allocator.handle_cast(d));
+    EXPECT_TRUE(allocator.isValid(d));
+    EXPECT_FALSE(allocator.isValid(a));
+
+    // but not by another one
+    allocator.free(b, 100);
+    HandleBase::HandleId e = allocator.allocate(16);
+    EXPECT_NE(pb, allocator.handle_cast(e));
+
+    // allocations and frees from several threads
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < 4; t++) {
+        threads.emplace_back([&allocator]() {
+            std::vector<HandleBase::HandleId> ids;
+            for (size_t i = 0; i < 10000; i++) {
+                ids.push_back(allocator.allocate(32));
+                if (ids.size() == 16) {
+                    for (HandleBase::HandleId id : ids) {
+                        EXPECT_TRUE(allocator.isValid(id));
+                        allocator.free(id, 32);
+                    }
+                    ids.clear();
+                }
+            }
+            for (HandleBase::HandleId id : ids) {
+                allocator.free(id, 32);
+            }
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+}
 
 int main(int argc, char** argv) {
     ::testing::InitGoogleTest(&argc, argv);
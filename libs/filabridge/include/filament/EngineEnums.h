@@ -42,8 +42,9 @@ namespace BindingPoints {
     constexpr uint8_t PER_RENDERABLE_BONES    = 2;    // bones data, per renderable
     constexpr uint8_t LIGHTS                  = 3;    // lights data array
     constexpr uint8_t POST_PROCESS            = 4;    // samplers for the post process pass
-    constexpr uint8_t PER_MATERIAL_INSTANCE   = 5;    // uniforms/samplers updates per material
-    constexpr uint8_t COUNT                   = 6;
+    constexpr uint8_t PER_RENDERABLE_INSTANCES= 5;    // instances transforms, per renderable
+    constexpr uint8_t PER_MATERIAL_INSTANCE   = 6;    // uniforms/samplers updates per material
+    constexpr uint8_t COUNT                   = 7;
 };
 
 static_assert(BindingPoints::PER_MATERIAL_INSTANCE == BindingPoints::COUNT - 1,
@@ -58,6 +59,19 @@ constexpr size_t CONFIG_MAX_LIGHT_COUNT = 256;
 // 256 is enough, but we could use 512 if needed
 constexpr size_t CONFIG_MAX_BONE_COUNT = 256;
 
+// This value is also limited by UBO size, ES3.0 only guarantees 16 KiB.
+// Each instance uses a mat4 (64 bytes).
+constexpr size_t CONFIG_MAX_INSTANCE_COUNT = 256;
+
+// Maximum number of cascades of the directional light's shadow map. The cascades' splits are
+// stored in a single vec4, so this can't be larger than 4.
+constexpr size_t CONFIG_MAX_SHADOW_CASCADES = 4;
+
+// Maximum number of tiles in the shadow atlas of the spot and point lights, a spot light uses a
+// single tile and a point light uses six. This is limited by UBO size (each tile uses a mat4) and
+// by the 32-bits visibility mask of the shadow casters.
+constexpr size_t CONFIG_MAX_SHADOW_ATLAS_TILES = 24;
+
 // can't really use std::underlying_type<AttributeIndex>::type because the driver takes a uint32_t
 using AttributeBitset = utils::bitset32;
 
@@ -21,6 +21,9 @@
 #include <stdint.h>
 
 namespace filament {
+    // update this when the format of the material packages changes, e.g. a new variant bit
+    static constexpr uint32_t MATERIAL_VERSION = 2;
+
     enum class Shading : uint8_t {
         UNLIT,                  // no lighting applied, emissive possible
         LIT,                    // default, standard lighting
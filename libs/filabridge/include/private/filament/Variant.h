@@ -21,7 +21,7 @@
 #include <cstddef>
 
 namespace filament {
-    static constexpr size_t VARIANT_COUNT = 16;
+    static constexpr size_t VARIANT_COUNT = 64;
 
     // IMPORTANT: update filterVariant() when adding more variants
     struct Variant {
@@ -33,17 +33,21 @@ namespace filament {
         // DYL: Dynamic Lighting
         // SRE: Shadow Receiver
         // SKN: Skinning
+        // INS: Instancing
+        // CAS: Shadow Cascades
         //
-        //                    ...-----+-----+-----+-----+-----+
-        // Variant                 0  | SKN | SRE | DYN | DIR |
-        //                    ...-----+-----+-----+-----+-----+
+        //                    ...-----+-----+-----+-----+-----+-----+-----+
+        // Variant                 0  | CAS | INS | SKN | SRE | DYN | DIR |
+        //                    ...-----+-----+-----+-----+-----+-----+-----+
         // Reserved variants:
-        //       Depth shader            X     1     0     0
-        //           Reserved            X     1     1     0
+        //       Depth shader            0     X     X     1     0     0
+        //           Reserved            X     X     X     1     1     0
         //
         // Standard variants:
-        //      Vertex shader            X     X     0     X
-        //    Fragment shader            0     X     X     X
+        //      Vertex shader            X     X     X     X     0     X
+        //    Fragment shader            X     0     0     X     X     X
+        //
+        // CAS is only used together with SRE and DIR.
 
         uint8_t key = 0;
 
@@ -53,38 +57,52 @@ namespace filament {
         static constexpr uint8_t DYNAMIC_LIGHTING       = 0x02; // point, spot or area present, per frame/world position
         static constexpr uint8_t SHADOW_RECEIVER        = 0x04; // receives shadows, per renderable
         static constexpr uint8_t SKINNING               = 0x08; // GPU skinning
+        static constexpr uint8_t INSTANCING             = 0x10; // hardware instancing
+        static constexpr uint8_t SHADOW_CASCADES        = 0x20; // directional shadows use several cascades, per frame
 
         static constexpr uint8_t VERTEX_MASK = DIRECTIONAL_LIGHTING |
                                                SHADOW_RECEIVER |
-                                               SKINNING;
+                                               SKINNING |
+                                               INSTANCING |
+                                               SHADOW_CASCADES;
 
         static constexpr uint8_t FRAGMENT_MASK = DIRECTIONAL_LIGHTING |
                                                  DYNAMIC_LIGHTING |
-                                                 SHADOW_RECEIVER;
+                                                 SHADOW_RECEIVER |
+                                                 SHADOW_CASCADES;
 
         static constexpr uint8_t DEPTH_MASK = DIRECTIONAL_LIGHTING |
                                               DYNAMIC_LIGHTING |
-                                              SHADOW_RECEIVER;
+                                              SHADOW_RECEIVER |
+                                              SHADOW_CASCADES;
+
+        // the shadow cascades are only used by the shadow receivers of the directional light
+        static constexpr uint8_t SHADOW_CASCADES_MASK = DIRECTIONAL_LIGHTING |
+                                                        SHADOW_RECEIVER;
 
         // the depth variant deactivates all variants that make no sense when writing the depth
         // only -- essentially, all fragment-only variants.
         static constexpr uint8_t DEPTH_VARIANT = SHADOW_RECEIVER;
 
         // this mask filters out the lighting variants
-        static constexpr uint8_t UNLIT_MASK    = SKINNING;
+        static constexpr uint8_t UNLIT_MASK    = SKINNING | INSTANCING;
 
         static_assert((VERTEX_MASK | FRAGMENT_MASK) == VARIANT_COUNT - 1,
                 "inconsistency between vertex/fragment masks and variant count");
 
         inline bool hasSkinning() const noexcept { return key & SKINNING; }
+        inline bool hasInstancing() const noexcept { return key & INSTANCING; }
         inline bool hasDirectionalLighting() const noexcept { return key & DIRECTIONAL_LIGHTING; }
         inline bool hasDynamicLighting() const noexcept { return key & DYNAMIC_LIGHTING; }
         inline bool hasShadowReceiver() const noexcept { return key & SHADOW_RECEIVER; }
+        inline bool hasShadowCascades() const noexcept { return key & SHADOW_CASCADES; }
 
         inline void setSkinning(bool v) noexcept { set(v, SKINNING); }
+        inline void setInstancing(bool v) noexcept { set(v, INSTANCING); }
         inline void setDirectionalLighting(bool v) noexcept { set(v, DIRECTIONAL_LIGHTING); }
         inline void setDynamicLighting(bool v) noexcept { set(v, DYNAMIC_LIGHTING); }
         inline void setShadowReceiver(bool v) noexcept { set(v, SHADOW_RECEIVER); }
+        inline void setShadowCascades(bool v) noexcept { set(v, SHADOW_CASCADES); }
 
         inline constexpr bool isDepthPass() const noexcept {
             return (key & DEPTH_MASK) == DEPTH_VARIANT;
@@ -102,8 +120,8 @@ namespace filament {
         }
 
         static constexpr uint8_t filterVariantFragment(uint8_t variantKey) noexcept {
-            // filter out fragment variants that are not needed. For e.g. skinning doesn't
-            // affect the fragment shader.
+            // filter out fragment variants that are not needed. For e.g. skinning or
+            // instancing don't affect the fragment shader.
             return variantKey & FRAGMENT_MASK;
         }
 
@@ -112,6 +130,10 @@ namespace filament {
             if ((variantKey & DEPTH_MASK) == DEPTH_VARIANT) {
                 return variantKey;
             }
+            // remove the shadow cascades when there is no directional shadow to receive
+            if ((variantKey & SHADOW_CASCADES_MASK) != SHADOW_CASCADES_MASK) {
+                variantKey &= ~SHADOW_CASCADES;
+            }
             // when the shading mode is unlit, remove all the lighting variants
             return isLit ? variantKey : (variantKey & UNLIT_MASK);
         }
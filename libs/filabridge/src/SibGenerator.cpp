@@ -27,6 +27,7 @@ SamplerInterfaceBlock& SibGenerator::getPerViewSib() noexcept {
     static SamplerInterfaceBlock sib = SamplerInterfaceBlock::Builder()
             .name("Light")
             .add("shadowMap",     Type::SAMPLER_2D,      Format::SHADOW,Precision::LOW)
+            .add("shadowAtlas",   Type::SAMPLER_2D,      Format::SHADOW,Precision::LOW)
             .add("records",       Type::SAMPLER_2D,      Format::UINT,  Precision::MEDIUM)
             .add("froxels",       Type::SAMPLER_2D,      Format::UINT,  Precision::MEDIUM)
             .add("iblDFG",        Type::SAMPLER_2D,      Format::FLOAT, Precision::MEDIUM)
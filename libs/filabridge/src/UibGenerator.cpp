@@ -32,7 +32,8 @@ UniformInterfaceBlock& UibGenerator::getPerViewUib() noexcept  {
             .add("clipFromViewMatrix",      1, UniformInterfaceBlock::Type::MAT4, Precision::HIGH)
             .add("viewFromClipMatrix",      1, UniformInterfaceBlock::Type::MAT4, Precision::HIGH)
             .add("clipFromWorldMatrix",     1, UniformInterfaceBlock::Type::MAT4, Precision::HIGH)
-            .add("lightFromWorldMatrix",    1, UniformInterfaceBlock::Type::MAT4, Precision::HIGH)
+            .add("lightFromWorldMatrix",    CONFIG_MAX_SHADOW_CASCADES, UniformInterfaceBlock::Type::MAT4, Precision::HIGH)
+            .add("atlasFromWorldMatrix",    CONFIG_MAX_SHADOW_ATLAS_TILES, UniformInterfaceBlock::Type::MAT4, Precision::HIGH)
             // view
             .add("resolution",              1, UniformInterfaceBlock::Type::FLOAT4)
             // camera
@@ -45,8 +46,11 @@ UniformInterfaceBlock& UibGenerator::getPerViewUib() noexcept  {
             .add("lightDirection",          1, UniformInterfaceBlock::Type::FLOAT3)
             .add("padding1",                1, UniformInterfaceBlock::Type::FLOAT)
             // shadow
-            .add("shadowBias",              1, UniformInterfaceBlock::Type::FLOAT3)
+            .add("padding2",                1, UniformInterfaceBlock::Type::FLOAT3)
             .add("oneOverFroxelDimensionY", 1, UniformInterfaceBlock::Type::FLOAT)
+            .add("cascadeSplits",           1, UniformInterfaceBlock::Type::FLOAT4, Precision::HIGH)
+            .add("cascadeConstantBias",     1, UniformInterfaceBlock::Type::FLOAT4)
+            .add("cascadeNormalBias",       1, UniformInterfaceBlock::Type::FLOAT4)
             // froxels
             .add("zParams",                 1, UniformInterfaceBlock::Type::FLOAT4)
             .add("fParams",                 1, UniformInterfaceBlock::Type::UINT2)
@@ -99,4 +103,12 @@ UniformInterfaceBlock& UibGenerator::getPerRenderableBonesUib() noexcept {
     return uib;
 }
 
+UniformInterfaceBlock& UibGenerator::getPerRenderableInstancesUib() noexcept {
+    static UniformInterfaceBlock uib = UniformInterfaceBlock::Builder()
+            .name("InstancesUniforms")
+            .add("transforms", CONFIG_MAX_INSTANCE_COUNT, UniformInterfaceBlock::Type::MAT4, Precision::HIGH)
+            .build();
+    return uib;
+}
+
 } // namespace filament
@@ -57,6 +57,7 @@ public:
     bool getUIB(filament::UniformInterfaceBlock* uib) const noexcept;
     bool getSIB(filament::SamplerInterfaceBlock* sib) const noexcept;
     bool getSamplerBindingMap(filament::SamplerBindingMap*) const noexcept;
+    bool getMaterialVersion(uint32_t* value) const noexcept;
     bool getShaderModels(uint32_t* value) const noexcept;
 
     bool getDepthWriteSet(bool* value) const noexcept;
@@ -186,6 +186,10 @@ bool MaterialParser::getSamplerBindingMap(filament::SamplerBindingMap* bindings)
     return ChunkSamplerBindingsBlock().unflatten(unflattener, bindings);
 }
 
+bool MaterialParser::getMaterialVersion(uint32_t* value) const noexcept {
+    return mImpl->getFromSimpleChunk(ChunkType::MaterialVersion, value);
+}
+
 bool MaterialParser::getShaderModels(uint32_t* value) const noexcept {
     return mImpl->getFromSimpleChunk(ChunkType::MaterialShaderModels, value);
 }
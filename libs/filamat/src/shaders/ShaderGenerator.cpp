@@ -159,7 +159,9 @@ const std::string ShaderGenerator::createVertexProgram(filament::driver::ShaderM
     bool litVariants = lit || (!lit && material.hasShadowMultiplier);
     cg.generateDefine(vs, "HAS_DIRECTIONAL_LIGHTING", litVariants && variant.hasDirectionalLighting());
     cg.generateDefine(vs, "HAS_SHADOWING", litVariants && variant.hasShadowReceiver());
+    cg.generateDefine(vs, "HAS_SHADOW_CASCADES", litVariants && variant.hasShadowCascades());
     cg.generateDefine(vs, "HAS_SKINNING", variant.hasSkinning());
+    cg.generateDefine(vs, "HAS_INSTANCING", variant.hasInstancing());
     cg.generateDefine(vs, getShadingDefine(material.shading), true);
     generateMaterialDefines(vs, cg, mProperties);
 
@@ -189,6 +191,11 @@ const std::string ShaderGenerator::createVertexProgram(filament::driver::ShaderM
                 BindingPoints::PER_RENDERABLE_BONES,
                 UibGenerator::getPerRenderableBonesUib());
     }
+    if (variant.hasInstancing()) {
+        cg.generateUniforms(vs, ShaderType::VERTEX,
+                BindingPoints::PER_RENDERABLE_INSTANCES,
+                UibGenerator::getPerRenderableInstancesUib());
+    }
     cg.generateUniforms(vs, ShaderType::VERTEX,
             BindingPoints::PER_MATERIAL_INSTANCE, material.uib);
     cg.generateSeparator(vs);
@@ -251,6 +258,7 @@ const std::string ShaderGenerator::createFragmentProgram(filament::driver::Shade
     cg.generateDefine(fs, "HAS_DIRECTIONAL_LIGHTING", litVariants && variant.hasDirectionalLighting());
     cg.generateDefine(fs, "HAS_DYNAMIC_LIGHTING", litVariants && variant.hasDynamicLighting());
     cg.generateDefine(fs, "HAS_SHADOWING", litVariants && variant.hasShadowReceiver());
+    cg.generateDefine(fs, "HAS_SHADOW_CASCADES", litVariants && variant.hasShadowCascades());
 
     // material defines
     cg.generateDefine(fs, "MATERIAL_IS_DOUBLE_SIDED", material.isDoubleSided);
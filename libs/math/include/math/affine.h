@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef TNT_MATH_AFFINE_H
+#define TNT_MATH_AFFINE_H
+
+#include <math/compiler.h>
+#include <math/mat4.h>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define MATH_AFFINE_USE_SSE 1
+#endif
+
+namespace math {
+
+/*
+ * Affine transforms are the 4x4 matrices whose last row is [0, 0, 0, 1], i.e. the 4x3
+ * matrices made of a 3x3 linear transform and a translation. This is what most transforms of
+ * a scene graph are.
+ */
+
+// returns whether the last row of m is [0, 0, 0, 1]
+template<typename T>
+constexpr bool MATH_PURE isAffine(details::TMat44<T> const& m) noexcept {
+    return m[0][3] == T(0) && m[1][3] == T(0) && m[2][3] == T(0) && m[3][3] == T(1);
+}
+
+/*
+ * Returns a * b, where b must be affine (a can be any matrix).
+ *
+ * Because the last row of b is known, only its 4x3 upper part is used: this needs 12 multiplies
+ * and 9 additions instead of 16 and 12 for the generic product, and the w components of b are
+ * ignored. When a is affine as well, so is the result.
+ */
+inline details::TMat44<float> MATH_PURE multiplyAffine(
+        details::TMat44<float> const& a, details::TMat44<float> const& b) noexcept {
+    details::TMat44<float> r;
+#if defined(__ARM_NEON)
+    const float32x4_t a0 = vld1q_f32(&a[0][0]);
+    const float32x4_t a1 = vld1q_f32(&a[1][0]);
+    const float32x4_t a2 = vld1q_f32(&a[2][0]);
+    for (size_t i = 0; i < 4; i++) {
+        const float32x4_t c = vld1q_f32(&b[i][0]);
+        float32x4_t t = vmulq_lane_f32(a0, vget_low_f32(c), 0);
+        t = vmlaq_lane_f32(t, a1, vget_low_f32(c), 1);
+        t = vmlaq_lane_f32(t, a2, vget_high_f32(c), 0);
+        if (i == 3) {
+            t = vaddq_f32(t, vld1q_f32(&a[3][0]));
+        }
+        vst1q_f32(&r[i][0], t);
+    }
+#elif defined(MATH_AFFINE_USE_SSE)
+    const __m128 a0 = _mm_loadu_ps(&a[0][0]);
+    const __m128 a1 = _mm_loadu_ps(&a[1][0]);
+    const __m128 a2 = _mm_loadu_ps(&a[2][0]);
+    for (size_t i = 0; i < 4; i++) {
+        const __m128 c = _mm_loadu_ps(&b[i][0]);
+        __m128 t = _mm_mul_ps(a0, _mm_shuffle_ps(c, c, _MM_SHUFFLE(0, 0, 0, 0)));
+        t = _mm_add_ps(t, _mm_mul_ps(a1, _mm_shuffle_ps(c, c, _MM_SHUFFLE(1, 1, 1, 1))));
+        t = _mm_add_ps(t, _mm_mul_ps(a2, _mm_shuffle_ps(c, c, _MM_SHUFFLE(2, 2, 2, 2))));
+        if (i == 3) {
+            t = _mm_add_ps(t, _mm_loadu_ps(&a[3][0]));
+        }
+        _mm_storeu_ps(&r[i][0], t);
+    }
+#else
+    for (size_t i = 0; i < 4; i++) {
+        r[i] = a[0] * b[i].x + a[1] * b[i].y + a[2] * b[i].z;
+    }
+    r[3] += a[3];
+#endif
+    return r;
+}
+
+} // namespace math
+
+#undef MATH_AFFINE_USE_SSE
+
+#endif // TNT_MATH_AFFINE_H
@@ -20,6 +20,7 @@
 #include <random>
 #include <functional>
 
+#include <math/affine.h>
 #include <math/mat2.h>
 #include <math/mat4.h>
 #include <math/mat3.h>
@@ -36,6 +37,31 @@ TEST_F(MatTest, Basics) {
     EXPECT_EQ(sizeof(mat4), sizeof(double)*16);
 }
 
+TEST_F(MatTest, MultiplyAffine) {
+    std::default_random_engine generator(171717);
+    std::uniform_real_distribution<float> distribution(-10.0f, 10.0f);
+    auto rand_gen = std::bind(distribution, generator);
+
+    for (size_t n = 0; n < 100; ++n) {
+        mat4f a, b;
+        for (size_t i = 0; i < 4; i++) {
+            for (size_t j = 0; j < 4; j++) {
+                a[i][j] = rand_gen();
+                b[i][j] = j < 3 ? rand_gen() : (i < 3 ? 0.0f : 1.0f);
+            }
+        }
+        EXPECT_TRUE(isAffine(b));
+        mat4f r = multiplyAffine(a, b);
+        mat4f e = a * b;
+        for (size_t i = 0; i < 4; i++) {
+            for (size_t j = 0; j < 4; j++) {
+                EXPECT_NEAR(r[i][j], e[i][j], 1e-3f);
+            }
+        }
+    }
+    EXPECT_FALSE(isAffine(mat4f::perspective(90.0f, 1.0f, 0.1f, 10.0f)));
+}
+
 TEST_F(MatTest, ComparisonOps) {
     mat4 m0;
     mat4 m1(2);
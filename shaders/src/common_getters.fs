@@ -51,3 +51,20 @@ float getExposure() {
 float getEV100() {
     return frameUniforms.ev100;
 }
+
+mat4 getLightFromWorldMatrix(const uint cascade) {
+    return frameUniforms.lightFromWorldMatrix[cascade];
+}
+
+mat4 getAtlasFromWorldMatrix(const uint tile) {
+    return frameUniforms.atlasFromWorldMatrix[tile];
+}
+
+/**
+ * Returns the index of the shadow cascade covering the specified view space depth (i.e. the
+ * distance to the camera plane). This returns 4 past the last cascade.
+ */
+uint getShadowCascade(const float depth) {
+    bvec4 greater = greaterThan(vec4(depth), frameUniforms.cascadeSplits);
+    return uint(dot(vec4(greater), vec4(1.0)));
+}
@@ -25,6 +25,18 @@ vec2 getUV1() {
 
 #if defined(HAS_SHADOWING) && defined(HAS_DIRECTIONAL_LIGHTING)
 HIGHP vec3 getLightSpacePosition() {
-    return vertex_lightSpacePosition.xyz * (1.0 / vertex_lightSpacePosition.w);
+#if defined(HAS_SHADOW_CASCADES)
+    // the cascade is selected per fragment, so that cascades don't blend across triangles
+    uint cascade = getShadowCascade(vertex_shadowPosition.w);
+    if (cascade >= 4u) {
+        // past the last cascade, return a position that is never in shadow
+        return vec3(0.5, 0.5, 0.0);
+    }
+    HIGHP vec4 p = getLightFromWorldMatrix(cascade) * vec4(vertex_shadowPosition.xyz, 1.0);
+    p.z -= frameUniforms.cascadeConstantBias[cascade];
+    return p.xyz * (1.0 / p.w);
+#else
+    return vertex_shadowPosition.xyz * (1.0 / vertex_shadowPosition.w);
+#endif
 }
 #endif
@@ -2,18 +2,36 @@
 // Uniforms access
 //------------------------------------------------------------------------------
 
-mat4 getLightFromWorldMatrix() {
-    return frameUniforms.lightFromWorldMatrix;
+#if defined(HAS_INSTANCING)
+#if defined(CODEGEN_TARGET_VULKAN_ENVIRONMENT)
+#define INSTANCE_INDEX gl_InstanceIndex
+#else
+#define INSTANCE_INDEX gl_InstanceID
+#endif
+
+mat4 getInstanceFromModelMatrix() {
+    return instancesUniforms.transforms[INSTANCE_INDEX];
 }
+#endif
 
 /** @public-api */
 mat4 getWorldFromModelMatrix() {
+#if defined(HAS_INSTANCING)
+    return objectUniforms.worldFromModelMatrix * getInstanceFromModelMatrix();
+#else
     return objectUniforms.worldFromModelMatrix;
+#endif
 }
 
 /** @public-api */
 mat3 getWorldFromModelNormalMatrix() {
+#if defined(HAS_INSTANCING)
+    // instance transforms are assumed to be rigid or uniformly scaled, the normals
+    // are normalized after interpolation anyway
+    return objectUniforms.worldFromModelNormalMatrix * mat3(getInstanceFromModelMatrix());
+#else
     return objectUniforms.worldFromModelNormalMatrix;
+#endif
 }
 
 //------------------------------------------------------------------------------
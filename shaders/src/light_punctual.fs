@@ -112,6 +112,45 @@ void setupPunctualLight(inout Light light, const HIGHP vec4 positionFalloff) {
     light.attenuation = getDistanceAttenuation(posToLight, positionFalloff.w);
 }
 
+/**
+ * Returns the visibility of a spot or point light at the current fragment. The light's shadow
+ * is sampled from its tile(s) of the shadow atlas, whose index is given by shadowInfo.x, or -1
+ * if the light doesn't cast shadows. shadowInfo.y is the normal bias, scaled by the size of a
+ * texel at a distance of 1 from the light.
+ */
+float getPunctualLightVisibility(const HIGHP vec3 lightPosition, const vec3 l,
+        const vec2 shadowInfo, const bool isPointLight) {
+#if defined(HAS_SHADOWING)
+    if (shadowInfo.x < 0.0) {
+        return 1.0;
+    }
+    uint tile = uint(shadowInfo.x);
+    HIGHP vec3 lightToPosition = vertex_worldPosition - lightPosition;
+    if (isPointLight) {
+        // a point light has a tile per face of a cube, see ShadowAtlas.cpp
+        vec3 a = abs(lightToPosition);
+        if (a.x >= a.y && a.x >= a.z) {
+            tile += lightToPosition.x >= 0.0 ? 0u : 1u;
+        } else if (a.y >= a.z) {
+            tile += lightToPosition.y >= 0.0 ? 2u : 3u;
+        } else {
+            tile += lightToPosition.z >= 0.0 ? 4u : 5u;
+        }
+    }
+
+    // the texels of a perspective projection grow with the distance to the light
+    vec3 n = shading_tangentToWorld[2];
+    float NoL = saturate(dot(n, l));
+    float normalBias = sqrt(1.0 - NoL * NoL) * shadowInfo.y * length(lightToPosition);
+
+    HIGHP vec4 p = getAtlasFromWorldMatrix(tile) *
+            vec4(vertex_worldPosition + n * normalBias, 1.0);
+    return shadow(light_shadowAtlas, p.xyz * (1.0 / p.w));
+#else
+    return 1.0;
+#endif
+}
+
 /**
  * Returns a Light structure (see common_lighting.fs) describing a spot light.
  * The colorIntensity field will store the *pre-exposed* intensity of the light
@@ -120,7 +159,7 @@ void setupPunctualLight(inout Light light, const HIGHP vec4 positionFalloff) {
  * The light parameters used to compute the Light structure are fetched from the
  * lightsUniforms uniform buffer.
  */
-Light getSpotLight(uint index) {
+Light getSpotLight(uint index, out float visibility) {
     Light light;
     ivec2 texCoord = getRecordTexCoord(index);
     uint lightIndex = texelFetch(light_records, texCoord, 0).r;
@@ -128,14 +167,16 @@ Light getSpotLight(uint index) {
     HIGHP vec4 positionFalloff = lightsUniforms.lights[lightIndex][0];
     HIGHP vec4 colorIntensity  = lightsUniforms.lights[lightIndex][1];
           vec4 directionIES    = lightsUniforms.lights[lightIndex][2];
-          vec2 scaleOffset     = lightsUniforms.lights[lightIndex][3].xy;
+          vec4 scaleOffset     = lightsUniforms.lights[lightIndex][3];
 
     light.colorIntensity.rgb = colorIntensity.rgb;
     light.colorIntensity.w = computePreExposedIntensity(colorIntensity.w, frameUniforms.exposure);
 
     setupPunctualLight(light, positionFalloff);
 
-    light.attenuation *= getAngleAttenuation(-directionIES.xyz, light.l, scaleOffset);
+    light.attenuation *= getAngleAttenuation(-directionIES.xyz, light.l, scaleOffset.xy);
+
+    visibility = getPunctualLightVisibility(positionFalloff.xyz, light.l, scaleOffset.zw, false);
 
     return light;
 }
@@ -148,19 +189,22 @@ Light getSpotLight(uint index) {
  * The light parameters used to compute the Light structure are fetched from the
  * lightsUniforms uniform buffer.
  */
-Light getPointLight(uint index) {
+Light getPointLight(uint index, out float visibility) {
     Light light;
     ivec2 texCoord = getRecordTexCoord(index);
     uint lightIndex = texelFetch(light_records, texCoord, 0).r;
 
     HIGHP vec4 positionFalloff = lightsUniforms.lights[lightIndex][0];
     HIGHP vec4 colorIntensity  = lightsUniforms.lights[lightIndex][1];
+          vec2 shadowInfo      = lightsUniforms.lights[lightIndex][3].zw;
 
     light.colorIntensity.rgb = colorIntensity.rgb;
     light.colorIntensity.w = computePreExposedIntensity(colorIntensity.w, frameUniforms.exposure);
 
     setupPunctualLight(light, positionFalloff);
 
+    visibility = getPunctualLightVisibility(positionFalloff.xyz, light.l, shadowInfo, true);
+
     return light;
 }
 
@@ -185,15 +229,17 @@ void evaluatePunctualLights(const PixelParams pixel, inout vec3 color) {
 
     // Iterate point lights
     for ( ; index < end; index++) {
-        Light light = getPointLight(index);
-        color.rgb += surfaceShading(pixel, light, 1.0);
+        float visibility;
+        Light light = getPointLight(index, visibility);
+        color.rgb += surfaceShading(pixel, light, visibility);
     }
 
     end += froxel.spotCount;
 
     // Iterate spotlights
     for ( ; index < end; index++) {
-        Light light = getSpotLight(index);
-        color.rgb += surfaceShading(pixel, light, 1.0);
+        float visibility;
+        Light light = getSpotLight(index, visibility);
+        color.rgb += surfaceShading(pixel, light, visibility);
     }
 }
@@ -4,12 +4,22 @@
 
 #if defined(HAS_SHADOWING) && defined(HAS_DIRECTIONAL_LIGHTING)
 /**
- * Computes the light space position of the specified world space point.
+ * Computes the position used to access the shadow map for the specified world space point.
  * The returned point may contain a bias to attempt to eliminate common
  * shadowing artifacts such as "acne". To achieve this, the world space
  * normal at the point must also be passed to this function.
+ * With a single cascade, the returned point is in light space. With several cascades, it is
+ * in world space (xyz) and its w component is the view space depth of the point, which
+ * selects the shadow cascade in the fragment shader, see getLightSpacePosition().
  */
-vec4 getLightSpacePosition(const vec3 p, const vec3 n) {
+vec4 getShadowPosition(const vec3 p, const vec3 n) {
+#if defined(HAS_SHADOW_CASCADES)
+    float depth = -(getViewFromWorldMatrix() * vec4(p, 1.0)).z;
+    uint cascade = min(getShadowCascade(depth), 3u);
+#else
+    const uint cascade = 0u;
+#endif
+
     float NoL = saturate(dot(n, frameUniforms.lightDirection));
 
 #ifdef TARGET_MOBILE
@@ -18,10 +28,13 @@ vec4 getLightSpacePosition(const vec3 p, const vec3 n) {
     float normalBias = sqrt(1.0 - NoL * NoL);
 #endif
 
-    vec3 offsetPosition = p + n * (normalBias * frameUniforms.shadowBias.y);
-    vec4 lightSpacePosition = (getLightFromWorldMatrix() * vec4(offsetPosition, 1.0));
-    lightSpacePosition.z -= frameUniforms.shadowBias.x;
-
+    vec3 offsetPosition = p + n * (normalBias * frameUniforms.cascadeNormalBias[cascade]);
+#if defined(HAS_SHADOW_CASCADES)
+    return vec4(offsetPosition, depth);
+#else
+    vec4 lightSpacePosition = getLightFromWorldMatrix(cascade) * vec4(offsetPosition, 1.0);
+    lightSpacePosition.z -= frameUniforms.cascadeConstantBias[cascade];
     return lightSpacePosition;
+#endif
 }
 #endif
@@ -28,7 +28,7 @@ LAYOUT_LOCATION(10) in HIGHP vec4 vertex_uv01;
 #endif
 
 #if defined(HAS_SHADOWING) && defined(HAS_DIRECTIONAL_LIGHTING)
-LAYOUT_LOCATION(11) in HIGHP vec4 vertex_lightSpacePosition;
+LAYOUT_LOCATION(11) in HIGHP vec4 vertex_shadowPosition;
 #endif
 
 layout(location = 0) out vec4 fragColor;
@@ -47,5 +47,5 @@ LAYOUT_LOCATION(10) out HIGHP vec4 vertex_uv01;
 #endif
 
 #if defined(HAS_SHADOWING) && defined(HAS_DIRECTIONAL_LIGHTING)
-LAYOUT_LOCATION(11) out HIGHP vec4 vertex_lightSpacePosition;
+LAYOUT_LOCATION(11) out HIGHP vec4 vertex_shadowPosition;
 #endif
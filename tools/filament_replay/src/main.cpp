@@ -0,0 +1,104 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Replays a recording of the driver commands, made by running an application with
+// FILAMENT_DRIVER_RECORDING=<path> (debug and development builds only), and reports how long it
+// took.
+//
+// usage: filament_replay <recording> [noop|opengl|vulkan] [repeat]
+//
+// The noop driver (the default) measures the cost of decoding and dispatching the commands, the
+// other backends the cost of the driver itself.
+
+#include "driver/Driver.h"
+#include "driver/noop/NoopDriver.h"
+#include "driver/record/CommandReplayer.h"
+#include "driver/record/CommandSerialization.h"
+
+#include <filament/driver/ExternalContext.h>
+
+#include <utils/memalign.h>
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <memory>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace filament;
+using namespace filament::driver;
+using namespace utils;
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        std::cerr << "usage: " << argv[0] << " <recording> [noop|opengl|vulkan] [repeat]"
+                  << std::endl;
+        return 1;
+    }
+
+    FILE* file = fopen(argv[1], "rb");
+    if (!file) {
+        std::cerr << "could not open " << argv[1] << std::endl;
+        return 1;
+    }
+    fseek(file, 0, SEEK_END);
+    const size_t size = size_t(ftell(file));
+    fseek(file, 0, SEEK_SET);
+    std::unique_ptr<void, void(*)(void*)> data(
+            utils::aligned_alloc(size, CommandWriter::PAYLOAD_ALIGNMENT), utils::aligned_free);
+    const bool ok = fread(data.get(), 1, size, file) == size;
+    fclose(file);
+    if (!ok || !CommandReader::isValid(data.get(), size)) {
+        std::cerr << argv[1] << " is not a driver commands recording" << std::endl;
+        return 1;
+    }
+
+    const char* backendName = argc > 2 ? argv[2] : "noop";
+    const size_t repeat = argc > 3 ? size_t(std::max(1, atoi(argv[3]))) : 1;
+
+    std::unique_ptr<ExternalContext> context;
+    std::unique_ptr<Driver> driver;
+    if (!strcmp(backendName, "noop")) {
+        driver = NoopDriver::create();
+    } else {
+        Backend backend = !strcmp(backendName, "vulkan") ? Backend::VULKAN : Backend::OPENGL;
+        context.reset(ExternalContext::create(&backend));
+        if (context) {
+            driver = context->createDriver(nullptr);
+        }
+    }
+    if (!driver) {
+        std::cerr << "could not create the " << backendName << " driver" << std::endl;
+        return 1;
+    }
+
+    for (size_t i = 0; i < repeat; i++) {
+        CommandReplayer replayer(*driver, data.get(), size);
+        auto start = std::chrono::steady_clock::now();
+        const size_t count = replayer.replay();
+        std::chrono::duration<double, std::milli> duration =
+                std::chrono::steady_clock::now() - start;
+        std::cout << count << " commands replayed in " << duration.count() << " ms ("
+                  << duration.count() * 1e6 / std::max(count, size_t(1)) << " ns/command)"
+                  << std::endl;
+    }
+
+    driver->terminate();
+    return 0;
+}
@@ -61,7 +61,8 @@ static void usage(char* name) {
             "       Reflect the specified metadata as JSON: parameters\n\n"
             "   --variant-filter=<filter>, -v <filter>\n"
             "       Filter out specified comma-separated variants:\n"
-            "           directionalLighting, dynamicLighting, shadowReceiver, skinning\n"
+            "           directionalLighting, dynamicLighting, shadowReceiver, skinning, instancing,\n"
+            "           shadowCascades\n"
             "       This variant filter is merged the filter from the material, if any\n\n"
             "Internal use only:\n"
             "   --output-format, -f\n"
@@ -196,6 +197,10 @@ bool CommandlineConfig::parse() {
                         variantFilter |= filament::Variant::SHADOW_RECEIVER;
                     } else if (item == "skinning") {
                         variantFilter |= filament::Variant::SKINNING;
+                    } else if (item == "instancing") {
+                        variantFilter |= filament::Variant::INSTANCING;
+                    } else if (item == "shadowCascades") {
+                        variantFilter |= filament::Variant::SHADOW_CASCADES;
                     }
                 }
                 mVariantFilter = variantFilter;
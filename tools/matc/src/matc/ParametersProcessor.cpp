@@ -125,6 +125,8 @@ ParametersProcessor::ParametersProcessor() {
     mStringToVariant["dynamicLighting"] = filament::Variant::DYNAMIC_LIGHTING;
     mStringToVariant["shadowReceiver"] = filament::Variant::SHADOW_RECEIVER;
     mStringToVariant["skinning"] = filament::Variant::SKINNING;
+    mStringToVariant["instancing"] = filament::Variant::INSTANCING;
+    mStringToVariant["shadowCascades"] = filament::Variant::SHADOW_CASCADES;
 }
 
 bool ParametersProcessor::process(filamat::MaterialBuilder& builder, const JsonishObject& jsonObject) {